@@ -0,0 +1,82 @@
+#include "arena.h"
+#include <stdlib.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+// All allocations are rounded up to this, so all of them are aligned
+#define ARENA_ALIGNMENT (sizeof(max_align_t))
+
+void arena_init(Arena *arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size;
+    arena->allocated = 0;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        // Doesn't fit: start a new block. What's left of the old one is lost
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            DEBUG_PRINT("Arena %p couldn't malloc a block of %zu bytes\n",
+                    arena, block_size);
+            return NULL;
+        }
+        DEBUG_PRINT("Arena %p: new block of %zu bytes at %p\n",
+                arena, block_size, block);
+
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+
+    void *ptr = (char *)block->data + block->used;
+    block->used += size;
+    arena->allocated += size;
+
+    return ptr;
+}
+
+void arena_merge(Arena *dst, Arena *src) {
+    DEBUG_PRINT("Merging arena %p into %p\n", src, dst);
+    if (src->head == NULL)
+        return;
+
+    // Behind dst's head, which is the only block new allocations come from
+    ArenaBlock *tail = src->head;
+    while (tail->next != NULL)
+        tail = tail->next;
+    if (dst->head == NULL) {
+        dst->head = src->head;
+    } else {
+        tail->next = dst->head->next;
+        dst->head->next = src->head;
+    }
+    dst->allocated += src->allocated;
+
+    src->head = NULL;
+    src->allocated = 0;
+}
+
+void arena_free(Arena *arena) {
+    DEBUG_PRINT("Freeing arena %p\n", arena);
+    ArenaBlock *block = arena->head;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->head = NULL;
+    arena->allocated = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h> // For size_t and max_align_t
+
+// ==== Data Structures ====
+
+/** Block of memory owned by an Arena.
+ *
+ * Allocations are carved from `data` in order. Blocks are never resized: when
+ * one fills up, a new one is linked in front of it.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next; ///< Block that was in use before this one
+    size_t size;             ///< Number of bytes available in `data`
+    size_t used;             ///< Number of bytes already handed out
+    max_align_t data[];      ///< The memory itself, suitably aligned
+} ArenaBlock;
+
+/** Bump allocator.
+ *
+ * Hands out memory from a few large blocks, so that objects allocated one
+ * after the other end up contiguous. Individual allocations can't be freed;
+ * everything is released at once with arena_free().
+ */
+typedef struct Arena {
+    ArenaBlock *head;  ///< Block allocations are currently made from
+    size_t block_size; ///< Minimum size of new blocks, in bytes
+    size_t allocated;  ///< Total number of bytes handed out
+} Arena;
+
+// ==== Function Prototypes ====
+
+/** Initialize an empty arena. No memory is allocated until it's needed.
+ *
+ * @param arena Pointer to the arena to initialize.
+ * @param block_size Minimum size of the blocks to allocate, in bytes. Larger
+ *      blocks mean fewer calls to malloc.
+ */
+void arena_init(Arena *arena, size_t block_size);
+
+/** Allocate memory from an arena.
+ *
+ * @param arena Pointer to the arena.
+ * @param size Number of bytes to allocate.
+ *
+ * @return Pointer to the allocated memory, aligned for any type, or NULL on
+ *      failure. It stays valid until arena_free() is called.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/** Move all the memory allocated from one arena into another.
+ *
+ * Allocations from `src` stay valid, and are freed together with those from
+ * `dst`. New allocations from `dst` keep using its current block, while `src`
+ * is left empty.
+ *
+ * @param dst Pointer to the arena that takes the memory.
+ * @param src Pointer to the arena that gives it up.
+ */
+void arena_merge(Arena *dst, Arena *src);
+
+/** Free all the memory allocated from an arena at once.
+ *
+ * The arena is left empty, and can be used again.
+ *
+ * @param arena Pointer to the arena.
+ */
+void arena_free(Arena *arena);
+
+#endif // ARENA_H
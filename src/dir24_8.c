@@ -0,0 +1,185 @@
+#include "dir24_8.h"
+#include <stdlib.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+// How many addresses ahead lookup_ip_dir24_8_batch prefetches
+#define DIR24_8_PREFETCH_DISTANCE 8
+
+/** Get the block of the second level for the /24 of an address, creating it
+ *  (filled with the /24's current entry) if there isn't one yet.
+ *
+ *  @returns the block, or NULL if memory ran out or there are too many
+ */
+static uint16_t *get_block(Dir24_8 *table, ip_addr_t prefix) {
+    uint16_t *entry = &table->tbl24[prefix >> 8];
+    if (*entry & DIR24_8_LONG)
+        return &table->tbl_long[(size_t)(*entry & ~DIR24_8_LONG)
+            * DIR24_8_BLOCK];
+
+    if (table->num_blocks >= DIR24_8_MAX_INDEX) {
+        DEBUG_PRINT("DIR-24-8 table %p has too many blocks\n", table);
+        return NULL;
+    }
+    if (table->num_blocks == table->block_capacity) {
+        uint32_t capacity = table->block_capacity ?
+            2 * table->block_capacity : 64;
+        uint16_t *tbl_long = realloc(table->tbl_long,
+                (size_t)capacity * DIR24_8_BLOCK * sizeof(uint16_t));
+        if (tbl_long == NULL)
+            return NULL;
+        table->tbl_long = tbl_long;
+        table->block_capacity = capacity;
+    }
+
+    uint32_t index = table->num_blocks++;
+    uint16_t *block = &table->tbl_long[(size_t)index * DIR24_8_BLOCK];
+    for (int i = 0; i < DIR24_8_BLOCK; i++)
+        block[i] = *entry; // Whatever covered the whole /24 until now
+    *entry = DIR24_8_LONG | index;
+    return block;
+}
+
+/** Get the prefix of a rule without the bits past its length, which a FIB
+ *  may have set (e.g. 10.1.2.200/25).
+ *
+ *  @returns the prefix, masked with its length
+ */
+static inline uint32_t rule_prefix(const Rule *rule) {
+    return rule->prefix_len == 0 ? 0 :
+        rule->prefix & (0xFFFFFFFF << (32 - rule->prefix_len));
+}
+
+/** Write the next hop of a rule in every entry its prefix covers, in the
+ *  first level or in a block of the second.
+ *
+ *  @returns 0 on success, or -1 if a block couldn't be created
+ */
+static int add_rule(Dir24_8 *table, const Rule *rule, uint16_t next_hop) {
+    uint32_t prefix = rule_prefix(rule); // Or it could write past the end
+    if (rule->prefix_len <= 24) {
+        // There are no blocks yet: longer rules come later
+        size_t first = prefix >> 8;
+        size_t count = (size_t)1 << (24 - rule->prefix_len);
+        for (size_t i = first; i < first + count; i++)
+            table->tbl24[i] = next_hop;
+        return 0;
+    }
+
+    uint16_t *block = get_block(table, prefix);
+    if (block == NULL)
+        return -1;
+    uint32_t first = prefix & (DIR24_8_BLOCK - 1);
+    uint32_t count = 1u << (32 - rule->prefix_len);
+    for (uint32_t i = first; i < first + count; i++)
+        block[i] = next_hop;
+    return 0;
+}
+
+Dir24_8 *build_dir24_8(const Rule *rules, size_t num_rules) {
+    DEBUG_PRINT("Building DIR-24-8 table with %zu rules at %p\n",
+            num_rules, rules);
+    if (rules == NULL)
+        return NULL;
+
+    Dir24_8 *table = malloc(sizeof(Dir24_8));
+    if (table == NULL)
+        return NULL;
+    table->tbl_long = NULL;
+    table->num_blocks = 0;
+    table->block_capacity = 0;
+    // Entry 0 (NO_NEXT_HOP) is what addresses without a route get
+    table->tbl24 = calloc(DIR24_8_ENTRIES, sizeof(uint16_t));
+    size_t *order = malloc(num_rules * sizeof(size_t));
+    if (next_hop_table_init(&table->next_hops) != 0 || !table->tbl24
+            || (!order && num_rules > 0)) {
+        free(order);
+        free_dir24_8(table);
+        return NULL;
+    }
+
+    // Rules are added from shortest to longest, each overwriting the ones it's
+    // nested in. A stable counting sort by length keeps duplicates in order
+    size_t starts[34] = {0};
+    for (size_t i = 0; i < num_rules; i++)
+        starts[rules[i].prefix_len + 1]++;
+    for (int len = 0; len < 33; len++)
+        starts[len + 1] += starts[len];
+    for (size_t i = 0; i < num_rules; i++)
+        order[starts[rules[i].prefix_len]++] = i;
+
+    for (size_t i = 0; i < num_rules; i++) {
+        const Rule *rule = &rules[order[i]];
+        if (rule->out_iface == 0)
+            continue; // Never an answer, as in an LC-Trie
+        if (i + 1 < num_rules
+                && rule_prefix(&rules[order[i + 1]]) == rule_prefix(rule)
+                && rules[order[i + 1]].prefix_len == rule->prefix_len)
+            continue; // Its duplicate would overwrite it right away
+        int32_t next_hop = next_hop_intern(&table->next_hops, rule->out_iface);
+        if (next_hop < 0 || next_hop >= DIR24_8_MAX_INDEX
+                || add_rule(table, rule, next_hop) != 0) {
+            DEBUG_PRINT("--Error: couldn't add rule %zu\n", order[i]);
+            free(order);
+            free_dir24_8(table);
+            return NULL;
+        }
+    }
+    free(order);
+
+    DEBUG_PRINT("--Done building DIR-24-8 table, %u blocks, %u next hops\n",
+            table->num_blocks, table->next_hops.num_hops);
+    return table;
+}
+
+void free_dir24_8(Dir24_8 *table) {
+    DEBUG_PRINT("Freeing DIR-24-8 table at %p\n", table);
+    if (table == NULL)
+        return;
+
+    free(table->tbl24);
+    free(table->tbl_long);
+    next_hop_table_free(&table->next_hops);
+    free(table);
+}
+
+uint32_t count_entries_dir24_8(const Dir24_8 *table) {
+    return table == NULL ? 0 :
+        DIR24_8_ENTRIES + table->num_blocks * DIR24_8_BLOCK;
+}
+
+uint32_t lookup_ip_dir24_8(ip_addr_t ip_addr, const Dir24_8 *table,
+                           int *access_count) {
+    uint16_t entry = table->tbl24[ip_addr >> 8];
+    int accesses = 1;
+    if (entry & DIR24_8_LONG) {
+        entry = table->tbl_long[(size_t)(entry & ~DIR24_8_LONG)
+            * DIR24_8_BLOCK + (ip_addr & (DIR24_8_BLOCK - 1))];
+        accesses++;
+    }
+    if (access_count != NULL)
+        *access_count = accesses;
+
+    DEBUG_PRINT("Looked IP 0x%08X up in DIR-24-8 table %p in %d accesses\n",
+            ip_addr, table, accesses);
+    return next_hop_iface(&table->next_hops, entry);
+}
+
+void lookup_ip_dir24_8_batch(const ip_addr_t *addrs, uint32_t *out, size_t n,
+                             const Dir24_8 *table, int *access_counts) {
+    DEBUG_PRINT("Looking up %zu IPs in batch in DIR-24-8 table %p\n",
+            n, table);
+    for (size_t i = 0; i < n; i++) {
+        if (i + DIR24_8_PREFETCH_DISTANCE < n)
+            __builtin_prefetch(
+                &table->tbl24[addrs[i + DIR24_8_PREFETCH_DISTANCE] >> 8]);
+        out[i] = lookup_ip_dir24_8(addrs[i], table,
+                access_counts ? &access_counts[i] : NULL);
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef DIR24_8_H
+#define DIR24_8_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For fixed-width integer types like uint32_t
+
+#include "lc_trie.h"  // For Rule and ip_addr_t
+#include "next_hop.h"
+
+// ==== Constants ====
+#define DIR24_8_ENTRIES (1u << 24) // Entries in the first level
+#define DIR24_8_BLOCK 256          // Entries in each block of the second level
+#define DIR24_8_LONG 0x8000        // Flag of entries that point to a block
+#define DIR24_8_MAX_INDEX 0x8000   // Most next hops, and blocks, there can be
+/// Most distinct interfaces a table can have: every index but NO_NEXT_HOP's
+#define DIR24_8_MAX_NEXT_HOPS (DIR24_8_MAX_INDEX - 1)
+
+// ==== Data Structures ====
+
+/** DIR-24-8 lookup table.
+ *
+ * The first level has an entry for every possible /24, indexed by the first
+ * 24 bits of the address. It holds the index of the next hop of the longest
+ * prefix of 24 bits or less that matches them, unless longer prefixes start
+ * within the /24: then it's DIR24_8_LONG plus the index of a block of the
+ * second level, which has an entry for each of the last 8 bits instead.
+ *
+ * Lookups take one memory access, or two for addresses under longer
+ * prefixes, at the cost of 32 MB for the first level (entries are 16 bits).
+ * With the flag taking one of those bits, there can only be
+ * DIR24_8_MAX_NEXT_HOPS distinct interfaces.
+ */
+typedef struct Dir24_8 {
+    uint16_t *tbl24;        ///< First level, DIR24_8_ENTRIES entries
+    uint16_t *tbl_long;     ///< Second level, DIR24_8_BLOCK entries per block
+    uint32_t num_blocks;    ///< Number of blocks in `tbl_long`
+    uint32_t block_capacity;///< Number of blocks `tbl_long` has room for
+    NextHopTable next_hops; ///< Next hops the entries refer to
+} Dir24_8;
+
+// ==== Function Prototypes ====
+
+/** Build a DIR-24-8 table from a set of rules.
+ *
+ * @param rules Pointer to a SORTED array of rules (see sort_rules()). Only the
+ *      order of duplicated prefixes matters: as in an LC-Trie, the last one
+ *      wins. Rules with interface 0 are ignored.
+ * @param num_rules Number of rules in the array.
+ *
+ * @return Pointer to the new table, or NULL on failure (including having
+ *      more than DIR24_8_MAX_NEXT_HOPS distinct interfaces, or needing
+ *      DIR24_8_MAX_INDEX blocks or more).
+ */
+Dir24_8 *build_dir24_8(const Rule *rules, size_t num_rules);
+
+/** Free the memory allocated for a DIR-24-8 table.
+ *
+ * @param table Pointer to the table.
+ */
+void free_dir24_8(Dir24_8 *table);
+
+/** Count the entries of a DIR-24-8 table, in both levels.
+ *
+ * @param table Pointer to the table.
+ *
+ * @return The number of entries.
+ */
+uint32_t count_entries_dir24_8(const Dir24_8 *table);
+
+/** Look up an IP address in a DIR-24-8 table. Same as lookup_ip().
+ *
+ * @param ip_addr The IP address to look up.
+ * @param table Pointer to the table.
+ * @param[out] access_count Number of entries read during the lookup (1 or
+ *      2). Will be overwritten, not added to. Pass NULL to ignore.
+ *
+ * @return The outgoing interface associated with the longest matching prefix,
+ *      or 0 if no rules match.
+ */
+uint32_t lookup_ip_dir24_8(ip_addr_t ip_addr, const Dir24_8 *table,
+                           int *access_count);
+
+/** Look up several IP addresses in a DIR-24-8 table at once. Same as
+ *  lookup_ip_batch(), prefetching the first-level entries of the addresses
+ *  that follow.
+ */
+void lookup_ip_dir24_8_batch(const ip_addr_t *addrs, uint32_t *out, size_t n,
+                             const Dir24_8 *table, int *access_counts);
+
+#endif // DIR24_8_H
@@ -0,0 +1,470 @@
+#include "engine.h"
+#include "dir24_8.h"
+#include "tree_bitmap.h"
+#include "trie_image.h"
+#include "io.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+/// Compact trie with precomputed leaves, and how long their lists got
+typedef struct LeafInfoTrie {
+    CompactTrie *trie;
+    uint32_t max_chain;      ///< Longest parent chain of a rule
+    uint32_t max_candidates; ///< Longest list of candidates of a leaf
+} LeafInfoTrie;
+
+/// Bytes allocated for a next hop table.
+static size_t next_hops_size(const NextHopTable *table) {
+    return table->capacity * sizeof(NextHop)
+        + table->num_slots * sizeof(uint16_t);
+}
+
+// ==== LC-Trie ====
+
+static void *build_lc_trie(Rule *rules, size_t num_rules,
+                           const EngineOptions *options) {
+    TrieBuildOptions build_options = {
+        .num_threads = options->num_threads,
+        .root_branch = options->root_branch,
+    };
+    // The trie sorts and keeps its own copy of the rules
+    return build_trie_with_options(rules, num_rules, &build_options);
+}
+
+static uint32_t lookup_lc_trie(const void *table, ip_addr_t ip_addr,
+                               int *access_count) {
+    return lookup_ip(ip_addr, ((const Trie *)table)->root, access_count);
+}
+
+static void lookup_lc_trie_batch(const void *table, const ip_addr_t *addrs,
+                                 uint32_t *out, size_t n, int *access_counts) {
+    lookup_ip_batch(addrs, out, n, ((const Trie *)table)->root, access_counts);
+}
+
+static void print_lc_trie_stats(const void *table, FILE *out) {
+    const Trie *trie = table;
+    if (trie->root_branch != 0)
+        fprintf(out, "Root branch: %hhu bits\n", trie->root_branch);
+}
+
+/// Print a histogram of a TrieStats, as its minimum, average and maximum
+/// followed by the count of each value that has any.
+static void print_trie_histogram(const char *label,
+                                 const uint32_t counts[TRIE_STATS_LEVELS],
+                                 FILE *out) {
+    uint64_t total = 0, sum = 0;
+    int min = -1, max = 0;
+    for (int i = 0; i < TRIE_STATS_LEVELS; i++) {
+        if (counts[i] == 0)
+            continue;
+        if (min < 0)
+            min = i;
+        max = i;
+        total += counts[i];
+        sum += (uint64_t)i * counts[i];
+    }
+    fprintf(out, "%s: min %d, avg %.2f, max %d.", label, min < 0 ? 0 : min,
+            total ? (double)sum / total : 0, max);
+    for (int i = 0; i < TRIE_STATS_LEVELS; i++) {
+        if (counts[i] != 0)
+            fprintf(out, " %d:%u", i, counts[i]);
+    }
+    fprintf(out, "\n");
+}
+
+static void print_lc_trie_report(const void *table, FILE *out) {
+    const Trie *trie = table;
+    const TrieStats *stats = &trie->stats;
+    uint32_t own_leaves = stats->num_leaves - stats->empty_leaves
+        - stats->default_leaves;
+    fprintf(out, "Nodes: %u (%u internal, %u leaves), %zu KB. Rules: %zu, "
+            "%zu KB. Arena: %zu KB, %zu KB of them no longer used\n",
+            stats->num_nodes, stats->num_nodes - stats->num_leaves,
+            stats->num_leaves, stats->num_nodes * sizeof(TrieNode) / 1024,
+            trie->num_rules, trie->num_rules * sizeof(Rule) / 1024,
+            trie->arena.allocated / 1024, trie->wasted / 1024);
+    fprintf(out, "Leaves: %u with a rule of their own, %u filled with a "
+            "default, %u without a rule\n", own_leaves, stats->default_leaves,
+            stats->empty_leaves);
+    print_trie_histogram("Branch of internal nodes", stats->branches, out);
+    print_trie_histogram("Skip of internal nodes", stats->skips, out);
+    print_trie_histogram("Depth of leaves", stats->depths, out);
+    print_trie_histogram("Parent chain of leaves", stats->chains, out);
+}
+
+static uint32_t count_lc_trie_nodes(const void *table) {
+    return ((const Trie *)table)->stats.num_nodes;
+}
+
+static size_t lc_trie_size(const void *table) {
+    const Trie *trie = table;
+    return trie->arena.allocated + trie->order_capacity * sizeof(Rule *);
+}
+
+static void destroy_lc_trie(void *table) {
+    destroy_trie(table);
+}
+
+// ==== Compact LC-Trie ====
+
+static void *build_compact(Rule *rules, size_t num_rules,
+                           const EngineOptions *options) {
+    Trie *trie = build_lc_trie(rules, num_rules, options);
+    if (trie == NULL)
+        return NULL;
+
+    DEBUG_PRINT("  Freezing trie\n");
+    CompactTrie *compact = freeze_trie(trie->root, trie->rules,
+            trie->num_rules);
+    // The compact trie has its own copy of everything
+    destroy_trie(trie);
+    return compact;
+}
+
+static uint32_t lookup_compact(const void *table, ip_addr_t ip_addr,
+                               int *access_count) {
+    return lookup_ip_compact(ip_addr, table, access_count);
+}
+
+static void lookup_compact_batch(const void *table, const ip_addr_t *addrs,
+                                 uint32_t *out, size_t n, int *access_counts) {
+    lookup_ip_compact_batch(addrs, out, n, table, access_counts);
+}
+
+static void print_compact_stats(const void *table, FILE *out) {
+    const CompactTrie *trie = table;
+    fprintf(out, "Root branch: %hhu bits. Distinct next hops: %u. Batch "
+            "kernel: %s\n", compact_branch(trie->nodes[0]),
+            trie->next_hops.num_hops,
+            compact_kernel_name(resolve_compact_kernel(COMPACT_KERNEL_AUTO)));
+}
+
+static uint32_t count_compact_nodes(const void *table) {
+    return count_nodes_compact_trie(table);
+}
+
+static size_t compact_size(const void *table) {
+    const CompactTrie *trie = table;
+    if (trie->image != NULL)
+        return trie->image_size;
+    size_t size = trie->num_nodes * sizeof(CompactNode)
+        + trie->num_rules * sizeof(Rule) + next_hops_size(&trie->next_hops);
+    if (trie->leaves != NULL) {
+        size += trie->num_rules * sizeof(LeafInfo)
+            + trie->num_candidates * sizeof(LeafCandidate);
+    }
+    return size;
+}
+
+static void destroy_compact(void *table) {
+    free_compact_trie(table);
+}
+
+// ==== Compact LC-Trie with precomputed leaves ====
+
+static void *build_leaf_info(Rule *rules, size_t num_rules,
+                             const EngineOptions *options) {
+    LeafInfoTrie *table = malloc(sizeof(LeafInfoTrie));
+    if (table == NULL)
+        return NULL;
+    table->trie = build_compact(rules, num_rules, options);
+    if (table->trie == NULL) {
+        free(table);
+        return NULL;
+    }
+
+    DEBUG_PRINT("  Precomputing leaves\n");
+    if (precompute_leaves(table->trie, &table->max_chain,
+                &table->max_candidates) != 0) {
+        free_compact_trie(table->trie);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+static uint32_t lookup_leaf_info(const void *table, ip_addr_t ip_addr,
+                                 int *access_count) {
+    return lookup_ip_compact(ip_addr, ((const LeafInfoTrie *)table)->trie,
+            access_count);
+}
+
+static void lookup_leaf_info_batch(const void *table, const ip_addr_t *addrs,
+                                   uint32_t *out, size_t n,
+                                   int *access_counts) {
+    lookup_ip_compact_batch(addrs, out, n, ((const LeafInfoTrie *)table)->trie,
+            access_counts);
+}
+
+static void print_leaf_info_stats(const void *table, FILE *out) {
+    const LeafInfoTrie *leaf_info = table;
+    fprintf(out, "Longest parent chain: %u rules. Longest list of leaf "
+            "candidates: %u, in at most 2 reads. Distinct next hops: %u. "
+            "Batch kernel: %s\n", leaf_info->max_chain,
+            leaf_info->max_candidates, leaf_info->trie->next_hops.num_hops,
+            compact_kernel_name(resolve_compact_kernel(COMPACT_KERNEL_AUTO)));
+}
+
+static uint32_t count_leaf_info_nodes(const void *table) {
+    return count_nodes_compact_trie(((const LeafInfoTrie *)table)->trie);
+}
+
+static size_t leaf_info_size(const void *table) {
+    return sizeof(LeafInfoTrie)
+        + compact_size(((const LeafInfoTrie *)table)->trie);
+}
+
+static void destroy_leaf_info(void *table) {
+    if (table == NULL)
+        return;
+    free_compact_trie(((LeafInfoTrie *)table)->trie);
+    free(table);
+}
+
+static int save_leaf_info(const void *table, const char *path) {
+    const LeafInfoTrie *leaf_info = table;
+    return save_trie_image(leaf_info->trie, leaf_info->max_chain,
+            leaf_info->max_candidates, path);
+}
+
+static void *load_leaf_info(const void *data, size_t size) {
+    LeafInfoTrie *table = malloc(sizeof(LeafInfoTrie));
+    if (table == NULL)
+        return NULL;
+    table->trie = open_trie_image(data, size, &table->max_chain,
+            &table->max_candidates);
+    if (table->trie == NULL) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+// ==== DIR-24-8 ====
+
+static void *build_dir(Rule *rules, size_t num_rules,
+                       const EngineOptions *options) {
+    // Sorted like a trie's, so that duplicates resolve the same way
+    sort_rules_parallel(rules, num_rules, options->num_threads);
+    return build_dir24_8(rules, num_rules);
+}
+
+static uint32_t lookup_dir(const void *table, ip_addr_t ip_addr,
+                           int *access_count) {
+    return lookup_ip_dir24_8(ip_addr, table, access_count);
+}
+
+static void lookup_dir_batch(const void *table, const ip_addr_t *addrs,
+                             uint32_t *out, size_t n, int *access_counts) {
+    lookup_ip_dir24_8_batch(addrs, out, n, table, access_counts);
+}
+
+static void print_dir_stats(const void *table, FILE *out) {
+    const Dir24_8 *dir = table;
+    fprintf(out, "%u blocks of /25 and longer. Distinct next hops: %u\n",
+            dir->num_blocks, dir->next_hops.num_hops);
+}
+
+static uint32_t count_dir_entries(const void *table) {
+    return count_entries_dir24_8(table);
+}
+
+static size_t dir_size(const void *table) {
+    const Dir24_8 *dir = table;
+    return (size_t)DIR24_8_ENTRIES * sizeof(uint16_t)
+        + (size_t)dir->block_capacity * DIR24_8_BLOCK * sizeof(uint16_t)
+        + next_hops_size(&dir->next_hops);
+}
+
+static void destroy_dir(void *table) {
+    free_dir24_8(table);
+}
+
+// ==== Tree Bitmap ====
+
+static void *build_tree(Rule *rules, size_t num_rules,
+                        const EngineOptions *options) {
+    // Sorted like a trie's, so that duplicates resolve the same way
+    sort_rules_parallel(rules, num_rules, options->num_threads);
+    return build_tree_bitmap(rules, num_rules);
+}
+
+static uint32_t lookup_tree(const void *table, ip_addr_t ip_addr,
+                            int *access_count) {
+    return lookup_ip_tree_bitmap(ip_addr, table, access_count);
+}
+
+static void lookup_tree_batch(const void *table, const ip_addr_t *addrs,
+                              uint32_t *out, size_t n, int *access_counts) {
+    lookup_ip_tree_bitmap_batch(addrs, out, n, table, access_counts);
+}
+
+static void print_tree_stats(const void *table, FILE *out) {
+    const TreeBitmap *tree = table;
+    fprintf(out, "%u-bit strides, %u prefixes in nodes. Distinct next hops: "
+            "%u\n", TREE_BITMAP_STRIDE,
+            tree->num_results - tree->wasted_results, tree->next_hops.num_hops);
+}
+
+static uint32_t count_tree_nodes(const void *table) {
+    return count_nodes_tree_bitmap(table);
+}
+
+static size_t tree_size(const void *table) {
+    const TreeBitmap *tree = table;
+    return tree->node_capacity * sizeof(TreeBitmapNode)
+        + tree->result_capacity * sizeof(uint16_t)
+        + next_hops_size(&tree->next_hops);
+}
+
+static void destroy_tree(void *table) {
+    free_tree_bitmap(table);
+}
+
+// ==== Registry ====
+
+static const LookupEngine LC_TRIE_ENGINE = {
+    .name = "lc-trie",
+    .description = "LC-Trie of linked nodes (the default)",
+    .build = build_lc_trie,
+    .lookup = lookup_lc_trie,
+    .lookup_batch = lookup_lc_trie_batch,
+    .print_stats = print_lc_trie_stats,
+    .print_report = print_lc_trie_report,
+    .count_nodes = count_lc_trie_nodes,
+    .memory_usage = lc_trie_size,
+    .destroy = destroy_lc_trie,
+};
+
+static const LookupEngine COMPACT_ENGINE = {
+    .name = "compact",
+    .description = "LC-Trie frozen into an array of packed nodes",
+    .max_next_hops = MAX_NEXT_HOPS,
+    .build = build_compact,
+    .lookup = lookup_compact,
+    .lookup_batch = lookup_compact_batch,
+    .print_stats = print_compact_stats,
+    .count_nodes = count_compact_nodes,
+    .memory_usage = compact_size,
+    .destroy = destroy_compact,
+};
+
+static const LookupEngine LEAF_INFO_ENGINE = {
+    .name = "leaf-info",
+    .description = "Compact LC-Trie with the answers of its leaves",
+    .max_next_hops = MAX_NEXT_HOPS,
+    .build = build_leaf_info,
+    .lookup = lookup_leaf_info,
+    .lookup_batch = lookup_leaf_info_batch,
+    .print_stats = print_leaf_info_stats,
+    .count_nodes = count_leaf_info_nodes,
+    .memory_usage = leaf_info_size,
+    .destroy = destroy_leaf_info,
+    .save_image = save_leaf_info,
+    .load_image = load_leaf_info,
+};
+
+static const LookupEngine DIR24_8_ENGINE = {
+    .name = "dir-24-8",
+    .description = "DIR-24-8 table (at most 2 accesses, 32 MB or more)",
+    .max_next_hops = DIR24_8_MAX_NEXT_HOPS,
+    .build = build_dir,
+    .lookup = lookup_dir,
+    .lookup_batch = lookup_dir_batch,
+    .print_stats = print_dir_stats,
+    .count_nodes = count_dir_entries,
+    .memory_usage = dir_size,
+    .destroy = destroy_dir,
+};
+
+static const LookupEngine TREE_BITMAP_ENGINE = {
+    .name = "tree-bitmap",
+    .description = "Tree Bitmap of 4-bit strides, indexed by popcounts",
+    .max_next_hops = MAX_NEXT_HOPS,
+    .build = build_tree,
+    .lookup = lookup_tree,
+    .lookup_batch = lookup_tree_batch,
+    .print_stats = print_tree_stats,
+    .count_nodes = count_tree_nodes,
+    .memory_usage = tree_size,
+    .destroy = destroy_tree,
+};
+
+const LookupEngine *const LOOKUP_ENGINES[] = {
+    &LC_TRIE_ENGINE,
+    &COMPACT_ENGINE,
+    &LEAF_INFO_ENGINE,
+    &DIR24_8_ENGINE,
+    &TREE_BITMAP_ENGINE,
+    NULL
+};
+
+const LookupEngine *find_engine(const char *name) {
+    for (int i = 0; LOOKUP_ENGINES[i] != NULL; i++) {
+        if (strcmp(LOOKUP_ENGINES[i]->name, name) == 0)
+            return LOOKUP_ENGINES[i];
+    }
+    DEBUG_PRINT("No engine called %s\n", name);
+    return NULL;
+}
+
+const LookupEngine *find_image_engine(const LookupEngine *preferred) {
+    if (preferred->load_image != NULL)
+        return preferred;
+    for (int i = 0; LOOKUP_ENGINES[i] != NULL; i++) {
+        if (LOOKUP_ENGINES[i]->load_image != NULL)
+            return LOOKUP_ENGINES[i];
+    }
+    return NULL;
+}
+
+Rule *read_rules(const char *data, size_t data_size, int *rule_count,
+                 int *status, int *line_number) {
+    DEBUG_PRINT("Reading rules\n");
+
+    // There can't be more rules than lines
+    size_t capacity = countLines(data, data_size);
+    size_t size = 0;
+    Rule* rules = malloc(sizeof(Rule) * capacity);
+    DEBUG_PRINT("  Malloc rules done, capacity %zu\n", capacity);
+    if (rules == NULL) {
+        *status = PARSE_ERROR;
+        return NULL;
+    }
+
+    const char *cursor = data;
+    const char *end = data + data_size;
+    ip_addr_t addr;
+    int prefix_len;
+    int out_iface;
+
+    *line_number = 0;
+    while ((*status = parseFIBLine(&cursor, end, line_number, &addr,
+                    &prefix_len, &out_iface)) == OK) {
+        DEBUG_PRINT("  Read rule %zu: 0x%08X/%d %d\n", size, addr, prefix_len, out_iface);
+
+        rules[size].prefix = addr;
+        rules[size].prefix_len = prefix_len;
+        rules[size].out_iface = out_iface;
+        rules[size].parent = NULL;
+
+        size++;
+    }
+
+    if (*status != REACHED_EOF) { // Could be BAD_ROUTING_TABLE
+        free(rules);
+        return NULL;
+    }
+    *status = OK;
+    *rule_count = size;
+
+    DEBUG_PRINT("--Done reading %d rules\n", *rule_count);
+    return rules;
+}
@@ -0,0 +1,130 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For fixed-width integer types like uint32_t
+#include <stdio.h>  // For FILE
+
+#include "lc_trie.h" // For Rule and ip_addr_t
+
+// ==== Constants ====
+#define DEFAULT_ENGINE "lc-trie" // Name of the engine used if none is chosen
+
+// ==== Data Structures ====
+
+/** How an engine builds its table. Engines ignore what doesn't apply to them.
+ */
+typedef struct EngineOptions {
+    int num_threads; ///< Threads to build in, including the calling one
+    int root_branch; ///< Branch to force on a trie's root (see TrieBuildOptions)
+} EngineOptions;
+
+/** A lookup engine: a structure longest prefix matches are made on, and what
+ *  it takes to build it and use it.
+ *
+ * Callers only ever see the table as a `void *`, so the same I/O path can
+ * drive any of them. Every function but `build` takes a table `build`
+ * returned.
+ */
+typedef struct LookupEngine {
+    const char *name;        ///< What --engine calls it
+    const char *description; ///< A short line for the usage message
+    /// Most distinct interfaces its tables can have, checked before building
+    /// one. 0 if there's no such limit
+    uint32_t max_next_hops;
+
+    /** Build a table from a set of rules.
+     *
+     * @param rules Pointer to an array of rules, not necessarily sorted. It
+     *      may be reordered, and it isn't needed after the call.
+     * @param num_rules Number of rules in the array.
+     * @param options How to build it.
+     *
+     * @return The new table, or NULL on failure.
+     */
+    void *(*build)(Rule *rules, size_t num_rules,
+                   const EngineOptions *options);
+
+    /// Look up an IP address. Same as lookup_ip().
+    uint32_t (*lookup)(const void *table, ip_addr_t ip_addr,
+                       int *access_count);
+
+    /// Look up several IP addresses at once. Same as lookup_ip_batch().
+    void (*lookup_batch)(const void *table, const ip_addr_t *addrs,
+                         uint32_t *out, size_t n, int *access_counts);
+
+    /// Print a line with what's particular about a table, or nothing.
+    void (*print_stats)(const void *table, FILE *out);
+
+    /// Print a detailed report of the shape of a table (see --stats). NULL
+    /// if the engine has none.
+    void (*print_report)(const void *table, FILE *out);
+
+    /// Number of nodes (or entries) of a table, for the summary.
+    uint32_t (*count_nodes)(const void *table);
+
+    /// Bytes of memory allocated for a table.
+    size_t (*memory_usage)(const void *table);
+
+    /// Free the memory allocated for a table. NULL is ignored.
+    void (*destroy)(void *table);
+
+    /** Write a table to an image file, which `load_image` can use in place.
+     *  NULL if the engine has no images.
+     *
+     * @return 0 on success, or -1 on failure.
+     */
+    int (*save_image)(const void *table, const char *path);
+
+    /** Make a table out of an image `save_image` wrote. NULL if the engine
+     *  has no images.
+     *
+     * @param data The image, mapped with mmap(). On success, the table owns
+     *      the mapping, and `destroy` unmaps it.
+     * @param size Number of bytes mapped.
+     *
+     * @return The table, or NULL if it isn't a valid image.
+     */
+    void *(*load_image)(const void *data, size_t size);
+} LookupEngine;
+
+/// Every engine, DEFAULT_ENGINE first, followed by NULL.
+extern const LookupEngine *const LOOKUP_ENGINES[];
+
+// ==== Function Prototypes ====
+
+/** Find an engine by name.
+ *
+ * @param name What --engine calls it.
+ *
+ * @return The engine, or NULL if there's none with that name.
+ */
+const LookupEngine *find_engine(const char *name);
+
+/** Find the engine that loads images, for FIB files that are one.
+ *
+ * @param preferred The engine to use if it can load them.
+ *
+ * @return `preferred`, or the first engine that loads images if it can't.
+ */
+const LookupEngine *find_image_engine(const LookupEngine *preferred);
+
+/** Parse a FIB file into an array of rules, for building a table with.
+ *
+ * The FIB is parsed in place, e.g. as mapped into memory by mapRoutingTable().
+ * The array is sized for the number of lines in the file, so it's never
+ * reallocated while parsing.
+ *
+ * @param data The contents of the FIB file.
+ * @param data_size The number of bytes in `data`.
+ * @param[out] rule_count Pointer where the number of rules will be stored.
+ * @param[out] status Pointer where OK or the error code will be stored.
+ * @param[out] line_number Pointer where the last line parsed will be stored,
+ *      the malformed one if `status` is BAD_ROUTING_TABLE.
+ *
+ * @return A heap-allocated array of the (unsorted) rules, or NULL on failure.
+ */
+Rule *read_rules(const char *data, size_t data_size, int *rule_count,
+                 int *status, int *line_number);
+
+#endif // ENGINE_H
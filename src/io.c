@@ -1,5 +1,9 @@
 #include "io.h"
 #include "utils.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 
@@ -10,6 +14,36 @@ static FILE *routingTable;
 static FILE *inputFile;
 static FILE *outputFile;
 
+/***********************************************************************
+ * Buffer for readInputPacketFileBlock. Bytes between inputCursor and
+ * inputEnd haven't been parsed yet
+ ***********************************************************************/
+static char inputBuffer[INPUT_BUFFER_SIZE];
+static char *inputCursor;
+static char *inputEnd;
+static int inputEOF;
+
+/***********************************************************************
+ * Buffer for the output lines, written to the output file (and mirrored
+ * to the standard output, unless disabled) when it fills up
+ ***********************************************************************/
+static char outputBuffer[OUTPUT_BUFFER_SIZE];
+static size_t outputUsed;
+static int mirrorOutput = 1;
+
+
+/***********************************************************************
+ * Write the buffered output lines and empty the buffer
+ ***********************************************************************/
+static void flushOutputBuffer(){
+
+  if (outputUsed == 0) return;
+  fwrite(outputBuffer, 1, outputUsed, outputFile);
+  if (mirrorOutput) fwrite(outputBuffer, 1, outputUsed, stdout);
+  outputUsed = 0;
+
+}
+
 /***********************************************************************
  * Write the input to the specified file (f) and the standard output
  *
@@ -18,6 +52,7 @@ static FILE *outputFile;
  ***********************************************************************/
 void tee(FILE *f, char const *fmt, ...){
     va_list ap;
+    flushOutputBuffer(); // Keep everything in order
     va_start(ap, fmt);
     vprintf(fmt, ap);
     va_end(ap);
@@ -46,6 +81,13 @@ int initializeIO(char *routingTableName, char *inputFileName){
    	return INPUT_FILE_NOT_FOUND;
  	}
 
+  inputCursor = inputEnd = inputBuffer;
+  inputEOF = 0;
+
+  // Like stdio's buffers, ours must be written even if freeIO isn't called
+  static int flushAtExit = 0;
+  if (!flushAtExit) flushAtExit = !atexit(flushOutputBuffer);
+
   sprintf(outputFileName, "%s%s", inputFileName, OUTPUT_NAME);
   outputFile = fopen(outputFileName, "w");
   if (outputFile == NULL) {
@@ -64,6 +106,7 @@ int initializeIO(char *routingTableName, char *inputFileName){
  ***********************************************************************/
 void freeIO() {
 
+  flushOutputBuffer();
 	fclose(inputFile);
   fclose(outputFile);
   fclose(routingTable);
@@ -95,6 +138,9 @@ void printIOExplanationError(int result){
     case CANNOT_CREATE_OUTPUT:
       printf("Cannot create output file\n");
       break;
+    case TOO_MANY_NEXT_HOPS:
+      printf("Too many distinct next hops for the engine\n");
+      break;
     default:
       printf("Unknown error\n");
       break;
@@ -127,6 +173,223 @@ int readFIBLine(uint32_t *prefix, int *prefixLength, int *outInterface){
 }
 
 
+/***********************************************************************
+ * Map a whole open FIB into memory, read-only. The mapping doesn't
+ * need the descriptor to stay open
+ ***********************************************************************/
+static int mapDescriptor(int fd, char const **data, size_t *size){
+
+  struct stat info;
+
+  if (fstat(fd, &info) != 0) return BAD_ROUTING_TABLE;
+
+  *size = info.st_size;
+  *data = NULL;
+  if (*size == 0) return OK;
+
+  void *mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) return BAD_ROUTING_TABLE;
+  madvise(mapping, *size, MADV_SEQUENTIAL);
+
+  *data = mapping;
+  return OK;
+
+}
+
+
+/***********************************************************************
+ * Map the whole FIB into memory, read-only
+ *
+ * data and size are output parameters. An empty FIB is mapped as
+ * data = NULL and size = 0. Must be undone with unmapRoutingTable
+ *
+ ***********************************************************************/
+int mapRoutingTable(char const **data, size_t *size){
+
+  return mapDescriptor(fileno(routingTable), data, size);
+
+}
+
+
+/***********************************************************************
+ * Map the whole FIB at path into memory, read-only, like mapRoutingTable
+ ***********************************************************************/
+int mapRoutingTableFile(char const *path, char const **data, size_t *size){
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return ROUTING_TABLE_NOT_FOUND;
+  int result = mapDescriptor(fd, data, size);
+  close(fd);
+  return result;
+
+}
+
+
+/***********************************************************************
+ * Undo mapRoutingTable
+ ***********************************************************************/
+void unmapRoutingTable(char const *data, size_t size){
+
+  if (data != NULL) munmap((void *)data, size);
+
+}
+
+
+/***********************************************************************
+ * Count the lines in a buffer (an upper bound of the entries in it)
+ ***********************************************************************/
+size_t countLines(char const *data, size_t size){
+
+  size_t lines = 0;
+  char const *end = data + size;
+
+  while (data < end && (data = memchr(data, '\n', end - data)) != NULL) {
+    lines++;
+    data++;
+  }
+
+  return lines + 1; // The last line may not end in '\n'
+
+}
+
+
+/***********************************************************************
+ * Scanner helpers for parseFIBLine and friends
+ *
+ * They take the address of a cursor into a buffer which ends at end,
+ * and move it past whatever they read
+ ***********************************************************************/
+
+// Skip spaces and tabs, but not newlines
+static inline void skipBlanks(char const **cursor, char const *end){
+  while (*cursor < end && (**cursor == ' ' || **cursor == '\t' || **cursor == '\r')) (*cursor)++;
+}
+
+// Skip all whitespace, counting the newlines in *lines
+static inline void skipWhitespace(char const **cursor, char const *end, int *lines){
+  while (*cursor < end) {
+    char c = **cursor;
+    if (c == '\n') (*lines)++;
+    else if (c != ' ' && c != '\t' && c != '\r') break;
+    (*cursor)++;
+  }
+}
+
+// Read a number the way fscanf's %i does (which the FIB and input files
+// were read with, and test/linearSearch still is): hexadecimal after 0x,
+// octal after 0, decimal otherwise. Returns 0 if there is none, or if it
+// doesn't fit in 32 bits
+static inline int parseInteger(char const **cursor, char const *end, uint32_t *value){
+  char const *p = *cursor;
+  unsigned base = 10;
+  uint64_t result = 0;
+
+  if (p < end && *p == '0') {
+    base = 8; // The 0 is a digit, so "0" alone is still read
+    if (end - p > 2 && (p[1] == 'x' || p[1] == 'X') && isxdigit((unsigned char)p[2])) {
+      base = 16;
+      p += 2;
+    }
+  }
+  char const *digits = p;
+
+  while (p < end && isxdigit((unsigned char)*p)) {
+    unsigned digit = isdigit((unsigned char)*p) ? *p - '0' : (*p | 0x20) - 'a' + 10;
+    if (digit >= base) break;
+    result = result * base + digit;
+    if (result > UINT32_MAX) return 0;
+    p++;
+  }
+  if (p == digits) return 0;
+
+  *value = result;
+  *cursor = p;
+  return 1;
+}
+
+// Read an IPv4 address in dotted-quad notation. Returns 0 on error
+static inline int parseDottedQuad(char const **cursor, char const *end, uint32_t *address){
+  uint32_t octet, result = 0;
+
+  for (int i = 0; i < 4; i++) {
+    if (i > 0) {
+      if (*cursor >= end || **cursor != '.') return 0;
+      (*cursor)++;
+    }
+    if (!parseInteger(cursor, end, &octet) || octet > 255) return 0;
+    result = (result << 8) | octet;
+  }
+
+  *address = result;
+  return 1;
+}
+
+
+/***********************************************************************
+ * Parse one entry of a FIB mapped with mapRoutingTable
+ *
+ * Same as readFIBLine, but reading from memory: cursor points to the
+ * next character to parse, and is moved past the entry
+ *
+ ***********************************************************************/
+int parseFIBLine(char const **cursor, char const *end, int *lineNumber, uint32_t *prefix, int *prefixLength, int *outInterface){
+
+  uint32_t length, interface;
+
+  // Like fscanf, ignore leading whitespace (including empty lines)
+  skipWhitespace(cursor, end, lineNumber);
+  if (*cursor >= end) return REACHED_EOF;
+  (*lineNumber)++;
+
+  if (!parseDottedQuad(cursor, end, prefix)) return BAD_ROUTING_TABLE;
+  if (*cursor >= end || **cursor != '/') return BAD_ROUTING_TABLE;
+  (*cursor)++;
+  if (!parseInteger(cursor, end, &length) || length > 32) return BAD_ROUTING_TABLE;
+  skipBlanks(cursor, end);
+  if (!parseInteger(cursor, end, &interface) || interface > INT32_MAX) return BAD_ROUTING_TABLE;
+  skipBlanks(cursor, end);
+
+  // The entry must be the only thing in its line
+  if (*cursor < end) {
+    if (**cursor != '\n') return BAD_ROUTING_TABLE;
+    (*cursor)++;
+  }
+
+  *prefixLength = length;
+  *outInterface = interface;
+  return OK;
+
+}
+
+
+/***********************************************************************
+ * Parse one entry of an input packet file in memory
+ *
+ * Same as readInputPacketFileLine, but reading from memory: cursor
+ * points to the next character to parse, and is moved past the entry
+ *
+ ***********************************************************************/
+int parseInputPacketLine(char const **cursor, char const *end, uint32_t *IPAddress){
+
+  int lines = 0; // Unused, skipWhitespace needs it
+
+  skipWhitespace(cursor, end, &lines);
+  if (*cursor >= end) return REACHED_EOF;
+
+  if (!parseDottedQuad(cursor, end, IPAddress)) return BAD_INPUT_FILE;
+  skipBlanks(cursor, end);
+
+  // The address must be the only thing in its line
+  if (*cursor < end) {
+    if (**cursor != '\n') return BAD_INPUT_FILE;
+    (*cursor)++;
+  }
+
+  return OK;
+
+}
+
+
 /***********************************************************************
  * Read one entry in the input packet file
  *
@@ -151,6 +414,69 @@ int readInputPacketFileLine(uint32_t *IPAddress){
 }
 
 
+/***********************************************************************
+ * Move the unparsed input to the start of the buffer, and fill the rest
+ * of it from the input file
+ ***********************************************************************/
+static void refillInputBuffer(){
+
+  size_t remaining = inputEnd - inputCursor;
+  memmove(inputBuffer, inputCursor, remaining);
+  inputCursor = inputBuffer;
+  inputEnd = inputBuffer + remaining;
+
+  while (!inputEOF && inputEnd < inputBuffer + INPUT_BUFFER_SIZE) {
+    ssize_t result = read(fileno(inputFile), inputEnd, inputBuffer + INPUT_BUFFER_SIZE - inputEnd);
+    if (result <= 0) inputEOF = 1; // Errors are treated as the end of the file
+    else inputEnd += result;
+  }
+
+}
+
+
+/***********************************************************************
+ * Read a block of entries in the input packet file
+ *
+ * Reads up to maxCount addresses into IPAddresses, and stores how many
+ * were read in count. The file is read through a large private buffer,
+ * so this must not be mixed with readInputPacketFileLine
+ *
+ * Returns OK if at least one address was read. Errors (BAD_INPUT_FILE)
+ * are returned, with count = 0, by the call after the last good address
+ *
+ ***********************************************************************/
+int readInputPacketFileBlock(uint32_t *IPAddresses, int maxCount, int *count){
+
+  int lines = 0; // Unused, skipWhitespace needs it
+  char const *cursor;
+  int n = 0;
+
+  while (n < maxCount) {
+    // Make sure a whole line is in the buffer before parsing it
+    if (inputEnd - inputCursor < MAX_INPUT_LINE && !inputEOF) refillInputBuffer();
+
+    cursor = inputCursor;
+    skipWhitespace(&cursor, inputEnd, &lines);
+    inputCursor = (char *)cursor;
+    if (inputCursor == inputEnd) {
+      if (inputEOF) break;
+      continue;
+    }
+    if (inputEnd - inputCursor < MAX_INPUT_LINE && !inputEOF) continue;
+
+    if (parseInputPacketLine(&cursor, inputEnd, &IPAddresses[n]) != OK) break;
+
+    inputCursor = (char *)cursor;
+    n++;
+  }
+
+  *count = n;
+  if (n > 0) return OK;
+  return inputCursor == inputEnd ? REACHED_EOF : BAD_INPUT_FILE;
+
+}
+
+
 /***********************************************************************
  * Print a line to the output file
  *
@@ -177,13 +503,104 @@ void printOutputLine(uint32_t IPAddress, int outInterface,
 
     *searchingTime = 1e9*sec + nsec;
 
+    printOutputResult(IPAddress, outInterface, *searchingTime, numberOfAccesses);
+
+}
+
+
+/***********************************************************************
+ * Enable or disable mirroring the output lines to the standard output
+ *
+ * The summary is always printed to both
+ ***********************************************************************/
+void setOutputMirroring(int enabled){
+
+  flushOutputBuffer(); // Lines so far follow the previous setting
+  mirrorOutput = enabled;
+
+}
+
+
+/***********************************************************************
+ * Formatters for printOutputResult. They write at dest and return the
+ * number of characters written, with the same result as printf would
+ ***********************************************************************/
+
+// Like "%u"
+static inline int formatUnsigned(char *dest, uint64_t value){
+  char digits[20];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+
+  for (int i = 0; i < n; i++) dest[i] = digits[n - 1 - i];
+  return n;
+}
+
+// Like "%i"
+static inline int formatInt(char *dest, int value){
+  if (value >= 0) return formatUnsigned(dest, value);
+  *dest = '-';
+  return 1 + formatUnsigned(dest + 1, -(int64_t)value);
+}
+
+// Like "%i.%i.%i.%i" on each byte, from most to least significant
+static inline int formatDottedQuad(char *dest, uint32_t address){
+  int n = formatUnsigned(dest, address >> 24);
+  dest[n++] = '.';
+  n += formatUnsigned(dest + n, (address >> 16) & 0x000000ff);
+  dest[n++] = '.';
+  n += formatUnsigned(dest + n, (address >> 8) & 0x000000ff);
+  dest[n++] = '.';
+  n += formatUnsigned(dest + n, address & 0x000000ff);
+  return n;
+}
+
+// Like "%.0lf"
+static inline int formatRounded(char *dest, double value){
+  // Same rounding as printf (to nearest, ties to even)
+  double rounded = nearbyint(value);
+  if (rounded >= 0 && rounded < 1e18) return formatUnsigned(dest, (uint64_t)rounded);
+  return snprintf(dest, MAX_OUTPUT_LINE / 2, "%.0lf", value); // Rare, let printf deal with it
+}
+
+
+/***********************************************************************
+ * Print a line to the output file, given the time already measured
+ *
+ * Same as printOutputLine, for lookups which weren't timed one by one
+ * (searchingTime is then the average time of the batch they were in)
+ *
+ ***********************************************************************/
+void printOutputResult(uint32_t IPAddress, int outInterface,
+		       double searchingTime, int numberOfAccesses) {
+
+  if (OUTPUT_BUFFER_SIZE - outputUsed < MAX_OUTPUT_LINE) flushOutputBuffer();
+  char *line = outputBuffer + outputUsed;
+  int n = 0;
+
 	//remember that output interface equals 0 means no matching
 	//remember that if no matching but default route is specified in the FIB, the default output interface
 	//must be stored to avoid dropping the packet (i.e., MISS)
-    if (!outInterface)
-      tee(outputFile,"%i.%i.%i.%i;%s;%i;%.0lf\n",IPAddress >> 24, (IPAddress >> 16) & 0x000000ff, (IPAddress >> 8) & 0x000000ff, IPAddress & 0x000000ff , "MISS",numberOfAccesses, *searchingTime);
-    else
-      tee(outputFile,"%i.%i.%i.%i;%i;%i;%.0lf\n",IPAddress >> 24, (IPAddress >> 16) & 0x000000ff, (IPAddress >> 8) & 0x000000ff, IPAddress & 0x000000ff , outInterface,numberOfAccesses, *searchingTime);
+  // Same as "%i.%i.%i.%i;%i;%i;%.0lf\n", with "MISS" if there's no interface
+  n += formatDottedQuad(line + n, IPAddress);
+  line[n++] = ';';
+  if (!outInterface) {
+    memcpy(line + n, "MISS", 4);
+    n += 4;
+  }
+  else
+    n += formatInt(line + n, outInterface);
+  line[n++] = ';';
+  n += formatInt(line + n, numberOfAccesses);
+  line[n++] = ';';
+  n += formatRounded(line + n, searchingTime);
+  line[n++] = '\n';
+
+  outputUsed += n;
 
 }
 
@@ -204,7 +621,40 @@ void printSummary(int NumberOfNodesInTrie, int processedPackets, double averageN
   tee(outputFile, "Packets processed= %i\n", processedPackets);
   tee(outputFile, "Average nodes accessed= %.2lf\n", averageNodeAccesses);
   tee(outputFile,"Average packet processing time (nsecs)= %.2lf\n", averagePacketProcessingTime);
-  printMemoryTimeUsage();
+}
+
+
+/***********************************************************************
+ * Print percentiles of the packet processing time to the output file,
+ * after the summary
+ ***********************************************************************/
+void printLatencySummary(uint64_t p50, uint64_t p90, uint64_t p99, uint64_t p999, uint64_t max){
+
+  tee(outputFile, "Packet processing time percentiles (nsecs)= "
+      "p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+      (unsigned long long)p50, (unsigned long long)p90,
+      (unsigned long long)p99, (unsigned long long)p999,
+      (unsigned long long)max);
+
+}
+
+
+/***********************************************************************
+ * Print counts of events (e.g. hardware ones) to the output file, as
+ * "label= name value, name value...". Negative values weren't counted,
+ * and are printed as n/a
+ ***********************************************************************/
+void printEventCounts(char const *label, char const *names[], double const values[], int count){
+
+  tee(outputFile, "%s=", label);
+  for (int i = 0; i < count; i++){
+    if (values[i] < 0)
+      tee(outputFile, "%s %s n/a", i ? "," : "", names[i]);
+    else
+      tee(outputFile, "%s %s %.2lf", i ? "," : "", names[i], values[i]);
+  }
+  tee(outputFile, "\n");
+
 }
 
 
@@ -21,6 +21,11 @@
 #define BAD_INPUT_FILE -3004
 #define PARSE_ERROR -3005
 #define CANNOT_CREATE_OUTPUT -3006
+#define TOO_MANY_NEXT_HOPS -3007
+#define INPUT_BUFFER_SIZE (1 << 20) // Bytes read at once by readInputPacketFileBlock
+#define MAX_INPUT_LINE 64           // Longest line readInputPacketFileBlock accepts
+#define OUTPUT_BUFFER_SIZE (1 << 20) // Bytes of output lines buffered before writing
+#define MAX_OUTPUT_LINE 128          // Room needed in the buffer for an output line
 
 /***********************************************************************
  * Write the input to the specified file (f) and the standard output
@@ -63,6 +68,62 @@ void printIOExplanationError(int result);
 int readFIBLine(uint32_t *prefix, int *prefixLength, int *outInterface);
 
 
+/***********************************************************************
+ * Map the whole FIB into memory, read-only
+ *
+ * data and size are output parameters. An empty FIB is mapped as
+ * data = NULL and size = 0. Must be undone with unmapRoutingTable
+ *
+ ***********************************************************************/
+int mapRoutingTable(char const **data, size_t *size);
+
+
+/***********************************************************************
+ * Undo mapRoutingTable
+ ***********************************************************************/
+void unmapRoutingTable(char const *data, size_t size);
+
+
+/***********************************************************************
+ * Map the whole FIB at path into memory, read-only
+ *
+ * Same as mapRoutingTable, but on a descriptor of its own instead of the
+ * FIB given to initializeIO, so it can be used from any thread (e.g. to
+ * read the current contents of a FIB that was replaced). Must be undone
+ * with unmapRoutingTable
+ *
+ ***********************************************************************/
+int mapRoutingTableFile(char const *path, char const **data, size_t *size);
+
+
+/***********************************************************************
+ * Count the lines in a buffer (an upper bound of the entries in it)
+ ***********************************************************************/
+size_t countLines(char const *data, size_t size);
+
+
+/***********************************************************************
+ * Parse one entry of a FIB mapped with mapRoutingTable
+ *
+ * Same as readFIBLine, but reading from memory: cursor points to the
+ * next character to parse, and is moved past the entry. lineNumber is
+ * the number of lines parsed so far (0 at the start of the FIB), and is
+ * left at the line of the entry, so it's the line of any error
+ *
+ ***********************************************************************/
+int parseFIBLine(char const **cursor, char const *end, int *lineNumber, uint32_t *prefix, int *prefixLength, int *outInterface);
+
+
+/***********************************************************************
+ * Parse one entry of an input packet file in memory
+ *
+ * Same as readInputPacketFileLine, but reading from memory: cursor
+ * points to the next character to parse, and is moved past the entry
+ *
+ ***********************************************************************/
+int parseInputPacketLine(char const **cursor, char const *end, uint32_t *IPAddress);
+
+
 /***********************************************************************
  * Read one entry in the input packet file
  *
@@ -73,6 +134,20 @@ int readFIBLine(uint32_t *prefix, int *prefixLength, int *outInterface);
 int readInputPacketFileLine(uint32_t *IPAddress);
 
 
+/***********************************************************************
+ * Read a block of entries in the input packet file
+ *
+ * Reads up to maxCount addresses into IPAddresses, and stores how many
+ * were read in count. The file is read through a large private buffer,
+ * so this must not be mixed with readInputPacketFileLine
+ *
+ * Returns OK if at least one address was read. Errors (BAD_INPUT_FILE)
+ * are returned, with count = 0, by the call after the last good address
+ *
+ ***********************************************************************/
+int readInputPacketFileBlock(uint32_t *IPAddresses, int maxCount, int *count);
+
+
 /***********************************************************************
  * Print a line to the output file
  *
@@ -88,6 +163,25 @@ int readInputPacketFileLine(uint32_t *IPAddress);
                         double *searchingTime, int numberOfTableAccesses);
 
 
+/***********************************************************************
+ * Print a line to the output file, given the time already measured
+ *
+ * Same as printOutputLine, for lookups which weren't timed one by one
+ * (searchingTime is then the average time of the batch they were in)
+ *
+ ***********************************************************************/
+void printOutputResult(uint32_t IPAddress, int outInterface,
+                       double searchingTime, int numberOfAccesses);
+
+
+/***********************************************************************
+ * Enable or disable mirroring the output lines to the standard output
+ *
+ * The summary is always printed to both
+ ***********************************************************************/
+void setOutputMirroring(int enabled);
+
+
 /***********************************************************************
  * Print execution summary to the output file
  *
@@ -101,6 +195,21 @@ int readInputPacketFileLine(uint32_t *IPAddress);
 void printSummary(int NumberOfNodesInTrie, int processedPackets, double averageNodeAccesses, double averagePacketProcessingTime);
 
 
+/***********************************************************************
+ * Print percentiles of the packet processing time to the output file,
+ * after the summary
+ ***********************************************************************/
+void printLatencySummary(uint64_t p50, uint64_t p90, uint64_t p99, uint64_t p999, uint64_t max);
+
+
+/***********************************************************************
+ * Print counts of events (e.g. hardware ones) to the output file, as
+ * "label= name value, name value...". Negative values weren't counted,
+ * and are printed as n/a
+ ***********************************************************************/
+void printEventCounts(char const *label, char const *names[], double const values[], int count);
+
+
 /***********************************************************************
  * Print memory and CPU time
  *
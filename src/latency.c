@@ -0,0 +1,107 @@
+#include "latency.h"
+#include <stdio.h>
+#include <math.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+/** Lowest time that goes in a bucket.
+ *
+ *  @returns the time in nanoseconds
+ */
+static uint64_t bucket_lowest(uint32_t bucket) {
+    if (bucket < LATENCY_LINEAR_LIMIT)
+        return bucket;
+    // The inverse of latency_bucket()
+    uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t top_bits = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+    return top_bits << shift;
+}
+
+/** Highest time that goes in a bucket.
+ *
+ *  @returns the time in nanoseconds
+ */
+static uint64_t bucket_highest(uint32_t bucket) {
+    return bucket + 1 < LATENCY_BUCKETS ?
+        bucket_lowest(bucket + 1) - 1 : LATENCY_MAX_NS;
+}
+
+void latency_record_batch(LatencyHistogram *histogram, uint64_t total_ns,
+                          uint64_t n) {
+    if (n == 0)
+        return;
+    latency_record_n(histogram, total_ns / n, n);
+    histogram->sum_ns += total_ns % n; // What the average rounded off
+}
+
+void latency_merge(LatencyHistogram *into, const LatencyHistogram *from) {
+    if (from->count == 0)
+        return;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    if (into->count == 0 || from->min_ns < into->min_ns)
+        into->min_ns = from->min_ns;
+    if (from->max_ns > into->max_ns)
+        into->max_ns = from->max_ns;
+    into->count += from->count;
+    into->sum_ns += from->sum_ns;
+}
+
+uint64_t latency_percentile(const LatencyHistogram *histogram,
+                            double percentile) {
+    if (histogram->count == 0)
+        return 0;
+    if (percentile >= 100)
+        return histogram->max_ns;
+
+    // The time of the rank-th fastest lookup, counting from 1
+    uint64_t rank = ceil(percentile / 100 * histogram->count);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t highest = bucket_highest(i);
+            return highest < histogram->max_ns ? highest : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+double latency_mean(const LatencyHistogram *histogram) {
+    return histogram->count ?
+        (double)histogram->sum_ns / histogram->count : 0;
+}
+
+int latency_dump(const LatencyHistogram *histogram, const char *path) {
+    DEBUG_PRINT("Dumping latency histogram to %s\n", path);
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+
+    fprintf(file, "# Lookup times: %llu, mean %.2f ns, min %llu ns, "
+            "max %llu ns\n", (unsigned long long)histogram->count,
+            latency_mean(histogram),
+            (unsigned long long)(histogram->count ? histogram->min_ns : 0),
+            (unsigned long long)histogram->max_ns);
+    fprintf(file, "# lowest_ns highest_ns count cumulative_percent\n");
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        if (histogram->counts[i] == 0)
+            continue;
+        seen += histogram->counts[i];
+        fprintf(file, "%llu %llu %llu %.4f\n",
+                (unsigned long long)bucket_lowest(i),
+                (unsigned long long)bucket_highest(i),
+                (unsigned long long)histogram->counts[i],
+                100.0 * seen / histogram->count);
+    }
+
+    return fclose(file) == 0 ? 0 : -1;
+}
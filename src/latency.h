@@ -0,0 +1,146 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h> // For fixed-width integer types like uint64_t
+#include <time.h>   // For struct timespec
+
+// ==== Constants ====
+#define LATENCY_SUB_BITS 5       // Each power of 2 is split in 2^this buckets
+#define LATENCY_MAX_MAGNITUDE 40 // Times of 2^41 ns (~37 min) or more are capped
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+/// Times below this have a bucket of their own, and so are exact
+#define LATENCY_LINEAR_LIMIT (2 * LATENCY_SUB_BUCKETS)
+#define LATENCY_BUCKETS ((LATENCY_MAX_MAGNITUDE - LATENCY_SUB_BITS) \
+    * LATENCY_SUB_BUCKETS + LATENCY_LINEAR_LIMIT)
+#define LATENCY_MAX_NS ((UINT64_C(1) << (LATENCY_MAX_MAGNITUDE + 1)) - 1)
+
+// ==== Data Structures ====
+
+/** Histogram of lookup times, in the style of HdrHistogram.
+ *
+ * Times below LATENCY_LINEAR_LIMIT nanoseconds get a bucket each. Above that,
+ * every power of 2 is split into LATENCY_SUB_BUCKETS buckets of equal width,
+ * so a time is known to within 1/LATENCY_SUB_BUCKETS (about 3%) of its value
+ * whatever its size. Recording one is a few integer operations, with no
+ * allocation, so it can be done in the lookup loop.
+ *
+ * A zero-initialized histogram is empty. Each thread should have its own, to
+ * be merged with latency_merge() when they're done.
+ */
+typedef struct LatencyHistogram {
+    uint64_t counts[LATENCY_BUCKETS]; ///< Times recorded in each bucket
+    uint64_t count;  ///< Times recorded
+    uint64_t sum_ns; ///< Sum of the times recorded, for the mean
+    uint64_t min_ns; ///< Shortest time recorded, if any
+    uint64_t max_ns; ///< Longest time recorded (capped at LATENCY_MAX_NS)
+} LatencyHistogram;
+
+// ==== Function Prototypes ====
+
+/** Nanoseconds between two times taken with clock_gettime().
+ *
+ * @param start The earlier time.
+ * @param end The later time.
+ *
+ * @return The difference, or 0 if `end` is earlier.
+ */
+static inline uint64_t latency_elapsed_ns(const struct timespec *start,
+                                          const struct timespec *end) {
+    int64_t ns = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000
+        + (end->tv_nsec - start->tv_nsec);
+    return ns > 0 ? (uint64_t)ns : 0;
+}
+
+/** Index of the bucket a time goes in.
+ *
+ * @param ns The time in nanoseconds.
+ *
+ * @return Its bucket, the last one if it's over LATENCY_MAX_NS.
+ */
+static inline uint32_t latency_bucket(uint64_t ns) {
+    if (ns < LATENCY_LINEAR_LIMIT)
+        return ns;
+    if (ns > LATENCY_MAX_NS)
+        ns = LATENCY_MAX_NS;
+    // The top LATENCY_SUB_BITS + 1 bits of the time pick its bucket
+    uint32_t shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return shift * LATENCY_SUB_BUCKETS + (uint32_t)(ns >> shift);
+}
+
+/** Record a number of lookups that took the same time.
+ *
+ * @param histogram Pointer to the histogram.
+ * @param ns Time each of them took, in nanoseconds.
+ * @param n Number of lookups.
+ */
+static inline void latency_record_n(LatencyHistogram *histogram, uint64_t ns,
+                                    uint64_t n) {
+    if (histogram->count == 0 || ns < histogram->min_ns)
+        histogram->min_ns = ns;
+    if (ns > histogram->max_ns)
+        histogram->max_ns = ns > LATENCY_MAX_NS ? LATENCY_MAX_NS : ns;
+    histogram->counts[latency_bucket(ns)] += n;
+    histogram->count += n;
+    histogram->sum_ns += ns * n;
+}
+
+/** Record the time a lookup took.
+ *
+ * @param histogram Pointer to the histogram.
+ * @param ns Time it took, in nanoseconds.
+ */
+static inline void latency_record(LatencyHistogram *histogram, uint64_t ns) {
+    latency_record_n(histogram, ns, 1);
+}
+
+/** Record a batch of lookups timed as a whole, each taking the average.
+ *
+ * @param histogram Pointer to the histogram.
+ * @param total_ns Time the whole batch took, in nanoseconds. It's added to
+ *      the sum as is, so the mean isn't affected by rounding the average.
+ * @param n Number of lookups in the batch.
+ */
+void latency_record_batch(LatencyHistogram *histogram, uint64_t total_ns,
+                          uint64_t n);
+
+/** Add the times recorded in a histogram to another one.
+ *
+ * @param into Pointer to the histogram to add them to.
+ * @param from Pointer to the histogram to add.
+ */
+void latency_merge(LatencyHistogram *into, const LatencyHistogram *from);
+
+/** Get a percentile of the times recorded.
+ *
+ * @param histogram Pointer to the histogram.
+ * @param percentile Which one, from 0 to 100.
+ *
+ * @return The highest time of the bucket the percentile falls in (so, at most
+ *      3% over the actual time), never more than the longest time recorded.
+ *      0 if the histogram is empty.
+ */
+uint64_t latency_percentile(const LatencyHistogram *histogram,
+                            double percentile);
+
+/** Get the mean of the times recorded.
+ *
+ * @param histogram Pointer to the histogram.
+ *
+ * @return The mean in nanoseconds, or 0 if the histogram is empty.
+ */
+double latency_mean(const LatencyHistogram *histogram);
+
+/** Write the buckets of a histogram that have any times in them to a file.
+ *
+ * Each line has the lowest and highest time of a bucket (in nanoseconds), the
+ * times recorded in it, and the percentage of times up to its highest one.
+ * Lines starting with '#' are comments.
+ *
+ * @param histogram Pointer to the histogram.
+ * @param path Name of the file, which is overwritten.
+ *
+ * @return 0 on success, or -1 if the file couldn't be written.
+ */
+int latency_dump(const LatencyHistogram *histogram, const char *path);
+
+#endif // LATENCY_H
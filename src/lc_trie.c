@@ -2,6 +2,16 @@
 #include "utils.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h> // For the counters shared by builder threads
+#include <pthread.h>
+#include <sched.h>     // For sched_yield
+#include <sys/mman.h>  // For munmap, for tries mapped from images
+
+// SIMD kernels for lookup_ip_compact_batch(), chosen at runtime
+#if defined(__x86_64__) && defined(__GNUC__)
+#define COMPACT_SIMD
+#include <immintrin.h>
+#endif
 
 // Macro for debug printing
 #ifdef DEBUG
@@ -11,22 +21,127 @@
 #define DEBUG_PRINT(...) do {} while (0)
 #endif
 
+// Smallest group create_node() splits into tasks for other threads, when
+// building in parallel. Smaller ones are created by a single thread
+#define PARALLEL_BUILD_GRAIN 1024
+
 // ---- Trie creation ----
 
-/** Recursively create a subtrie.
+/** Allocate memory for a block of sibling nodes.
  *
- *  @param group the memory address of the group's first member (a memory
- *      address in a SORTED base vector)
- *  @param group_size the number of actions in this group, including the one
- *      at `group`.
- *  @param pre_skip the number of bits already skipped and read by parent groups
- *  @param node_ptr the memory address where the root node of the subtrie should
- *      be placed. Must have been previously allocated.
+ *  @param arena the arena to allocate from, or NULL to use malloc
+ *  @param num_nodes the number of nodes in the block
  *
- *  @returns the memory address of the root node of the generated subtrie
+ *  @returns the memory address of the first node, or NULL on failure
  */
-TrieNode *create_subtrie(Rule *group, size_t group_size, uint8_t pre_skip,
-                         TrieNode *node_ptr, Rule *default_rule) {
+static TrieNode *alloc_nodes(Arena *arena, size_t num_nodes) {
+    if (arena == NULL)
+        return malloc(num_nodes * sizeof(TrieNode));
+    return arena_alloc(arena, num_nodes * sizeof(TrieNode));
+}
+
+/** Count a node in the shape of a trie, or take it out of it.
+ *
+ *  @param stats the shape to update
+ *  @param node the node, already filled in
+ *  @param depth the number of nodes above it
+ *  @param pos the number of bits read before reaching it
+ *  @param sign 1 to count the node, or -1 to take it out
+ */
+static void count_node_stats(TrieStats *stats, const TrieNode *node,
+                             uint8_t depth, uint8_t pos, int sign) {
+    stats->num_nodes += sign;
+    if (node->branch != 0) {
+        stats->branches[node->branch] += sign;
+        stats->skips[node->skip] += sign;
+        return;
+    }
+
+    stats->num_leaves += sign;
+    stats->depths[depth] += sign;
+    const Rule *rule = node->pointer;
+    if (rule == NULL)
+        stats->empty_leaves += sign;
+    else if (rule->prefix_len < pos) // It covers the whole node
+        stats->default_leaves += sign;
+    int chain = 0;
+    for (; rule != NULL && chain < TRIE_STATS_LEVELS - 1; rule = rule->parent)
+        chain++;
+    stats->chains[chain] += sign;
+}
+
+/** Count every node of a subtrie in the shape of a trie, or take them out.
+ *
+ *  Takes the same parameters as count_node_stats(), for the subtrie's root.
+ */
+static void count_subtrie_stats(TrieStats *stats, const TrieNode *node,
+                                uint8_t depth, uint8_t pos, int sign) {
+    count_node_stats(stats, node, depth, pos, sign);
+    if (node->branch == 0)
+        return;
+
+    const TrieNode *children = node->pointer;
+    uint8_t children_pos = pos + node->skip + node->branch;
+    for (uint32_t i = 0; i < (1u << node->branch); i++)
+        count_subtrie_stats(stats, &children[i], depth + 1, children_pos,
+                sign);
+}
+
+/// Add the shape of a part of a trie to that of the rest.
+static void merge_trie_stats(TrieStats *into, const TrieStats *from) {
+    into->num_nodes += from->num_nodes;
+    into->num_leaves += from->num_leaves;
+    into->empty_leaves += from->empty_leaves;
+    into->default_leaves += from->default_leaves;
+    for (int i = 0; i < TRIE_STATS_LEVELS; i++) {
+        into->branches[i] += from->branches[i];
+        into->skips[i] += from->skips[i];
+        into->depths[i] += from->depths[i];
+        into->chains[i] += from->chains[i];
+    }
+}
+
+/// A group of rules being split among the children of a node
+typedef struct NodeSplit {
+    Rule *group;         ///< First rule under the children (past defaults)
+    size_t group_size;   ///< Number of rules under the children
+    Rule *default_rule;  ///< Default rule the children inherit
+    uint8_t pos;         ///< Bits read before the node's branch
+    uint8_t branch;      ///< Branch of the node
+    size_t next;         ///< Index in `group` of the next child's first rule
+    Rule *covering;      ///< Default of the last child (see next_subgroup())
+} NodeSplit;
+
+/** Check if a rule too short for a node's branch covers one of its children.
+ *
+ *  @param rule a rule of the node's group, at least `pos` bits long
+ *  @param pos the number of bits read before the node's branch
+ *  @param branch the branch of the node
+ *  @param child_n the index of the child
+ *
+ *  @returns true if every address under the child matches the rule
+ */
+static inline bool rule_covers_child(const Rule *rule, uint8_t pos,
+                                     uint8_t branch, uint32_t child_n) {
+    uint8_t free_bits = pos + branch - rule->prefix_len;
+    return ((extract_msb(rule->prefix, pos, branch) ^ child_n)
+            >> free_bits) == 0;
+}
+
+/** Fill in the root node of a subtrie, without creating its children.
+ *
+ *  Takes the same parameters as build_subtrie(), but doesn't count the node.
+ *  If the node isn't a leaf, its children are allocated (but not filled in)
+ *  and `split` is set up for next_subgroup() to find the group of each one.
+ *
+ *  @param[out] split where to store how the group is split among children
+ *
+ *  @returns 1 if the node has children to create, 0 if it's a leaf, or -1 if
+ *      memory ran out
+ */
+static int create_node(Rule *group, size_t group_size, uint8_t pre_skip,
+                       TrieNode *node_ptr, Rule *default_rule, Arena *arena,
+                       uint8_t force_branch, NodeSplit *split) {
     // Base case: single rule in the group
     if (group_size == 1) {
         DEBUG_PRINT("Creating leaf node with rule %p\n", group);
@@ -34,7 +149,7 @@ TrieNode *create_subtrie(Rule *group, size_t group_size, uint8_t pre_skip,
         node_ptr->skip = 0;
         node_ptr->pointer = (TrieNode *)group; // Store rule directly
         DEBUG_PRINT("--Done creating leaf node at %p\n", node_ptr);
-        return node_ptr;
+        return 0;
     }
 
     DEBUG_PRINT("Creating subtrie with %zu rules at %p\n", group_size, group);
@@ -48,75 +163,178 @@ TrieNode *create_subtrie(Rule *group, size_t group_size, uint8_t pre_skip,
                 new_default->prefix_len, new_default->out_iface);
         default_rule = new_default;
 
-        // Virtually remove the default rule from the group
-        // This looks so wrong...
-        size_t default_count = (size_t)(new_default - group) / sizeof(Rule) + 1;
+        // Virtually remove the default rule (and any before it) from the group
+        size_t default_count = (size_t)(new_default - group) + 1;
         group_size -= default_count;
         group = new_default + 1;
     }
 
-    // Compute skip and branch values
+    // Compute skip and branch values. A forced branch may be longer than
+    // some of the prefixes, which next_subgroup() deals with
     uint8_t skip = compute_skip(group, group_size, pre_skip);
-    uint8_t branch = compute_branch(group, group_size, pre_skip + skip);
+    uint8_t branch;
+    if (force_branch > 0 && group_size > 1) {
+        branch = force_branch < 32 - pre_skip - skip ?
+            force_branch : 32 - pre_skip - skip;
+    } else {
+        branch = compute_branch(group, group_size, pre_skip + skip);
+    }
     DEBUG_PRINT("  skip = %hhu, branch = %hhu\n", skip, branch);
 
     // Edge case! All rules are single children
     if ( default_rule == &group[group_size - 1] || branch == 0) {
         DEBUG_PRINT("  Single-child chain encountered, forcing leaf node\n");
-        create_subtrie(default_rule, 1, 0, node_ptr, default_rule);
-        return node_ptr;
+        return create_node(default_rule, 1, 0, node_ptr, default_rule, arena,
+                0, split);
     }
 
     // Allocate memory for child nodes
     size_t num_children = 1 << branch;
-    TrieNode *children = malloc(num_children * sizeof(TrieNode));
+    TrieNode *children = alloc_nodes(arena, num_children);
     if (!children)
-        return NULL;
-    DEBUG_PRINT("  Allocated %zu children at %p\n", num_children, new_default);
+        return -1;
+    DEBUG_PRINT("  Allocated %zu children at %p\n", num_children, children);
 
     // Set current node's properties
     node_ptr->branch = branch;
     node_ptr->skip = skip;
     node_ptr->pointer = children;
 
-    // Recursively create children
-    uint8_t children_skip = pre_skip + skip + branch;
-    size_t current_pos = 0;
-
-    for (size_t child_n = 0; child_n < num_children; child_n++) {
-        DEBUG_PRINT("  Preparing child %zu\n", child_n);
-        size_t subgroup_size = 0;
-        while (current_pos + subgroup_size < group_size) {
-            uint32_t current_prefix = extract_msb(
-                group[current_pos + subgroup_size].prefix,
-                pre_skip + skip,
-                branch);
-
-            if (current_prefix != child_n)
-                break;
-            subgroup_size++;
-        }
-        DEBUG_PRINT("    Subgroup size: %zu\n", subgroup_size);
+    *split = (NodeSplit){
+        .group = group,
+        .group_size = group_size,
+        .default_rule = default_rule,
+        .pos = pre_skip + skip,
+        .branch = branch,
+        .next = 0,
+        .covering = default_rule,
+    };
+    return 1;
+}
 
-        // Build subtrie for this child
-        if (subgroup_size == 0) {
-            DEBUG_PRINT("    RECURSING for child at %p\n", &children[child_n]);
-            create_subtrie(default_rule, 1, 0, &children[child_n], default_rule);
-        }
-        else {
-            DEBUG_PRINT("    RECURSING for child at %p\n", &children[child_n]);
-            create_subtrie(
-                &group[current_pos], subgroup_size, children_skip,
-                &children[child_n], default_rule);
-        }
+/** Find the group of the next child of a node set up by create_node().
+ *
+ *  Must be called once for each child, in order.
+ *
+ *  Only a forced branch can be longer than some prefixes in the group. Each
+ *  of those is sorted before the rules of the first child it covers, but
+ *  covers the next ones too: instead of going into a group, it becomes the
+ *  default of all of them.
+ *
+ *  @param split the split stored by create_node()
+ *  @param child_n the index of the child
+ *  @param[out] subgroup where to store the first rule of the child's group
+ *  @param[out] child_default where to store the default rule of the child
+ *
+ *  @returns the size of the child's group. A child without rules of its own
+ *      gets a group with only the default rule
+ */
+static size_t next_subgroup(NodeSplit *split, uint32_t child_n,
+                            Rule **subgroup, Rule **child_default) {
+    DEBUG_PRINT("  Preparing child %u\n", child_n);
+    uint8_t children_pos = split->pos + split->branch;
+    while (split->covering != split->default_rule &&
+            !rule_covers_child(split->covering, split->pos, split->branch,
+                child_n))
+        split->covering = split->covering->parent;
+    while (split->next < split->group_size) {
+        Rule *rule = &split->group[split->next];
+        if (rule->prefix_len >= children_pos ||
+                extract_msb(rule->prefix, split->pos, split->branch) != child_n)
+            break;
+        DEBUG_PRINT("    Rule %p is too short, covers the child\n", rule);
+        rule->parent = split->covering;
+        split->covering = rule;
+        split->next++;
+    }
+    *child_default = split->covering;
+
+    size_t subgroup_size = 0;
+    while (split->next + subgroup_size < split->group_size) {
+        uint32_t current_prefix = extract_msb(
+            split->group[split->next + subgroup_size].prefix,
+            split->pos,
+            split->branch);
+
+        if (current_prefix != child_n)
+            break;
+        subgroup_size++;
+    }
+    DEBUG_PRINT("    Subgroup size: %zu\n", subgroup_size);
+
+    if (subgroup_size == 0) {
+        *subgroup = split->covering;
+        return 1;
+    }
+    *subgroup = &split->group[split->next];
+    split->next += subgroup_size;
+    if (split->covering != split->default_rule)
+        set_group_parent(*subgroup, subgroup_size, split->covering);
+    return subgroup_size;
+}
+
+/** Recursively create a subtrie.
+ *
+ *  @param group the memory address of the group's first member (a memory
+ *      address in a SORTED base vector)
+ *  @param group_size the number of actions in this group, including the one
+ *      at `group`.
+ *  @param pre_skip the number of bits already skipped and read by parent groups
+ *  @param node_ptr the memory address where the root node of the subtrie should
+ *      be placed. Must have been previously allocated.
+ *  @param default_rule the most specific rule that applies to the whole group,
+ *      found by parent groups (or NULL if none)
+ *  @param arena the arena children nodes are allocated from, or NULL to
+ *      allocate each block of them with malloc
+ *  @param force_branch the branch of the subtrie's root node, or 0 to compute
+ *      it like any other's. It's forced even if some prefixes are shorter,
+ *      but not past the 32nd bit
+ *  @param depth the number of nodes above `node_ptr`
+ *  @param stats where the nodes created are counted, or NULL
+ *
+ *  @returns the memory address of the root node of the generated subtrie, or
+ *      NULL if memory ran out
+ */
+static TrieNode *build_subtrie(Rule *group, size_t group_size,
+                               uint8_t pre_skip, TrieNode *node_ptr,
+                               Rule *default_rule, Arena *arena,
+                               uint8_t force_branch, uint8_t depth,
+                               TrieStats *stats) {
+    NodeSplit split;
+    int status = create_node(group, group_size, pre_skip, node_ptr,
+            default_rule, arena, force_branch, &split);
+    if (status >= 0 && stats)
+        count_node_stats(stats, node_ptr, depth, pre_skip, 1);
+    if (status <= 0)
+        return status == 0 ? node_ptr : NULL;
 
-        current_pos += subgroup_size;
+    // Recursively create children
+    TrieNode *children = node_ptr->pointer;
+    uint8_t children_skip = split.pos + split.branch;
+    for (uint32_t child_n = 0; child_n < (1u << split.branch); child_n++) {
+        Rule *subgroup, *child_default;
+        size_t subgroup_size = next_subgroup(&split, child_n, &subgroup,
+                &child_default);
+
+        DEBUG_PRINT("    RECURSING for child at %p\n", &children[child_n]);
+        if (!build_subtrie(subgroup, subgroup_size, children_skip,
+                    &children[child_n], child_default, arena, 0, depth + 1,
+                    stats))
+            return NULL;
     }
     DEBUG_PRINT("--Done creating subtrie at %p\n", node_ptr);
 
     return node_ptr;
 }
 
+/// Same as build_subtrie(), letting FILL_FACTOR pick every branch.
+TrieNode *create_subtrie(Rule *group, size_t group_size, uint8_t pre_skip,
+                         TrieNode *node_ptr, Rule *default_rule,
+                         Arena *arena) {
+    return build_subtrie(group, group_size, pre_skip, node_ptr, default_rule,
+            arena, 0, 0, NULL);
+}
+
 // ---- Dependency functions ----
 
 /** Get the length of the largest common prefix in a group of actions.
@@ -147,15 +365,16 @@ uint8_t compute_skip(const Rule *group, size_t group_size, uint8_t pre_skip) {
         return group[0].prefix_len - pre_skip;
     }
 
+    // The group is sorted, so whatever the first and last rules share, every
+    // rule in between shares too
     ip_addr_t first = group[0].prefix;
     ip_addr_t last = group[group_size - 1].prefix;
     DEBUG_PRINT("  First IP: 0x%08X; Last IP: 0x%08X\n", first, last);
 
-    uint8_t skip = pre_skip;
-    while (skip <= min_len && prefix_match(first, last, skip)) {
-        skip++;
-    } // At this point, skip is one too big
-    skip--;
+    uint8_t common = first == last ? 32 : __builtin_clz(first ^ last);
+    uint8_t skip = common < min_len ? common : min_len;
+    if (skip < pre_skip) // Not in a valid group, whose bits were all shared
+        skip = pre_skip;
 
     DEBUG_PRINT("--Done computing skip: %hhu\n", skip - pre_skip);
     return skip - pre_skip;
@@ -180,28 +399,33 @@ uint8_t compute_branch(const Rule *group, size_t group_size, uint8_t pre_skip) {
         return 0;
     }
 
-    uint8_t branch = 1;
+    // Bits past the end of a prefix mean nothing for it: a rule shorter than
+    // the branch would only be placed in one of the children it covers.
+    //
+    // With a branch of b bits, a rule is in a different child than the one
+    // before it if they differ within those b bits. So in the same pass,
+    // count the rules that first differ from the one before at each bit:
+    // adding them up gives the number of children in use for every b at once
+    uint8_t max_branch = 32 - pre_skip;
+    uint32_t first_difference[33] = {0}; // By bit after pre_skip, 32 if none
+    for (size_t i = 0; i < group_size; i++) {
+        if (group[i].prefix_len - pre_skip < max_branch)
+            max_branch = group[i].prefix_len - pre_skip;
+        if (i > 0) {
+            uint32_t diff = group[i].prefix ^ group[i - 1].prefix;
+            diff = pre_skip < 32 ? diff << pre_skip : 0;
+            first_difference[diff == 0 ? 32 : __builtin_clz(diff)]++;
+        }
+    }
 
-    while (1) {
-        const uint16_t max_branch_prefixes = 1 << branch; //2^branch
-        uint16_t unique_branch_prefixes = 1; //Start with 1 (group isn't empty)
-        uint32_t last_branch_prefix = extract_msb(group[0].prefix, pre_skip, branch);
-        DEBUG_PRINT("  Trying branch=%hhu: %hu prefixes available\n", branch,
-                max_branch_prefixes);
-
-        //Count unique branch prefixes at this branch level
-        for (size_t i = 1; i < group_size; i++) {
-            uint32_t current_prefix = extract_msb(group[i].prefix, pre_skip, branch);
-            DEBUG_PRINT("    Rule with prefix 0x%08X branches as 0x%X\n",
-                    group[i].prefix, current_prefix);
-
-            if (current_prefix != last_branch_prefix) {
-                unique_branch_prefixes++;
-            }
+    uint32_t unique_branch_prefixes = 1; // Start with 1 (group isn't empty)
+    uint8_t branch = 1;
 
-            last_branch_prefix = current_prefix;
-        }
-        DEBUG_PRINT("    %u prefixes found\n", unique_branch_prefixes);
+    while (branch <= max_branch) {
+        unique_branch_prefixes += first_difference[branch - 1];
+        const uint64_t max_branch_prefixes = (uint64_t)1 << branch; //2^branch
+        DEBUG_PRINT("  Trying branch=%hhu: %u of %lu prefixes used\n", branch,
+                unique_branch_prefixes, (unsigned long)max_branch_prefixes);
 
         //Return when fill factor condition is no longer met
         if ((float)unique_branch_prefixes / max_branch_prefixes < FILL_FACTOR) {
@@ -211,8 +435,8 @@ uint8_t compute_branch(const Rule *group, size_t group_size, uint8_t pre_skip) {
 
         branch++;
     }
-    DEBUG_PRINT("--Abnormal end of compute_branch: %hhu\n", branch-1);
-    return branch;
+    DEBUG_PRINT("--Done computing branch: %hhu (longest allowed)\n", branch-1);
+    return branch - 1;
 }
 
 // Comparison function for sorting rules
@@ -255,13 +479,241 @@ Rule *sort_rules(Rule *rules, size_t num_rules) {
 
     DEBUG_PRINT("  Copying rules to new memory space\n");
     memcpy(sorted, rules, num_rules * sizeof(Rule));
-    DEBUG_PRINT("  Sorting with qsort\n");
-    qsort(sorted, num_rules, sizeof(Rule), compare_rules);
+    sort_rules_in_place(sorted, num_rules);
     DEBUG_PRINT("--Sorted\n");
 
     return sorted;
 }
 
+// Rules are sorted by a key of RULE_KEY_DIGITS digits of RADIX_BITS bits:
+// the outgoing interface's bytes first (least significant), then the prefix
+// length, then the prefix's bytes
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RULE_KEY_DIGITS 9
+
+// Smallest number of rules sort_rules_parallel() splits among threads
+#define PARALLEL_SORT_MIN 65536
+
+/** Get a digit of the key rules are sorted by, in the order compare_rules()
+ *  defines. Default routes have no interface digits, like compare_rules()
+ *  doesn't look at their interface, so they keep their original order.
+ */
+static inline uint32_t rule_digit(const Rule *rule, int digit) {
+    if (digit < 4) {
+        if (rule->prefix_len == 0 && rule->prefix == 0)
+            return 0;
+        return (rule->out_iface >> (digit * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+    }
+    if (digit == 4)
+        return rule->prefix_len;
+    return (rule->prefix >> ((digit - 5) * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+}
+
+/** Count how many rules have each value of each digit, in a single pass. */
+static void count_rule_digits(const Rule *rules, size_t num_rules,
+                              size_t counts[RULE_KEY_DIGITS][RADIX_BUCKETS]) {
+    memset(counts, 0, RULE_KEY_DIGITS * RADIX_BUCKETS * sizeof(size_t));
+    for (size_t i = 0; i < num_rules; i++) {
+        for (int d = 0; d < RULE_KEY_DIGITS; d++)
+            counts[d][rule_digit(&rules[i], d)]++;
+    }
+}
+
+/** Move rules to the positions given by a digit, in a stable way.
+ *
+ *  @param offsets where the next rule with each value of the digit goes. Is
+ *      updated as rules are moved
+ */
+static void scatter_rules(const Rule *from, Rule *to, size_t lo, size_t hi,
+                          int digit, size_t offsets[RADIX_BUCKETS]) {
+    for (size_t i = lo; i < hi; i++)
+        to[offsets[rule_digit(&from[i], digit)]++] = from[i];
+}
+
+/** Sort an array of Rules, without copying it.
+ *
+ *  This is a stable LSD radix sort: one pass per digit of the key, skipping
+ *  digits that are the same in every rule (like the upper bytes of the
+ *  interfaces, usually). It uses a temporary buffer as large as the array,
+ *  and falls back to qsort if it can't be allocated.
+ *
+ *  @param rules the Rule array to sort
+ *  @param num_rules the number of rules in the array
+ */
+void sort_rules_in_place(Rule *rules, size_t num_rules) {
+    DEBUG_PRINT("  Sorting %zu rules at %p with radix sort\n", num_rules, rules);
+    if (num_rules < 2)
+        return;
+    Rule *scratch = malloc(num_rules * sizeof(Rule));
+    if (!scratch) {
+        DEBUG_PRINT("  Couldn't malloc a buffer, using qsort\n");
+        qsort(rules, num_rules, sizeof(Rule), compare_rules);
+        return;
+    }
+
+    size_t counts[RULE_KEY_DIGITS][RADIX_BUCKETS];
+    count_rule_digits(rules, num_rules, counts);
+
+    Rule *from = rules, *to = scratch;
+    for (int d = 0; d < RULE_KEY_DIGITS; d++) {
+        if (counts[d][rule_digit(&rules[0], d)] == num_rules)
+            continue; // Every rule has the same value: nothing to sort
+
+        size_t offsets[RADIX_BUCKETS];
+        size_t offset = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            offsets[b] = offset;
+            offset += counts[d][b];
+        }
+        scatter_rules(from, to, 0, num_rules, d, offsets);
+
+        Rule *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != rules)
+        memcpy(rules, from, num_rules * sizeof(Rule));
+    free(scratch);
+}
+
+/// State shared by the threads of sort_rules_parallel()
+typedef struct ParallelSort {
+    Rule *buffers[2];      ///< The rules, and the temporary buffer
+    size_t num_rules;
+    int num_threads;
+    bool skip[RULE_KEY_DIGITS]; ///< Digits every rule has the same value of
+    size_t (*counts)[RADIX_BUCKETS]; ///< Each thread's count for a digit
+    pthread_mutex_t start_lock; ///< Held until every thread is started
+    pthread_barrier_t barrier;  ///< Separates the steps of each pass
+} ParallelSort;
+
+/// Thread sorting a slice of the rules for sort_rules_parallel()
+typedef struct SortWorker {
+    ParallelSort *sort;
+    int id;
+    pthread_t thread;
+} SortWorker;
+
+/** Run every pass of the radix sort on one thread's slice of the rules.
+ *
+ *  In each pass, every thread counts the digits in its slice, and then moves
+ *  its rules after those with lower digits and those with the same digit in
+ *  earlier slices, so the sort is still stable.
+ */
+static void *sort_worker(void *arg) {
+    SortWorker *worker = arg;
+    ParallelSort *sort = worker->sort;
+    // Until then, num_threads and the barrier may still change
+    pthread_mutex_lock(&sort->start_lock);
+    pthread_mutex_unlock(&sort->start_lock);
+
+    size_t slice = sort->num_rules / sort->num_threads;
+    size_t lo = worker->id * slice;
+    size_t hi = worker->id == sort->num_threads - 1 ?
+        sort->num_rules : lo + slice;
+    size_t *counts = sort->counts[worker->id];
+
+    int src = 0;
+    for (int d = 0; d < RULE_KEY_DIGITS; d++) {
+        if (sort->skip[d])
+            continue;
+        const Rule *from = sort->buffers[src];
+
+        memset(counts, 0, RADIX_BUCKETS * sizeof(size_t));
+        for (size_t i = lo; i < hi; i++)
+            counts[rule_digit(&from[i], d)]++;
+        pthread_barrier_wait(&sort->barrier);
+
+        size_t offsets[RADIX_BUCKETS];
+        size_t offset = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            for (int t = 0; t < sort->num_threads; t++) {
+                if (t == worker->id)
+                    offsets[b] = offset;
+                offset += sort->counts[t][b];
+            }
+        }
+        scatter_rules(from, sort->buffers[!src], lo, hi, d, offsets);
+        // Counts can't be reset until every thread is done reading them
+        pthread_barrier_wait(&sort->barrier);
+
+        src = !src;
+    }
+
+    return NULL;
+}
+
+/** Sort an array of Rules in several threads, without copying it.
+ *
+ *  Same as sort_rules_in_place(), with each pass split among the threads.
+ *  Arrays smaller than PARALLEL_SORT_MIN are sorted by the calling thread.
+ *
+ *  @param rules the Rule array to sort
+ *  @param num_rules the number of rules in the array
+ *  @param num_threads the number of threads to use, including the calling one
+ */
+void sort_rules_parallel(Rule *rules, size_t num_rules, int num_threads) {
+    if (num_threads <= 1 || num_rules < PARALLEL_SORT_MIN) {
+        sort_rules_in_place(rules, num_rules);
+        return;
+    }
+    DEBUG_PRINT("  Sorting %zu rules at %p with radix sort in %d threads\n",
+            num_rules, rules, num_threads);
+
+    ParallelSort sort = {
+        .buffers = {rules, malloc(num_rules * sizeof(Rule))},
+        .num_rules = num_rules,
+        .num_threads = num_threads,
+        .counts = malloc(num_threads * sizeof(*sort.counts)),
+    };
+    SortWorker *workers = malloc(num_threads * sizeof(SortWorker));
+    if (!sort.buffers[1] || !sort.counts || !workers) {
+        free(sort.buffers[1]);
+        free(sort.counts);
+        free(workers);
+        sort_rules_in_place(rules, num_rules);
+        return;
+    }
+
+    size_t counts[RULE_KEY_DIGITS][RADIX_BUCKETS];
+    count_rule_digits(rules, num_rules, counts);
+    int passes = 0;
+    for (int d = 0; d < RULE_KEY_DIGITS; d++) {
+        sort.skip[d] = counts[d][rule_digit(&rules[0], d)] == num_rules;
+        passes += !sort.skip[d];
+    }
+
+    // The calling thread is worker 0. If some threads can't be started, the
+    // rules are split among those that could
+    pthread_mutex_init(&sort.start_lock, NULL);
+    pthread_mutex_lock(&sort.start_lock);
+    int started = 1;
+    for (; started < num_threads; started++) {
+        workers[started] = (SortWorker){ .sort = &sort, .id = started };
+        if (pthread_create(&workers[started].thread, NULL, sort_worker,
+                    &workers[started]) != 0)
+            break;
+    }
+    sort.num_threads = started;
+    pthread_barrier_init(&sort.barrier, NULL, started);
+    pthread_mutex_unlock(&sort.start_lock);
+
+    workers[0] = (SortWorker){ .sort = &sort, .id = 0 };
+    sort_worker(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    if (passes % 2 == 1)
+        memcpy(rules, sort.buffers[1], num_rules * sizeof(Rule));
+
+    pthread_barrier_destroy(&sort.barrier);
+    pthread_mutex_destroy(&sort.start_lock);
+    free(sort.buffers[1]);
+    free(sort.counts);
+    free(workers);
+}
+
 /** Get the most specific action which applies to all possible subgroups.
  *
  *  @param group the memory address of the group's first member (a memory
@@ -288,20 +740,27 @@ Rule *compute_default(const Rule *group, size_t group_size, uint8_t pre_skip) {
 
     DEBUG_PRINT("  Last rule at %p: 0x%08X/%hhu\n",
             &last_rule, last_rule.prefix, last_rule.prefix_len);
-    for (uint8_t i = 0; i < group_size; i++) {
-        DEBUG_PRINT("  Checking rule %hhu: 0x%08X/%hhu\n",
+    size_t i;
+    for (i = 0; i < group_size; i++) {
+        DEBUG_PRINT("  Checking rule %zu: 0x%08X/%hhu\n",
                 i, group[i].prefix, group[i].prefix_len);
         // Since rules should be ordered, if the last rule is encompassed by
         // the current one, all rules in between are as well
-        if (rule_match(&group[i], last_rule.prefix)) {
-            DEBUG_PRINT("    Match. This is a default for the rest.\n");
-            default_rule = (Rule *)&group[i];
-            DEBUG_PRINT("    Setting parent for all subsequent rules\n");
-            set_group_parent((Rule *)&group[i+1], group_size - i - 1, default_rule);
-        } else {
+        if (!rule_match(&group[i], last_rule.prefix)) {
             DEBUG_PRINT("    No match.\n");
             break;
         }
+        DEBUG_PRINT("    Match. This is a default for the rest.\n");
+        default_rule = (Rule *)&group[i];
+    }
+
+    if (default_rule != NULL) {
+        // Each default is the parent of the next one, and the last one is
+        // the parent of the rest
+        DEBUG_PRINT("  Setting parents of the %zu defaults and the rest\n", i);
+        for (size_t j = 1; j < i; j++)
+            ((Rule *)group)[j].parent = (Rule *)&group[j - 1];
+        set_group_parent(default_rule + 1, group_size - i, default_rule);
     }
 
     DEBUG_PRINT("--Done computing default: %p\n", default_rule);
@@ -364,119 +823,934 @@ TrieNode *create_trie(Rule *rules, size_t num_rules) {
         return NULL;
     DEBUG_PRINT("  Allocated root node at %p\n", root);
 
-    create_subtrie(rules, num_rules, 0, root, NULL);
+    create_subtrie(rules, num_rules, 0, root, NULL, NULL);
 
     DEBUG_PRINT("--Done creating trie at %p\n", root);
     return root;
 }
 
-// ---- Count nodes ----
-
-uint32_t count_nodes_trie(TrieNode *trie) {
-    DEBUG_PRINT("Counting nodes in trie at %p\n", trie);
-    if (trie == NULL) {
-        DEBUG_PRINT("--Trie doesn't exist. 0 nodes.\n");
-        return 0;
-    }
-
-    // Si es un nodo hoja (no tiene hijos, apunta a una Rule)
-    if (trie->branch == 0) {
-        DEBUG_PRINT("--Leaf node, there is 1 node\n");
-        return 1;
-    }
-
-    DEBUG_PRINT("  Intermediate node with branch=%u\n", trie->branch);
-
-    // Si es un nodo interno (tiene hijos)
-    uint32_t count = 1; // Contamos este nodo
-    TrieNode *children = (TrieNode *)trie->pointer; //Pointer to the first child
+/** Create a trie handle with its own sorted copy of some rules, and room for
+ *  the root node. Nothing else is filled in.
+ *
+ *  @param block_size the size of the handle's arena blocks. 0 to make the
+ *      first one large enough for the rules and every node
+ *  @param num_threads the number of threads to sort the rules in
+ *  @param root_branch the branch to force on the root, or 0
+ *
+ *  @returns the new handle, or NULL on failure
+ */
+static Trie *new_trie_handle(const Rule *rules, size_t num_rules,
+                             size_t block_size, int num_threads,
+                             uint8_t root_branch) {
+    if (rules == NULL || num_rules == 0)
+        return NULL;
 
-    // Calculamos cuántos hijos tiene este nodo: 2^branch
-    uint32_t num_children = 1 << trie->branch;
-    DEBUG_PRINT("  Counting 1 and RECURSING for %u children at %p\n",
-            num_children, children);
+    Trie *trie = malloc(sizeof(Trie));
+    if (!trie)
+        return NULL;
 
-    for (uint32_t i = 0; i < num_children; i++) {
-        count += count_nodes_trie(&children[i]);
+    // A single block should usually hold the rules and every node: tries
+    // tend to have between 1 and 2 nodes per rule, plus the root's children
+    // if they're forced
+    size_t rules_size = num_rules * sizeof(Rule);
+    size_t root_children = root_branch ? (size_t)1 << root_branch : 0;
+    size_t nodes_size = (2 * num_rules + 1 + root_children) * sizeof(TrieNode);
+    arena_init(&trie->arena, block_size ? block_size : rules_size + nodes_size);
+
+    trie->num_rules = num_rules;
+    trie->order = NULL;
+    trie->order_capacity = 0;
+    trie->wasted = 0;
+    trie->root_branch = root_branch;
+    memset(&trie->stats, 0, sizeof(TrieStats));
+    trie->rules = arena_alloc(&trie->arena, rules_size);
+    trie->root = alloc_nodes(&trie->arena, 1);
+    if (!trie->rules || !trie->root) {
+        destroy_trie(trie);
+        return NULL;
     }
 
-    DEBUG_PRINT("--Done counting, there are %u nodes under trie at %p\n",
-            count, trie);
-    return count;
+    memcpy(trie->rules, rules, rules_size);
+    sort_rules_parallel(trie->rules, num_rules, num_threads);
+    return trie;
 }
 
-// ---- Address lookup ----
+/** Build a trie handle in the calling thread, maybe forcing the branch of the
+ *  root (0 for none).
+ */
+static Trie *build_trie_serial(const Rule *rules, size_t num_rules,
+                               uint8_t root_branch) {
+    DEBUG_PRINT("Building trie handle with %zu rules at %p\n",
+            num_rules, rules);
+    Trie *trie = new_trie_handle(rules, num_rules, 0, 1, root_branch);
+    if (!trie)
+        return NULL;
 
-uint32_t lookup_ip(ip_addr_t ip_addr, TrieNode *trie, int *access_count) {
-    DEBUG_PRINT("Looking up IP 0x%08X in trie at %p\n", ip_addr, trie);
-    int black_hole = 0; // Temporary variable to avoid dereferencing NULL
-    if (access_count == NULL) {
-        access_count = &black_hole;
-        DEBUG_PRINT("  Dumping access count to %p\n", access_count);
+    if (!build_subtrie(trie->rules, num_rules, 0, trie->root, NULL,
+                &trie->arena, root_branch, 0, &trie->stats)) {
+        destroy_trie(trie);
+        return NULL;
     }
 
-    *access_count = 0; // Initialize access count
+    DEBUG_PRINT("--Done building trie, %zu bytes in arena\n",
+            trie->arena.allocated);
+    return trie;
+}
 
-    TrieNode *current = trie;
-    uint8_t bit_pos = current->skip;
-    uint8_t read_bits = current->branch;
+Trie *build_trie(const Rule *rules, size_t num_rules) {
+    return build_trie_serial(rules, num_rules, 0);
+}
 
-    // Traverse the trie until reaching a leaf node
-    while (read_bits != 0) {
-        uint32_t bits = extract_msb(ip_addr, bit_pos, read_bits);
-        DEBUG_PRINT("  Reading %hhu bits from position %hhu: %u\n",
-                read_bits, bit_pos, bits);
-        TrieNode *next = ((TrieNode *)current->pointer) + bits;
-        DEBUG_PRINT("    Next node is at %p\n", next);
+// ---- Parallel trie creation ----
 
-        bit_pos += read_bits + next->skip;
-        read_bits = next->branch;
-        current = next;
+/// Subtrie left for a builder thread to create, as in create_subtrie()
+typedef struct BuildTask {
+    Rule *group;
+    size_t group_size;
+    uint8_t pre_skip;
+    TrieNode *node_ptr;
+    Rule *default_rule;
+    uint8_t force_branch; ///< As in build_subtrie(). Only set for the root
+    uint8_t depth;        ///< Number of nodes above `node_ptr`
+} BuildTask;
 
-        (*access_count)++;
-    } // We'll exit when we reach a leaf node, which has branch=0
+/** Tasks of a builder thread.
+ *
+ * The owner pushes and pops them at the back, so it goes depth-first through
+ * its own subtries, while idle threads steal them from the front, where the
+ * largest ones are.
+ */
+typedef struct BuildDeque {
+    pthread_mutex_t lock;
+    BuildTask *tasks;   ///< Tasks in [front, back) are pending
+    size_t front;
+    size_t back;
+    size_t capacity;    ///< Number of elements `tasks` has room for
+} BuildDeque;
+
+struct ParallelBuild;
+
+/// Thread creating subtries for build_trie_parallel()
+typedef struct BuildWorker {
+    struct ParallelBuild *build;
+    int id;
+    BuildDeque deque;
+    Arena arena;        ///< Where this thread's nodes are allocated from
+    TrieStats stats;    ///< Shape of the nodes this thread created
+    pthread_t thread;
+} BuildWorker;
+
+/// State shared by all the threads of build_trie_parallel()
+typedef struct ParallelBuild {
+    BuildWorker *workers;
+    int num_workers;
+    _Atomic size_t pending; ///< Tasks pushed and not finished yet
+    _Atomic bool failed;    ///< Whether any thread ran out of memory
+} ParallelBuild;
+
+/** Add a task to the back of a thread's deque. */
+static int push_build_task(BuildWorker *worker, const BuildTask *task) {
+    BuildDeque *deque = &worker->deque;
+    int result = 0;
+    atomic_fetch_add(&worker->build->pending, 1);
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->back == deque->capacity) {
+        if (deque->front > 0) {
+            // Reuse the room left by stolen tasks
+            memmove(deque->tasks, &deque->tasks[deque->front],
+                    (deque->back - deque->front) * sizeof(BuildTask));
+            deque->back -= deque->front;
+            deque->front = 0;
+        } else {
+            size_t capacity = deque->capacity ? 2 * deque->capacity : 64;
+            BuildTask *tasks = realloc(deque->tasks,
+                    capacity * sizeof(BuildTask));
+            if (tasks) {
+                deque->tasks = tasks;
+                deque->capacity = capacity;
+            }
+        }
+    }
+    if (deque->back < deque->capacity)
+        deque->tasks[deque->back++] = *task;
+    else
+        result = -1;
+    pthread_mutex_unlock(&deque->lock);
+
+    if (result != 0)
+        atomic_fetch_sub(&worker->build->pending, 1);
+    return result;
+}
 
-    DEBUG_PRINT("  Reached a leaf node in %u accesses\n", *access_count);
+/** Take a task from a thread's deque, from the back (its owner) or the front
+ *  (anyone else).
+ *
+ *  @returns whether there was a task to take
+ */
+static bool take_build_task(BuildDeque *deque, bool steal, BuildTask *task) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->front < deque->back) {
+        *task = steal ? deque->tasks[deque->front++]
+                      : deque->tasks[--deque->back];
+        found = true;
+    }
+    if (deque->front == deque->back)
+        deque->front = deque->back = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
 
-    // Check the leaf node's prefix
-    Rule *match = (Rule *)current->pointer;
-    if (match == NULL) {
-        return 0;
+/** Create one node of a subtrie, leaving its larger children as new tasks
+ *  for any thread, or the whole subtrie if it's small.
+ */
+static void run_build_task(BuildWorker *worker, const BuildTask *task) {
+    ParallelBuild *build = worker->build;
+    if (atomic_load_explicit(&build->failed, memory_order_relaxed))
+        return; // Nothing would be used
+
+    if (task->group_size < PARALLEL_BUILD_GRAIN) {
+        if (!build_subtrie(task->group, task->group_size, task->pre_skip,
+                    task->node_ptr, task->default_rule, &worker->arena,
+                    task->force_branch, task->depth, &worker->stats))
+            atomic_store(&build->failed, true);
+        return;
     }
 
-    DEBUG_PRINT("  Checking against 0x%08X/%hhu (rule at %p)\n",
-            match->prefix, match->prefix_len, match);
+    NodeSplit split;
+    int status = create_node(task->group, task->group_size, task->pre_skip,
+            task->node_ptr, task->default_rule, &worker->arena,
+            task->force_branch, &split);
+    if (status >= 0)
+        count_node_stats(&worker->stats, task->node_ptr, task->depth,
+                task->pre_skip, 1);
+    if (status <= 0) {
+        if (status < 0)
+            atomic_store(&build->failed, true);
+        return;
+    }
 
-    uint32_t out_iface;
+    // Each child covers its own slice of the base vector, so they can be
+    // created by different threads. Leaves aren't worth a task
+    TrieNode *children = task->node_ptr->pointer;
+    for (uint32_t child_n = 0; child_n < (1u << split.branch); child_n++) {
+        BuildTask child = {
+            .pre_skip = split.pos + split.branch,
+            .node_ptr = &children[child_n],
+            .depth = task->depth + 1,
+        };
+        child.group_size = next_subgroup(&split, child_n, &child.group,
+                &child.default_rule);
+        if (child.group_size == 1 || push_build_task(worker, &child) != 0)
+            run_build_task(worker, &child);
+    }
+}
 
-    while(1) {
-        (*access_count)++;
-        out_iface = rule_match(match, ip_addr) ? match->out_iface : 0;
-        if (out_iface != 0) {
-            DEBUG_PRINT("    Match found: %d\n", out_iface);
-            break;
-        } else if (match->parent != NULL) {
-            match = match->parent;
-            DEBUG_PRINT("    No match, checking parent (0x%08X/%hhu, at %p)\n",
-                    match->prefix, match->prefix_len, match);
+/** Run tasks until there are none left in any thread. */
+static void *build_worker(void *arg) {
+    BuildWorker *worker = arg;
+    ParallelBuild *build = worker->build;
+    DEBUG_PRINT("Builder thread %d started\n", worker->id);
+
+    BuildTask task;
+    while (atomic_load(&build->pending) > 0) {
+        bool found = take_build_task(&worker->deque, false, &task);
+        for (int i = 1; !found && i < build->num_workers; i++) {
+            BuildWorker *victim =
+                &build->workers[(worker->id + i) % build->num_workers];
+            found = take_build_task(&victim->deque, true, &task);
+        }
+        if (!found) {
+            sched_yield(); // Others are still splitting the last tasks
             continue;
-        } else {
-            DEBUG_PRINT("    No match\n");
-            break;
         }
-    }
 
-    DEBUG_PRINT("--Done looking IP 0x%08X up in %u accesses: -> %d\n",
-            ip_addr, *access_count, out_iface);
+        run_build_task(worker, &task);
+        atomic_fetch_sub(&build->pending, 1);
+    }
 
-    return out_iface;
+    DEBUG_PRINT("--Builder thread %d done\n", worker->id);
+    return NULL;
 }
 
-// ---- Trie cleanup ----
+/** Build a trie handle in several threads, maybe forcing the branch of the
+ *  root (0 for none).
+ */
+static Trie *build_trie_threads(const Rule *rules, size_t num_rules,
+                                int num_threads, uint8_t root_branch) {
+    if (num_threads <= 1)
+        return build_trie_serial(rules, num_rules, root_branch);
+    DEBUG_PRINT("Building trie handle with %zu rules at %p in %d threads\n",
+            num_rules, rules, num_threads);
+
+    // Most nodes go to the threads' arenas, so the handle's is small
+    Trie *trie = new_trie_handle(rules, num_rules,
+            num_rules * sizeof(Rule) + sizeof(TrieNode), num_threads,
+            root_branch);
+    ParallelBuild build = { .num_workers = num_threads };
+    atomic_init(&build.pending, 0);
+    atomic_init(&build.failed, false);
+    build.workers = calloc(num_threads, sizeof(BuildWorker));
+    if (!trie || !build.workers) {
+        free(build.workers);
+        destroy_trie(trie);
+        return NULL;
+    }
 
-void free_children(TrieNode *root) {
-    DEBUG_PRINT("Freeing children of %p\n", root);
-    if (root->branch == 0) {
+    size_t block_size = (2 * num_rules / num_threads + 1) * sizeof(TrieNode);
+    for (int i = 0; i < num_threads; i++) {
+        build.workers[i].build = &build;
+        build.workers[i].id = i;
+        pthread_mutex_init(&build.workers[i].deque.lock, NULL);
+        arena_init(&build.workers[i].arena, block_size);
+    }
+
+    // The calling thread is worker 0, and starts with the whole trie
+    BuildTask root = {
+        .group = trie->rules,
+        .group_size = num_rules,
+        .pre_skip = 0,
+        .node_ptr = trie->root,
+        .default_rule = NULL,
+        .force_branch = root_branch,
+        .depth = 0,
+    };
+    int started = 1;
+    if (push_build_task(&build.workers[0], &root) != 0) {
+        atomic_store(&build.failed, true);
+    } else {
+        for (; started < num_threads; started++) {
+            if (pthread_create(&build.workers[started].thread, NULL,
+                        build_worker, &build.workers[started]) != 0)
+                break; // The ones that started can do it on their own
+        }
+        build_worker(&build.workers[0]);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        if (i > 0 && i < started)
+            pthread_join(build.workers[i].thread, NULL);
+        pthread_mutex_destroy(&build.workers[i].deque.lock);
+        free(build.workers[i].deque.tasks);
+        arena_merge(&trie->arena, &build.workers[i].arena);
+        merge_trie_stats(&trie->stats, &build.workers[i].stats);
+    }
+    free(build.workers);
+
+    if (atomic_load(&build.failed)) {
+        destroy_trie(trie);
+        return NULL;
+    }
+    DEBUG_PRINT("--Done building trie, %zu bytes in arenas\n",
+            trie->arena.allocated);
+    return trie;
+}
+
+Trie *build_trie_parallel(const Rule *rules, size_t num_rules,
+                          int num_threads) {
+    return build_trie_threads(rules, num_rules, num_threads, 0);
+}
+
+Trie *build_trie_with_options(const Rule *rules, size_t num_rules,
+                              const TrieBuildOptions *options) {
+    int root_branch = options->root_branch;
+    if (root_branch == ROOT_BRANCH_AUTO) {
+        // As many bits as the rule count has, so there's about one rule for
+        // every one or two children of the root
+        root_branch = num_rules > 0 ? 64 - __builtin_clzll(num_rules) : 0;
+        if (root_branch < MIN_AUTO_ROOT_BRANCH)
+            root_branch = MIN_AUTO_ROOT_BRANCH;
+        if (root_branch > MAX_AUTO_ROOT_BRANCH)
+            root_branch = MAX_AUTO_ROOT_BRANCH;
+    } else if (root_branch < 0 || root_branch > MAX_ROOT_BRANCH) {
+        DEBUG_PRINT("Invalid root branch %d\n", root_branch);
+        return NULL;
+    }
+
+    return build_trie_threads(rules, num_rules, options->num_threads,
+            root_branch);
+}
+
+// ---- Trie updates ----
+
+/** Compare a rule with a prefix, in the same order as compare_rules() but
+ *  ignoring the outgoing interface.
+ */
+static int compare_prefix(const Rule *rule, ip_addr_t prefix,
+                          uint8_t prefix_len) {
+    if (rule->prefix != prefix)
+        return rule->prefix < prefix ? -1 : 1;
+    return (int)rule->prefix_len - prefix_len;
+}
+
+/** Find where a prefix is (or would be) in a sorted array of rules.
+ *
+ *  @returns the index of the first rule that doesn't go before the prefix
+ */
+static size_t find_rule(Rule *const *order, size_t num_rules,
+                        ip_addr_t prefix, uint8_t prefix_len) {
+    size_t lo = 0, hi = num_rules;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_prefix(order[mid], prefix, prefix_len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Count the rules compute_default() would take as defaults in a group.
+ *
+ *  @param order sorted array of rules the group is taken from
+ *  @param lo index of the group's first rule
+ *  @param hi index past the group's last rule
+ *  @param skip index of a rule to leave out of the group (or `hi` for none)
+ *
+ *  @returns the number of rules at the start of the group that cover its last
+ *      rule (leaving `skip` out)
+ */
+static size_t count_defaults(Rule *const *order, size_t lo, size_t hi,
+                             size_t skip) {
+    if (hi > lo && skip == hi - 1)
+        hi--;
+    if (hi <= lo)
+        return 0;
+
+    size_t count = 0;
+    for (size_t i = lo; i < hi; i++) {
+        if (i == skip)
+            continue;
+        if (!rule_match(order[i], order[hi - 1]->prefix))
+            break;
+        count++;
+    }
+    return count;
+}
+
+/** Narrow a range of sorted rules down to the ones that go to a given child.
+ *
+ *  @param order sorted array of rules
+ *  @param[in,out] lo index of the first rule in the range
+ *  @param[in,out] hi index past the last rule in the range
+ *  @param pos the position of the first bit the children are selected by
+ *  @param branch the number of bits the children are selected by
+ *  @param child the index of the child
+ */
+static void find_child(Rule *const *order, size_t *lo, size_t *hi,
+                       uint8_t pos, uint8_t branch, uint32_t child) {
+    // The bits are in order within the range, so it's two binary searches
+    size_t first = *lo, end = *hi;
+    while (first < end) {
+        size_t mid = first + (end - first) / 2;
+        if (extract_msb(order[mid]->prefix, pos, branch) < child)
+            first = mid + 1;
+        else
+            end = mid;
+    }
+    end = *hi;
+    for (size_t last = first; last < end; ) {
+        size_t mid = last + (end - last) / 2;
+        if (extract_msb(order[mid]->prefix, pos, branch) <= child)
+            last = mid + 1;
+        else
+            end = mid;
+    }
+    *lo = first;
+    *hi = end;
+}
+
+/** Narrow the range of rules of a child down past the ones too short for the
+ *  branch, and find the child's default (see next_subgroup()).
+ *
+ *  @param order sorted array of rules
+ *  @param group_lo index of the first rule of the node's group, past its
+ *      defaults
+ *  @param[in,out] lo index of the first rule in the child's range, from
+ *      find_child()
+ *  @param hi index past the last rule in the child's range
+ *  @param pos the position of the first bit the children are selected by
+ *  @param branch the number of bits the children are selected by
+ *  @param child the index of the child
+ *  @param default_rule the default of the node's group
+ *
+ *  @returns the default rule of the child
+ */
+static Rule *find_child_default(Rule *const *order, size_t group_lo,
+                                size_t *lo, size_t hi, uint8_t pos,
+                                uint8_t branch, uint32_t child,
+                                Rule *default_rule) {
+    // The deepest of the short rules sorted with the child covers it...
+    Rule *covering = NULL;
+    while (*lo < hi && order[*lo]->prefix_len < pos + branch)
+        covering = order[(*lo)++];
+    if (covering != NULL || *lo == group_lo)
+        return covering ? covering : default_rule;
+
+    // ...or else it's a parent of the rule right before the child, if any
+    for (Rule *r = order[*lo - 1]; r != NULL && r != default_rule;
+            r = r->parent) {
+        if (r->prefix_len < pos + branch &&
+                rule_covers_child(r, pos, branch, child))
+            return r;
+    }
+    return default_rule;
+}
+
+/** Replace a subtrie with one built again from new copies of its rules.
+ *
+ *  @param trie the trie handle
+ *  @param node the root of the subtrie, which is overwritten
+ *  @param lo index (in `trie->order`) of the subtrie's first rule
+ *  @param hi index past the subtrie's last rule
+ *  @param x index of the rule being updated, between `lo` and `hi`
+ *  @param remove whether order[x] is being deleted (or inserted)
+ *  @param pre_skip the number of bits read before reaching `node`
+ *  @param depth the number of nodes above `node`
+ *  @param default_rule the default rule `node` inherits, as in create_subtrie
+ *
+ *  @returns 0 on success, or -1 if memory ran out (nothing is changed)
+ */
+static int rebuild_subtrie(Trie *trie, TrieNode *node, size_t lo, size_t hi,
+                           size_t x, bool remove, uint8_t pre_skip,
+                           uint8_t depth, Rule *default_rule) {
+    size_t size = hi - lo - remove;
+    DEBUG_PRINT("Rebuilding subtrie at %p with %zu rules\n", node, size);
+
+    Rule *group = NULL;
+    if (size > 0) {
+        group = arena_alloc(&trie->arena, size * sizeof(Rule));
+        if (!group)
+            return -1;
+    }
+    for (size_t i = lo, j = 0; i < hi; i++) {
+        if (remove && i == x)
+            continue;
+        group[j] = *trie->order[i];
+        // Defaults in the group will be found again by create_subtrie
+        group[j].parent = default_rule;
+        j++;
+    }
+
+    TrieNode new_node;
+    TrieStats new_stats = {0};
+    uint8_t force_branch = node == trie->root ? trie->root_branch : 0;
+    if (size == 0) {
+        new_node = (TrieNode){.branch = 0, .skip = 0, .pointer = default_rule};
+        count_node_stats(&new_stats, &new_node, depth, pre_skip, 1);
+    } else if (!build_subtrie(group, size, pre_skip, &new_node, default_rule,
+                &trie->arena, force_branch, depth, &new_stats)) {
+        return -1;
+    }
+
+    // The old nodes under `node`, and the old copies of the rules (the one
+    // being inserted isn't in the arena) are left unused
+    uint32_t num_nodes = trie->stats.num_nodes;
+    count_subtrie_stats(&trie->stats, node, depth, pre_skip, -1);
+    size_t old_nodes = num_nodes - trie->stats.num_nodes;
+    merge_trie_stats(&trie->stats, &new_stats);
+    size_t old_rules = remove ? hi - lo : hi - lo - 1;
+    trie->wasted += (old_nodes - 1) * sizeof(TrieNode)
+        + old_rules * sizeof(Rule);
+
+    for (size_t i = lo, j = 0; i < hi; i++) {
+        if (remove && i == x)
+            continue;
+        trie->order[i] = &group[j++];
+    }
+    *node = new_node;
+    trie->rules = NULL; // Not in a single array anymore
+
+    DEBUG_PRINT("--Done rebuilding subtrie, %zu bytes wasted\n", trie->wasted);
+    return 0;
+}
+
+/** Update the trie for a rule inserted in, or about to be deleted from,
+ *  `trie->order`.
+ *
+ *  The trie is walked down towards the rule for as long as the nodes stay
+ *  valid without it (or with it): their defaults must be the same, the rule
+ *  must be long enough for their branch, and an inserted rule must have the
+ *  bits they skip. The first node that isn't valid (or the leaf) is rebuilt.
+ *
+ *  @param trie the trie handle. `trie->order` must include the rule
+ *  @param x index of the rule in `trie->order`
+ *  @param remove whether the rule is being deleted (or inserted)
+ *
+ *  @returns 0 on success, or -1 if memory ran out
+ */
+static int update_trie(Trie *trie, size_t x, bool remove) {
+    Rule *const *order = trie->order;
+    const Rule *rule = order[x];
+    DEBUG_PRINT("Updating trie at %p for 0x%08X/%hhu (%s)\n", trie,
+            rule->prefix, rule->prefix_len, remove ? "delete" : "insert");
+
+    TrieNode *node = trie->root;
+    size_t lo = 0, hi = trie->num_rules;
+    uint8_t pos = 0; // Bits read before reaching `node`
+    uint8_t depth = 0; // Nodes above `node`
+    Rule *default_rule = NULL;
+
+    while (node->branch != 0) {
+        // The defaults of the group must be the same with and without x
+        size_t defaults = count_defaults(order, lo, hi, hi);
+        if (x < lo + defaults || count_defaults(order, lo, hi, x) != defaults)
+            break;
+
+        // A shorter rule covers several children (only under a forced
+        // branch, see next_subgroup())
+        uint8_t children_pos = pos + node->skip + node->branch;
+        if (rule->prefix_len < children_pos)
+            break;
+        if (!remove) {
+            // Any other rule in the group (after the defaults) has the bits
+            const Rule *other = order[x == hi - 1 ? hi - 2 : hi - 1];
+            if (!prefix_match(rule->prefix, other->prefix, pos + node->skip))
+                break;
+        }
+
+        if (defaults > 0)
+            default_rule = order[lo + defaults - 1];
+        lo += defaults;
+        size_t group_lo = lo;
+        uint32_t child = extract_msb(rule->prefix, pos + node->skip,
+                node->branch);
+        find_child(order, &lo, &hi, pos + node->skip, node->branch, child);
+        default_rule = find_child_default(order, group_lo, &lo, hi,
+                pos + node->skip, node->branch, child, default_rule);
+        DEBUG_PRINT("  Valid node at %p, going to child %u (rules %zu to %zu)\n",
+                node, child, lo, hi);
+
+        node = &((TrieNode *)node->pointer)[child];
+        pos = children_pos;
+        depth++;
+    }
+
+    return rebuild_subtrie(trie, node, lo, hi, x, remove, pos, depth,
+            default_rule);
+}
+
+/** Make sure `trie->order` exists and has room for a number of rules. */
+static int reserve_order(Trie *trie, size_t num_rules) {
+    if (trie->order != NULL && num_rules <= trie->order_capacity)
+        return 0;
+
+    size_t capacity = trie->order_capacity ? trie->order_capacity : 16;
+    while (capacity < num_rules)
+        capacity *= 2;
+    Rule **order = realloc(trie->order, capacity * sizeof(Rule *));
+    if (!order)
+        return -1;
+
+    if (trie->order == NULL) {
+        for (size_t i = 0; i < trie->num_rules; i++)
+            order[i] = &trie->rules[i];
+    }
+    trie->order = order;
+    trie->order_capacity = capacity;
+    return 0;
+}
+
+int trie_insert_rule(Trie *trie, const Rule *rule) {
+    if (trie == NULL || rule == NULL || rule->prefix_len > 32)
+        return -1;
+    DEBUG_PRINT("Inserting 0x%08X/%hhu -> %u\n", rule->prefix,
+            rule->prefix_len, rule->out_iface);
+    if (rule->prefix_len < 32 && rule->prefix << rule->prefix_len != 0) {
+        DEBUG_PRINT("--Error: bits set past the prefix length\n");
+        return -1;
+    }
+    if (reserve_order(trie, trie->num_rules + 1) != 0)
+        return -1;
+
+    size_t n = trie->num_rules;
+    size_t x = find_rule(trie->order, n, rule->prefix, rule->prefix_len);
+    if (x < n && compare_prefix(trie->order[x], rule->prefix,
+                rule->prefix_len) == 0) {
+        // Already there: the trie stays the same
+        for (; x < n && compare_prefix(trie->order[x], rule->prefix,
+                    rule->prefix_len) == 0; x++)
+            trie->order[x]->out_iface = rule->out_iface;
+        DEBUG_PRINT("--Replaced outgoing interface\n");
+        return 0;
+    }
+
+    Rule copy = *rule; // Until the rebuilt subtrie has its own
+    copy.parent = NULL;
+    memmove(&trie->order[x + 1], &trie->order[x], (n - x) * sizeof(Rule *));
+    trie->order[x] = &copy;
+    trie->num_rules++;
+
+    if (update_trie(trie, x, false) != 0) {
+        memmove(&trie->order[x], &trie->order[x + 1], (n - x) * sizeof(Rule *));
+        trie->num_rules--;
+        return -1;
+    }
+
+    if (trie->wasted > trie->arena.allocated / 2)
+        trie_compact(trie); // If it fails, the trie is still usable
+    DEBUG_PRINT("--Done inserting\n");
+    return 0;
+}
+
+int trie_delete_rule(Trie *trie, ip_addr_t prefix, uint8_t prefix_len) {
+    if (trie == NULL || reserve_order(trie, trie->num_rules) != 0)
+        return -1;
+    DEBUG_PRINT("Deleting 0x%08X/%hhu\n", prefix, prefix_len);
+
+    size_t x = find_rule(trie->order, trie->num_rules, prefix, prefix_len);
+    if (x == trie->num_rules ||
+            compare_prefix(trie->order[x], prefix, prefix_len) != 0) {
+        DEBUG_PRINT("--Error: no such rule\n");
+        return -1;
+    }
+
+    // Duplicates (if any) are deleted one at a time
+    do {
+        if (update_trie(trie, x, true) != 0)
+            return -1;
+        trie->num_rules--;
+        memmove(&trie->order[x], &trie->order[x + 1],
+                (trie->num_rules - x) * sizeof(Rule *));
+    } while (x < trie->num_rules &&
+            compare_prefix(trie->order[x], prefix, prefix_len) == 0);
+
+    if (trie->wasted > trie->arena.allocated / 2)
+        trie_compact(trie); // If it fails, the trie is still usable
+    DEBUG_PRINT("--Done deleting\n");
+    return 0;
+}
+
+int trie_compact(Trie *trie) {
+    if (trie == NULL)
+        return -1;
+    // Nothing to do if it was never updated, and build_trie can't make an
+    // empty trie, so one is left as it is
+    if (trie->order == NULL || trie->num_rules == 0)
+        return 0;
+    DEBUG_PRINT("Compacting trie at %p, %zu bytes wasted\n", trie,
+            trie->wasted);
+
+    Rule *rules = malloc(trie->num_rules * sizeof(Rule));
+    if (!rules)
+        return -1;
+    for (size_t i = 0; i < trie->num_rules; i++) {
+        rules[i] = *trie->order[i];
+        rules[i].parent = NULL;
+    }
+    Trie *fresh = build_trie_serial(rules, trie->num_rules, trie->root_branch);
+    free(rules);
+    if (!fresh)
+        return -1;
+
+    arena_free(&trie->arena);
+    free(trie->order);
+    *trie = *fresh; // The arena's blocks now belong to `trie`
+    free(fresh);
+
+    DEBUG_PRINT("--Done compacting, %zu bytes in arena\n",
+            trie->arena.allocated);
+    return 0;
+}
+
+// ---- Count nodes ----
+
+uint32_t count_nodes_trie(TrieNode *trie) {
+    DEBUG_PRINT("Counting nodes in trie at %p\n", trie);
+    if (trie == NULL) {
+        DEBUG_PRINT("--Trie doesn't exist. 0 nodes.\n");
+        return 0;
+    }
+
+    // Si es un nodo hoja (no tiene hijos, apunta a una Rule)
+    if (trie->branch == 0) {
+        DEBUG_PRINT("--Leaf node, there is 1 node\n");
+        return 1;
+    }
+
+    DEBUG_PRINT("  Intermediate node with branch=%u\n", trie->branch);
+
+    // Si es un nodo interno (tiene hijos)
+    uint32_t count = 1; // Contamos este nodo
+    TrieNode *children = (TrieNode *)trie->pointer; //Pointer to the first child
+
+    // Calculamos cuántos hijos tiene este nodo: 2^branch
+    uint32_t num_children = 1 << trie->branch;
+    DEBUG_PRINT("  Counting 1 and RECURSING for %u children at %p\n",
+            num_children, children);
+
+    for (uint32_t i = 0; i < num_children; i++) {
+        count += count_nodes_trie(&children[i]);
+    }
+
+    DEBUG_PRINT("--Done counting, there are %u nodes under trie at %p\n",
+            count, trie);
+    return count;
+}
+
+void count_trie_stats(const TrieNode *trie, TrieStats *stats) {
+    DEBUG_PRINT("Counting the shape of trie at %p\n", trie);
+    memset(stats, 0, sizeof(TrieStats));
+    if (trie != NULL)
+        count_subtrie_stats(stats, trie, 0, 0, 1);
+}
+
+// ---- Address lookup ----
+
+/** Find the outgoing interface for an address that reached a given leaf.
+ *
+ *  As bits were skipped on the way down, the leaf's rule must be checked
+ *  against the address. If it doesn't match, its parents are tried in order.
+ *
+ *  @param match the rule the leaf node points to (may be NULL)
+ *  @param ip_addr the IP address being looked up
+ *  @param[out] access_count Pointer where the number of rules checked will be
+ *      ADDED. Must not be NULL.
+ *
+ *  @return the outgoing interface, or 0 if no rules match
+ */
+static inline uint32_t resolve_leaf(const Rule *match, ip_addr_t ip_addr,
+                                    int *access_count) {
+    if (match == NULL) {
+        return 0;
+    }
+
+    DEBUG_PRINT("  Checking against 0x%08X/%hhu (rule at %p)\n",
+            match->prefix, match->prefix_len, match);
+
+    uint32_t out_iface;
+
+    while(1) {
+        (*access_count)++;
+        out_iface = rule_match(match, ip_addr) ? match->out_iface : 0;
+        if (out_iface != 0) {
+            DEBUG_PRINT("    Match found: %d\n", out_iface);
+            break;
+        } else if (match->parent != NULL) {
+            match = match->parent;
+            DEBUG_PRINT("    No match, checking parent (0x%08X/%hhu, at %p)\n",
+                    match->prefix, match->prefix_len, match);
+            continue;
+        } else {
+            DEBUG_PRINT("    No match\n");
+            break;
+        }
+    }
+
+    return out_iface;
+}
+
+uint32_t lookup_ip(ip_addr_t ip_addr, TrieNode *trie, int *access_count) {
+    DEBUG_PRINT("Looking up IP 0x%08X in trie at %p\n", ip_addr, trie);
+    int black_hole = 0; // Temporary variable to avoid dereferencing NULL
+    if (access_count == NULL) {
+        access_count = &black_hole;
+        DEBUG_PRINT("  Dumping access count to %p\n", access_count);
+    }
+
+    *access_count = 0; // Initialize access count
+
+    TrieNode *current = trie;
+    uint8_t bit_pos = current->skip;
+    uint8_t read_bits = current->branch;
+
+    // Traverse the trie until reaching a leaf node
+    while (read_bits != 0) {
+        uint32_t bits = extract_msb(ip_addr, bit_pos, read_bits);
+        DEBUG_PRINT("  Reading %hhu bits from position %hhu: %u\n",
+                read_bits, bit_pos, bits);
+        TrieNode *next = ((TrieNode *)current->pointer) + bits;
+        DEBUG_PRINT("    Next node is at %p\n", next);
+
+        bit_pos += read_bits + next->skip;
+        read_bits = next->branch;
+        current = next;
+
+        (*access_count)++;
+    } // We'll exit when we reach a leaf node, which has branch=0
+
+    DEBUG_PRINT("  Reached a leaf node in %u accesses\n", *access_count);
+
+    // Check the leaf node's prefix, falling back to its parents
+    uint32_t out_iface = resolve_leaf((Rule *)current->pointer, ip_addr,
+            access_count);
+
+    DEBUG_PRINT("--Done looking IP 0x%08X up in %u accesses: -> %d\n",
+            ip_addr, *access_count, out_iface);
+
+    return out_iface;
+}
+
+void lookup_ip_batch(const ip_addr_t *addrs, uint32_t *out, size_t n,
+                     TrieNode *trie, int *access_counts) {
+    DEBUG_PRINT("Looking up %zu IPs in batch in trie at %p\n", n, trie);
+
+    // Per-lane state. `node` is the next node to read, which was prefetched
+    // the last time the lane was advanced; `bit_pos` is the position of the
+    // first bit not yet consumed before reaching it.
+    TrieNode *node[LOOKUP_BATCH_LANES];
+    uint8_t bit_pos[LOOKUP_BATCH_LANES];
+    int accesses[LOOKUP_BATCH_LANES];
+    uint8_t active[LOOKUP_BATCH_LANES]; // Lanes which haven't reached a leaf
+
+    for (size_t base = 0; base < n; base += LOOKUP_BATCH_LANES) {
+        size_t lanes = n - base < LOOKUP_BATCH_LANES ?
+            n - base : LOOKUP_BATCH_LANES;
+        const ip_addr_t *lane_addrs = &addrs[base];
+
+        size_t num_active = lanes;
+        for (size_t l = 0; l < lanes; l++) {
+            node[l] = trie;
+            bit_pos[l] = 0;
+            accesses[l] = 0;
+            active[l] = l;
+        }
+
+        // Advance every active lane one level per round. Each lane's child
+        // is prefetched here and only read in the next round, so the misses
+        // of all lanes overlap instead of stalling one after the other.
+        while (num_active > 0) {
+            size_t still_active = 0;
+            for (size_t i = 0; i < num_active; i++) {
+                uint8_t l = active[i];
+                TrieNode *current = node[l];
+                bit_pos[l] += current->skip;
+
+                if (current->branch == 0) { // Leaf: its rule is needed next
+                    __builtin_prefetch(current->pointer);
+                    continue;
+                }
+
+                uint32_t bits = extract_msb(lane_addrs[l], bit_pos[l],
+                        current->branch);
+                bit_pos[l] += current->branch;
+                node[l] = ((TrieNode *)current->pointer) + bits;
+                __builtin_prefetch(node[l]);
+                accesses[l]++;
+
+                active[still_active++] = l;
+            }
+            num_active = still_active;
+        }
+
+        // All lanes are at a leaf now. Resolve them against their rules.
+        for (size_t l = 0; l < lanes; l++) {
+            out[base + l] = resolve_leaf((Rule *)node[l]->pointer,
+                    lane_addrs[l], &accesses[l]);
+            if (access_counts != NULL)
+                access_counts[base + l] = accesses[l];
+        }
+    }
+
+    DEBUG_PRINT("--Done looking up %zu IPs in batch\n", n);
+}
+
+// ---- Trie cleanup ----
+
+void free_children(TrieNode *root) {
+    DEBUG_PRINT("Freeing children of %p\n", root);
+    if (root->branch == 0) {
         DEBUG_PRINT("--Leaf node, nothing to free\n");
         return; // Leaf node, nothing to free
     }
@@ -507,6 +1781,16 @@ void free_trie(TrieNode *root) {
     DEBUG_PRINT("--Done freeing tree\n");
 }
 
+void destroy_trie(Trie *trie) {
+    DEBUG_PRINT("Destroying trie handle at %p\n", trie);
+    if (trie == NULL)
+        return;
+
+    arena_free(&trie->arena); // Nodes and rules, all at once
+    free(trie->order);
+    free(trie);
+}
+
 void free_trie_rules(TrieNode *root) {
     DEBUG_PRINT("Freeing rules for trie at %p\n", root);
     if (root == NULL) {
@@ -538,6 +1822,655 @@ void free_trie_rules(TrieNode *root) {
     DEBUG_PRINT("--Done freeing rules\n");
 }
 
+// ---- Compact trie ----
+
+CompactTrie *create_compact_trie(Rule *rules, size_t num_rules) {
+    DEBUG_PRINT("Creating compact trie with %zu rules at %p\n",
+            num_rules, rules);
+    TrieNode *trie = create_trie(rules, num_rules);
+    if (trie == NULL)
+        return NULL;
+
+    CompactTrie *compact = freeze_trie(trie, rules, num_rules);
+    free_trie(trie);
+
+    DEBUG_PRINT("--Done creating compact trie at %p\n", compact);
+    return compact;
+}
+
+CompactTrie *freeze_trie(const TrieNode *trie, const Rule *rules,
+                         size_t num_rules) {
+    DEBUG_PRINT("Freezing trie at %p\n", trie);
+    if (trie == NULL || rules == NULL || num_rules >= COMPACT_NULL_ADR)
+        return NULL;
+
+    uint32_t num_nodes = count_nodes_trie((TrieNode *)trie);
+    if (num_nodes >= COMPACT_NULL_ADR) {
+        DEBUG_PRINT("--Too many nodes (%u) for the adr field\n", num_nodes);
+        return NULL;
+    }
+
+    CompactTrie *compact = malloc(sizeof(CompactTrie));
+    const TrieNode **sources = malloc(num_nodes * sizeof(TrieNode *));
+    if (compact != NULL) {
+        compact->nodes = malloc(num_nodes * sizeof(CompactNode));
+        compact->rules = malloc(num_rules * sizeof(Rule));
+    }
+    if (!compact || !sources || !compact->nodes || !compact->rules) {
+        DEBUG_PRINT("--Error: couldn't malloc compact trie\n");
+        if (compact) {
+            free(compact->nodes);
+            free(compact->rules);
+        }
+        free(compact);
+        free(sources);
+        return NULL;
+    }
+    compact->num_nodes = num_nodes;
+    compact->num_rules = num_rules;
+    compact->leaves = NULL;
+    compact->candidates = NULL;
+    compact->num_candidates = 0;
+    compact->image = NULL;
+    compact->image_size = 0;
+    if (next_hop_table_init(&compact->next_hops) != 0) {
+        free(sources);
+        free_compact_trie(compact);
+        return NULL;
+    }
+
+    // Copy the rules, making parents point inside the copy, and add their
+    // next hops to the table
+    memcpy(compact->rules, rules, num_rules * sizeof(Rule));
+    for (size_t i = 0; i < num_rules; i++) {
+        if (rules[i].parent != NULL)
+            compact->rules[i].parent =
+                &compact->rules[rules[i].parent - rules];
+
+        if (next_hop_intern(&compact->next_hops, rules[i].out_iface) < 0) {
+            DEBUG_PRINT("--Error: no room for the next hop of rule %zu\n", i);
+            free(sources);
+            free_compact_trie(compact);
+            return NULL;
+        }
+    }
+
+    // Lay the nodes out breadth-first. `sources` doubles as the queue: node i
+    // of the compact trie is a copy of sources[i], and the children of each
+    // internal node are appended at the end as it's copied.
+    sources[0] = trie;
+    uint32_t next_free = 1;
+    for (uint32_t i = 0; i < num_nodes; i++) {
+        const TrieNode *node = sources[i];
+        uint32_t adr;
+
+        if (node->branch == 0) {
+            const Rule *rule = (const Rule *)node->pointer;
+            if (rule == NULL) {
+                adr = COMPACT_NULL_ADR;
+            } else if (rule < rules || rule >= rules + num_rules) {
+                DEBUG_PRINT("--Error: leaf points outside of the rules\n");
+                free(sources);
+                free_compact_trie(compact);
+                return NULL;
+            } else {
+                adr = rule - rules;
+            }
+        } else {
+            const TrieNode *children = (const TrieNode *)node->pointer;
+            uint32_t num_children = 1 << node->branch;
+            adr = next_free;
+            for (uint32_t j = 0; j < num_children; j++)
+                sources[next_free++] = &children[j];
+        }
+
+        compact->nodes[i] = make_compact_node(node->branch, node->skip, adr);
+        DEBUG_PRINT("  Node %u: branch=%hhu, skip=%hhu, adr=%u\n",
+                i, node->branch, node->skip, adr);
+    }
+
+    free(sources);
+    DEBUG_PRINT("--Done freezing trie into %u nodes\n", num_nodes);
+    return compact;
+}
+
+void free_compact_trie(CompactTrie *trie) {
+    DEBUG_PRINT("Freeing compact trie at %p\n", trie);
+    if (trie == NULL)
+        return;
+
+    if (trie->image != NULL) { // Everything else is in the mapping
+        munmap((void *)trie->image, trie->image_size);
+        free(trie);
+        return;
+    }
+
+    free(trie->nodes);
+    free(trie->rules);
+    next_hop_table_free(&trie->next_hops);
+    free(trie->leaves);
+    free(trie->candidates);
+    free(trie);
+}
+
+/** List the candidate answers of a leaf pointing to a rule, see LeafInfo.
+ *
+ *  @param rule the rule the leaf points to
+ *  @param next_hops the trie's next hops, which every rule's interface is in
+ *  @param[out] candidates where to store them, most specific first. It must
+ *      have room for 33 (one per prefix length). NULL to only count them
+ *  @param[out] chain where to store the number of rules in the `parent` chain
+ *
+ *  @returns the number of candidates
+ */
+static uint8_t list_candidates(const Rule *rule, NextHopTable *next_hops,
+                               LeafCandidate *candidates, uint32_t *chain) {
+    // The same rules resolve_leaf() would check, in the same order
+    uint8_t count = 0;
+    uint8_t last_len = 33;
+    *chain = 0;
+    for (const Rule *r = rule; r != NULL; r = r->parent) {
+        (*chain)++;
+        // Shadowed by an earlier one, or never an answer
+        if (r->prefix_len >= last_len || r->out_iface == 0)
+            continue;
+        last_len = r->prefix_len;
+        // Already interned by freeze_trie(), so this only finds its index
+        if (candidates)
+            candidates[count] = (LeafCandidate){
+                .next_hop = next_hop_intern(next_hops, r->out_iface),
+                .prefix_len = r->prefix_len,
+            };
+        count++;
+    }
+    return count;
+}
+
+int precompute_leaves(CompactTrie *trie, uint32_t *max_chain,
+                      uint32_t *max_candidates) {
+    DEBUG_PRINT("Precomputing leaves of compact trie at %p\n", trie);
+    if (trie == NULL)
+        return -1;
+
+    // Count the candidates that don't fit in the LeafInfos first
+    size_t num_more = 0;
+    uint32_t longest_chain = 0, longest_list = 0;
+    for (uint32_t i = 0; i < trie->num_rules; i++) {
+        uint32_t chain;
+        uint8_t count = list_candidates(&trie->rules[i], &trie->next_hops,
+                NULL, &chain);
+        num_more += count > 1 ? count - 1 : 0;
+        if (chain > longest_chain)
+            longest_chain = chain;
+        if (count > longest_list)
+            longest_list = count;
+    }
+    if (num_more >= UINT32_MAX)
+        return -1;
+
+    LeafInfo *leaves = malloc(trie->num_rules * sizeof(LeafInfo));
+    LeafCandidate *candidates = malloc(num_more * sizeof(LeafCandidate));
+    if (!leaves || (!candidates && num_more > 0)) {
+        free(leaves);
+        free(candidates);
+        return -1;
+    }
+
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < trie->num_rules; i++) {
+        LeafCandidate list[33];
+        uint32_t chain;
+        uint8_t count = list_candidates(&trie->rules[i], &trie->next_hops,
+                list, &chain);
+
+        leaves[i] = (LeafInfo){
+            .prefix = trie->rules[i].prefix,
+            .more = next,
+            .next_hop = count > 0 ? list[0].next_hop : NO_NEXT_HOP,
+            .prefix_len = count > 0 ? list[0].prefix_len : 0xFF,
+            .num_more = count > 1 ? count - 1 : 0,
+        };
+        for (uint8_t j = 1; j < count; j++)
+            candidates[next++] = list[j];
+    }
+
+    free(trie->leaves);
+    free(trie->candidates);
+    trie->leaves = leaves;
+    trie->candidates = candidates;
+    trie->num_candidates = next;
+    if (max_chain)
+        *max_chain = longest_chain;
+    if (max_candidates)
+        *max_candidates = longest_list;
+
+    DEBUG_PRINT("--Done precomputing leaves, %u extra candidates\n", next);
+    return 0;
+}
+
+uint32_t count_nodes_compact_trie(const CompactTrie *trie) {
+    return trie == NULL ? 0 : trie->num_nodes;
+}
+
+/// Get the rule a compact leaf node refers to, or NULL if it has none.
+static inline const Rule *compact_leaf_rule(const CompactTrie *trie,
+                                            CompactNode leaf) {
+    uint32_t adr = compact_adr(leaf);
+    return adr == COMPACT_NULL_ADR ? NULL : &trie->rules[adr];
+}
+
+/// Get the memory a lookup reads first at a compact leaf: its LeafInfo if
+/// there are any, or else its rule. NULL if it has neither.
+static inline const void *compact_leaf_data(const CompactTrie *trie,
+                                            CompactNode leaf) {
+    uint32_t adr = compact_adr(leaf);
+    if (adr == COMPACT_NULL_ADR)
+        return NULL;
+    return trie->leaves ? (const void *)&trie->leaves[adr]
+                        : (const void *)&trie->rules[adr];
+}
+
+/** Find the outgoing interface for an address that reached a compact leaf.
+ *
+ *  Same as resolve_leaf(), but using the leaf's LeafInfo if the trie has them.
+ *  Reading the LeafInfo counts as one access, and reading the rest of the
+ *  candidates as another.
+ */
+static inline uint32_t resolve_compact_leaf(const CompactTrie *trie,
+                                            CompactNode leaf,
+                                            ip_addr_t ip_addr,
+                                            int *access_count) {
+    if (trie->leaves == NULL)
+        return resolve_leaf(compact_leaf_rule(trie, leaf), ip_addr,
+                access_count);
+
+    uint32_t adr = compact_adr(leaf);
+    if (adr == COMPACT_NULL_ADR)
+        return 0;
+
+    const LeafInfo *info = &trie->leaves[adr];
+    (*access_count)++;
+    // Number of leading bits the address shares with every candidate
+    uint32_t diff = ip_addr ^ info->prefix;
+    uint8_t shared = diff == 0 ? 32 : __builtin_clz(diff);
+    if (info->prefix_len <= shared)
+        return next_hop_iface(&trie->next_hops, info->next_hop);
+    if (info->num_more == 0)
+        return 0;
+
+    (*access_count)++;
+    const LeafCandidate *more = &trie->candidates[info->more];
+    for (uint8_t i = 0; i < info->num_more; i++) {
+        if (more[i].prefix_len <= shared)
+            return next_hop_iface(&trie->next_hops, more[i].next_hop);
+    }
+    return 0;
+}
+
+uint32_t lookup_ip_compact(ip_addr_t ip_addr, const CompactTrie *trie,
+                           int *access_count) {
+    DEBUG_PRINT("Looking up IP 0x%08X in compact trie at %p\n", ip_addr, trie);
+    int black_hole = 0; // Temporary variable to avoid dereferencing NULL
+    if (access_count == NULL)
+        access_count = &black_hole;
+
+    *access_count = 0; // Initialize access count
+
+    const CompactNode *nodes = trie->nodes;
+    CompactNode current = nodes[0];
+    uint8_t bit_pos = compact_skip(current);
+    uint8_t read_bits = compact_branch(current);
+
+    // Traverse the trie until reaching a leaf node
+    while (read_bits != 0) {
+        uint32_t bits = extract_msb(ip_addr, bit_pos, read_bits);
+        current = nodes[compact_adr(current) + bits];
+
+        bit_pos += read_bits + compact_skip(current);
+        read_bits = compact_branch(current);
+
+        (*access_count)++;
+    } // We'll exit when we reach a leaf node, which has branch=0
+
+    uint32_t out_iface = resolve_compact_leaf(trie, current, ip_addr,
+            access_count);
+
+    DEBUG_PRINT("--Done looking IP 0x%08X up in %u accesses: -> %d\n",
+            ip_addr, *access_count, out_iface);
+
+    return out_iface;
+}
+
+/** Walk a compact trie with LOOKUP_BATCH_LANES addresses at a time, one
+ *  address after another, prefetching each one's next node.
+ *
+ *  Same arguments as lookup_ip_compact_batch().
+ */
+static void lookup_compact_scalar(const ip_addr_t *addrs, uint32_t *out,
+                                  size_t n, const CompactTrie *trie,
+                                  int *access_counts) {
+    const CompactNode *nodes = trie->nodes;
+
+    // Same as in lookup_ip_batch, with node indices instead of pointers
+    uint32_t node[LOOKUP_BATCH_LANES];
+    uint8_t bit_pos[LOOKUP_BATCH_LANES];
+    int accesses[LOOKUP_BATCH_LANES];
+    uint8_t active[LOOKUP_BATCH_LANES];
+
+    for (size_t base = 0; base < n; base += LOOKUP_BATCH_LANES) {
+        size_t lanes = n - base < LOOKUP_BATCH_LANES ?
+            n - base : LOOKUP_BATCH_LANES;
+        const ip_addr_t *lane_addrs = &addrs[base];
+
+        size_t num_active = lanes;
+        for (size_t l = 0; l < lanes; l++) {
+            node[l] = 0;
+            bit_pos[l] = 0;
+            accesses[l] = 0;
+            active[l] = l;
+        }
+
+        while (num_active > 0) {
+            size_t still_active = 0;
+            for (size_t i = 0; i < num_active; i++) {
+                uint8_t l = active[i];
+                CompactNode current = nodes[node[l]];
+                uint8_t branch = compact_branch(current);
+                bit_pos[l] += compact_skip(current);
+
+                if (branch == 0) { // Leaf: its rule is needed next
+                    __builtin_prefetch(compact_leaf_data(trie, current));
+                    continue;
+                }
+
+                uint32_t bits = extract_msb(lane_addrs[l], bit_pos[l], branch);
+                bit_pos[l] += branch;
+                node[l] = compact_adr(current) + bits;
+                __builtin_prefetch(&nodes[node[l]]);
+                accesses[l]++;
+
+                active[still_active++] = l;
+            }
+            num_active = still_active;
+        }
+
+        for (size_t l = 0; l < lanes; l++) {
+            out[base + l] = resolve_compact_leaf(trie, nodes[node[l]],
+                    lane_addrs[l], &accesses[l]);
+            if (access_counts != NULL)
+                access_counts[base + l] = accesses[l];
+        }
+    }
+}
+
+#ifdef COMPACT_SIMD
+
+/** Resolve the leaves some lanes of a SIMD kernel stopped at.
+ *
+ *  All of their data is prefetched before the first one is read, since the
+ *  lanes reach their leaves at the same time.
+ *
+ *  @param node the index of each lane's leaf
+ *  @param accesses the node accesses of each lane so far
+ *
+ *  The rest are the same as lookup_ip_compact_batch()'s, for these lanes.
+ */
+static inline void resolve_compact_lanes(const CompactTrie *trie,
+                                         const ip_addr_t *addrs,
+                                         const uint32_t *node, int *accesses,
+                                         uint32_t *out, int *access_counts,
+                                         size_t lanes) {
+    for (size_t l = 0; l < lanes; l++)
+        __builtin_prefetch(compact_leaf_data(trie, trie->nodes[node[l]]));
+
+    for (size_t l = 0; l < lanes; l++) {
+        out[l] = resolve_compact_leaf(trie, trie->nodes[node[l]], addrs[l],
+                &accesses[l]);
+        if (access_counts != NULL)
+            access_counts[l] = accesses[l];
+    }
+}
+
+#define COMPACT_SKIP_MASK ((1 << COMPACT_SKIP_BITS) - 1)
+#define COMPACT_BRANCH_MASK ((1 << COMPACT_BRANCH_BITS) - 1)
+
+/** Load the node each of 8 lanes is at, and split it into its fields.
+ *
+ *  @param nodes the nodes of the trie
+ *  @param idx the index of each lane's node
+ *  @param[out] adr, skip, branch the fields of each lane's node
+ */
+__attribute__((target("avx2")))
+static inline void load_compact_avx2(const CompactNode *nodes, __m256i idx,
+                                     __m256i *adr, __m256i *skip,
+                                     __m256i *branch) {
+#if COMPACT_NODE_BITS == 32
+    __m256i node = _mm256_i32gather_epi32((const int *)nodes, idx, 4);
+    *adr = _mm256_and_si256(node, _mm256_set1_epi32(COMPACT_NULL_ADR));
+    __m256i high = _mm256_srli_epi32(node, COMPACT_ADR_BITS);
+#else
+    // Lanes 0-3 and 4-7, as 64-bit nodes
+    __m256i low_nodes = _mm256_i32gather_epi64((const long long *)nodes,
+            _mm256_castsi256_si128(idx), 8);
+    __m256i high_nodes = _mm256_i32gather_epi64((const long long *)nodes,
+            _mm256_extracti128_si256(idx, 1), 8);
+    // Lower halves of the nodes first and upper halves after, in each
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    low_nodes = _mm256_permutevar8x32_epi32(low_nodes, split);
+    high_nodes = _mm256_permutevar8x32_epi32(high_nodes, split);
+    *adr = _mm256_permute2x128_si256(low_nodes, high_nodes, 0x20);
+    __m256i high = _mm256_permute2x128_si256(low_nodes, high_nodes, 0x31);
+    // `adr` takes the whole lower half, so `skip` starts the upper one
+#endif
+    *skip = _mm256_and_si256(high, _mm256_set1_epi32(COMPACT_SKIP_MASK));
+    *branch = _mm256_and_si256(_mm256_srli_epi32(high, COMPACT_SKIP_BITS),
+            _mm256_set1_epi32(COMPACT_BRANCH_MASK));
+}
+
+/** Walk a compact trie with 8 addresses at a time, in the lanes of an AVX2
+ *  vector. Lanes that reach a leaf keep loading it until all of them have.
+ *
+ *  Same arguments as lookup_ip_compact_batch().
+ */
+__attribute__((target("avx2")))
+static void lookup_compact_avx2(const ip_addr_t *addrs, uint32_t *out,
+                                size_t n, const CompactTrie *trie,
+                                int *access_counts) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i word_bits = _mm256_set1_epi32(32);
+    uint32_t node[8];
+    int accesses[8];
+
+    size_t base = 0;
+    for (; base + 8 <= n; base += 8) {
+        __m256i addr = _mm256_loadu_si256((const __m256i *)&addrs[base]);
+        __m256i idx = zero;
+        __m256i bit_pos = zero;
+        __m256i count = zero;
+        __m256i active = _mm256_cmpeq_epi32(zero, zero); // All ones
+
+        while (true) {
+            __m256i adr, skip, branch;
+            load_compact_avx2(trie->nodes, idx, &adr, &skip, &branch);
+            bit_pos = _mm256_add_epi32(bit_pos, skip);
+
+            // Leaves have branch=0
+            active = _mm256_andnot_si256(_mm256_cmpeq_epi32(branch, zero),
+                    active);
+            if (_mm256_testz_si256(active, active))
+                break;
+
+            // Same as extract_msb(), which a shift by 32 can't be part of
+            __m256i bits = _mm256_srlv_epi32(_mm256_sllv_epi32(addr, bit_pos),
+                    _mm256_sub_epi32(word_bits, branch));
+            idx = _mm256_blendv_epi8(idx, _mm256_add_epi32(adr, bits), active);
+            bit_pos = _mm256_add_epi32(bit_pos,
+                    _mm256_and_si256(branch, active));
+            count = _mm256_sub_epi32(count, active); // Active lanes are -1
+        }
+
+        _mm256_storeu_si256((__m256i *)node, idx);
+        _mm256_storeu_si256((__m256i *)accesses, count);
+        resolve_compact_lanes(trie, &addrs[base], node, accesses, &out[base],
+                access_counts == NULL ? NULL : &access_counts[base], 8);
+    }
+
+    if (base < n) {
+        lookup_compact_scalar(&addrs[base], &out[base], n - base, trie,
+                access_counts == NULL ? NULL : &access_counts[base]);
+    }
+}
+
+/** Load the node each of 16 lanes is at, and split it into its fields.
+ *
+ *  @param nodes the nodes of the trie
+ *  @param idx the index of each lane's node
+ *  @param[out] adr, skip, branch the fields of each lane's node
+ */
+__attribute__((target("avx512f")))
+static inline void load_compact_avx512(const CompactNode *nodes, __m512i idx,
+                                       __m512i *adr, __m512i *skip,
+                                       __m512i *branch) {
+#if COMPACT_NODE_BITS == 32
+    __m512i node = _mm512_i32gather_epi32(idx, nodes, 4);
+    *adr = _mm512_and_si512(node, _mm512_set1_epi32(COMPACT_NULL_ADR));
+    __m512i high = _mm512_srli_epi32(node, COMPACT_ADR_BITS);
+#else
+    // Lanes 0-7 and 8-15, as 64-bit nodes
+    __m512i low_nodes = _mm512_i32gather_epi64(_mm512_castsi512_si256(idx),
+            nodes, 8);
+    __m512i high_nodes = _mm512_i32gather_epi64(
+            _mm512_extracti64x4_epi64(idx, 1), nodes, 8);
+    // Lower and upper halves of the nodes, from both
+    const __m512i lower = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+            16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i upper = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15,
+            17, 19, 21, 23, 25, 27, 29, 31);
+    *adr = _mm512_permutex2var_epi32(low_nodes, lower, high_nodes);
+    __m512i high = _mm512_permutex2var_epi32(low_nodes, upper, high_nodes);
+    // `adr` takes the whole lower half, so `skip` starts the upper one
+#endif
+    *skip = _mm512_and_si512(high, _mm512_set1_epi32(COMPACT_SKIP_MASK));
+    *branch = _mm512_and_si512(_mm512_srli_epi32(high, COMPACT_SKIP_BITS),
+            _mm512_set1_epi32(COMPACT_BRANCH_MASK));
+}
+
+/** Walk a compact trie with 16 addresses at a time, in the lanes of an
+ *  AVX-512 vector. Same as lookup_compact_avx2(), with mask registers.
+ *
+ *  Same arguments as lookup_ip_compact_batch().
+ */
+__attribute__((target("avx512f")))
+static void lookup_compact_avx512(const ip_addr_t *addrs, uint32_t *out,
+                                  size_t n, const CompactTrie *trie,
+                                  int *access_counts) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i word_bits = _mm512_set1_epi32(32);
+    uint32_t node[16];
+    int accesses[16];
+
+    size_t base = 0;
+    for (; base + 16 <= n; base += 16) {
+        __m512i addr = _mm512_loadu_si512(&addrs[base]);
+        __m512i idx = zero;
+        __m512i bit_pos = zero;
+        __m512i count = zero;
+        __mmask16 active = 0xFFFF;
+
+        while (true) {
+            __m512i adr, skip, branch;
+            load_compact_avx512(trie->nodes, idx, &adr, &skip, &branch);
+            bit_pos = _mm512_add_epi32(bit_pos, skip);
+
+            // Leaves have branch=0
+            active = _mm512_mask_cmpneq_epi32_mask(active, branch, zero);
+            if (active == 0)
+                break;
+
+            __m512i bits = _mm512_srlv_epi32(_mm512_sllv_epi32(addr, bit_pos),
+                    _mm512_sub_epi32(word_bits, branch));
+            idx = _mm512_mask_add_epi32(idx, active, adr, bits);
+            bit_pos = _mm512_mask_add_epi32(bit_pos, active, bit_pos, branch);
+            count = _mm512_mask_add_epi32(count, active, count, one);
+        }
+
+        _mm512_storeu_si512(node, idx);
+        _mm512_storeu_si512(accesses, count);
+        resolve_compact_lanes(trie, &addrs[base], node, accesses, &out[base],
+                access_counts == NULL ? NULL : &access_counts[base], 16);
+    }
+
+    if (base < n) {
+        lookup_compact_scalar(&addrs[base], &out[base], n - base, trie,
+                access_counts == NULL ? NULL : &access_counts[base]);
+    }
+}
+
+#endif // COMPACT_SIMD
+
+CompactKernel resolve_compact_kernel(CompactKernel kernel) {
+#ifdef COMPACT_SIMD
+    __builtin_cpu_init(); // Only needed the first time, but cheap
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool avx512 = __builtin_cpu_supports("avx512f");
+    switch (kernel) {
+    case COMPACT_KERNEL_AUTO:
+        if (avx512)
+            return COMPACT_KERNEL_AVX512;
+        return avx2 ? COMPACT_KERNEL_AVX2 : COMPACT_KERNEL_SCALAR;
+    case COMPACT_KERNEL_AVX2:
+        return avx2 ? kernel : COMPACT_KERNEL_SCALAR;
+    case COMPACT_KERNEL_AVX512:
+        return avx512 ? kernel : COMPACT_KERNEL_SCALAR;
+    default:
+        break;
+    }
+#else
+    (void)kernel;
+#endif
+    return COMPACT_KERNEL_SCALAR;
+}
+
+const char *compact_kernel_name(CompactKernel kernel) {
+    switch (kernel) {
+    case COMPACT_KERNEL_AUTO:   return "auto";
+    case COMPACT_KERNEL_SCALAR: return "scalar";
+    case COMPACT_KERNEL_AVX2:   return "avx2";
+    case COMPACT_KERNEL_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+void lookup_ip_compact_batch_with(const ip_addr_t *addrs, uint32_t *out,
+                                  size_t n, const CompactTrie *trie,
+                                  int *access_counts, CompactKernel kernel) {
+    DEBUG_PRINT("Looking up %zu IPs in batch in compact trie at %p (%s)\n",
+            n, trie, compact_kernel_name(kernel));
+
+    switch (resolve_compact_kernel(kernel)) {
+#ifdef COMPACT_SIMD
+    case COMPACT_KERNEL_AVX512:
+        lookup_compact_avx512(addrs, out, n, trie, access_counts);
+        break;
+    case COMPACT_KERNEL_AVX2:
+        lookup_compact_avx2(addrs, out, n, trie, access_counts);
+        break;
+#endif
+    default:
+        lookup_compact_scalar(addrs, out, n, trie, access_counts);
+        break;
+    }
+
+    DEBUG_PRINT("--Done looking up %zu IPs in batch\n", n);
+}
+
+void lookup_ip_compact_batch(const ip_addr_t *addrs, uint32_t *out, size_t n,
+                             const CompactTrie *trie, int *access_counts) {
+    lookup_ip_compact_batch_with(addrs, out, n, trie, access_counts,
+            COMPACT_KERNEL_AUTO);
+}
+
 // ---- Mock implementations for testing ----
 
 #ifdef MOCK
@@ -5,11 +5,31 @@
 #include <stdint.h>  // For fixed-width integer types like uint32_t
 #include <stdbool.h> // For the bool type
 
+#include "arena.h"
+#include "next_hop.h"
+
 // ==== Constants ====
 #ifndef FILL_FACTOR     // Can be overridden at compile time
 #define FILL_FACTOR 1.0 // Determines how densely populated branches must be
 #endif
 
+#ifndef COMPACT_NODE_BITS    // Can be overridden at compile time
+#define COMPACT_NODE_BITS 64 // Size of a CompactNode. Either 32 or 64
+#endif
+
+#ifndef LOOKUP_BATCH_LANES    // Can be overridden at compile time
+#define LOOKUP_BATCH_LANES 16 // Lookups advanced in lockstep by lookup_ip_batch
+#endif
+// The batch lookups keep lists of lane indices in uint8_t
+_Static_assert(LOOKUP_BATCH_LANES >= 1 && LOOKUP_BATCH_LANES <= 256,
+               "LOOKUP_BATCH_LANES must be from 1 to 256");
+
+#define ROOT_BRANCH_AUTO -1      // Size the root's branch from the rule count
+#define MIN_AUTO_ROOT_BRANCH 16  // Narrowest root ROOT_BRANCH_AUTO picks
+#define MAX_AUTO_ROOT_BRANCH 20  // Widest root ROOT_BRANCH_AUTO picks
+#define MAX_ROOT_BRANCH 24       // Widest root that can be forced
+#define TRIE_STATS_LEVELS 34     // Values 0 to 33 in each TrieStats histogram
+
 // ==== Data Types ====
 
 /// An IP address as a 32-bit unsigned integer.
@@ -48,6 +68,58 @@ typedef struct TrieNode {
     void *pointer;
 } TrieNode;
 
+/** Node of a compact LC-Trie.
+ *
+ * The `branch`, `skip` and `adr` fields of a node packed in a single word, as
+ * in the original layout by Nilsson and Karlsson. All nodes of a compact trie
+ * live in one array, so `adr` is an index instead of a pointer: that of the
+ * first child for internal nodes, or that of the rule for leaves.
+ *
+ * With COMPACT_NODE_BITS=64 (default), `adr` is the lower 32 bits, `skip` the
+ * next 8 and `branch` the 8 after those. With COMPACT_NODE_BITS=32, they are
+ * 5 bits of `branch`, 6 of `skip` and 21 of `adr`, from MSB to LSB.
+ */
+#if COMPACT_NODE_BITS == 32
+typedef uint32_t CompactNode;
+#define COMPACT_BRANCH_BITS 5
+#define COMPACT_SKIP_BITS   6
+#define COMPACT_ADR_BITS    21
+#elif COMPACT_NODE_BITS == 64
+typedef uint64_t CompactNode;
+#define COMPACT_BRANCH_BITS 8
+#define COMPACT_SKIP_BITS   8
+#define COMPACT_ADR_BITS    32
+#else
+#error "COMPACT_NODE_BITS must be either 32 or 64"
+#endif
+
+/// Largest value of the `adr` field, used by leaves that have no rule.
+#define COMPACT_NULL_ADR ((uint32_t)(((uint64_t)1 << COMPACT_ADR_BITS) - 1))
+
+/// Get the `branch` field of a CompactNode.
+static inline uint8_t compact_branch(CompactNode node) {
+    return (node >> (COMPACT_ADR_BITS + COMPACT_SKIP_BITS))
+        & ((1 << COMPACT_BRANCH_BITS) - 1);
+}
+
+/// Get the `skip` field of a CompactNode.
+static inline uint8_t compact_skip(CompactNode node) {
+    return (node >> COMPACT_ADR_BITS) & ((1 << COMPACT_SKIP_BITS) - 1);
+}
+
+/// Get the `adr` field of a CompactNode.
+static inline uint32_t compact_adr(CompactNode node) {
+    return node & COMPACT_NULL_ADR;
+}
+
+/// Pack the given fields into a CompactNode. They're assumed to fit.
+static inline CompactNode make_compact_node(uint8_t branch, uint8_t skip,
+                                            uint32_t adr) {
+    return ((CompactNode)branch << (COMPACT_ADR_BITS + COMPACT_SKIP_BITS))
+        | ((CompactNode)skip << COMPACT_ADR_BITS)
+        | adr;
+}
+
 /** Forwarding rule.
  *
  * Associates a CIDR prefix with an outgoing interface. A packet with a
@@ -71,6 +143,123 @@ typedef struct Rule {
     struct Rule *parent; // Pointer to the parent rule in the hierarchy
 } Rule;
 
+/// Possible answer for the addresses that reach a leaf, see LeafInfo.
+typedef struct LeafCandidate {
+    uint16_t next_hop;  ///< Next hop of the rule, in the trie's NextHopTable
+    uint8_t prefix_len; ///< Length of the rule's prefix
+} LeafCandidate;
+
+/** Precomputed answers for the addresses that reach a leaf.
+ *
+ * Instead of checking the leaf's rule and then walking its `parent` chain,
+ * the rules of the chain are listed from most to least specific, keeping only
+ * those that can be an answer (a shorter prefix than the ones before, and an
+ * interface other than 0). As they're all prefixes of the same one, an
+ * address matches one of them if it shares at least `prefix_len` bits with
+ * `prefix`, which is found with a single count of leading zeros.
+ *
+ * The first candidate is stored here, so that a lookup matching the leaf's
+ * own rule reads nothing else. The rest follow each other in a separate
+ * array. Answers are 16-bit next hop indices rather than interfaces, which
+ * keeps a LeafInfo at 12 bytes and a LeafCandidate at 4.
+ */
+typedef struct LeafInfo {
+    ip_addr_t prefix;   ///< Prefix of the leaf's rule
+    uint32_t more;      ///< Index of the first other candidate in `candidates`
+    uint16_t next_hop;  ///< Next hop of the first candidate
+    uint8_t prefix_len; ///< Length of the first candidate, or 0xFF if none
+    uint8_t num_more;   ///< Number of other candidates
+} LeafInfo;
+
+/** Compact LC-Trie.
+ *
+ * A read-only ("frozen") form of an LC-Trie where every node is stored in a
+ * single array, breadth-first, and has its fields packed in a CompactNode.
+ * The root is the first node, and the children of each node are contiguous.
+ * It holds its own copy of the rules, which the leaves refer to by index,
+ * and a table with each of their distinct next hops.
+ *
+ * Optionally (see precompute_leaves()), it also has a LeafInfo for each
+ * rule, with the same index, which lookups use instead of the rule.
+ *
+ * A trie mapped from an image file (see open_trie_image()) has its arrays in
+ * the mapping, and no rules.
+ */
+typedef struct CompactTrie {
+    CompactNode *nodes; ///< All nodes in the trie, root first
+    uint32_t num_nodes; ///< Number of elements in `nodes`
+    Rule *rules;        ///< Rules referenced by the leaves
+    uint32_t num_rules; ///< Number of elements in `rules`
+    NextHopTable next_hops; ///< Next hops the rules and leaves refer to
+    LeafInfo *leaves;   ///< Answers for the leaves of each rule, or NULL
+    LeafCandidate *candidates; ///< Candidates not stored in `leaves`
+    uint32_t num_candidates;   ///< Number of elements in `candidates`
+    const void *image;  ///< Image file the arrays are mapped from, or NULL
+    size_t image_size;  ///< Bytes mapped at `image`
+} CompactTrie;
+
+/** Shape of an LC-Trie.
+ *
+ * What FILL_FACTOR and the node layout are tuned against. Depths, branches
+ * and skips can't go over 32, and parent chains (a rule and its parents, all
+ * of them shorter than the rule) over 33.
+ */
+typedef struct TrieStats {
+    uint32_t num_nodes;      ///< Nodes, internal and leaves
+    uint32_t num_leaves;     ///< Nodes without children
+    uint32_t empty_leaves;   ///< Leaves without a rule
+    /// Leaves of a node that had no rules of its own, which get the default
+    /// rule of its parent (a rule shorter than the bits read to reach them)
+    uint32_t default_leaves;
+    uint32_t branches[TRIE_STATS_LEVELS]; ///< Internal nodes by branch
+    uint32_t skips[TRIE_STATS_LEVELS];    ///< Internal nodes by skip
+    /// Leaves by depth, the number of internal nodes above them
+    uint32_t depths[TRIE_STATS_LEVELS];
+    /// Leaves by the rules a lookup reaching them may check: their rule and
+    /// its parents. 0 for empty leaves
+    uint32_t chains[TRIE_STATS_LEVELS];
+} TrieStats;
+
+/** LC-Trie handle.
+ *
+ * Owns an LC-Trie together with the sorted copy of the rules it was created
+ * from. Both come from a single arena, so sibling nodes are contiguous in
+ * memory and the whole trie is freed at once by destroy_trie().
+ *
+ * Rules can be inserted and deleted afterwards (see trie_insert_rule()). Each
+ * update rebuilds a subtrie from new copies of its rules, so from then on the
+ * rules are no longer in a single array: `order` keeps track of them instead,
+ * until trie_compact() builds the whole trie again.
+ */
+typedef struct Trie {
+    TrieNode *root;   ///< Root node of the trie
+    Rule *rules;      ///< Sorted base vector the leaves point into, or NULL
+                      ///< if the trie has been updated since it was built
+    size_t num_rules; ///< Number of rules in the trie
+    Rule **order;     ///< Every rule in use, sorted. NULL until an update
+    size_t order_capacity; ///< Number of elements `order` has room for
+    size_t wasted;    ///< Bytes of the arena no longer used after updates
+    uint8_t root_branch; ///< Branch forced on the root, or 0 if none was
+    TrieStats stats;  ///< Shape of the trie, counted as its nodes are built
+    Arena arena;      ///< Where the nodes and rules are allocated from
+} Trie;
+
+/** How build_trie_with_options() builds an LC-Trie handle.
+ *
+ * A wide root turns the first levels of the trie into a single table indexed
+ * by the first bits of the address, as recommended by the LC-trie paper for
+ * large tables. The nodes below are still built as usual. It takes more
+ * memory (2^root_branch nodes), but most lookups end in a few accesses.
+ */
+typedef struct TrieBuildOptions {
+    int num_threads; ///< Threads to build in, including the calling one
+    /// Branch to force on the root, from 1 to MAX_ROOT_BRANCH. 0 to let
+    /// FILL_FACTOR pick it like any other, or ROOT_BRANCH_AUTO to use the
+    /// number of bits in the rule count, from MIN_AUTO_ROOT_BRANCH to
+    /// MAX_AUTO_ROOT_BRANCH
+    int root_branch;
+} TrieBuildOptions;
+
 // ==== Function Prototypes ====
 
 // TODO: complete these docs
@@ -84,6 +273,98 @@ typedef struct Rule {
  */
 TrieNode *create_trie(Rule *rules, size_t num_rules);
 
+/** Build an LC-Trie handle from a set of rules.
+ *
+ * Unlike create_trie(), the rules don't need to be sorted, and aren't
+ * modified: the handle sorts its own copy of them.
+ *
+ * @param rules Pointer to an array of rules.
+ * @param num_rules Number of rules in the array.
+ *
+ * @return Pointer to the new trie handle, or NULL on failure.
+ */
+Trie *build_trie(const Rule *rules, size_t num_rules);
+
+/** Build an LC-Trie handle from a set of rules, in several threads.
+ *
+ * Same as build_trie(), but the rules are sorted with sort_rules_parallel(),
+ * and the children of the nodes near the root (those with many rules under
+ * them) are created by a pool of threads, which steal them from each other as
+ * they run out. Each thread allocates its nodes from an arena of its own,
+ * which is merged into the handle's at the end.
+ *
+ * @param rules Pointer to an array of rules.
+ * @param num_rules Number of rules in the array.
+ * @param num_threads Number of threads to use, including the calling one. 1
+ *      or fewer is the same as build_trie().
+ *
+ * @return Pointer to the new trie handle, or NULL on failure.
+ */
+Trie *build_trie_parallel(const Rule *rules, size_t num_rules,
+                          int num_threads);
+
+/** Build an LC-Trie handle from a set of rules, with the given options.
+ *
+ * Same as build_trie_parallel(), but it can also force the branch of the
+ * root. Updates keep it, and so does trie_compact().
+ *
+ * @param rules Pointer to an array of rules.
+ * @param num_rules Number of rules in the array.
+ * @param options How to build it.
+ *
+ * @return Pointer to the new trie handle, or NULL on failure (including an
+ *      invalid `root_branch`).
+ */
+Trie *build_trie_with_options(const Rule *rules, size_t num_rules,
+                              const TrieBuildOptions *options);
+
+/** Free the memory allocated for an LC-Trie handle, including its rules.
+ *
+ * @param trie Pointer to the trie handle.
+ */
+void destroy_trie(Trie *trie);
+
+/** Insert a rule into an LC-Trie handle, without building it again.
+ *
+ * Only the subtrie under the deepest node whose skip, branch and default
+ * rules remain valid with the new rule is rebuilt. If a rule with the same
+ * prefix and length is already there, its outgoing interface is replaced.
+ *
+ * The arena isn't reused as subtries are replaced, so once more than half of
+ * it is wasted the handle is compacted with trie_compact().
+ *
+ * @param trie Pointer to the trie handle.
+ * @param rule The rule to insert. It's copied, and its `parent` is ignored.
+ *
+ * @return 0 on success, -1 if the rule isn't a valid prefix (it's longer
+ *      than 32 bits, or has bits set past its length) or memory ran out.
+ */
+int trie_insert_rule(Trie *trie, const Rule *rule);
+
+/** Delete a rule from an LC-Trie handle, without building it again.
+ *
+ * Same as trie_insert_rule(), but removing the rule with the given prefix and
+ * length (all of them, if there are duplicates).
+ *
+ * @param trie Pointer to the trie handle.
+ * @param prefix The prefix of the rule to delete.
+ * @param prefix_len The length of the prefix.
+ *
+ * @return 0 on success, -1 if there is no such rule or memory ran out.
+ */
+int trie_delete_rule(Trie *trie, ip_addr_t prefix, uint8_t prefix_len);
+
+/** Build an updated LC-Trie handle again, in a new arena.
+ *
+ * Frees the memory wasted by updates, and puts the rules back into a single
+ * sorted array in `rules` (needed by freeze_trie()).
+ *
+ * @param trie Pointer to the trie handle.
+ *
+ * @return 0 on success, or -1 if memory ran out (the handle is unchanged).
+ */
+int trie_compact(Trie *trie);
+
 /** Free the memory allocated for the LC-Trie.
  *
  * @param trie Pointer to the root node of the LC-Trie.
@@ -105,6 +386,17 @@ void free_trie_rules(TrieNode *trie);
  */
 uint32_t count_nodes_trie(TrieNode *trie);
 
+/** Walk an LC-Trie to find its shape.
+ *
+ * Trie handles already keep theirs in `stats`, counted as their nodes are
+ * built (or rebuilt by an update). This is for tries made by create_trie(),
+ * and to check those.
+ *
+ * @param trie Pointer to the root node of the LC-Trie, or NULL.
+ * @param[out] stats Pointer where the shape will be stored.
+ */
+void count_trie_stats(const TrieNode *trie, TrieStats *stats);
+
 /** Look up an IP address in the given LC-Trie and return the next out port.
  *
  * @param ip_addr The IP address to look up.
@@ -117,13 +409,156 @@ uint32_t count_nodes_trie(TrieNode *trie);
  */
 uint32_t lookup_ip(ip_addr_t ip_addr, TrieNode *trie, int *access_count);
 
+/** Look up several IP addresses in the given LC-Trie at once.
+ *
+ * Addresses are walked down the trie in groups of LOOKUP_BATCH_LANES, one
+ * level per round, prefetching each one's next node so that the cache misses
+ * of the whole group overlap. Results are the same as calling lookup_ip() on
+ * each address.
+ *
+ * @param addrs The IP addresses to look up.
+ * @param[out] out Array where the outgoing interface for each address will be
+ *      stored (0 if no rules match). Must have room for `n` elements.
+ * @param n Number of addresses to look up.
+ * @param trie Pointer to the root node of the LC-Trie.
+ * @param[out] access_counts Array where the number of node accesses for each
+ *      address will be stored. Pass NULL to ignore.
+ */
+void lookup_ip_batch(const ip_addr_t *addrs, uint32_t *out, size_t n,
+                     TrieNode *trie, int *access_counts);
+
+/** Create a compact LC-Trie from a set of rules.
+ *
+ * Same as calling create_trie() and then freeze_trie(), but the intermediate
+ * trie is freed before returning.
+ *
+ * @param rules Pointer to a SORTED array of rules.
+ * @param num_rules Number of rules in the array.
+ *
+ * @return Pointer to the new compact trie, or NULL on failure.
+ */
+CompactTrie *create_compact_trie(Rule *rules, size_t num_rules);
+
+/** Create a compact copy of an LC-Trie.
+ *
+ * @param trie Pointer to the root node of the LC-Trie.
+ * @param rules Pointer to the array of rules the LC-Trie was created from. All
+ *      leaves must point inside it.
+ * @param num_rules Number of rules in the array.
+ *
+ * @return Pointer to the new compact trie, or NULL on failure (including the
+ *      trie not fitting the `adr` field of a CompactNode, or the rules having
+ *      more than MAX_NEXT_HOPS distinct interfaces).
+ */
+CompactTrie *freeze_trie(const TrieNode *trie, const Rule *rules,
+                         size_t num_rules);
+
+/** Precompute the answers of the leaves of a compact LC-Trie.
+ *
+ * Builds a LeafInfo for every rule, so that lookups don't have to walk the
+ * `parent` chain of the rule they end at: they read one LeafInfo, and only
+ * read more candidates if the rule itself doesn't match. Results are the
+ * same.
+ *
+ * @param trie Pointer to the compact LC-Trie.
+ * @param[out] max_chain Where to store the number of rules in the longest
+ *      `parent` chain (what a lookup could check before). NULL to ignore.
+ * @param[out] max_candidates Where to store the number of candidates in the
+ *      longest list. NULL to ignore.
+ *
+ * @return 0 on success, or -1 if memory ran out (the trie is unchanged).
+ */
+int precompute_leaves(CompactTrie *trie, uint32_t *max_chain,
+                      uint32_t *max_candidates);
+
+/** Free the memory allocated for a compact LC-Trie, including its rules.
+ *  If it was mapped from an image, the image is unmapped instead.
+ *
+ * @param trie Pointer to the compact LC-Trie.
+ */
+void free_compact_trie(CompactTrie *trie);
+
+/** Count the total number of nodes in a given compact LC-Trie.
+ *
+ * @param trie Pointer to the compact LC-Trie.
+ *
+ * @return The total number of nodes in the compact LC-Trie.
+ */
+uint32_t count_nodes_compact_trie(const CompactTrie *trie);
+
+/** Look up an IP address in a compact LC-Trie. Same as lookup_ip().
+ *
+ * @param ip_addr The IP address to look up.
+ * @param trie Pointer to the compact LC-Trie.
+ * @param[out] access_count Number of node accesses during the lookup. Will be
+ *      overwritten, not added to. Pass NULL to ignore.
+ *
+ * @return The outgoing interface associated with the longest matching prefix,
+ *      or 0 if no rules match.
+ */
+uint32_t lookup_ip_compact(ip_addr_t ip_addr, const CompactTrie *trie,
+                           int *access_count);
+
+/** Look up several IP addresses in a compact LC-Trie at once. Same as
+ *  lookup_ip_batch().
+ *
+ * The trie is walked with the widest kernel the CPU supports (see
+ * CompactKernel).
+ */
+void lookup_ip_compact_batch(const ip_addr_t *addrs, uint32_t *out, size_t n,
+                             const CompactTrie *trie, int *access_counts);
+
+/** Ways of walking a compact LC-Trie with several addresses at once.
+ *
+ * The SIMD kernels keep one address in each lane of a vector, and load the
+ * next node of every lane with a single gather instruction. Lanes that reach
+ * a leaf are masked off until all of them have, and leaves are then resolved
+ * one by one as in the scalar kernel.
+ */
+typedef enum CompactKernel {
+    COMPACT_KERNEL_AUTO,   ///< The widest one the CPU supports
+    COMPACT_KERNEL_SCALAR, ///< LOOKUP_BATCH_LANES lanes, with prefetches
+    COMPACT_KERNEL_AVX2,   ///< 8 lanes per AVX2 vector
+    COMPACT_KERNEL_AVX512, ///< 16 lanes per AVX-512 vector
+} CompactKernel;
+
+/** Find out which kernel would walk a compact LC-Trie if asked for one.
+ *
+ * @param kernel The kernel asked for.
+ *
+ * @return The kernel itself if the CPU (and the compiler) support it. The
+ *      widest supported one for COMPACT_KERNEL_AUTO. COMPACT_KERNEL_SCALAR
+ *      otherwise.
+ */
+CompactKernel resolve_compact_kernel(CompactKernel kernel);
+
+/** Get the name of a compact LC-Trie kernel, for messages.
+ *
+ * @param kernel The kernel.
+ *
+ * @return Its name, e.g. "avx2".
+ */
+const char *compact_kernel_name(CompactKernel kernel);
+
+/** Same as lookup_ip_compact_batch(), walking the trie with a given kernel.
+ *
+ * @param kernel The kernel to use. Falls back as resolve_compact_kernel()
+ *      does if it isn't supported. Results are the same with any kernel.
+ */
+void lookup_ip_compact_batch_with(const ip_addr_t *addrs, uint32_t *out,
+                                  size_t n, const CompactTrie *trie,
+                                  int *access_counts, CompactKernel kernel);
+
 // Not going to add a 'compress_trie' function since the trie is born
 // compressed
 
 // I needed to add them here in order to check my functions in proobs_main.c
 // Rule* parseFibFile(const char* filename, size_t* count);
 
+int compare_rules(const void *a, const void *b);
 Rule *sort_rules(Rule *rules, size_t num_rules);
+void sort_rules_in_place(Rule *rules, size_t num_rules);
+void sort_rules_parallel(Rule *rules, size_t num_rules, int num_threads);
 uint8_t compute_branch(const Rule *group, size_t group_size, uint8_t pre_skip);
 
 uint8_t compute_skip(const Rule *group, size_t group_size, uint8_t pre_skip);
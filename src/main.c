@@ -1,7 +1,25 @@
 #include "lc_trie.h"
+#include "engine.h"
+#include "next_hop.h"
+#include "trie_image.h"
 #include "io.h"
+#include "snapshot.h"
+#include "latency.h"
+#include "perf_counters.h"
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <getopt.h> // For option parsing
+#include <pthread.h> // For the -j lookup threads
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h> // For -r: FIB changes...
+#include <sys/signalfd.h> // ...SIGHUP...
+#include <sys/eventfd.h>  // ...and stopping the reload thread
 #include <time.h> // For time measurements
 
 // Macro for debug printing
@@ -14,202 +32,981 @@
 // ==== Constants ====
 #define OUT_PREFIX ".out"
 #define OUT_PREFIX_LEN 4
+#define LOOKUP_BATCH_SIZE 4096 // Addresses read (and looked up, in batch mode) at once
+#define MAX_JOBS 64 // Most lookup threads allowed with -j
+
+// For constants in USAGE
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+// Each lookup thread (and the main one) is a reader of the table snapshot
+_Static_assert(MAX_JOBS + 1 <= MAX_SNAPSHOT_READERS, "Too many lookup threads");
+
+#define USAGE "Usage: %s [OPTIONS] FIB InputPacketFile\n" \
+    "\n" \
+    "OPTIONS\n" \
+    "    -b, --batch     Look up addresses in batches, without timing each\n" \
+    "                    packet. Per-packet times are the batch's average\n" \
+    "    -c, --compact   Same as --engine compact\n" \
+    "    -d, --dir-24-8  Same as --engine dir-24-8\n" \
+    "    -e, --engine NAME\n" \
+    "                    Look up addresses in the structure NAME builds (see\n" \
+    "                    ENGINES). " DEFAULT_ENGINE " by default\n" \
+    "    -H, --histogram FILE\n" \
+    "                    Write the histogram of packet processing times to\n" \
+    "                    FILE\n" \
+    "    -j, --jobs N    Build the table and look up addresses in N threads.\n" \
+    "                    Results are still written in input order\n" \
+    "    -l, --leaf-info Same as --engine leaf-info\n" \
+    "    -p, --perf      Count cycles, instructions, cache, TLB and branch\n" \
+    "                    misses while building the table and looking up\n" \
+    "                    addresses\n" \
+    "    -q, --quiet     Don't print a line per packet to the standard output\n" \
+    "    -r, --reload    Build the table again when the FIB file changes, or\n" \
+    "                    on SIGHUP, without stopping lookups\n" \
+    "    -S, --stats     Print the shape of the table: nodes by branch, skip\n" \
+    "                    and depth, and parent chains of the leaves\n" \
+    "    -s, --save-image FILE\n" \
+    "                    Write the table to FILE as an image, which is mapped\n" \
+    "                    instead of built when given as the FIB. Only with\n" \
+    "                    leaf-info\n" \
+    "    -w, --wide-root[=BITS]\n" \
+    "                    Make the root of the trie read BITS bits (1 to " \
+    TO_STRING(MAX_ROOT_BRANCH) "),\n" \
+    "                    or " TO_STRING(MIN_AUTO_ROOT_BRANCH) " to " \
+    TO_STRING(MAX_AUTO_ROOT_BRANCH) " depending on the size of the FIB\n" \
+    "    -h, --help      Show this message\n"
+
+// ==== Data Structures ====
+
+/// What lookups are made on: a table built by one of the engines
+typedef struct LookupTable {
+    const LookupEngine *engine; ///< What built the table, and looks up in it
+    void *data;                 ///< The table itself
+} LookupTable;
+
+/// How read_table() builds a LookupTable
+typedef struct TableOptions {
+    const LookupEngine *engine; ///< Which engine builds the table
+    EngineOptions build;        ///< How the engine builds it
+} TableOptions;
+
+/// A block of input addresses, looked up by one thread and printed later
+typedef struct LookupSlice {
+    ip_addr_t addrs[LOOKUP_BATCH_SIZE]; ///< The addresses to look up
+    int count;                          ///< Number of addresses in `addrs`
+    uint32_t ifaces[LOOKUP_BATCH_SIZE]; ///< Output interface for each address
+    int accesses[LOOKUP_BATCH_SIZE];    ///< Node accesses for each address
+    /// Nanoseconds each lookup took. Only [0] is used in batch mode, for the
+    /// whole slice
+    uint64_t times[LOOKUP_BATCH_SIZE];
+} LookupSlice;
+
+/// State shared by the lookup threads of run_parallel_lookups()
+typedef struct LookupPool {
+    Snapshot *tables;         ///< Where the table to look up in is published
+    bool batch;               ///< Whether to use batches instead of timing
+    bool perf;                ///< Whether to count hardware events
+    int jobs;                 ///< Number of lookup threads
+    /// Two rounds of `jobs` slices: while the threads look up the addresses
+    /// in one, the main thread prints the other and reads the next input
+    LookupSlice *rounds[2];
+    pthread_barrier_t barrier; ///< Where every round starts (and ends)
+    pthread_mutex_t start_lock; ///< Held until every thread is started
+    /// Whether the threads should stop instead of looking up a round. It's
+    /// set for round i before the barrier where it starts, and can't be
+    /// a single flag: some threads may still be reading it for round i-1
+    bool stop[2];
+} LookupPool;
+
+/// A lookup thread, which takes the same slice of every round
+typedef struct LookupWorker {
+    LookupPool *pool;
+    int id;           ///< Index of this thread's slice in each round
+    pthread_t thread;
+    LatencyHistogram latency; ///< Times of this thread's lookups
+    PerfCounts perf;          ///< Hardware events of this thread's lookups
+} LookupWorker;
+
+/// Background thread that builds a new table when the FIB changes
+typedef struct Reloader {
+    Snapshot *tables;     ///< Where new tables are published
+    TableOptions options; ///< How to build the new tables
+    const char *fib_path; ///< Path to the FIB file, mapped on each reload
+    const char *fib_name; ///< Name of the FIB file within its directory
+    int inotify_fd;       ///< Watches the FIB file's directory
+    int signal_fd;        ///< Receives SIGHUP
+    int stop_fd;          ///< Written to by stop_reloader()
+    pthread_t thread;
+} Reloader;
+
+// ==== Function Prototypes ====
+
+/** Print the usage message, with the list of engines
+ *
+ * @param out Where to print it
+ * @param program Name the program was called with
+ */
+void print_usage(FILE *out, const char *program);
+
+/** Print counts of hardware events to the summary
+ *
+ * @param label What was counted
+ * @param counts The counts
+ * @param divisor What each count is divided by, e.g. the number of packets to
+ *      print counts per packet
+ */
+void print_counts(const char *label, const PerfCounts *counts, int divisor);
 
-/** Read the FIB file and create a trie
+/** Read the FIB file and create the table lookups will be made on
  *
- * @return A pointer to the root of the trie, or NULL on failure
+ * If the FIB file is an image (see save_image), it's mapped as the table
+ * instead, by the chosen engine if it can, or else by one that can. The
+ * engine's statistics, and the table's size, are printed to the standard
+ * error.
+ *
+ * @param[out] table Pointer to the table to fill in
+ * @param options How to build the table
+ * @param fib_path Path to the FIB file, or NULL for the one given to
+ *      initializeIO() (only from the main thread)
+ *
+ * @return OK on success, TOO_MANY_NEXT_HOPS if the FIB has more distinct
+ *      interfaces than the engine's tables can have, or an error code from
+ *      the I/O library
+ *
+ * @warning The caller is responsible for freeing the memory using
+ *      free_table().
+ */
+int read_table(LookupTable *table, const TableOptions *options,
+        const char *fib_path);
+
+/** Free the memory allocated by read_table()
  *
- * @warning The FIB file is read using the IO library, which is assumed to be
- *      initialized.
- * @warning The caller is responsible for freeing the memory using free_trie().
+ * @param table Pointer to the table to free
  */
-TrieNode *read_trie();
+void free_table(LookupTable *table);
 
-/** Read the FIB file and return a heap-allocated array of rules
+/** Process the whole input, a block of addresses at a time
  *
- * @param[out] rule_count Pointer where the number of rules will be stored
+ * The table is acquired again for every block, so that new ones published by
+ * a Reloader are used as soon as possible. Each block is looked up (and timed,
+ * a packet at a time or as a single batch) before its results are logged, so
+ * that hardware events are only counted for the lookups.
  *
- * @return A pointer to the (unsorted) array of rules, or NULL on failure
+ * @param tables Where the table to look up in is published
+ * @param batch Whether to use lookup batches instead of timing each packet
+ * @param[out] latency Histogram where the time spent is recorded
+ * @param[out] perf Where the hardware events of the lookups are ADDED, or NULL
+ *      not to count them
+ * @param[out] accumAccessCount Pointer where the node access count will be
+ *      ADDED
+ * @param[out] processed Pointer where the number of addresses will be ADDED
  *
- * @warning The FIB file is read using the IO library, which is assumed to be
- *      initialized.
+ * @return REACHED_EOF after the whole input, an error code from the I/O
+ *      library if it's malformed, or -1 if a lookup failed
  */
-Rule *read_rules(int *rule_count);
+int run_lookups(
+    Snapshot *tables, bool batch,
+    LatencyHistogram *latency, PerfCounts *perf,
+    int *accumAccessCount, int *processed
+);
 
-/** Look up an IP address in the trie, measure, and log the result
+/** Process the whole input in several threads, logging results in order
  *
- * @param ip_address The IP address to look up
- * @param root The root of the trie to look up in
- * @param[out] accumSearchTime Pointer where the time spent will be ADDED
+ * The input is read in rounds of one slice per thread. Each thread looks up
+ * its slice of a round (timing each packet, or the whole slice in batch mode)
+ * while the main thread prints the previous round and reads the next one, so
+ * the output is the same as a single-threaded run's.
+ *
+ * @param tables Where the table to look up in is published. Each thread
+ *      acquires it again for every slice, like run_lookups()
+ * @param batch Whether to use lookup batches instead of timing each packet
+ * @param jobs Number of lookup threads, from 1 to MAX_JOBS
+ * @param[out] latency Histogram where the time spent is recorded. Each thread
+ *      records its lookups in a histogram of its own, added to it at the end
+ * @param[out] perf Where the hardware events of the lookups are ADDED, or NULL
+ *      not to count them. Each thread counts its own, like the times
  * @param[out] accumAccessCount Pointer where the node access count will be
  *      ADDED
+ * @param[out] processed Pointer where the number of addresses will be ADDED
  *
- * @return 0 on success, -1 on failure
+ * @return REACHED_EOF after the whole input, an error code from the I/O
+ *      library if it's malformed, or -1 if the threads couldn't be started
  */
-int profiled_lookup(
-    ip_addr_t ip_address, TrieNode *root,
-    double *accumSearchTime, int *accumAccessCount
+int run_parallel_lookups(
+    Snapshot *tables, bool batch, int jobs,
+    LatencyHistogram *latency, PerfCounts *perf,
+    int *accumAccessCount, int *processed
 );
 
+/** Start watching the FIB file, to publish a new table whenever it changes
+ *
+ * The FIB is read again (with read_table()) when a file with its name is
+ * written or moved into its directory, or when the process gets SIGHUP. The
+ * new table is published in `tables`, and the old one is freed once no
+ * lookup can be using it. If the new FIB can't be read, the old table stays.
+ *
+ * @param[out] reloader Pointer to the reloader to start
+ * @param tables Where the current table is published
+ * @param fib_filename Path to the FIB file, as given to initializeIO()
+ * @param options How to build the new tables
+ *
+ * @return 0 on success, or -1 on failure
+ *
+ * @warning It must be called before starting any other thread, so that none
+ *      of them gets SIGHUP (which would kill the process).
+ */
+int start_reloader(Reloader *reloader, Snapshot *tables,
+        const char *fib_filename, const TableOptions *options);
+
+/** Stop a reloader, waiting for a reload in progress to end
+ *
+ * @param reloader Pointer to the reloader to stop
+ */
+void stop_reloader(Reloader *reloader);
+
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s FIB InputPacketFile\n", argv[0]);
+    bool batch = false;     // Whether to skip per-packet timing and use batches
+    const LookupEngine *engine = find_engine(DEFAULT_ENGINE); // Builds the table
+    bool quiet = false;     // Whether to keep per-packet lines out of stdout
+    bool reload = false;    // Whether to build the table again on FIB changes
+    int jobs = 0;           // Number of lookup threads, 0 to use none
+    int root_branch = 0;    // Branch to force on the trie's root, 0 for none
+    const char *image = NULL; // Where to save the table as an image, if any
+    const char *histogram = NULL; // Where to write the lookup times, if anywhere
+    bool perf = false;      // Whether to count hardware events
+    bool stats = false;     // Whether to print the shape of the table
+
+    static const struct option long_options[] = {
+        {"batch",   no_argument, NULL, 'b'},
+        {"compact", no_argument, NULL, 'c'},
+        {"dir-24-8", no_argument, NULL, 'd'},
+        {"engine",  required_argument, NULL, 'e'},
+        {"histogram", required_argument, NULL, 'H'},
+        {"jobs",    required_argument, NULL, 'j'},
+        {"leaf-info", no_argument, NULL, 'l'},
+        {"perf",    no_argument, NULL, 'p'},
+        {"quiet",   no_argument, NULL, 'q'},
+        {"reload",  no_argument, NULL, 'r'},
+        {"save-image", required_argument, NULL, 's'},
+        {"stats",   no_argument, NULL, 'S'},
+        {"wide-root", optional_argument, NULL, 'w'},
+        {"help",  no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "bcde:H:j:lpqrSs:w::h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            batch = true;
+            break;
+        case 'c':
+            engine = find_engine("compact");
+            break;
+        case 'd':
+            engine = find_engine("dir-24-8");
+            break;
+        case 'e':
+            engine = find_engine(optarg);
+            if (engine == NULL) {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                print_usage(stderr, argv[0]);
+                return 1;
+            }
+            break;
+        case 'H':
+            histogram = optarg;
+            break;
+        case 'j': {
+            char *end;
+            long value = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || value < 1 || value > MAX_JOBS) {
+                fprintf(stderr, "Invalid number of jobs: %s (1 to %d)\n",
+                        optarg, MAX_JOBS);
+                return 1;
+            }
+            jobs = value;
+            break;
+        }
+        case 'l':
+            engine = find_engine("leaf-info");
+            break;
+        case 'p':
+            perf = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        case 'r':
+            reload = true;
+            break;
+        case 'S':
+            stats = true;
+            break;
+        case 's':
+            image = optarg;
+            break;
+        case 'w': {
+            if (optarg == NULL) {
+                root_branch = ROOT_BRANCH_AUTO;
+                break;
+            }
+            char *end;
+            long value = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || value < 1
+                    || value > MAX_ROOT_BRANCH) {
+                fprintf(stderr, "Invalid root branch: %s (1 to %d)\n",
+                        optarg, MAX_ROOT_BRANCH);
+                return 1;
+            }
+            root_branch = value;
+            break;
+        }
+        case 'h':
+            print_usage(stdout, argv[0]);
+            return 0;
+        default:
+            print_usage(stderr, argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        print_usage(stderr, argv[0]);
         return 1;
     }
 
-    int status;     // Used at various points for return status checking
-    TrieNode *root; // Root of the trie we'll use through the program
+    int status;         // Used at various points for return status checking
+    LookupTable *table; // The table we'll use through the program
+    Snapshot tables;    // Where `table` is published for lookups
+    Reloader reloader;  // Replaces the table on FIB changes, with -r
 
-    char *fib_filename = argv[1];
-    char *input_filename = argv[2];
+    char *fib_filename = argv[optind];
+    char *input_filename = argv[optind + 1];
 
     // Initialize the I/O library
     if ( (status=initializeIO(fib_filename, input_filename)) != OK ) {
         printIOExplanationError(status);
         return 1;
     }
+    setOutputMirroring(!quiet);
     DEBUG_PRINT("I/O init done\n");
 
     DEBUG_PRINT("Reading FIB start\n");
-    // Attempt to create the trie from the FIB file
-    root = read_trie();
-    if (!root) {
+    // Attempt to create the table from the FIB file
+    table = malloc(sizeof(LookupTable));
+    if (table == NULL) {
         printIOExplanationError(PARSE_ERROR);
         return 1;
     }
+    TableOptions table_options = {
+        .engine = engine,
+        .build = {
+            .num_threads = jobs,
+            .root_branch = root_branch,
+        },
+    };
+    // Build threads started by the engine are counted too
+    PerfCounters build_counters;
+    PerfCounts build_counts = {0};
+    if (perf && perf_counters_open(&build_counters, true) != 0) {
+        fprintf(stderr, "Couldn't open any hardware event counter (the CPU "
+                "may not expose them, or see perf_event_paranoid)\n");
+        perf = false;
+    }
+    if (perf)
+        perf_counters_start(&build_counters);
+    status = read_table(table, &table_options, NULL);
+    if (perf) {
+        perf_counters_stop(&build_counters);
+        perf_counters_read(&build_counters, &build_counts);
+        perf_counters_close(&build_counters);
+    }
+    if (status != OK) {
+        printIOExplanationError(status);
+        return 1;
+    }
     DEBUG_PRINT("FIB read done\n");
 
-    // Accumulators for search time and memory accesses
-    double total_search_time = 0;  // Total time spent in lookups
-    int total_access_count = 0;    // Total number of 'table accesses'
-    int i = 0;                     // Total number of addresses processed
+    if (stats) {
+        if (table->engine->print_report != NULL)
+            table->engine->print_report(table->data, stderr);
+        else
+            fprintf(stderr, "The %s engine has no report of its shape\n",
+                    table->engine->name);
+    }
 
-    DEBUG_PRINT("Ready to process Input\n");
-    // Process the input packet file
-    ip_addr_t addr;
-    for (i=0; (status=readInputPacketFileLine(&addr)) != REACHED_EOF; i++) {
-        DEBUG_PRINT("Processing input line %d\n", i);
-        if (status != OK) {
-            printIOExplanationError(status); // Could be BAD_INPUT_FILE
+    if (image != NULL) {
+        if (table->engine->save_image == NULL) {
+            fprintf(stderr, "The %s engine can't save images, but %s can\n",
+                    table->engine->name, find_image_engine(engine)->name);
             return 1;
         }
-        if (profiled_lookup(addr, root,
-                &total_search_time, &total_access_count) != 0) {
-            fprintf(stderr, "Error during lookup\n");
+        if (table->engine->save_image(table->data, image) != 0) {
+            fprintf(stderr, "Couldn't write the image to %s\n", image);
             return 1;
         }
+        fprintf(stderr, "Saved the table to %s\n", image);
+    }
+
+    snapshot_init(&tables, table);
+    if (reload && start_reloader(&reloader, &tables, fib_filename,
+                &table_options) != 0) {
+        fprintf(stderr, "Couldn't watch the FIB file for changes\n");
+        return 1;
+    }
+
+    // Accumulators for search time and memory accesses
+    static LatencyHistogram latency; // Time spent in each lookup
+    PerfCounts lookup_counts = {0};  // Hardware events of the lookups
+    int total_access_count = 0;    // Total number of 'table accesses'
+    int i = 0;                     // Total number of addresses processed
+
+    DEBUG_PRINT("Ready to process Input\n");
+    // Process the input packet file, a block of addresses at a time
+    status = jobs > 0 ?
+        run_parallel_lookups(&tables, batch, jobs, &latency,
+                perf ? &lookup_counts : NULL, &total_access_count, &i) :
+        run_lookups(&tables, batch, &latency,
+                perf ? &lookup_counts : NULL, &total_access_count, &i);
+    if (status == -1) {
+        fprintf(stderr, "Error during lookup\n");
+        return 1;
+    }
+    if (status != REACHED_EOF) {
+        printIOExplanationError(status); // Could be BAD_INPUT_FILE
+        return 1;
     }
     DEBUG_PRINT("Input processing done\n");
+    if (reload)
+        stop_reloader(&reloader);
+    table = snapshot_acquire(&tables); // The last one published
 
     DEBUG_PRINT("Summary start\n");
     // Print the summary information
-    int node_count = count_nodes_trie(root);
+    int node_count = table->engine->count_nodes(table->data);
     double avg_access_count = (double)total_access_count / i;
-    double avg_search_time = total_search_time / i;
+    double avg_search_time = latency_mean(&latency);
     printSummary(node_count, i, avg_access_count, avg_search_time);
+    printLatencySummary(latency_percentile(&latency, 50),
+            latency_percentile(&latency, 90), latency_percentile(&latency, 99),
+            latency_percentile(&latency, 99.9), latency.max_ns);
+    if (perf) {
+        print_counts("Table build hardware events", &build_counts, 1);
+        print_counts("Lookup hardware events per packet", &lookup_counts, i);
+    }
+    printMemoryTimeUsage();
+    if (histogram != NULL && latency_dump(&latency, histogram) != 0)
+        fprintf(stderr, "Couldn't write the histogram to %s\n", histogram);
     DEBUG_PRINT("Summary done\n");
 
     // Clean up
     DEBUG_PRINT("Clean up start\n");
     freeIO();
-    // Free the rules because it isn't done anywhere else
-    free_trie_rules(root);
-    free_trie(root);
+    free_table(table);
+    free(table);
 
     DEBUG_PRINT("Clean up done\n");
 
     return 0;
 }
 
-TrieNode *read_trie() {
-    DEBUG_PRINT("Reading trie\n");
-    int rule_count = 0;
-    Rule *rules = read_rules(&rule_count);
+void print_usage(FILE *out, const char *program) {
+    fprintf(out, USAGE, program);
+    fprintf(out, "\nENGINES\n");
+    for (int i = 0; LOOKUP_ENGINES[i] != NULL; i++) {
+        fprintf(out, "    %-16s%s\n", LOOKUP_ENGINES[i]->name,
+                LOOKUP_ENGINES[i]->description);
+        if (LOOKUP_ENGINES[i]->max_next_hops != 0)
+            fprintf(out, "    %-16sAt most %u distinct next hops\n", "",
+                    LOOKUP_ENGINES[i]->max_next_hops);
+    }
+}
 
-    Rule *sorted = sort_rules(rules, rule_count);
-    free(rules);
+void print_counts(const char *label, const PerfCounts *counts, int divisor) {
+    const char *names[PERF_EVENTS];
+    double values[PERF_EVENTS];
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        names[i] = perf_event_name(i);
+        values[i] = counts->counted[i] && divisor > 0 ?
+            (double)counts->values[i] / divisor : -1;
+    }
+    printEventCounts(label, names, values, PERF_EVENTS);
+}
 
-    TrieNode *root = create_trie(sorted, rule_count);
-    DEBUG_PRINT("  Create trie done, root at %p\n", root);
-    // Since create_trie doesn't create a copy of the rules yet
-    // free(sorted);
-    // DEBUG_PRINT("Free rules done\n");
+/** Check whether rules go to more distinct interfaces than an engine's tables
+ *  can have
+ *
+ * @param rules The rules
+ * @param rule_count The number of rules
+ * @param max_next_hops Most distinct interfaces the engine takes
+ *
+ * @return true if there are more, false if not (or memory ran out counting
+ *      them, which building would run into anyway)
+ */
+static bool too_many_next_hops(const Rule *rules, int rule_count,
+        uint32_t max_next_hops) {
+    NextHopTable hops;
+    bool too_many = false;
+    if (next_hop_table_init(&hops) == 0) {
+        for (int i = 0; i < rule_count && !too_many; i++) {
+            // Interface 0 is already there, as NO_NEXT_HOP
+            too_many = next_hop_intern(&hops, rules[i].out_iface) < 0
+                || hops.num_hops - 1 > max_next_hops;
+        }
+    }
+    next_hop_table_free(&hops);
+    return too_many;
+}
+
+int read_table(LookupTable *table, const TableOptions *options,
+        const char *fib_path) {
+    DEBUG_PRINT("Reading table\n");
+    const char *data; // The whole FIB file, mapped in memory
+    size_t data_size;
+    int status = fib_path ? mapRoutingTableFile(fib_path, &data, &data_size)
+        : mapRoutingTable(&data, &data_size);
+    if (status != OK)
+        return status;
+
+    bool mapped = is_trie_image(data, data_size);
+    if (mapped) {
+        // The table is used in place, and keeps the mapping
+        table->engine = find_image_engine(options->engine);
+        table->data = table->engine->load_image(data, data_size);
+        DEBUG_PRINT("  Image loaded, table at %p\n", table->data);
+        if (table->data == NULL) {
+            unmapRoutingTable(data, data_size);
+            return BAD_ROUTING_TABLE;
+        }
+    } else {
+        int rule_count = 0, line = 0;
+        Rule *rules = read_rules(data, data_size, &rule_count, &status,
+                &line);
+        unmapRoutingTable(data, data_size);
+        if (rules == NULL) {
+            if (status == BAD_ROUTING_TABLE)
+                fprintf(stderr, "Line %d of the FIB is malformed\n", line);
+            return status;
+        }
+        if (options->engine->max_next_hops != 0 && too_many_next_hops(rules,
+                    rule_count, options->engine->max_next_hops)) {
+            fprintf(stderr, "The %s engine takes at most %u distinct next "
+                    "hops, and the FIB has more\n", options->engine->name,
+                    options->engine->max_next_hops);
+            free(rules);
+            return TOO_MANY_NEXT_HOPS;
+        }
 
-    return root;
+        table->engine = options->engine;
+        table->data = table->engine->build(rules, rule_count, &options->build);
+        free(rules);
+        DEBUG_PRINT("  Build done, table at %p\n", table->data);
+        if (table->data == NULL)
+            return PARSE_ERROR;
+    }
+
+    fprintf(stderr, "Engine: %s%s. Table size: %zu KB\n", table->engine->name,
+            mapped ? " (mapped image)" : "",
+            table->engine->memory_usage(table->data) / 1024);
+    table->engine->print_stats(table->data, stderr);
+    return OK;
+}
+
+void free_table(LookupTable *table) {
+    DEBUG_PRINT("Freeing table\n");
+    table->engine->destroy(table->data);
+}
+
+/** Look up an IP address with the table's engine
+ *
+ * @param table The table to look up in
+ * @param ip_address The IP address to look up
+ * @param[out] access_count Where to store the number of accesses
+ *
+ * @return The outgoing interface, or 0 if no rules match
+ */
+static inline uint32_t table_lookup(const LookupTable *table,
+        ip_addr_t ip_address, int *access_count) {
+    return table->engine->lookup(table->data, ip_address, access_count);
+}
+
+/** Look up several IP addresses at once with the table's engine, like
+ *  lookup_ip_batch()
+ */
+static inline void table_lookup_batch(const LookupTable *table,
+        const ip_addr_t *addrs, uint32_t *out, size_t n, int *access_counts) {
+    table->engine->lookup_batch(table->data, addrs, out, n, access_counts);
+}
+
+/** Look up the addresses of a slice, recording results and times in it
+ *
+ * @param slice The slice, with its addresses already read
+ * @param table The table to look up in
+ * @param batch Whether to look up (and time) the slice as a single batch
+ * @param[out] latency The calling thread's histogram, where the times are
+ *      also recorded
+ */
+static void lookup_slice(LookupSlice *slice, const LookupTable *table,
+        bool batch, LatencyHistogram *latency) {
+    struct timespec start, end;
+    if (batch) {
+        if (slice->count == 0)
+            return;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        table_lookup_batch(table, slice->addrs, slice->ifaces, slice->count,
+                slice->accesses);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        slice->times[0] = latency_elapsed_ns(&start, &end);
+        latency_record_batch(latency, slice->times[0], slice->count);
+        return;
+    }
+
+    for (int j = 0; j < slice->count; j++) {
+        slice->accesses[j] = 0;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        slice->ifaces[j] = table_lookup(table, slice->addrs[j],
+                &slice->accesses[j]);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        slice->times[j] = latency_elapsed_ns(&start, &end);
+        latency_record(latency, slice->times[j]);
+    }
 }
 
-Rule *read_rules(int *rule_count) {
-    DEBUG_PRINT("Reading rules\n");
-    // Min chars per line: 11
-    // Max chars per line: 24
+/** Log the results of a slice
+ *
+ * Its times were already recorded by the thread that looked it up.
+ *
+ * @param slice The slice, already looked up
+ * @param batch Whether the slice was looked up as a single batch
+ * @param[out] accumAccessCount Pointer where the node access count will be
+ *      ADDED
+ */
+static void print_slice(LookupSlice *slice, bool batch,
+        int *accumAccessCount) {
+    for (int j = 0; j < slice->count; j++) {
+        double searchingTime = batch ?
+            (double)slice->times[0] / slice->count : slice->times[j];
+        printOutputResult(slice->addrs[j], slice->ifaces[j], searchingTime,
+                slice->accesses[j]);
+        *accumAccessCount += slice->accesses[j];
+    }
+}
+
+int run_lookups(
+        Snapshot *tables, bool batch,
+        LatencyHistogram *latency, PerfCounts *perf,
+        int *accumAccessCount, int *processed
+    ) {
+    static LookupSlice slice;
     int status;
+    int reader = snapshot_register(tables);
+    if (reader < 0)
+        return -1;
+    PerfCounters counters;
+    if (perf != NULL && perf_counters_open(&counters, false) != 0)
+        perf = NULL;
+
+    while ((status=readInputPacketFileBlock(slice.addrs, LOOKUP_BATCH_SIZE,
+                    &slice.count)) == OK) {
+        DEBUG_PRINT("Processing input lines %d to %d\n",
+                *processed, *processed + slice.count - 1);
+        if (perf != NULL)
+            perf_counters_start(&counters);
+        lookup_slice(&slice, snapshot_acquire(tables), batch, latency);
+        if (perf != NULL)
+            perf_counters_stop(&counters);
+        snapshot_quiescent(tables, reader); // Done with the table
+
+        print_slice(&slice, batch, accumAccessCount);
+        *processed += slice.count;
+    }
+
+    if (perf != NULL) {
+        perf_counters_read(&counters, perf);
+        perf_counters_close(&counters);
+    }
+    snapshot_unregister(tables, reader);
+    return status;
+}
+
+/** Read the next round of input, a slice per thread
+ *
+ * @param slices The `jobs` slices of the round
+ * @param jobs Number of slices
+ *
+ * @return OK if there may be more input, or the status that stopped reading
+ *      (REACHED_EOF or an error). Slices are filled even if it's not OK
+ */
+static int read_round(LookupSlice *slices, int jobs) {
+    int status = OK;
+    for (int k = 0; k < jobs; k++) {
+        slices[k].count = 0;
+        if (status == OK)
+            status = readInputPacketFileBlock(slices[k].addrs,
+                    LOOKUP_BATCH_SIZE, &slices[k].count);
+    }
+    return status;
+}
 
-    // Temporarily using a basic dynamic array with exponential growth
-    size_t capacity = 2;
-    size_t size = 0;
-    Rule* rules = malloc(sizeof(Rule) * capacity);
-    DEBUG_PRINT("  Malloc rules done, capacity %zu\n", capacity);
+/// Body of each lookup thread. See run_parallel_lookups()
+static void *lookup_worker(void *arg) {
+    LookupWorker *worker = arg;
+    LookupPool *pool = worker->pool;
+    int reader = snapshot_register(pool->tables);
+    // Counters only count the thread that opens them
+    PerfCounters counters;
+    bool perf = pool->perf && perf_counters_open(&counters, false) == 0;
+
+    // Wait until the barrier is set up for the threads that could start
+    pthread_mutex_lock(&pool->start_lock);
+    pthread_mutex_unlock(&pool->start_lock);
+
+    for (int round = 0; ; round++) {
+        pthread_barrier_wait(&pool->barrier);
+        if (pool->stop[round % 2])
+            break;
+        if (perf)
+            perf_counters_start(&counters);
+        lookup_slice(&pool->rounds[round % 2][worker->id],
+                snapshot_acquire(pool->tables), pool->batch, &worker->latency);
+        if (perf)
+            perf_counters_stop(&counters);
+        snapshot_quiescent(pool->tables, reader); // Not while in the barrier
+    }
 
-    ip_addr_t addr;
-    int prefix_len;
-    int out_iface;
+    if (perf) {
+        perf_counters_read(&counters, &worker->perf);
+        perf_counters_close(&counters);
+    }
+    snapshot_unregister(pool->tables, reader);
+    return NULL;
+}
 
-    while ((status=readFIBLine(&addr, &prefix_len, &out_iface)) != REACHED_EOF){
-        if (status != OK) {
-            free(rules);
-            return NULL;
-        }
-        DEBUG_PRINT("  Read rule %zu: 0x%08X/%d %d\n", size, addr, prefix_len, out_iface);
+int run_parallel_lookups(
+        Snapshot *tables, bool batch, int jobs,
+        LatencyHistogram *latency, PerfCounts *perf,
+        int *accumAccessCount, int *processed
+    ) {
+    DEBUG_PRINT("Starting %d lookup threads\n", jobs);
+    LookupPool pool = {
+        .tables = tables, .batch = batch, .perf = perf != NULL, .jobs = jobs
+    };
+    pool.rounds[0] = malloc(2 * jobs * sizeof(LookupSlice));
+    LookupWorker *workers = malloc(jobs * sizeof(LookupWorker));
+    if (pool.rounds[0] == NULL || workers == NULL) {
+        free(pool.rounds[0]);
+        free(workers);
+        return -1;
+    }
+    pool.rounds[1] = pool.rounds[0] + jobs;
+
+    int status = read_round(pool.rounds[0], jobs);
+
+    pthread_mutex_init(&pool.start_lock, NULL);
+    pthread_mutex_lock(&pool.start_lock);
+    int started = 0;
+    for (; started < jobs; started++) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        memset(&workers[started].latency, 0, sizeof(LatencyHistogram));
+        memset(&workers[started].perf, 0, sizeof(PerfCounts));
+        if (pthread_create(&workers[started].thread, NULL, lookup_worker,
+                    &workers[started]) != 0)
+            break;
+    }
 
-        if (size == capacity) { // Next element would overflow
-            capacity *= 2;
-            DEBUG_PRINT("  Reallocating rules, new capacity %zu\n", capacity);
-            rules = realloc(rules, sizeof(Rule) * capacity);
+    // The main thread takes part in the barrier too, to hand out rounds. If
+    // not every thread started, those that did are stopped at round 0, and
+    // leave as they would after the last one
+    pthread_barrier_init(&pool.barrier, NULL, started + 1);
+    pool.stop[0] = started < jobs;
+    pthread_mutex_unlock(&pool.start_lock);
+
+    pthread_barrier_wait(&pool.barrier); // Round 0 starts
+    if (started < jobs) {
+        DEBUG_PRINT("Only %d of %d lookup threads started\n", started, jobs);
+        for (int k = 0; k < started; k++)
+            pthread_join(workers[k].thread, NULL);
+        pthread_barrier_destroy(&pool.barrier);
+        pthread_mutex_destroy(&pool.start_lock);
+        free(pool.rounds[0]);
+        free(workers);
+        return -1;
+    }
+    for (int round = 0; ; round++) {
+        // Read the next round while the threads look up this one
+        bool last = status != OK;
+        if (!last)
+            status = read_round(pool.rounds[(round + 1) % 2], jobs);
+        pool.stop[(round + 1) % 2] = last;
+
+        // This round is done, and the next one starts (unless it's the last)
+        pthread_barrier_wait(&pool.barrier);
+
+        LookupSlice *slices = pool.rounds[round % 2];
+        for (int k = 0; k < jobs; k++) {
+            print_slice(&slices[k], batch, accumAccessCount);
+            *processed += slices[k].count;
         }
+        if (last)
+            break;
+    }
+
+    // Each thread recorded the times (and events) of its own lookups
+    for (int k = 0; k < jobs; k++) {
+        pthread_join(workers[k].thread, NULL);
+        latency_merge(latency, &workers[k].latency);
+        if (perf != NULL)
+            perf_counts_merge(perf, &workers[k].perf);
+    }
+    pthread_barrier_destroy(&pool.barrier);
+    pthread_mutex_destroy(&pool.start_lock);
+    free(pool.rounds[0]);
+    free(workers);
+    DEBUG_PRINT("Lookup threads done\n");
 
-        rules[size].prefix = addr;
-        rules[size].prefix_len = prefix_len;
-        rules[size].out_iface = out_iface;
-        rules[size].parent = NULL;
+    return status;
+}
 
-        size++;
+/** Check whether inotify events include a change of the FIB file
+ *
+ * @param reloader The reloader whose inotify descriptor has events to read
+ *
+ * @return true if the FIB was written or replaced
+ */
+static bool fib_changed(Reloader *reloader) {
+    // Aligned as the events are, since they are read in place
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t size = read(reloader->inotify_fd, buffer, sizeof(buffer));
+    bool changed = false;
+
+    for (char *event = buffer; size > 0 && event < buffer + size; ) {
+        const struct inotify_event *info = (const struct inotify_event *)event;
+        if (info->len > 0 && strcmp(info->name, reloader->fib_name) == 0)
+            changed = true;
+        event += sizeof(struct inotify_event) + info->len;
     }
+    return changed;
+}
 
-    // Should we trim the array to the actual size, or leave some slack?
-    rules = realloc(rules, sizeof(Rule) * size);
-    *rule_count = size;
+/** Read the FIB again and publish the new table, freeing the old one
+ *
+ * @param reloader The reloader
+ */
+static void reload_table(Reloader *reloader) {
+    DEBUG_PRINT("Reloading the FIB\n");
+    LookupTable *table = malloc(sizeof(LookupTable));
+    // Mapped by path, as the file may have been replaced. The I/O library's
+    // FIB belongs to the main thread
+    int status = table ? read_table(table, &reloader->options,
+            reloader->fib_path) : PARSE_ERROR;
+    if (status != OK) {
+        // read_table() doesn't leave anything to free when it fails
+        fprintf(stderr, "Couldn't reload the FIB (error %d), "
+                "the old one is still used\n", status);
+        free(table);
+        return;
+    }
 
-    DEBUG_PRINT("--Done reading %d rules\n", *rule_count);
-    return rules;
+    LookupTable *old = snapshot_publish(reloader->tables, table);
+    snapshot_synchronize(reloader->tables); // Lookups are done with `old`
+    free_table(old);
+    free(old);
+    fprintf(stderr, "Reloaded the FIB\n");
 }
 
-int profiled_lookup(
-        ip_addr_t ip_address, TrieNode *root,
-        double *accumSearchTime, int *accumAccessCount
-    ) {
-    // Placeholder for the actual implementation
-    struct timespec initialTime, finalTime; // Performance measurement
-    uint32_t outInterface = 0; // Set by lookup_ip
-    int tableAccessCount = 0;  // Set by lookup_ip
+/// Body of the reload thread. See start_reloader()
+static void *reload_worker(void *arg) {
+    Reloader *reloader = arg;
+    struct pollfd fds[] = {
+        {.fd = reloader->inotify_fd, .events = POLLIN},
+        {.fd = reloader->signal_fd,  .events = POLLIN},
+        {.fd = reloader->stop_fd,    .events = POLLIN},
+    };
+
+    while (true) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[2].revents)
+            break;
 
-    // TODO: Pass tableAccessCount to lookup_ip (check #16)
-    // Timed IP lookup
-    clock_gettime(CLOCK_MONOTONIC_RAW, &initialTime);
-    outInterface = lookup_ip(ip_address, root, &tableAccessCount);
-    clock_gettime(CLOCK_MONOTONIC_RAW, &finalTime);
+        bool changed = false;
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            changed = read(reloader->signal_fd, &info, sizeof(info)) > 0;
+        }
+        if (fds[0].revents & POLLIN)
+            changed |= fib_changed(reloader);
+        if (changed)
+            reload_table(reloader);
+    }
 
-    double searchingTime; // Set by printOutputLine
+    DEBUG_PRINT("Reload thread done\n");
+    return NULL;
+}
 
-    // Print output and performance to stdout and output file
-    printOutputLine(
-        ip_address, outInterface, &initialTime, &finalTime,
-        &searchingTime, tableAccessCount
-    );
+int start_reloader(Reloader *reloader, Snapshot *tables,
+        const char *fib_filename, const TableOptions *options) {
+    DEBUG_PRINT("Starting reload thread for %s\n", fib_filename);
+    reloader->tables = tables;
+    reloader->options = *options;
+    reloader->fib_path = fib_filename;
+
+    // The directory is watched, not the file, to see it being replaced
+    static char directory[4096];
+    const char *slash = strrchr(fib_filename, '/');
+    if (slash == NULL) {
+        strcpy(directory, ".");
+        reloader->fib_name = fib_filename;
+    } else {
+        size_t length = slash - fib_filename;
+        if (length >= sizeof(directory))
+            return -1;
+        if (length == 0)
+            length = 1; // It's in the root, keep the slash
+        memcpy(directory, fib_filename, length);
+        directory[length] = '\0';
+        reloader->fib_name = slash + 1;
+    }
 
-    // Update the accumulators
-    *accumSearchTime += searchingTime;
-    *accumAccessCount += tableAccessCount;
+    // SIGHUP is only taken by the signalfd, so it has to be blocked here,
+    // before any other thread can inherit a mask where it isn't
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0)
+        return -1;
+
+    reloader->inotify_fd = inotify_init1(IN_CLOEXEC);
+    reloader->signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    reloader->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (reloader->inotify_fd < 0 || reloader->signal_fd < 0
+            || reloader->stop_fd < 0
+            || inotify_add_watch(reloader->inotify_fd, directory,
+                IN_CLOSE_WRITE | IN_MOVED_TO) < 0
+            || pthread_create(&reloader->thread, NULL, reload_worker,
+                reloader) != 0) {
+        close(reloader->inotify_fd);
+        close(reloader->signal_fd);
+        close(reloader->stop_fd);
+        return -1;
+    }
 
     return 0;
 }
+
+void stop_reloader(Reloader *reloader) {
+    DEBUG_PRINT("Stopping reload thread\n");
+    uint64_t one = 1;
+    if (write(reloader->stop_fd, &one, sizeof(one)) == sizeof(one))
+        pthread_join(reloader->thread, NULL);
+    close(reloader->inotify_fd);
+    close(reloader->signal_fd);
+    close(reloader->stop_fd);
+}
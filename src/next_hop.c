@@ -0,0 +1,107 @@
+#include "next_hop.h"
+#include <stdlib.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+#define INITIAL_NEXT_HOPS 16 // Room for this many next hops at first
+
+/// Slot of the hash table where the search for an interface starts.
+static inline uint32_t next_hop_slot(const NextHopTable *table,
+                                     uint32_t out_iface) {
+    // Fibonacci hashing: the top bits of the product are the best mixed
+    return (uint32_t)(out_iface * 2654435769u)
+        >> (32 - __builtin_ctz(table->num_slots));
+}
+
+/** Double the room for next hops, and the size of the hash table with it, so
+ *  that it's never more than half full.
+ *
+ *  @returns 0 on success, or -1 if memory ran out (the table still works)
+ */
+static int grow_next_hops(NextHopTable *table) {
+    uint32_t capacity = table->capacity * 2;
+    uint32_t num_slots = capacity * 2;
+    uint16_t *slots = calloc(num_slots, sizeof(uint16_t));
+    NextHop *hops = slots ? realloc(table->hops, capacity * sizeof(NextHop))
+                          : NULL;
+    if (hops == NULL) {
+        free(slots);
+        return -1;
+    }
+    table->hops = hops;
+    table->capacity = capacity;
+
+    free(table->slots);
+    table->slots = slots;
+    table->num_slots = num_slots;
+    for (uint32_t i = 1; i < table->num_hops; i++) {
+        uint32_t slot = next_hop_slot(table, table->hops[i].out_iface);
+        while (slots[slot] != 0)
+            slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = i;
+    }
+    DEBUG_PRINT("Next hop table %p grown to %u slots\n", table, num_slots);
+    return 0;
+}
+
+int next_hop_table_init(NextHopTable *table) {
+    table->hops = malloc(INITIAL_NEXT_HOPS * sizeof(NextHop));
+    table->slots = calloc(INITIAL_NEXT_HOPS * 2, sizeof(uint16_t));
+    if (table->hops == NULL || table->slots == NULL) {
+        next_hop_table_free(table);
+        return -1;
+    }
+    table->capacity = INITIAL_NEXT_HOPS;
+    table->num_slots = INITIAL_NEXT_HOPS * 2;
+
+    table->hops[NO_NEXT_HOP] = (NextHop){ .out_iface = 0 };
+    table->num_hops = 1;
+    return 0;
+}
+
+int32_t next_hop_intern(NextHopTable *table, uint32_t out_iface) {
+    if (out_iface == 0)
+        return NO_NEXT_HOP; // Never in the hash table, so 0 can mean empty
+
+    uint32_t slot = next_hop_slot(table, out_iface);
+    while (table->slots[slot] != 0) {
+        uint16_t index = table->slots[slot];
+        if (table->hops[index].out_iface == out_iface)
+            return index;
+        slot = (slot + 1) & (table->num_slots - 1);
+    }
+
+    // Not there yet: slot is where it goes, unless the table has to grow
+    if (table->num_hops > MAX_NEXT_HOPS) { // NO_NEXT_HOP is one of them
+        DEBUG_PRINT("Next hop table %p is full\n", table);
+        return -1;
+    }
+    if (table->num_hops == table->capacity) {
+        if (grow_next_hops(table) != 0)
+            return -1;
+        slot = next_hop_slot(table, out_iface);
+        while (table->slots[slot] != 0)
+            slot = (slot + 1) & (table->num_slots - 1);
+    }
+
+    uint32_t index = table->num_hops++;
+    table->hops[index] = (NextHop){ .out_iface = out_iface };
+    table->slots[slot] = index;
+    return index;
+}
+
+void next_hop_table_free(NextHopTable *table) {
+    free(table->hops);
+    free(table->slots);
+    table->hops = NULL;
+    table->slots = NULL;
+    table->num_hops = 0;
+    table->capacity = 0;
+    table->num_slots = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef NEXT_HOP_H
+#define NEXT_HOP_H
+
+#include <stdint.h> // For fixed-width integer types like uint32_t
+
+// ==== Constants ====
+#define NO_NEXT_HOP 0       // Index of the next hop of interface 0 (no route)
+/// Most distinct interfaces a table can have: every 16-bit index but
+/// NO_NEXT_HOP's
+#define MAX_NEXT_HOPS 65535
+
+// ==== Data Structures ====
+
+/** Where packets matching a rule are sent.
+ *
+ * Rules and leaves refer to it by its index in a NextHopTable, so it can
+ * grow to hold more than the interface without making them any bigger.
+ */
+typedef struct NextHop {
+    uint32_t out_iface; ///< Outgoing interface
+} NextHop;
+
+/** Deduplicated set of next hops, addressed by 16-bit indices.
+ *
+ * Each distinct interface is stored once, in the order they were first seen.
+ * Index NO_NEXT_HOP is always interface 0, which means there's no route.
+ * A small open-addressing hash table finds the index of an interface that's
+ * already there.
+ */
+typedef struct NextHopTable {
+    NextHop *hops;      ///< Every next hop, by index
+    uint32_t num_hops;  ///< Number of elements in `hops`
+    uint32_t capacity;  ///< Number of elements `hops` has room for
+    uint16_t *slots;    ///< Hash table of indices into `hops`, 0 if empty
+    uint32_t num_slots; ///< Number of elements in `slots`, a power of 2
+} NextHopTable;
+
+// ==== Function Prototypes ====
+
+/** Initialize a next hop table with only the NO_NEXT_HOP entry.
+ *
+ * @param table Pointer to the table to initialize.
+ *
+ * @return 0 on success, or -1 if memory ran out (the table is left empty, and
+ *      can still be freed).
+ */
+int next_hop_table_init(NextHopTable *table);
+
+/** Get the index of the next hop for an interface, adding it if it's new.
+ *
+ * @param table Pointer to the table.
+ * @param out_iface The outgoing interface.
+ *
+ * @return The index of the next hop, or -1 if it's new and there's no room
+ *      for it (MAX_NEXT_HOPS reached or memory ran out).
+ */
+int32_t next_hop_intern(NextHopTable *table, uint32_t out_iface);
+
+/** Get the outgoing interface of a next hop.
+ *
+ * @param table Pointer to the table.
+ * @param index Index of the next hop, which must be in the table.
+ *
+ * @return The outgoing interface.
+ */
+static inline uint32_t next_hop_iface(const NextHopTable *table,
+                                      uint16_t index) {
+    return table->hops[index].out_iface;
+}
+
+/** Free the memory allocated for a next hop table. It's left empty.
+ *
+ * @param table Pointer to the table.
+ */
+void next_hop_table_free(NextHopTable *table);
+
+#endif // NEXT_HOP_H
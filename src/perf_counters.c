@@ -0,0 +1,115 @@
+#include "perf_counters.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>      // For SYS_perf_event_open, which has no wrapper
+#include <linux/perf_event.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+// ==== Constants ====
+/// Config of a read miss of a cache, for PERF_TYPE_HW_CACHE
+#define CACHE_READ_MISS(cache) ((cache) \
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8) \
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+/// How each PerfEvent is asked for to perf_event_open()
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} EVENTS[PERF_EVENTS] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+        "instructions"},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+        CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D), "L1d misses"},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HW_CACHE,
+        CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL), "LLC misses"},
+    [PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+        CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB), "dTLB misses"},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,
+        "branch misses"},
+};
+
+const char *perf_event_name(PerfEvent event) {
+    return EVENTS[event].name;
+}
+
+int perf_counters_open(PerfCounters *counters, bool inherit) {
+    int opened = 0;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = EVENTS[i].type;
+        attr.config = EVENTS[i].config;
+        attr.disabled = 1;
+        attr.inherit = inherit;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // For scaling the count when the event wasn't always on a counter
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // Each event is on its own rather than in a group, so that the ones
+        // that fit on the counters are counted even if not all of them do
+        counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                PERF_FLAG_FD_CLOEXEC);
+        DEBUG_PRINT("Opened %s counter: %d\n", EVENTS[i].name,
+                counters->fds[i]);
+        if (counters->fds[i] >= 0)
+            opened++;
+    }
+    return opened > 0 ? 0 : -1;
+}
+
+void perf_counters_start(const PerfCounters *counters) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_counters_stop(const PerfCounters *counters) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+void perf_counters_read(const PerfCounters *counters, PerfCounts *counts) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        uint64_t data[3]; // Value, time enabled and time running
+        if (counters->fds[i] < 0
+                || read(counters->fds[i], data, sizeof(data)) != sizeof(data))
+            continue;
+        if (data[2] == 0 && data[1] != 0)
+            continue; // It never got a counter, so it's unknown, not 0
+        uint64_t value = data[2] == data[1] ? data[0] :
+            (unsigned __int128)data[0] * data[1] / data[2];
+        counts->values[i] += value;
+        counts->counted[i] = true;
+    }
+}
+
+void perf_counters_close(PerfCounters *counters) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+void perf_counts_merge(PerfCounts *into, const PerfCounts *from) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        into->values[i] += from->values[i];
+        into->counted[i] |= from->counted[i];
+    }
+}
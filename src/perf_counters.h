@@ -0,0 +1,96 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>  // For fixed-width integer types like uint64_t
+#include <stdbool.h> // For the bool type
+
+// ==== Data Structures ====
+
+/// Hardware events counted by PerfCounters, in the order they're reported
+typedef enum PerfEvent {
+    PERF_CYCLES,        ///< CPU cycles
+    PERF_INSTRUCTIONS,  ///< Instructions retired
+    PERF_L1D_MISSES,    ///< L1 data cache read misses
+    PERF_LLC_MISSES,    ///< Last level cache read misses
+    PERF_DTLB_MISSES,   ///< Data TLB read misses
+    PERF_BRANCH_MISSES, ///< Mispredicted branches
+    PERF_EVENTS,        ///< Number of events
+} PerfEvent;
+
+/** Counts of the hardware events, added up over one or more PerfCounters.
+ *
+ * A zero-initialized one has nothing counted.
+ */
+typedef struct PerfCounts {
+    uint64_t values[PERF_EVENTS]; ///< Count of each event
+    /// Whether each event was counted. Not every CPU (or virtual machine) has
+    /// all of them
+    bool counted[PERF_EVENTS];
+} PerfCounts;
+
+/** Hardware event counters of the calling thread, from perf_event_open(2).
+ *
+ * They only count in user space, so they can be opened by unprivileged users
+ * with the default kernel.perf_event_paranoid of 2. When there are more events
+ * than hardware counters, the kernel takes turns with them and their counts
+ * are scaled up to the whole time they were counting.
+ */
+typedef struct PerfCounters {
+    int fds[PERF_EVENTS]; ///< File descriptor of each event, -1 if not counted
+} PerfCounters;
+
+// ==== Function Prototypes ====
+
+/** Get the name of an event, as printed in the summary.
+ *
+ * @param event The event.
+ *
+ * @return Its name, e.g. "L1d misses".
+ */
+const char *perf_event_name(PerfEvent event);
+
+/** Open counters for the calling thread, stopped.
+ *
+ * Events the CPU doesn't have are left out.
+ *
+ * @param counters Pointer to the counters to open.
+ * @param inherit Whether to also count in threads created afterwards by the
+ *      calling thread (e.g. the builders of a table).
+ *
+ * @return 0 if any event can be counted, or -1 if none can.
+ */
+int perf_counters_open(PerfCounters *counters, bool inherit);
+
+/** Start (or resume) counting.
+ *
+ * @param counters Pointer to the open counters.
+ */
+void perf_counters_start(const PerfCounters *counters);
+
+/** Stop counting. The counts are kept until it's started again.
+ *
+ * @param counters Pointer to the open counters.
+ */
+void perf_counters_stop(const PerfCounters *counters);
+
+/** Add the counts so far to a PerfCounts.
+ *
+ * @param counters Pointer to the open counters.
+ * @param[out] counts Pointer to the counts to add them to.
+ */
+void perf_counters_read(const PerfCounters *counters, PerfCounts *counts);
+
+/** Close the counters.
+ *
+ * @param counters Pointer to the counters.
+ */
+void perf_counters_close(PerfCounters *counters);
+
+/** Add counts to others, e.g. those of each thread.
+ *
+ * @param into Pointer to the counts to add them to.
+ * @param from Pointer to the counts to add.
+ */
+void perf_counts_merge(PerfCounts *into, const PerfCounts *from);
+
+#endif // PERF_COUNTERS_H
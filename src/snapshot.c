@@ -0,0 +1,79 @@
+#include "snapshot.h"
+#include <time.h> // For nanosleep
+
+// Macro for debug printing
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+// How long snapshot_synchronize sleeps between checks of the readers
+#define SYNCHRONIZE_SLEEP_NS 50000
+
+void snapshot_init(Snapshot *snapshot, void *initial) {
+    atomic_init(&snapshot->current, initial);
+    atomic_init(&snapshot->epoch, 0);
+    atomic_init(&snapshot->num_readers, 0);
+    for (int i = 0; i < MAX_SNAPSHOT_READERS; i++)
+        atomic_init(&snapshot->readers[i].epoch, SNAPSHOT_OFFLINE);
+}
+
+int snapshot_register(Snapshot *snapshot) {
+    int reader = atomic_fetch_add(&snapshot->num_readers, 1);
+    if (reader >= MAX_SNAPSHOT_READERS) {
+        DEBUG_PRINT("Snapshot %p has no room for more readers\n", snapshot);
+        return -1;
+    }
+
+    // Sequentially consistent, like snapshot_quiescent: it must be visible to
+    // writers before this reader gets hold of anything
+    atomic_store(&snapshot->readers[reader].epoch,
+            atomic_load(&snapshot->epoch));
+    DEBUG_PRINT("Registered reader %d of snapshot %p\n", reader, snapshot);
+    return reader;
+}
+
+void snapshot_unregister(Snapshot *snapshot, int reader) {
+    if (reader < 0)
+        return;
+    atomic_store_explicit(&snapshot->readers[reader].epoch, SNAPSHOT_OFFLINE,
+            memory_order_release);
+}
+
+void *snapshot_acquire(Snapshot *snapshot) {
+    return atomic_load_explicit(&snapshot->current, memory_order_acquire);
+}
+
+void snapshot_quiescent(Snapshot *snapshot, int reader) {
+    // The objects this reader used are published by the time it stores this
+    // epoch, and the next object it acquires can't be older than the epoch
+    atomic_store(&snapshot->readers[reader].epoch,
+            atomic_load(&snapshot->epoch));
+}
+
+void *snapshot_publish(Snapshot *snapshot, void *next) {
+    void *old = atomic_exchange(&snapshot->current, next);
+    atomic_fetch_add(&snapshot->epoch, 1);
+    DEBUG_PRINT("Published %p in snapshot %p, replacing %p\n",
+            next, snapshot, old);
+    return old;
+}
+
+void snapshot_synchronize(Snapshot *snapshot) {
+    uint64_t epoch = atomic_load(&snapshot->epoch);
+    int num_readers = atomic_load(&snapshot->num_readers);
+    if (num_readers > MAX_SNAPSHOT_READERS)
+        num_readers = MAX_SNAPSHOT_READERS;
+
+    DEBUG_PRINT("Waiting for %d readers of snapshot %p to reach epoch %lu\n",
+            num_readers, snapshot, (unsigned long)epoch);
+    const struct timespec pause = {0, SYNCHRONIZE_SLEEP_NS};
+    for (int i = 0; i < num_readers; i++) {
+        // Offline readers have the highest epoch, so they're never waited for
+        while (atomic_load(&snapshot->readers[i].epoch) < epoch)
+            nanosleep(&pause, NULL);
+    }
+    DEBUG_PRINT("--Done waiting for readers\n");
+}
@@ -0,0 +1,94 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// ==== Constants ====
+#define MAX_SNAPSHOT_READERS 128 // Most readers a snapshot can ever have
+#define SNAPSHOT_OFFLINE UINT64_MAX // Epoch of readers that hold nothing
+
+// ==== Data Structures ====
+
+/** A thread reading from a Snapshot.
+ *
+ * Each one is in a cache line of its own, since it's written by its thread
+ * after every batch of work.
+ */
+typedef struct SnapshotReader {
+    _Alignas(64) _Atomic uint64_t epoch; ///< Epoch it was last quiescent in
+} SnapshotReader;
+
+/** Published pointer to a read-only object, replaced while it's being read.
+ *
+ * Readers get the current object with snapshot_acquire() and may keep using
+ * it until they call snapshot_quiescent(), which they should do regularly
+ * (e.g. after every block of work). A writer replaces the object with
+ * snapshot_publish(), and must call snapshot_synchronize() before freeing the
+ * old one: once it returns, every reader has been quiescent at least once
+ * since, so none can still be using it (quiescent-state-based reclamation).
+ */
+typedef struct Snapshot {
+    _Atomic(void *) current;     ///< The published object
+    _Atomic uint64_t epoch;      ///< Incremented on every publication
+    _Atomic int num_readers;     ///< Reader slots handed out so far
+    SnapshotReader readers[MAX_SNAPSHOT_READERS];
+} Snapshot;
+
+// ==== Function Prototypes ====
+
+/** Initialize a snapshot, with no readers.
+ *
+ * @param snapshot Pointer to the snapshot to initialize.
+ * @param initial The object to publish first.
+ */
+void snapshot_init(Snapshot *snapshot, void *initial);
+
+/** Register the calling thread as a reader of a snapshot.
+ *
+ * @param snapshot Pointer to the snapshot.
+ *
+ * @return The reader's ID, or -1 if there are already MAX_SNAPSHOT_READERS.
+ */
+int snapshot_register(Snapshot *snapshot);
+
+/** Stop being a reader of a snapshot. The ID can't be used again.
+ *
+ * @param snapshot Pointer to the snapshot.
+ * @param reader The reader's ID, from snapshot_register().
+ */
+void snapshot_unregister(Snapshot *snapshot, int reader);
+
+/** Get the object currently published in a snapshot.
+ *
+ * @param snapshot Pointer to the snapshot.
+ *
+ * @return The object. Registered readers may use it until they are next
+ *      quiescent; anyone else, only while no writer can replace it.
+ */
+void *snapshot_acquire(Snapshot *snapshot);
+
+/** Declare that a reader doesn't hold any object from a snapshot anymore.
+ *
+ * @param snapshot Pointer to the snapshot.
+ * @param reader The reader's ID, from snapshot_register().
+ */
+void snapshot_quiescent(Snapshot *snapshot, int reader);
+
+/** Publish a new object in a snapshot.
+ *
+ * @param snapshot Pointer to the snapshot.
+ * @param next The object to publish.
+ *
+ * @return The object it replaced, which must not be freed until
+ *      snapshot_synchronize() is called.
+ */
+void *snapshot_publish(Snapshot *snapshot, void *next);
+
+/** Wait until every reader has been quiescent since the last publication.
+ *
+ * @param snapshot Pointer to the snapshot.
+ */
+void snapshot_synchronize(Snapshot *snapshot);
+
+#endif // SNAPSHOT_H
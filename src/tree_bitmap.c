@@ -0,0 +1,544 @@
+#include "tree_bitmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+#define INITIAL_CAPACITY 64       // Room for this many nodes or results at first
+#define NO_INDEX UINT32_MAX       // Returned instead of an index on failure
+
+/// Number of bits set. __builtin_popcount() is a call into libgcc unless the
+/// target has the instruction (e.g. with -mpopcnt or -march=native)
+#ifdef __POPCNT__
+static inline uint32_t popcount(uint32_t x) {
+    return __builtin_popcount(x);
+}
+#else
+static inline uint32_t popcount(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+#endif
+
+/// Chunk of an address (or prefix) that indexes a node at the given depth.
+static inline uint32_t chunk_at(ip_addr_t addr, int depth) {
+    return (addr >> (32 - TREE_BITMAP_STRIDE * (depth + 1)))
+        & (TREE_BITMAP_CHILDREN - 1);
+}
+
+/// Bit of the internal bitmap for the first `len` bits of a chunk.
+static inline uint32_t internal_bit(uint32_t chunk, int len) {
+    return (1u << len) - 2 + (chunk >> (TREE_BITMAP_STRIDE - len));
+}
+
+/// Bits of the internal bitmap of every prefix that matches a chunk.
+static inline uint32_t matching_bits(uint32_t chunk) {
+    uint32_t bits = 0;
+    for (int len = 1; len <= TREE_BITMAP_STRIDE; len++)
+        bits |= 1u << internal_bit(chunk, len);
+    return bits;
+}
+
+/// Index of the child of a node for a chunk, which must have one.
+static inline uint32_t child_index(const TreeBitmapNode *node,
+                                   uint32_t chunk) {
+    return node->children + popcount(node->external & ((1u << chunk) - 1));
+}
+
+/// Index of the result of a node for an internal bit, which must be set.
+static inline uint32_t result_index(const TreeBitmapNode *node, uint32_t bit) {
+    return node->results + popcount(node->internal & ((1u << bit) - 1));
+}
+
+/// Whether a prefix has no bits set past its length, which is at most 32.
+static inline int valid_prefix(ip_addr_t prefix, uint8_t prefix_len) {
+    if (prefix_len > 32)
+        return 0;
+    return prefix_len == 32 || (prefix & (UINT32_MAX >> prefix_len)) == 0;
+}
+
+/** Add room for `count` contiguous nodes at the end of `nodes`, zeroed.
+ *
+ *  @returns the index of the first one, or NO_INDEX if memory ran out
+ */
+static uint32_t alloc_nodes(TreeBitmap *tree, uint32_t count) {
+    if (tree->num_nodes + count > tree->node_capacity) {
+        uint32_t capacity = tree->node_capacity ?
+            tree->node_capacity : INITIAL_CAPACITY;
+        while (capacity < tree->num_nodes + count)
+            capacity *= 2;
+        TreeBitmapNode *nodes = realloc(tree->nodes,
+                (size_t)capacity * sizeof(TreeBitmapNode));
+        if (nodes == NULL)
+            return NO_INDEX;
+        tree->nodes = nodes;
+        tree->node_capacity = capacity;
+    }
+    uint32_t first = tree->num_nodes;
+    memset(&tree->nodes[first], 0, count * sizeof(TreeBitmapNode));
+    tree->num_nodes += count;
+    return first;
+}
+
+/** Add room for `count` contiguous results at the end of `results`.
+ *
+ *  @returns the index of the first one, or NO_INDEX if memory ran out
+ */
+static uint32_t alloc_results(TreeBitmap *tree, uint32_t count) {
+    if (tree->num_results + count > tree->result_capacity) {
+        uint32_t capacity = tree->result_capacity ?
+            tree->result_capacity : INITIAL_CAPACITY;
+        while (capacity < tree->num_results + count)
+            capacity *= 2;
+        uint16_t *results = realloc(tree->results,
+                (size_t)capacity * sizeof(uint16_t));
+        if (results == NULL)
+            return NO_INDEX;
+        tree->results = results;
+        tree->result_capacity = capacity;
+    }
+    uint32_t first = tree->num_results;
+    tree->num_results += count;
+    return first;
+}
+
+/** Fill in a node from the rules under it, and then its children.
+ *
+ *  @param index Index of the node, already allocated
+ *  @param depth Depth of the node, 0 for the root
+ *  @param rules Sorted rules that share the first `depth` chunks, the only
+ *      ones that can be under the node. Those that end in its parents are
+ *      skipped
+ *  @param num_rules Number of rules
+ *
+ *  @returns 0 on success, or -1 if memory or next hops ran out
+ */
+static int build_node(TreeBitmap *tree, uint32_t index, int depth,
+                      const Rule *rules, size_t num_rules) {
+    int base = depth * TREE_BITMAP_STRIDE; // Bits consumed by the parents
+    uint16_t hops[2 * TREE_BITMAP_CHILDREN - 2]; // By internal bit
+    uint32_t internal = 0;
+    uint16_t external = 0;
+
+    for (size_t i = 0; i < num_rules; i++) {
+        const Rule *rule = &rules[i];
+        if (rule->prefix_len <= base || rule->out_iface == 0)
+            continue; // A parent's, or never an answer
+        uint32_t chunk = chunk_at(rule->prefix, depth);
+        if (rule->prefix_len > base + TREE_BITMAP_STRIDE) {
+            external |= 1u << chunk;
+            continue;
+        }
+        int32_t hop = next_hop_intern(&tree->next_hops, rule->out_iface);
+        if (hop < 0)
+            return -1;
+        uint32_t bit = internal_bit(chunk, rule->prefix_len - base);
+        internal |= 1u << bit;
+        hops[bit] = hop; // The last of several duplicates wins
+    }
+
+    uint32_t results = alloc_results(tree, popcount(internal));
+    uint32_t children = alloc_nodes(tree, popcount(external));
+    if (results == NO_INDEX || children == NO_INDEX)
+        return -1;
+    for (uint32_t bits = internal, r = results; bits != 0; bits &= bits - 1)
+        tree->results[r++] = hops[__builtin_ctz(bits)];
+    TreeBitmapNode *node = &tree->nodes[index];
+    node->internal = internal;
+    node->external = external;
+    node->children = children;
+    node->results = results;
+
+    // Sorted rules that share the first `depth` chunks are also sorted by the
+    // next one, so each child's rules are contiguous
+    uint32_t child = children;
+    for (size_t i = 0, end; i < num_rules; i = end) {
+        uint32_t chunk = chunk_at(rules[i].prefix, depth);
+        for (end = i + 1; end < num_rules; end++) {
+            if (chunk_at(rules[end].prefix, depth) != chunk)
+                break;
+        }
+        if ((external & (1u << chunk))
+                && build_node(tree, child++, depth + 1, &rules[i], end - i))
+            return -1;
+    }
+    return 0;
+}
+
+TreeBitmap *build_tree_bitmap(const Rule *rules, size_t num_rules) {
+    DEBUG_PRINT("Building Tree Bitmap with %zu rules at %p\n",
+            num_rules, rules);
+    if (rules == NULL)
+        return NULL;
+
+    TreeBitmap *tree = calloc(1, sizeof(TreeBitmap));
+    if (tree == NULL)
+        return NULL;
+    tree->default_hop = NO_NEXT_HOP;
+    if (next_hop_table_init(&tree->next_hops) != 0
+            || alloc_nodes(tree, 1) == NO_INDEX) { // The root
+        free_tree_bitmap(tree);
+        return NULL;
+    }
+
+    // No node holds the default route: it's what's left if none matches
+    for (size_t i = 0; i < num_rules && rules[i].prefix_len == 0; i++) {
+        if (rules[i].out_iface == 0)
+            continue;
+        int32_t hop = next_hop_intern(&tree->next_hops, rules[i].out_iface);
+        if (hop < 0) {
+            free_tree_bitmap(tree);
+            return NULL;
+        }
+        tree->default_hop = hop;
+    }
+
+    if (build_node(tree, 0, 0, rules, num_rules) != 0) {
+        DEBUG_PRINT("--Error: couldn't build the Tree Bitmap\n");
+        free_tree_bitmap(tree);
+        return NULL;
+    }
+
+    DEBUG_PRINT("--Done building Tree Bitmap, %u nodes, %u results\n",
+            tree->num_nodes, tree->num_results);
+    return tree;
+}
+
+void free_tree_bitmap(TreeBitmap *tree) {
+    DEBUG_PRINT("Freeing Tree Bitmap at %p\n", tree);
+    if (tree == NULL)
+        return;
+
+    free(tree->nodes);
+    free(tree->results);
+    next_hop_table_free(&tree->next_hops);
+    free(tree);
+}
+
+uint32_t count_nodes_tree_bitmap(const TreeBitmap *tree) {
+    return tree == NULL ? 0 : tree->num_nodes - tree->wasted_nodes;
+}
+
+// ==== Updates ====
+
+/** Copy a node, its results and (recursively) its children at the end of
+ *  another tree's arrays, which must have room for all of them.
+ */
+static void copy_node(const TreeBitmap *from, uint32_t from_index,
+                      TreeBitmap *to, uint32_t to_index) {
+    const TreeBitmapNode *node = &from->nodes[from_index];
+    TreeBitmapNode *copy = &to->nodes[to_index];
+    uint32_t num_results = popcount(node->internal);
+    uint32_t num_children = popcount(node->external);
+
+    *copy = *node;
+    copy->results = to->num_results;
+    memcpy(&to->results[copy->results], &from->results[node->results],
+            num_results * sizeof(uint16_t));
+    to->num_results += num_results;
+    copy->children = to->num_nodes;
+    to->num_nodes += num_children;
+    for (uint32_t i = 0; i < num_children; i++)
+        copy_node(from, node->children + i, to, copy->children + i);
+}
+
+/** Copy a tree into new arrays, without the elements no longer used, if
+ *  more than half of either array is. The tree is left as it was if memory
+ *  runs out.
+ */
+static void compact_tree_bitmap(TreeBitmap *tree) {
+    if (2 * tree->wasted_nodes <= tree->num_nodes
+            && 2 * tree->wasted_results <= tree->num_results)
+        return;
+
+    uint32_t num_nodes = tree->num_nodes - tree->wasted_nodes;
+    uint32_t num_results = tree->num_results - tree->wasted_results;
+    DEBUG_PRINT("Compacting Tree Bitmap %p to %u nodes and %u results\n",
+            tree, num_nodes, num_results);
+    TreeBitmap copy = {
+        .nodes = malloc(num_nodes * sizeof(TreeBitmapNode)),
+        .results = malloc((num_results ? num_results : 1) * sizeof(uint16_t)),
+        .num_nodes = 1, // The root
+    };
+    if (copy.nodes == NULL || copy.results == NULL) {
+        free(copy.nodes);
+        free(copy.results);
+        return;
+    }
+    copy_node(tree, 0, &copy, 0);
+
+    free(tree->nodes);
+    free(tree->results);
+    tree->nodes = copy.nodes;
+    tree->num_nodes = tree->node_capacity = num_nodes;
+    tree->results = copy.results;
+    tree->num_results = tree->result_capacity = num_results;
+    tree->wasted_nodes = tree->wasted_results = 0;
+}
+
+/** Give a node a child for a chunk it has none for, moving its children to
+ *  a new array with room for it.
+ *
+ *  @returns the index of the new (empty) child, or NO_INDEX if memory ran out
+ */
+static uint32_t add_child(TreeBitmap *tree, uint32_t index, uint32_t chunk) {
+    uint32_t count = popcount(tree->nodes[index].external);
+    uint32_t first = alloc_nodes(tree, count + 1);
+    if (first == NO_INDEX)
+        return NO_INDEX;
+
+    TreeBitmapNode *node = &tree->nodes[index]; // `nodes` may have moved
+    uint32_t rank = popcount(node->external & ((1u << chunk) - 1));
+    memcpy(&tree->nodes[first], &tree->nodes[node->children],
+            rank * sizeof(TreeBitmapNode));
+    memcpy(&tree->nodes[first + rank + 1], &tree->nodes[node->children + rank],
+            (count - rank) * sizeof(TreeBitmapNode));
+    tree->wasted_nodes += count;
+    node->children = first;
+    node->external |= 1u << chunk;
+    return first + rank;
+}
+
+/** Remove the (empty) child of a node for a chunk, in place.
+ */
+static void remove_child(TreeBitmap *tree, uint32_t index, uint32_t chunk) {
+    TreeBitmapNode *node = &tree->nodes[index];
+    uint32_t count = popcount(node->external);
+    uint32_t rank = popcount(node->external & ((1u << chunk) - 1));
+    memmove(&tree->nodes[node->children + rank],
+            &tree->nodes[node->children + rank + 1],
+            (count - rank - 1) * sizeof(TreeBitmapNode));
+    tree->wasted_nodes++;
+    node->external &= ~(1u << chunk);
+}
+
+/** Set the next hop of a node for an internal bit, moving its results to a
+ *  new array with room for it if the bit isn't set yet.
+ *
+ *  @returns 0 on success, or -1 if memory ran out
+ */
+static int set_result(TreeBitmap *tree, uint32_t index, uint32_t bit,
+                      uint16_t hop) {
+    TreeBitmapNode *node = &tree->nodes[index];
+    if (node->internal & (1u << bit)) {
+        tree->results[result_index(node, bit)] = hop;
+        return 0;
+    }
+
+    uint32_t count = popcount(node->internal);
+    uint32_t first = alloc_results(tree, count + 1);
+    if (first == NO_INDEX)
+        return -1;
+    uint32_t rank = popcount(node->internal & ((1u << bit) - 1));
+    memcpy(&tree->results[first], &tree->results[node->results],
+            rank * sizeof(uint16_t));
+    tree->results[first + rank] = hop;
+    memcpy(&tree->results[first + rank + 1],
+            &tree->results[node->results + rank],
+            (count - rank) * sizeof(uint16_t));
+    tree->wasted_results += count;
+    node->results = first;
+    node->internal |= 1u << bit;
+    return 0;
+}
+
+int tree_bitmap_insert_rule(TreeBitmap *tree, const Rule *rule) {
+    DEBUG_PRINT("Inserting 0x%08X/%hhu -> %u into Tree Bitmap %p\n",
+            rule->prefix, rule->prefix_len, rule->out_iface, tree);
+    if (!valid_prefix(rule->prefix, rule->prefix_len))
+        return -1;
+    if (rule->out_iface == 0) {
+        // Same as any rule it replaces not being there
+        tree_bitmap_delete_rule(tree, rule->prefix, rule->prefix_len);
+        return 0;
+    }
+
+    int32_t hop = next_hop_intern(&tree->next_hops, rule->out_iface);
+    if (hop < 0)
+        return -1;
+    if (rule->prefix_len == 0) {
+        tree->default_hop = hop;
+        return 0;
+    }
+
+    uint32_t index = 0;
+    int depth = 0;
+    for (; rule->prefix_len > TREE_BITMAP_STRIDE * (depth + 1); depth++) {
+        uint32_t chunk = chunk_at(rule->prefix, depth);
+        const TreeBitmapNode *node = &tree->nodes[index];
+        index = node->external & (1u << chunk) ?
+            child_index(node, chunk) : add_child(tree, index, chunk);
+        if (index == NO_INDEX)
+            return -1; // The nodes added on the way are empty, but valid
+    }
+    uint32_t bit = internal_bit(chunk_at(rule->prefix, depth),
+            rule->prefix_len - TREE_BITMAP_STRIDE * depth);
+    if (set_result(tree, index, bit, hop) != 0)
+        return -1;
+
+    compact_tree_bitmap(tree);
+    return 0;
+}
+
+int tree_bitmap_delete_rule(TreeBitmap *tree, ip_addr_t prefix,
+                            uint8_t prefix_len) {
+    DEBUG_PRINT("Deleting 0x%08X/%hhu from Tree Bitmap %p\n",
+            prefix, prefix_len, tree);
+    if (!valid_prefix(prefix, prefix_len))
+        return -1;
+    if (prefix_len == 0) {
+        if (tree->default_hop == NO_NEXT_HOP)
+            return -1;
+        tree->default_hop = NO_NEXT_HOP;
+        return 0;
+    }
+
+    uint32_t path[TREE_BITMAP_LEVELS]; // Node at each depth, root first
+    uint32_t index = 0;
+    int depth = 0;
+    for (; prefix_len > TREE_BITMAP_STRIDE * (depth + 1); depth++) {
+        uint32_t chunk = chunk_at(prefix, depth);
+        const TreeBitmapNode *node = &tree->nodes[index];
+        if (!(node->external & (1u << chunk)))
+            return -1;
+        path[depth] = index;
+        index = child_index(node, chunk);
+    }
+
+    TreeBitmapNode *node = &tree->nodes[index];
+    uint32_t bit = internal_bit(chunk_at(prefix, depth),
+            prefix_len - TREE_BITMAP_STRIDE * depth);
+    if (!(node->internal & (1u << bit)))
+        return -1;
+    uint32_t first = result_index(node, bit);
+    uint32_t last = node->results + popcount(node->internal) - 1;
+    memmove(&tree->results[first], &tree->results[first + 1],
+            (last - first) * sizeof(uint16_t));
+    tree->wasted_results++;
+    node->internal &= ~(1u << bit);
+
+    // Nodes left with nothing under them are removed, bottom up
+    while (depth > 0 && tree->nodes[index].internal == 0
+            && tree->nodes[index].external == 0) {
+        depth--;
+        index = path[depth];
+        remove_child(tree, index, chunk_at(prefix, depth));
+    }
+
+    compact_tree_bitmap(tree);
+    return 0;
+}
+
+// ==== Lookups ====
+
+uint32_t lookup_ip_tree_bitmap(ip_addr_t ip_addr, const TreeBitmap *tree,
+                               int *access_count) {
+    const TreeBitmapNode *node = tree->nodes;
+    const TreeBitmapNode *best = NULL; // Node of the longest match so far
+    uint32_t best_bit = 0;
+    int accesses = 0;
+
+    for (int depth = 0; ; depth++) {
+        accesses++;
+        uint32_t chunk = chunk_at(ip_addr, depth);
+        uint32_t matches = node->internal & matching_bits(chunk);
+        if (matches != 0) {
+            // Longer prefixes have higher bits
+            best = node;
+            best_bit = 31 - __builtin_clz(matches);
+        }
+        if (!(node->external & (1u << chunk)))
+            break;
+        node = &tree->nodes[child_index(node, chunk)];
+    }
+
+    uint16_t hop = tree->default_hop;
+    if (best != NULL) {
+        hop = tree->results[result_index(best, best_bit)];
+        accesses++;
+    }
+    if (access_count != NULL)
+        *access_count = accesses;
+
+    DEBUG_PRINT("Looked IP 0x%08X up in Tree Bitmap %p in %d accesses\n",
+            ip_addr, tree, accesses);
+    return next_hop_iface(&tree->next_hops, hop);
+}
+
+void lookup_ip_tree_bitmap_batch(const ip_addr_t *addrs, uint32_t *out,
+                                 size_t n, const TreeBitmap *tree,
+                                 int *access_counts) {
+    DEBUG_PRINT("Looking up %zu IPs in batch in Tree Bitmap %p\n", n, tree);
+
+    // Per-lane state, as in lookup_ip_batch(). `node` was prefetched the last
+    // time the lane was advanced, and is at depth `depth`
+    const TreeBitmapNode *node[LOOKUP_BATCH_LANES];
+    const TreeBitmapNode *best[LOOKUP_BATCH_LANES];
+    uint8_t best_bit[LOOKUP_BATCH_LANES];
+    uint8_t depth[LOOKUP_BATCH_LANES];
+    int accesses[LOOKUP_BATCH_LANES];
+    uint8_t active[LOOKUP_BATCH_LANES];
+
+    for (size_t base = 0; base < n; base += LOOKUP_BATCH_LANES) {
+        size_t lanes = n - base < LOOKUP_BATCH_LANES ?
+            n - base : LOOKUP_BATCH_LANES;
+        const ip_addr_t *lane_addrs = &addrs[base];
+
+        size_t num_active = lanes;
+        for (size_t l = 0; l < lanes; l++) {
+            node[l] = tree->nodes;
+            best[l] = NULL;
+            best_bit[l] = 0;
+            depth[l] = 0;
+            accesses[l] = 0;
+            active[l] = l;
+        }
+
+        // Advance every active lane one level per round, prefetching the
+        // child it reads in the next one, or the result it ends with
+        while (num_active > 0) {
+            size_t still_active = 0;
+            for (size_t i = 0; i < num_active; i++) {
+                uint8_t l = active[i];
+                const TreeBitmapNode *current = node[l];
+                uint32_t chunk = chunk_at(lane_addrs[l], depth[l]++);
+                uint32_t matches = current->internal & matching_bits(chunk);
+                accesses[l]++;
+                if (matches != 0) {
+                    best[l] = current;
+                    best_bit[l] = 31 - __builtin_clz(matches);
+                }
+
+                if (!(current->external & (1u << chunk))) {
+                    if (best[l] != NULL)
+                        __builtin_prefetch(&tree->results[
+                                result_index(best[l], best_bit[l])]);
+                    continue;
+                }
+                node[l] = &tree->nodes[child_index(current, chunk)];
+                __builtin_prefetch(node[l]);
+                active[still_active++] = l;
+            }
+            num_active = still_active;
+        }
+
+        for (size_t l = 0; l < lanes; l++) {
+            uint16_t hop = tree->default_hop;
+            if (best[l] != NULL) {
+                hop = tree->results[result_index(best[l], best_bit[l])];
+                accesses[l]++;
+            }
+            out[base + l] = next_hop_iface(&tree->next_hops, hop);
+            if (access_counts != NULL)
+                access_counts[base + l] = accesses[l];
+        }
+    }
+}
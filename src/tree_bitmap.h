@@ -0,0 +1,145 @@
+#ifndef TREE_BITMAP_H
+#define TREE_BITMAP_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For fixed-width integer types like uint32_t
+
+#include "lc_trie.h"  // For Rule, ip_addr_t and LOOKUP_BATCH_LANES
+#include "next_hop.h"
+
+// ==== Constants ====
+#define TREE_BITMAP_STRIDE 4   // Bits of the address each level consumes
+#define TREE_BITMAP_CHILDREN (1 << TREE_BITMAP_STRIDE) // Most children of a node
+#define TREE_BITMAP_LEVELS (32 / TREE_BITMAP_STRIDE)   // Most nodes in a path
+
+// ==== Data Structures ====
+
+/** Node of a Tree Bitmap.
+ *
+ * A node at depth d stands for a TREE_BITMAP_STRIDE-bit chunk of the address
+ * (bits d * TREE_BITMAP_STRIDE onwards), and holds the prefixes that end in
+ * it: those of lengths 1 to TREE_BITMAP_STRIDE after the bits of its parents.
+ *
+ * The internal bitmap has a bit for each of them: the prefix of length l
+ * (relative to the node) and value v is bit 2^l - 2 + v, so longer prefixes
+ * come after shorter ones. The external bitmap has a bit for each chunk that
+ * has a child, with longer prefixes under it.
+ *
+ * Children are contiguous, and so are results (next hops, in bit order), so
+ * a node only needs the index of the first of each: the one for a given bit
+ * is found by counting the bits set before it (a popcount).
+ */
+typedef struct TreeBitmapNode {
+    uint32_t internal; ///< Prefixes that end in this node
+    uint16_t external; ///< Chunks that have a child
+    uint32_t children; ///< Index in `nodes` of the first child
+    uint32_t results;  ///< Index in `results` of the first next hop
+} TreeBitmapNode;
+
+/** Tree Bitmap (Eatherton, Varghese and Dittia, 2004).
+ *
+ * A multibit trie of TREE_BITMAP_STRIDE-bit strides, where each node only
+ * takes the room of its bitmaps and two indices, however many children and
+ * prefixes it has. The root is the first node. The default route (/0) is kept
+ * apart, since no node holds prefixes of length 0.
+ *
+ * Rules can be inserted and deleted afterwards (see tree_bitmap_insert_rule()).
+ * A node that gains a child or a prefix gets a new array of them at the end
+ * of `nodes` or `results`, and the old one is left unused until the whole
+ * tree is compacted.
+ */
+typedef struct TreeBitmap {
+    TreeBitmapNode *nodes;   ///< Every node, root first
+    uint32_t num_nodes;      ///< Number of elements in `nodes`
+    uint32_t node_capacity;  ///< Number of elements `nodes` has room for
+    uint16_t *results;       ///< Next hops of the prefixes of every node
+    uint32_t num_results;    ///< Number of elements in `results`
+    uint32_t result_capacity;///< Number of elements `results` has room for
+    uint32_t wasted_nodes;   ///< Elements of `nodes` no longer used
+    uint32_t wasted_results; ///< Elements of `results` no longer used
+    uint16_t default_hop;    ///< Next hop of the default route, if any
+    NextHopTable next_hops;  ///< Next hops the results refer to
+} TreeBitmap;
+
+// ==== Function Prototypes ====
+
+/** Build a Tree Bitmap from a set of rules.
+ *
+ * @param rules Pointer to a SORTED array of rules (see sort_rules()). As in
+ *      an LC-Trie, the last of several rules with the same prefix wins, and
+ *      rules with interface 0 are ignored.
+ * @param num_rules Number of rules in the array.
+ *
+ * @return Pointer to the new Tree Bitmap, or NULL on failure (including
+ *      having more than MAX_NEXT_HOPS distinct interfaces).
+ */
+TreeBitmap *build_tree_bitmap(const Rule *rules, size_t num_rules);
+
+/** Free the memory allocated for a Tree Bitmap.
+ *
+ * @param tree Pointer to the Tree Bitmap.
+ */
+void free_tree_bitmap(TreeBitmap *tree);
+
+/** Count the nodes in use in a Tree Bitmap.
+ *
+ * @param tree Pointer to the Tree Bitmap.
+ *
+ * @return The number of nodes.
+ */
+uint32_t count_nodes_tree_bitmap(const TreeBitmap *tree);
+
+/** Insert a rule into a Tree Bitmap, without building it again.
+ *
+ * Missing nodes on the way to the rule are created. If a rule with the same
+ * prefix and length is already there, its outgoing interface is replaced.
+ * Inserting a rule with interface 0 deletes any rule with the same prefix and
+ * length instead, since it would never be an answer.
+ *
+ * Once more than half of `nodes` or `results` is no longer used, the whole
+ * tree is copied into new arrays without the gaps.
+ *
+ * @param tree Pointer to the Tree Bitmap.
+ * @param rule The rule to insert. It's copied, and its `parent` is ignored.
+ *
+ * @return 0 on success, -1 if the rule isn't a valid prefix (it's longer
+ *      than 32 bits, or has bits set past its length) or there's no room for
+ *      it (MAX_NEXT_HOPS reached or memory ran out).
+ */
+int tree_bitmap_insert_rule(TreeBitmap *tree, const Rule *rule);
+
+/** Delete a rule from a Tree Bitmap, without building it again.
+ *
+ * Nodes left without prefixes or children are removed.
+ *
+ * @param tree Pointer to the Tree Bitmap.
+ * @param prefix The prefix of the rule to delete.
+ * @param prefix_len The length of the prefix.
+ *
+ * @return 0 on success, -1 if there is no such rule or memory ran out.
+ */
+int tree_bitmap_delete_rule(TreeBitmap *tree, ip_addr_t prefix,
+                            uint8_t prefix_len);
+
+/** Look up an IP address in a Tree Bitmap. Same as lookup_ip().
+ *
+ * @param ip_addr The IP address to look up.
+ * @param tree Pointer to the Tree Bitmap.
+ * @param[out] access_count Number of nodes read during the lookup, plus one
+ *      if a next hop was read. Will be overwritten, not added to. Pass NULL
+ *      to ignore.
+ *
+ * @return The outgoing interface associated with the longest matching prefix,
+ *      or 0 if no rules match.
+ */
+uint32_t lookup_ip_tree_bitmap(ip_addr_t ip_addr, const TreeBitmap *tree,
+                               int *access_count);
+
+/** Look up several IP addresses in a Tree Bitmap at once. Same as
+ *  lookup_ip_batch(), advancing LOOKUP_BATCH_LANES lookups a level at a time.
+ */
+void lookup_ip_tree_bitmap_batch(const ip_addr_t *addrs, uint32_t *out,
+                                 size_t n, const TreeBitmap *tree,
+                                 int *access_counts);
+
+#endif // TREE_BITMAP_H
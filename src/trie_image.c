@@ -0,0 +1,228 @@
+#include "trie_image.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Macro for debug printing
+#ifdef DEBUG
+#define DEBUG_PRINT(fmt, ...) printf("[DEBUG] " fmt, ##__VA_ARGS__)
+#else
+#define DEBUG_PRINT(...) do {} while (0)
+#endif
+
+// The sections are written as they are in memory, so their layout is the
+// image's. Changing any of these means bumping TRIE_IMAGE_VERSION
+_Static_assert(sizeof(LeafInfo) == 12, "LeafInfo changed, bump the version");
+_Static_assert(sizeof(LeafCandidate) == 4, "LeafCandidate changed");
+_Static_assert(sizeof(NextHop) == 4, "NextHop changed");
+_Static_assert(sizeof(TrieImageHeader) == 88, "TrieImageHeader changed");
+
+/// Round an offset up to the next multiple of TRIE_IMAGE_ALIGN.
+static inline uint64_t align_offset(uint64_t offset) {
+    return (offset + TRIE_IMAGE_ALIGN - 1) & ~(uint64_t)(TRIE_IMAGE_ALIGN - 1);
+}
+
+/** Write a section of an image, after the padding that aligns it.
+ *
+ *  @param file the image file, `written` bytes into it
+ *  @param offset where the section starts, at or after `written`
+ *  @param data the section
+ *  @param bytes size of the section
+ *  @param[in,out] written bytes written to the file so far
+ *
+ *  @returns 0 on success, -1 on failure
+ */
+static int write_section(FILE *file, uint64_t offset, const void *data,
+                         size_t bytes, uint64_t *written) {
+    static const char padding[TRIE_IMAGE_ALIGN] = {0};
+    if (fwrite(padding, 1, offset - *written, file) != offset - *written)
+        return -1;
+    if (bytes > 0 && fwrite(data, 1, bytes, file) != bytes)
+        return -1;
+    *written = offset + bytes;
+    return 0;
+}
+
+bool is_trie_image(const void *data, size_t size) {
+    return size >= sizeof(TRIE_IMAGE_MAGIC)
+        && memcmp(data, TRIE_IMAGE_MAGIC, sizeof(TRIE_IMAGE_MAGIC)) == 0;
+}
+
+int save_trie_image(const CompactTrie *trie, uint32_t max_chain,
+                    uint32_t max_candidates, const char *path) {
+    DEBUG_PRINT("Saving compact trie at %p to %s\n", trie, path);
+    if (trie->leaves == NULL) {
+        DEBUG_PRINT("--Error: the trie has no precomputed leaves\n");
+        return -1;
+    }
+
+    TrieImageHeader header = {
+        .magic = TRIE_IMAGE_MAGIC,
+        .version = TRIE_IMAGE_VERSION,
+        .byte_order = TRIE_IMAGE_BYTE_ORDER,
+        .node_bits = COMPACT_NODE_BITS,
+        .num_nodes = trie->num_nodes,
+        .num_leaves = trie->num_rules,
+        .num_candidates = trie->num_candidates,
+        .num_hops = trie->next_hops.num_hops,
+        .max_chain = max_chain,
+        .max_candidates = max_candidates,
+    };
+    size_t node_bytes = (size_t)header.num_nodes * sizeof(CompactNode);
+    size_t leaf_bytes = (size_t)header.num_leaves * sizeof(LeafInfo);
+    size_t candidate_bytes =
+        (size_t)header.num_candidates * sizeof(LeafCandidate);
+    size_t hop_bytes = (size_t)header.num_hops * sizeof(NextHop);
+    header.nodes = align_offset(sizeof(TrieImageHeader));
+    header.leaves = align_offset(header.nodes + node_bytes);
+    header.candidates = align_offset(header.leaves + leaf_bytes);
+    header.hops = align_offset(header.candidates + candidate_bytes);
+    header.size = header.hops + hop_bytes;
+
+    // Written aside and renamed, so that the old image is never half replaced
+    size_t path_len = strlen(path);
+    char *temp_path = malloc(path_len + sizeof(".tmp"));
+    if (temp_path == NULL)
+        return -1;
+    memcpy(temp_path, path, path_len);
+    memcpy(temp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        DEBUG_PRINT("--Error: couldn't create %s\n", temp_path);
+        free(temp_path);
+        return -1;
+    }
+    uint64_t written = 0;
+    int status = write_section(file, 0, &header, sizeof(header), &written);
+    if (status == 0)
+        status = write_section(file, header.nodes, trie->nodes, node_bytes,
+                &written);
+    if (status == 0)
+        status = write_section(file, header.leaves, trie->leaves, leaf_bytes,
+                &written);
+    if (status == 0)
+        status = write_section(file, header.candidates, trie->candidates,
+                candidate_bytes, &written);
+    if (status == 0)
+        status = write_section(file, header.hops, trie->next_hops.hops,
+                hop_bytes, &written);
+    if (fclose(file) != 0)
+        status = -1;
+    if (status == 0 && rename(temp_path, path) != 0)
+        status = -1;
+
+    if (status != 0) {
+        DEBUG_PRINT("--Error: couldn't write %s\n", path);
+        remove(temp_path);
+    }
+    free(temp_path);
+    DEBUG_PRINT("--Done saving %lu bytes\n", (unsigned long)header.size);
+    return status;
+}
+
+/** Check that a section of an image lies within it, properly aligned.
+ *
+ *  @param header the image's header
+ *  @param offset where the section starts
+ *  @param count number of elements in the section
+ *  @param element_size size of each element
+ *
+ *  @returns true if it fits
+ */
+static bool section_fits(const TrieImageHeader *header, uint64_t offset,
+                         uint32_t count, size_t element_size) {
+    return offset % TRIE_IMAGE_ALIGN == 0
+        && offset >= sizeof(TrieImageHeader) && offset <= header->size
+        && (uint64_t)count * element_size <= header->size - offset;
+}
+
+CompactTrie *open_trie_image(const void *data, size_t size,
+                             uint32_t *max_chain, uint32_t *max_candidates) {
+    DEBUG_PRINT("Opening image of %zu bytes at %p\n", size, data);
+    const TrieImageHeader *header = data;
+    if (size < sizeof(TrieImageHeader) || !is_trie_image(data, size)
+            || (uintptr_t)data % TRIE_IMAGE_ALIGN != 0) {
+        DEBUG_PRINT("--Error: not an image\n");
+        return NULL;
+    }
+    if (header->version != TRIE_IMAGE_VERSION
+            || header->byte_order != TRIE_IMAGE_BYTE_ORDER
+            || header->node_bits != COMPACT_NODE_BITS) {
+        DEBUG_PRINT("--Error: image of version %u, byte order 0x%08X and "
+                "%u-bit nodes\n", header->version, header->byte_order,
+                header->node_bits);
+        return NULL;
+    }
+    if (header->size != size || header->num_nodes == 0
+            || header->num_hops == 0
+            || !section_fits(header, header->nodes, header->num_nodes,
+                sizeof(CompactNode))
+            || !section_fits(header, header->leaves, header->num_leaves,
+                sizeof(LeafInfo))
+            || !section_fits(header, header->candidates,
+                header->num_candidates, sizeof(LeafCandidate))
+            || !section_fits(header, header->hops, header->num_hops,
+                sizeof(NextHop))) {
+        DEBUG_PRINT("--Error: image sections out of bounds\n");
+        return NULL;
+    }
+
+    CompactTrie *trie = malloc(sizeof(CompactTrie));
+    if (trie == NULL)
+        return NULL;
+    const char *base = data;
+    *trie = (CompactTrie){
+        .nodes = (CompactNode *)(base + header->nodes),
+        .num_nodes = header->num_nodes,
+        .rules = NULL,
+        .num_rules = header->num_leaves,
+        .next_hops = { // Read-only: no hash table to add more
+            .hops = (NextHop *)(base + header->hops),
+            .num_hops = header->num_hops,
+        },
+        .leaves = (LeafInfo *)(base + header->leaves),
+        .candidates = (LeafCandidate *)(base + header->candidates),
+        .num_candidates = header->num_candidates,
+        .image = data,
+        .image_size = size,
+    };
+    if (max_chain)
+        *max_chain = header->max_chain;
+    if (max_candidates)
+        *max_candidates = header->max_candidates;
+
+    // Lookups jump all over it, so reading ahead would be wasted
+    madvise((void *)data, size, MADV_RANDOM);
+
+    DEBUG_PRINT("--Done opening image of %u nodes\n", trie->num_nodes);
+    return trie;
+}
+
+CompactTrie *map_trie_image(const char *path, uint32_t *max_chain,
+                            uint32_t *max_candidates) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Shared, so that every process mapping the image uses the same pages
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file
+    if (data == MAP_FAILED)
+        return NULL;
+
+    CompactTrie *trie = open_trie_image(data, info.st_size, max_chain,
+            max_candidates);
+    if (trie == NULL)
+        munmap(data, info.st_size);
+    return trie;
+}
@@ -0,0 +1,107 @@
+#ifndef TRIE_IMAGE_H
+#define TRIE_IMAGE_H
+
+#include <stddef.h>  // For size_t
+#include <stdint.h>  // For fixed-width integer types like uint32_t
+#include <stdbool.h> // For the bool type
+
+#include "lc_trie.h" // For CompactTrie
+
+// ==== Constants ====
+#define TRIE_IMAGE_MAGIC "LCTRIMG"   // First bytes of an image, NUL included
+#define TRIE_IMAGE_VERSION 1         // Bumped whenever the layout changes
+#define TRIE_IMAGE_BYTE_ORDER 0x01020304 // Reads back the same on one host
+#define TRIE_IMAGE_ALIGN 64          // Alignment of each section
+
+// ==== Data Structures ====
+
+/** Header at the start of a compact trie image.
+ *
+ * An image is a compact trie with precomputed leaves (see precompute_leaves()),
+ * written as is: the header, followed by its nodes, leaves, candidates and
+ * next hops, each at a multiple of TRIE_IMAGE_ALIGN. Every reference between
+ * them is an index, so the file can be mapped anywhere and used in place,
+ * without parsing or allocating anything. The rules aren't needed by lookups,
+ * so they're left out.
+ *
+ * Integers are in the byte order of the host that wrote the image, and nodes
+ * in its COMPACT_NODE_BITS layout. An image from a host that differs in
+ * either is rejected rather than converted.
+ */
+typedef struct TrieImageHeader {
+    char magic[8];           ///< TRIE_IMAGE_MAGIC
+    uint32_t version;        ///< TRIE_IMAGE_VERSION
+    uint32_t byte_order;     ///< TRIE_IMAGE_BYTE_ORDER
+    uint32_t node_bits;      ///< COMPACT_NODE_BITS
+    uint32_t num_nodes;      ///< Number of nodes
+    uint32_t num_leaves;     ///< Number of LeafInfo (one per original rule)
+    uint32_t num_candidates; ///< Number of LeafCandidate
+    uint32_t num_hops;       ///< Number of NextHop
+    uint32_t max_chain;      ///< See precompute_leaves()
+    uint32_t max_candidates; ///< See precompute_leaves()
+    uint32_t reserved;       ///< Always 0
+    uint64_t nodes;          ///< Offset of the nodes from the start
+    uint64_t leaves;         ///< Offset of the leaves
+    uint64_t candidates;     ///< Offset of the candidates
+    uint64_t hops;           ///< Offset of the next hops
+    uint64_t size;           ///< Bytes in the whole image
+} TrieImageHeader;
+
+// ==== Function Prototypes ====
+
+/** Check whether some data starts like a compact trie image.
+ *
+ * @param data Pointer to the data.
+ * @param size Number of bytes of data.
+ *
+ * @return true if it begins with TRIE_IMAGE_MAGIC. The rest isn't checked.
+ */
+bool is_trie_image(const void *data, size_t size);
+
+/** Write a compact trie to an image file.
+ *
+ * The image is written to a temporary file next to `path`, which then
+ * replaces it, so processes that have the old one mapped keep using it.
+ *
+ * @param trie Pointer to the compact trie. It must have precomputed leaves.
+ * @param max_chain, max_candidates What precompute_leaves() returned, to be
+ *      read back by open_trie_image().
+ * @param path Name of the image file.
+ *
+ * @return 0 on success, or -1 if the trie has no precomputed leaves or the
+ *      file couldn't be written (`path` is then left as it was).
+ */
+int save_trie_image(const CompactTrie *trie, uint32_t max_chain,
+                    uint32_t max_candidates, const char *path);
+
+/** Make a compact trie out of an image mapped in memory.
+ *
+ * The header and the bounds of each section are checked, but not the nodes
+ * themselves: an image is trusted as much as the program that wrote it.
+ *
+ * @param data Pointer to the image, mapped with mmap() (so it's page-aligned).
+ *      On success, the trie owns the mapping and free_compact_trie() unmaps
+ *      it. It must stay read-only, and the file must not be truncated while
+ *      it's mapped.
+ * @param size Number of bytes mapped.
+ * @param[out] max_chain, max_candidates Where to store what precompute_leaves()
+ *      returned when the image was written. NULL to ignore.
+ *
+ * @return Pointer to the new compact trie, or NULL if it isn't a valid image
+ *      (or memory ran out). The mapping is then left to the caller.
+ */
+CompactTrie *open_trie_image(const void *data, size_t size,
+                             uint32_t *max_chain, uint32_t *max_candidates);
+
+/** Map an image file and make a compact trie out of it. Same as mapping it
+ *  read-only and calling open_trie_image().
+ *
+ * @param path Name of the image file.
+ * @param[out] max_chain, max_candidates As in open_trie_image().
+ *
+ * @return Pointer to the new compact trie, or NULL on failure.
+ */
+CompactTrie *map_trie_image(const char *path, uint32_t *max_chain,
+                            uint32_t *max_candidates);
+
+#endif // TRIE_IMAGE_H
@@ -0,0 +1,497 @@
+#include "../src/engine.h"
+#include "../src/io.h"
+#include "gen_rules.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TSC
+#endif
+
+// Measures lookup throughput and latency with the addresses already in memory,
+// away from the I/O and the per-packet clock_gettime() of my_route_lookup.
+// Usage: bench [-e ENGINE] [-n LOOKUPS] [-b BATCH] FIB [InputPacketFile]
+// The results are written to the standard output as JSON, and as a table to
+// the standard error.
+
+// ==== Constants ====
+#define DEFAULT_LOOKUPS 4000000 // Lookups timed in each loop
+#define DEFAULT_BATCH 256       // Addresses per lookup_batch() call
+#define MAX_LOOKUPS 1000000000 // Largest -n
+#define MAX_BATCH (1 << 20)     // Largest -b
+#define DEFAULT_ADDRESSES (1 << 20) // Generated when no input file is given
+#define MAX_LATENCY_SAMPLES (1 << 20) // Lookups timed one by one, at most
+#define CALIBRATION_NS 50000000 // How long to compare the TSC with the clock
+
+// ==== Data Structures ====
+
+/// What was measured of an engine in one mode
+typedef struct BenchResult {
+    const char *engine; ///< Name of the engine
+    const char *mode;   ///< "single" or "batch"
+    size_t lookups;     ///< Lookups in the throughput loop
+    double ns_per_lookup;
+    double p50, p99, p999; ///< Latency percentiles, in ns per lookup
+    uint32_t checksum;  ///< Sum of the interfaces found, to compare runs
+} BenchResult;
+
+// ==== Timing ====
+
+static double ticks_per_ns = 1; // Set by calibrate_ticks()
+
+/// Current time in nanoseconds.
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Read the time stamp counter, or the clock where there's none.
+static inline uint64_t read_ticks() {
+#ifdef BENCH_TSC
+    unsigned int aux;
+    return __rdtscp(&aux); // Waits for the previous instructions
+#else
+    return now_ns();
+#endif
+}
+
+/// Find how many ticks of read_ticks() there are in a nanosecond.
+static void calibrate_ticks() {
+#ifdef BENCH_TSC
+    uint64_t start_ns = now_ns(), start_ticks = read_ticks();
+    uint64_t elapsed_ns;
+    while ((elapsed_ns = now_ns() - start_ns) < CALIBRATION_NS)
+        ;
+    ticks_per_ns = (double)(read_ticks() - start_ticks) / elapsed_ns;
+#endif
+}
+
+/// Smallest number of ticks between two read_ticks(), the cost of timing.
+static uint64_t timer_overhead() {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t start = read_ticks();
+        uint64_t ticks = read_ticks() - start;
+        if (ticks < best)
+            best = ticks;
+    }
+    return best;
+}
+
+// ==== Input ====
+
+/** Read a whole file into memory.
+ *
+ *  @param path Name of the file.
+ *  @param[out] size Where to store the number of bytes read.
+ *
+ *  @returns the contents, to be freed, or NULL if the file couldn't be read
+ */
+static char *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    char *data = length >= 0 ? malloc(length + 1) : NULL;
+    if (data == NULL || fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+/** Read every rule of a FIB file, as my_route_lookup does.
+ *
+ *  @param path Name of the FIB file.
+ *  @param[out] num_rules Where to store the number of rules.
+ *
+ *  @returns the rules, or NULL if the file couldn't be read or is malformed
+ */
+static Rule *read_fib(const char *path, size_t *num_rules) {
+    size_t size;
+    char *data = read_file(path, &size);
+    if (data == NULL)
+        return NULL;
+
+    int count = 0, status, line;
+    Rule *rules = read_rules(data, size, &count, &status, &line);
+    free(data);
+    if (rules == NULL && status == BAD_ROUTING_TABLE)
+        fprintf(stderr, "Line %d of %s is malformed\n", line, path);
+    *num_rules = count;
+    return rules;
+}
+
+/** Read every address of an input packet file, as my_route_lookup does.
+ *
+ *  @param path Name of the file, one dotted-quad address per line.
+ *  @param[out] num_addrs Where to store the number of addresses.
+ *
+ *  @returns the addresses, or NULL if the file couldn't be read or is
+ *      malformed
+ */
+static ip_addr_t *read_addresses(const char *path, size_t *num_addrs) {
+    size_t size;
+    char *data = read_file(path, &size);
+    if (data == NULL)
+        return NULL;
+
+    // There can't be more addresses than lines
+    ip_addr_t *addrs = malloc(countLines(data, size) * sizeof(ip_addr_t));
+    const char *cursor = data, *end = data + size;
+    int status = OK;
+    *num_addrs = 0;
+    while (addrs != NULL && (status = parseInputPacketLine(&cursor, end,
+                    &addrs[*num_addrs])) == OK)
+        (*num_addrs)++;
+    free(data);
+    if (status == BAD_INPUT_FILE) {
+        fprintf(stderr, "Address %zu of %s is malformed\n", *num_addrs + 1,
+                path);
+        free(addrs);
+        return NULL;
+    }
+    return addrs;
+}
+
+/** Parse the number given to an option.
+ *
+ *  @param arg The option's argument.
+ *  @param what What the number is, for the error message.
+ *  @param max Largest number allowed (the smallest is 1).
+ *  @param[out] value Where to store the number.
+ *
+ *  @returns 0 on success, or -1 (with a message) if it isn't a valid number
+ */
+static int parse_count(const char *arg, const char *what, long max,
+                       size_t *value) {
+    char *end;
+    long parsed = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || parsed < 1 || parsed > max) {
+        fprintf(stderr, "Invalid %s: %s (1 to %ld)\n", what, arg, max);
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+/** Generate addresses that fall within the rules: each one is a random rule's
+ *  prefix followed by random bits, so lookups go as deep as real traffic's.
+ *
+ *  @returns the addresses, or NULL if memory ran out
+ */
+static ip_addr_t *generate_addresses(const Rule *rules, size_t num_rules,
+                                     size_t num_addrs) {
+    ip_addr_t *addrs = malloc(num_addrs * sizeof(ip_addr_t));
+    if (addrs == NULL)
+        return NULL;
+    uint64_t state = seed_random(GEN_DEFAULT_SEED); // Same on every run
+    for (size_t i = 0; i < num_addrs; i++) {
+        const Rule *rule = &rules[next_random(&state) % num_rules];
+        uint32_t host_mask = rule->prefix_len == 0 ?
+            ~(uint32_t)0 : ~(~(uint32_t)0 << (32 - rule->prefix_len));
+        addrs[i] = rule->prefix | (next_random(&state) & host_mask);
+    }
+    return addrs;
+}
+
+// ==== Measurements ====
+
+/// Compare two tick counts, for qsort().
+static int compare_ticks(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/** Fill in the latency percentiles of a result from the samples taken.
+ *
+ *  @param samples Ticks each sample took, overhead included. Sorted in place.
+ *  @param num_samples Number of samples.
+ *  @param per_sample Lookups in each sample.
+ *  @param overhead Ticks of timing each sample, subtracted.
+ */
+static void set_percentiles(BenchResult *result, uint64_t *samples,
+                            size_t num_samples, size_t per_sample,
+                            uint64_t overhead) {
+    qsort(samples, num_samples, sizeof(uint64_t), compare_ticks);
+    double percentiles[] = {0.50, 0.99, 0.999};
+    double *fields[] = {&result->p50, &result->p99, &result->p999};
+    for (int i = 0; i < 3; i++) {
+        uint64_t ticks = samples[(size_t)(percentiles[i] * (num_samples - 1))];
+        ticks = ticks > overhead ? ticks - overhead : 0;
+        *fields[i] = ticks / ticks_per_ns / per_sample;
+    }
+}
+
+/** Time lookups one at a time: first a loop of `lookups` untimed ones,
+ *  and then each of a sample of them.
+ */
+static void bench_single(const LookupEngine *engine, const void *table,
+                         const ip_addr_t *addrs, size_t num_addrs,
+                         size_t lookups, uint64_t *samples,
+                         BenchResult *result) {
+    int accesses;
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < num_addrs; i++) // Warm up
+        checksum += engine->lookup(table, addrs[i], &accesses);
+
+    checksum = 0;
+    uint64_t start = read_ticks();
+    for (size_t i = 0, j = 0; i < lookups; i++) {
+        checksum += engine->lookup(table, addrs[j], &accesses);
+        if (++j == num_addrs)
+            j = 0;
+    }
+    uint64_t ticks = read_ticks() - start;
+
+    size_t num_samples = lookups < MAX_LATENCY_SAMPLES ?
+        lookups : MAX_LATENCY_SAMPLES;
+    volatile uint32_t sink = 0; // Keeps the timed lookups from being dropped
+    for (size_t i = 0, j = 0; i < num_samples; i++) {
+        uint64_t sample_start = read_ticks();
+        sink += engine->lookup(table, addrs[j], &accesses);
+        samples[i] = read_ticks() - sample_start;
+        if (++j == num_addrs)
+            j = 0;
+    }
+
+    result->mode = "single";
+    result->lookups = lookups;
+    result->ns_per_lookup = ticks / ticks_per_ns / lookups;
+    result->checksum = checksum;
+    set_percentiles(result, samples, num_samples, 1, timer_overhead());
+}
+
+/** Time lookups in batches of `batch` addresses, each batch timed on its own.
+ *  Latencies are per address, the batch's time divided by its size.
+ */
+static int bench_batch(const LookupEngine *engine, const void *table,
+                       const ip_addr_t *addrs, size_t num_addrs,
+                       size_t lookups, size_t batch, uint64_t *samples,
+                       BenchResult *result) {
+    uint32_t *out = malloc(batch * sizeof(uint32_t));
+    int *accesses = malloc(batch * sizeof(int));
+    if (out == NULL || accesses == NULL) {
+        free(out);
+        free(accesses);
+        return -1;
+    }
+
+    // Whole batches only, wrapping around the addresses
+    size_t batches = (lookups + batch - 1) / batch;
+    size_t usable = num_addrs - num_addrs % batch;
+    for (size_t i = 0; i < usable; i += batch) // Warm up
+        engine->lookup_batch(table, addrs + i, out, batch, accesses);
+
+    uint32_t checksum = 0;
+    size_t num_samples = 0;
+    uint64_t ticks = 0;
+    for (size_t i = 0, j = 0; i < batches; i++) {
+        uint64_t start = read_ticks();
+        engine->lookup_batch(table, addrs + j, out, batch, accesses);
+        uint64_t elapsed = read_ticks() - start;
+        ticks += elapsed;
+        if (num_samples < MAX_LATENCY_SAMPLES)
+            samples[num_samples++] = elapsed;
+        for (size_t k = 0; k < batch; k++)
+            checksum += out[k];
+        if ((j += batch) == usable)
+            j = 0;
+    }
+
+    result->mode = "batch";
+    result->lookups = batches * batch;
+    result->ns_per_lookup = ticks / ticks_per_ns / result->lookups;
+    result->checksum = checksum;
+    set_percentiles(result, samples, num_samples, batch, timer_overhead());
+    free(out);
+    free(accesses);
+    return 0;
+}
+
+// ==== Output ====
+
+/// Write a string as JSON, quoted and escaped.
+static void print_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/// Write every result as a JSON object.
+static void print_json(FILE *out, const char *fib, const char *input,
+                       size_t num_rules, size_t num_addrs, size_t batch,
+                       const BenchResult *results, size_t num_results) {
+    fprintf(out, "{\n  \"fib\": ");
+    print_json_string(out, fib);
+    fprintf(out, ",\n  \"input\": ");
+    if (input)
+        print_json_string(out, input);
+    else
+        fprintf(out, "null");
+    fprintf(out, ",\n  \"rules\": %zu,\n  \"addresses\": %zu,\n"
+            "  \"batch\": %zu,\n  \"ticks_per_ns\": %.4f,\n  \"results\": [",
+            num_rules, num_addrs, batch, ticks_per_ns);
+    for (size_t i = 0; i < num_results; i++) {
+        const BenchResult *r = &results[i];
+        fprintf(out, "%s\n    {\"engine\": ", i ? "," : "");
+        print_json_string(out, r->engine);
+        fprintf(out, ", \"mode\": \"%s\", \"lookups\": %zu, "
+                "\"mlookups_per_s\": %.3f, \"ns_per_lookup\": %.3f, "
+                "\"p50_ns\": %.3f, \"p99_ns\": %.3f, \"p999_ns\": %.3f, "
+                "\"checksum\": %u}", r->mode, r->lookups,
+                1e3 / r->ns_per_lookup, r->ns_per_lookup,
+                r->p50, r->p99, r->p999, r->checksum);
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+// ==== Main flow ====
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-e ENGINE] [-n LOOKUPS] [-b BATCH] FIB "
+            "[InputPacketFile]\n", program);
+    fprintf(stderr, "Without an input file, %d addresses within the FIB's "
+            "prefixes are generated.\nEvery engine is measured unless one is "
+            "given.\n", DEFAULT_ADDRESSES);
+}
+
+int main(int argc, char *argv[]) {
+    const LookupEngine *only = NULL;
+    size_t lookups = DEFAULT_LOOKUPS, batch = DEFAULT_BATCH;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:n:b:h")) != -1) {
+        switch (opt) {
+        case 'e':
+            only = find_engine(optarg);
+            if (only == NULL) {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            if (parse_count(optarg, "number of lookups", MAX_LOOKUPS,
+                        &lookups) != 0)
+                return 1;
+            break;
+        case 'b':
+            if (parse_count(optarg, "batch size", MAX_BATCH, &batch) != 0)
+                return 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || argc - optind > 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *fib = argv[optind];
+    const char *input = argc - optind == 2 ? argv[optind + 1] : NULL;
+
+    size_t num_rules;
+    Rule *rules = read_fib(fib, &num_rules);
+    if (rules == NULL || num_rules == 0) {
+        fprintf(stderr, "Couldn't read the rules from %s\n", fib);
+        return 1;
+    }
+    size_t num_addrs = DEFAULT_ADDRESSES;
+    ip_addr_t *addrs = input ? read_addresses(input, &num_addrs)
+        : generate_addresses(rules, num_rules, num_addrs);
+    if (addrs == NULL || num_addrs == 0) {
+        fprintf(stderr, "Couldn't read the addresses from %s\n", input);
+        return 1;
+    }
+    if (num_addrs < batch) { // Repeat them up to a whole batch
+        ip_addr_t *grown = realloc(addrs, batch * sizeof(ip_addr_t));
+        if (grown == NULL)
+            return 1;
+        addrs = grown;
+        for (size_t i = num_addrs; i < batch; i++)
+            addrs[i] = addrs[i % num_addrs];
+        num_addrs = batch;
+    }
+
+    calibrate_ticks();
+    fprintf(stderr, "%zu rules, %zu addresses, %.3f ticks/ns\n",
+            num_rules, num_addrs, ticks_per_ns);
+    fprintf(stderr, "%-12s %-7s %10s %10s %10s %10s %10s\n", "Engine", "Mode",
+            "Mlookup/s", "ns/lookup", "p50 (ns)", "p99 (ns)", "p99.9 (ns)");
+
+    size_t num_engines = 0;
+    while (LOOKUP_ENGINES[num_engines] != NULL)
+        num_engines++;
+    BenchResult *results = calloc(2 * num_engines, sizeof(BenchResult));
+    uint64_t *samples = malloc(MAX_LATENCY_SAMPLES * sizeof(uint64_t));
+    Rule *scratch = malloc(num_rules * sizeof(Rule));
+    if (results == NULL || samples == NULL || scratch == NULL)
+        return 1;
+
+    size_t num_results = 0;
+    int status = 0;
+    EngineOptions options = { .num_threads = 1, .root_branch = 0 };
+    for (size_t e = 0; e < num_engines; e++) {
+        const LookupEngine *engine = LOOKUP_ENGINES[e];
+        if (only != NULL && engine != only)
+            continue;
+        memcpy(scratch, rules, num_rules * sizeof(Rule)); // Builds reorder it
+        void *table = engine->build(scratch, num_rules, &options);
+        if (table == NULL) {
+            fprintf(stderr, "Couldn't build a table with %s\n", engine->name);
+            status = 1;
+            continue;
+        }
+
+        BenchResult *single = &results[num_results++];
+        BenchResult *batched = &results[num_results++];
+        single->engine = batched->engine = engine->name;
+        bench_single(engine, table, addrs, num_addrs, lookups, samples, single);
+        if (bench_batch(engine, table, addrs, num_addrs, lookups, batch,
+                    samples, batched) != 0)
+            status = 1;
+        engine->destroy(table);
+
+        for (BenchResult *r = single; r <= batched; r++) {
+            fprintf(stderr, "%-12s %-7s %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                    r->engine, r->mode, 1e3 / r->ns_per_lookup,
+                    r->ns_per_lookup, r->p50, r->p99, r->p999);
+        }
+    }
+
+    // Every engine looked up the same addresses in each mode, so they must
+    // have found the same interfaces as the first one
+    for (size_t i = 2; i < num_results; i++) {
+        const BenchResult *first = &results[i % 2];
+        if (results[i].checksum != first->checksum) {
+            fprintf(stderr, "Warning: %s found different interfaces than %s "
+                    "(%s)\n", results[i].engine, first->engine, first->mode);
+            status = 1;
+        }
+    }
+
+    print_json(stdout, fib, input, num_rules, num_addrs, batch,
+            results, num_results);
+    free(scratch);
+    free(samples);
+    free(results);
+    free(addrs);
+    free(rules);
+    return status;
+}
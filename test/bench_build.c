@@ -0,0 +1,116 @@
+#include "../src/lc_trie.h"
+#include "gen_rules.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times how long building an LC-Trie takes as the number of rules grows.
+// Usage: bench_build [RULES...] (100000, 500000 and 1000000 by default)
+
+// ==== Constants ====
+#define BENCH_RUNS 3         // Builds timed for each size. The best is kept
+
+// ==== Helper functions ====
+
+/** Generate the rules of a FIB like `gen_data fib -n num_rules` does, the same
+ *  on every run.
+ */
+static Rule *generate_fib(size_t num_rules) {
+    Prefix *generated = generate_rules(num_rules, GEN_DEFAULT_INTERFACES,
+            GEN_DEFAULT_DEPTH, GEN_DEFAULT_SEED);
+    Rule *rules = malloc(num_rules * sizeof(Rule));
+    if (generated == NULL || rules == NULL) {
+        free(generated);
+        free(rules);
+        return NULL;
+    }
+    for (size_t i = 0; i < num_rules; i++) {
+        rules[i] = (Rule){
+            .prefix = generated[i].prefix,
+            .prefix_len = generated[i].len,
+            .out_iface = generated[i].out_iface,
+        };
+    }
+    free(generated);
+    return rules;
+}
+
+/// Current time in seconds, for measuring intervals.
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Time building a trie from a given number of generated rules, and print a
+ *  line with the results.
+ *
+ *  @returns 0 on success, or -1 if memory ran out
+ */
+static int bench_size(size_t num_rules) {
+    Rule *rules = generate_fib(num_rules);
+    Rule *sorted = malloc(num_rules * sizeof(Rule));
+    if (rules == NULL || sorted == NULL) {
+        free(rules);
+        free(sorted);
+        return -1;
+    }
+
+    double best_sort = 1e9, best_build = 1e9;
+    uint32_t nodes = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        memcpy(sorted, rules, num_rules * sizeof(Rule));
+        double start = now();
+        sort_rules_in_place(sorted, num_rules);
+        double sort_time = now() - start;
+
+        start = now();
+        Trie *trie = build_trie(rules, num_rules); // Sorts its own copy
+        double build_time = now() - start;
+        if (trie == NULL) {
+            free(rules);
+            free(sorted);
+            return -1;
+        }
+        nodes = count_nodes_trie(trie->root);
+        destroy_trie(trie);
+
+        if (sort_time < best_sort)
+            best_sort = sort_time;
+        if (build_time < best_build)
+            best_build = build_time;
+    }
+
+    printf("%10zu %12.1f %12.1f %12.1f %10.0f %10u\n", num_rules,
+            best_build * 1e3, best_sort * 1e3, (best_build - best_sort) * 1e3,
+            best_build * 1e9 / num_rules, nodes);
+    free(rules);
+    free(sorted);
+    return 0;
+}
+
+// ==== Main flow ====
+
+int main(int argc, char *argv[]) {
+    static const size_t DEFAULT_SIZES[] = {100000, 500000, 1000000};
+
+    printf("Best of %d builds, FILL_FACTOR %.3f\n", BENCH_RUNS, FILL_FACTOR);
+    printf("%10s %12s %12s %12s %10s %10s\n", "Rules", "Build (ms)",
+            "Sort (ms)", "Rest (ms)", "ns/rule", "Nodes");
+
+    int sizes = argc > 1 ? argc - 1 : 3;
+    for (int i = 0; i < sizes; i++) {
+        size_t num_rules = argc > 1 ?
+            strtoul(argv[i + 1], NULL, 10) : DEFAULT_SIZES[i];
+        if (num_rules == 0 || num_rules > GEN_MAX_RULES) {
+            fprintf(stderr, "Invalid number of rules: %s\n", argv[i + 1]);
+            return 1;
+        }
+        if (bench_size(num_rules) != 0) {
+            fprintf(stderr, "Couldn't build a trie of %zu rules\n", num_rules);
+            return 1;
+        }
+    }
+    return 0;
+}
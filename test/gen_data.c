@@ -0,0 +1,276 @@
+#include "gen_rules.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Generates FIBs and input packet files of any size, in the same formats as
+// those in test/data, to see how the engines scale.
+// Usage: gen_data fib [-n RULES] [-i INTERFACES] [-d DEPTH] [-s SEED]
+//        gen_data trace [-n ADDRESSES] [-p PATTERN] [-a ALPHA] [-s SEED] FIB
+// Both write to the standard output.
+
+// ==== Constants ====
+#define DEFAULT_RULES 100000
+#define DEFAULT_ADDRESSES 1000000
+#define DEFAULT_ALPHA 1.0      // Skew of the Zipf pattern
+#define FLOWS 256              // Destinations active at once in `locality`
+#define REPEAT_PERCENT 90      // Addresses of `locality` sent to an active one
+#define NEIGHBOR_PERCENT 50    // New `locality` destinations near an active one
+
+// ==== Helper functions ====
+
+/// Print an address in dotted-quad notation.
+static void print_address(uint32_t addr) {
+    printf("%u.%u.%u.%u", addr >> 24, addr >> 16 & 0xFF, addr >> 8 & 0xFF,
+            addr & 0xFF);
+}
+
+// ==== FIBs ====
+
+/** Print a FIB generated by generate_rules().
+ *
+ *  @returns 0 on success, or -1 if memory ran out
+ */
+static int generate_fib(size_t num_rules, uint32_t interfaces,
+                        uint8_t max_depth, uint64_t seed) {
+    Prefix *rules = generate_rules(num_rules, interfaces, max_depth, seed);
+    if (rules == NULL)
+        return -1;
+    for (size_t i = 0; i < num_rules; i++) {
+        print_address(rules[i].prefix);
+        printf("/%u\t%u\n", rules[i].len, rules[i].out_iface);
+    }
+    free(rules);
+    return 0;
+}
+
+// ==== Traces ====
+
+/** Read the prefixes of a FIB file.
+ *
+ *  @param[out] num_rules Where to store the number of rules.
+ *
+ *  @returns the rules, or NULL if the file couldn't be read
+ */
+static Prefix *read_fib(const char *path, size_t *num_rules) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    size_t capacity = 1024;
+    Prefix *rules = malloc(capacity * sizeof(Prefix));
+    unsigned int a, b, c, d, len, iface;
+    *num_rules = 0;
+    while (rules != NULL && fscanf(file, "%u.%u.%u.%u/%u %u",
+                &a, &b, &c, &d, &len, &iface) == 6) {
+        if (*num_rules == capacity) {
+            capacity *= 2;
+            Prefix *grown = realloc(rules, capacity * sizeof(Prefix));
+            if (grown == NULL)
+                free(rules);
+            rules = grown;
+            if (rules == NULL)
+                break;
+        }
+        uint8_t prefix_len = len > 32 ? 32 : len;
+        uint32_t prefix = a << 24 | b << 16 | c << 8 | d;
+        rules[(*num_rules)++] = (Prefix){
+            .prefix = prefix & prefix_mask(prefix_len), .len = prefix_len,
+        };
+    }
+    fclose(file);
+    return rules;
+}
+
+/// A random address within a rule's prefix.
+static uint32_t address_in(const Prefix *rule, uint64_t *state) {
+    uint32_t host = (uint32_t)next_random(state) & ~prefix_mask(rule->len);
+    return rule->prefix | host;
+}
+
+/** Build the table to sample rules from with a Zipf distribution: the rule of
+ *  rank k (in a random order) is picked with probability proportional to
+ *  1/k^alpha.
+ *
+ *  @param[out] ranked Where to store the rule of each rank
+ *
+ *  @returns the cumulative probability of each rank, or NULL if memory ran out
+ */
+static double *zipf_table(size_t num_rules, double alpha, size_t *ranked,
+                          uint64_t *state) {
+    double *cumulative = malloc(num_rules * sizeof(double));
+    if (cumulative == NULL)
+        return NULL;
+    double total = 0;
+    for (size_t k = 0; k < num_rules; k++) {
+        total += pow(k + 1, -alpha);
+        cumulative[k] = total;
+        ranked[k] = k;
+    }
+    for (size_t k = num_rules - 1; k > 0; k--) { // Fisher-Yates
+        size_t other = next_random(state) % (k + 1);
+        size_t swap = ranked[k];
+        ranked[k] = ranked[other];
+        ranked[other] = swap;
+    }
+    for (size_t k = 0; k < num_rules; k++)
+        cumulative[k] /= total;
+    return cumulative;
+}
+
+/// Sample a rank from a table made by zipf_table().
+static size_t zipf_rank(const double *cumulative, size_t num_rules,
+                        uint64_t *state) {
+    double u = random_unit(state);
+    size_t low = 0, high = num_rules - 1;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (cumulative[mid] < u)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/** Generate destination addresses within the prefixes of a FIB:
+ *  - `uniform`: within a rule picked at random, all equally likely.
+ *  - `zipf`: within a rule picked with a Zipf distribution of skew `alpha`,
+ *    so a few rules get most of the traffic.
+ *  - `locality`: REPEAT_PERCENT of them go to one of FLOWS active
+ *    destinations. The others start a new flow, replacing an active one,
+ *    half of the time in the same /24 as another one.
+ *
+ *  @returns 0 on success, or -1 if memory ran out
+ */
+static int generate_trace(const Prefix *rules, size_t num_rules,
+                          size_t num_addrs, const char *pattern, double alpha,
+                          uint64_t seed) {
+    uint64_t state = seed_random(seed);
+    double *cumulative = NULL;
+    size_t *ranked = NULL;
+    if (strcmp(pattern, "zipf") == 0) {
+        ranked = malloc(num_rules * sizeof(size_t));
+        if (ranked != NULL)
+            cumulative = zipf_table(num_rules, alpha, ranked, &state);
+        if (cumulative == NULL) {
+            free(ranked);
+            return -1;
+        }
+    }
+
+    uint32_t flows[FLOWS];
+    for (size_t i = 0; i < FLOWS; i++)
+        flows[i] = address_in(&rules[next_random(&state) % num_rules], &state);
+
+    for (size_t i = 0; i < num_addrs; i++) {
+        uint32_t addr;
+        if (cumulative != NULL) {
+            size_t rank = zipf_rank(cumulative, num_rules, &state);
+            addr = address_in(&rules[ranked[rank]], &state);
+        } else if (strcmp(pattern, "locality") == 0) {
+            uint32_t *flow = &flows[next_random(&state) % FLOWS];
+            if (next_random(&state) % 100 >= REPEAT_PERCENT) {
+                if (next_random(&state) % 100 < NEIGHBOR_PERCENT)
+                    *flow = (flows[next_random(&state) % FLOWS] & 0xFFFFFF00)
+                        | (next_random(&state) & 0xFF);
+                else
+                    *flow = address_in(&rules[next_random(&state) % num_rules],
+                            &state);
+            }
+            addr = *flow;
+        } else {
+            addr = address_in(&rules[next_random(&state) % num_rules], &state);
+        }
+        print_address(addr);
+        putchar('\n');
+    }
+    free(cumulative);
+    free(ranked);
+    return 0;
+}
+
+// ==== Main flow ====
+
+static void usage(const char *program) {
+    fprintf(stderr,
+        "Usage: %s fib [-n RULES] [-i INTERFACES] [-d DEPTH] [-s SEED]\n"
+        "       %s trace [-n ADDRESSES] [-p PATTERN] [-a ALPHA] [-s SEED] FIB\n"
+        "PATTERN is uniform (the default), zipf or locality.\n",
+        program, program);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    bool fib = strcmp(argv[1], "fib") == 0;
+    if (!fib && strcmp(argv[1], "trace") != 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t count = fib ? DEFAULT_RULES : DEFAULT_ADDRESSES;
+    unsigned long interfaces = GEN_DEFAULT_INTERFACES;
+    unsigned long depth = GEN_DEFAULT_DEPTH;
+    uint64_t seed = GEN_DEFAULT_SEED;
+    const char *pattern = "uniform";
+    double alpha = DEFAULT_ALPHA;
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, fib ? "n:i:d:s:h" : "n:p:a:s:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            interfaces = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            depth = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'a':
+            alpha = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (fib) {
+        if (optind != argc || count == 0 || count > GEN_MAX_RULES
+                || interfaces == 0 || depth > 32) {
+            usage(argv[0]);
+            return 1;
+        }
+        return generate_fib(count, interfaces, depth, seed) == 0 ? 0 : 1;
+    }
+
+    if (optind != argc - 1 || count == 0 || alpha < 0
+            || (strcmp(pattern, "uniform") != 0 && strcmp(pattern, "zipf") != 0
+                && strcmp(pattern, "locality") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    size_t num_rules;
+    Prefix *rules = read_fib(argv[optind], &num_rules);
+    if (rules == NULL || num_rules == 0) {
+        fprintf(stderr, "Couldn't read the rules from %s\n", argv[optind]);
+        free(rules);
+        return 1;
+    }
+    int status = generate_trace(rules, num_rules, count, pattern, alpha, seed);
+    free(rules);
+    return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+#include "gen_rules.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+// ==== Constants ====
+#define NESTED_PERCENT 30      // Rules that are more specifics of another one
+#define NESTED_MAX_LEN 24      // Longest of those more specifics
+
+// Share of each prefix length (per 10000) in the generated rules, roughly
+// that of a BGP table: mostly /24s, then /22-/23 and /16-/21, and hardly any
+// longer than /24, which most networks filter
+static const struct { uint8_t len; uint16_t weight; } LENGTHS[] = {
+    {8, 2},     {10, 5},    {12, 20},   {13, 40},   {14, 80},   {15, 100},
+    {16, 180},  {17, 140},  {18, 240},  {19, 450},  {20, 650},  {21, 700},
+    {22, 1100}, {23, 1000}, {24, 5241}, {25, 20},   {26, 12},   {27, 8},
+    {28, 5},    {29, 3},    {30, 2},    {32, 2},
+};
+#define NUM_LENGTHS (sizeof(LENGTHS) / sizeof(LENGTHS[0]))
+
+// ==== Helper functions ====
+
+uint64_t seed_random(uint64_t seed) {
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+    return state ? state : 1; // The state can't be 0
+}
+
+uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+double random_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+/// Pick a prefix length with the weights in LENGTHS, longer than `min_len`
+/// and up to `max_len`. Returns 0 if no length with weight is.
+static uint8_t random_length(uint64_t *state, uint8_t min_len,
+                             uint8_t max_len) {
+    uint32_t total = 0;
+    for (size_t i = 0; i < NUM_LENGTHS; i++)
+        if (LENGTHS[i].len > min_len && LENGTHS[i].len <= max_len)
+            total += LENGTHS[i].weight;
+    if (total == 0)
+        return 0;
+    uint32_t pick = next_random(state) % total;
+    for (size_t i = 0; i < NUM_LENGTHS; i++) {
+        if (LENGTHS[i].len <= min_len || LENGTHS[i].len > max_len)
+            continue;
+        if (pick < LENGTHS[i].weight)
+            return LENGTHS[i].len;
+        pick -= LENGTHS[i].weight;
+    }
+    return 0;
+}
+
+/** Add a prefix to a set, unless it's in it already.
+ *
+ *  @param set Open-addressing hash table of prefix and length, 0 for empty
+ *  @param mask Size of the table minus one (a power of two)
+ *
+ *  @returns true if it was added
+ */
+static bool add_unique(uint64_t *set, size_t mask, uint32_t prefix,
+                       uint8_t len) {
+    uint64_t key = (uint64_t)prefix << 8 | len | (uint64_t)1 << 40;
+    size_t slot = (key * 0x9E3779B97F4A7C15ull) >> 20 & mask;
+    while (set[slot] != 0) {
+        if (set[slot] == key)
+            return false;
+        slot = (slot + 1) & mask;
+    }
+    set[slot] = key;
+    return true;
+}
+
+// ==== Rules ====
+
+/// NESTED_PERCENT of the rules are more specifics, up to NESTED_MAX_LEN.
+Prefix *generate_rules(size_t num_rules, uint32_t interfaces,
+                       uint8_t max_depth, uint64_t seed) {
+    size_t set_size = 1;
+    while (set_size < 2 * num_rules)
+        set_size <<= 1;
+    Prefix *rules = malloc(num_rules * sizeof(Prefix));
+    uint64_t *set = calloc(set_size, sizeof(uint64_t));
+    if (rules == NULL || set == NULL) {
+        free(rules);
+        free(set);
+        return NULL;
+    }
+
+    uint64_t state = seed_random(seed);
+    size_t count = 0;
+    while (count < num_rules) {
+        Prefix rule = { .prefix = next_random(&state) >> 32, .depth = 0 };
+        rule.len = random_length(&state, 0, 32);
+        if (count > 0 && next_random(&state) % 100 < NESTED_PERCENT) {
+            const Prefix *outer = &rules[next_random(&state) % count];
+            uint8_t len = random_length(&state, outer->len, NESTED_MAX_LEN);
+            if (outer->depth < max_depth && len > 0) {
+                // Keep the outer rule's bits, and add some more
+                rule.prefix = outer->prefix
+                    | (rule.prefix & ~prefix_mask(outer->len));
+                rule.len = len;
+                rule.depth = outer->depth + 1;
+            }
+        }
+        rule.prefix &= prefix_mask(rule.len);
+        if (add_unique(set, set_size - 1, rule.prefix, rule.len))
+            rules[count++] = rule;
+    }
+
+    // Drawn last, so that the prefixes are the same for any `interfaces`
+    for (size_t i = 0; i < num_rules; i++)
+        rules[i].out_iface = 1 + (uint32_t)(next_random(&state) % interfaces);
+    free(set);
+    return rules;
+}
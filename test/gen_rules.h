@@ -0,0 +1,70 @@
+#ifndef GEN_RULES_H
+#define GEN_RULES_H
+
+#include <stddef.h> // For size_t
+#include <stdint.h> // For fixed-width integer types like uint32_t
+
+// Synthetic rules, shared by gen_data and the benchmarks so that they all
+// measure the same distribution of prefixes.
+
+// ==== Constants ====
+#define GEN_DEFAULT_INTERFACES 64  // Real routers have a few dozen next hops
+#define GEN_DEFAULT_DEPTH 4        // Most rules a prefix is nested in
+#define GEN_DEFAULT_SEED 20240229u // Same rules on every run
+#define GEN_MAX_RULES (1u << 25)   // Distinct prefixes there are enough of
+
+// ==== Data Structures ====
+
+/// A generated (or read) rule
+typedef struct Prefix {
+    uint32_t prefix;
+    uint8_t len;
+    uint8_t depth;      ///< Generated rules it's nested in
+    uint32_t out_iface; ///< From 1 up to the number of interfaces
+} Prefix;
+
+// ==== Function Prototypes ====
+
+/** Seed a generator for next_random().
+ *
+ * @param seed Any number, 0 included.
+ *
+ * @return The state of the generator.
+ */
+uint64_t seed_random(uint64_t seed);
+
+/** Next number of a generator, with xorshift64*: fast, good enough for
+ * sampling, and the same everywhere.
+ *
+ * @param state Pointer to the state of the generator, from seed_random().
+ *
+ * @return A random number.
+ */
+uint64_t next_random(uint64_t *state);
+
+/** Uniform random number in [0, 1).
+ *
+ * @param state Pointer to the state of the generator.
+ */
+double random_unit(uint64_t *state);
+
+/// Mask of the first `len` bits of an address.
+static inline uint32_t prefix_mask(uint8_t len) {
+    return len == 0 ? 0 : ~(uint32_t)0 << (32 - len);
+}
+
+/** Generate a FIB of distinct prefixes, with lengths roughly like those of a
+ * BGP table. Some of them are more specifics of a rule generated before, down
+ * to `max_depth` levels. The same arguments always give the same rules.
+ *
+ * @param num_rules Number of rules, up to GEN_MAX_RULES.
+ * @param interfaces Number of interfaces the rules go to.
+ * @param max_depth Most rules a prefix can be nested in.
+ * @param seed Seed of the generator.
+ *
+ * @return A heap-allocated array of the rules, or NULL if memory ran out.
+ */
+Prefix *generate_rules(size_t num_rules, uint32_t interfaces,
+                       uint8_t max_depth, uint64_t seed);
+
+#endif // GEN_RULES_H
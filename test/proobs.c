@@ -1,9 +1,20 @@
 #include "../src/lc_trie.h"
 #include "../src/utils.h"
+#include "../src/arena.h"
+#include "../src/io.h"
+#include "../src/snapshot.h"
+#include "../src/next_hop.h"
+#include "../src/dir24_8.h"
+#include "../src/tree_bitmap.h"
+#include "../src/engine.h"
+#include "../src/trie_image.h"
+#include "../src/latency.h"
+#include "../src/perf_counters.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 
 // ==== Macros ====
 #define TEST_FAIL(format, ...) \
@@ -37,6 +48,11 @@ void print_trie(const TrieNode *trie, char *tree_prefix, char *match_prefix,
         int pre_skip);
 
 int eq_tries(const TrieNode *a, const TrieNode *b);
+uint32_t linear_lookup(const Rule *rules, const bool *active, size_t count,
+        ip_addr_t ip);
+void random_rule_pool(Rule *pool, bool *active, size_t count,
+        const uint8_t *lengths, size_t num_lengths, uint32_t mask,
+        unsigned int seed);
 TrieNode *build_test_trie();
 TrieNode *build_test_trie2();
 
@@ -111,6 +127,489 @@ int test_extract_msb() {
     return fails;
 }
 
+// Test collection for the arena allocator
+int test_arena() {
+    printf("\n=== Testing arena ===\n");
+    int fails = 0;
+
+    Arena arena;
+    arena_init(&arena, 64 * sizeof(max_align_t));
+
+    // Consecutive allocations should be contiguous and aligned
+    printf("\n--- Test Case 1: Contiguous allocations ---\n");
+    char *a = arena_alloc(&arena, 3);
+    char *b = arena_alloc(&arena, sizeof(max_align_t));
+    printf("Allocated 3 bytes at %p, then %zu at %p\n",
+            (void *)a, sizeof(max_align_t), (void *)b);
+    if (a == NULL || b != a + sizeof(max_align_t)) {
+        printf("! TEST FAIL ! Allocations aren't contiguous\n");
+        fails++;
+    }
+
+    // An allocation larger than the block size gets its own block
+    printf("\n--- Test Case 2: Oversized allocation ---\n");
+    size_t big_size = 1000 * sizeof(max_align_t);
+    char *big = arena_alloc(&arena, big_size);
+    if (big == NULL || (size_t)big % sizeof(max_align_t) != 0) {
+        printf("! TEST FAIL ! Oversized allocation failed or is unaligned\n");
+        fails++;
+    } else {
+        memset(big, 0xAB, big_size); // Must be writable
+    }
+    printf("Arena has handed out %zu bytes\n", arena.allocated);
+    if (arena.allocated != 2 * sizeof(max_align_t) + big_size) {
+        printf("! TEST FAIL ! Wrong count of allocated bytes\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 3: Reuse after freeing ---\n");
+    arena_free(&arena);
+    if (arena.head != NULL || arena.allocated != 0
+            || arena_alloc(&arena, 8) == NULL) {
+        printf("! TEST FAIL ! Arena not reusable after freeing\n");
+        fails++;
+    }
+    arena_free(&arena);
+
+    printf("\n--- Test Case 4: Merging arenas ---\n");
+    Arena other;
+    arena_init(&other, 64 * sizeof(max_align_t));
+    char *first = arena_alloc(&arena, 8);
+    int *moved = arena_alloc(&other, 100 * sizeof(max_align_t));
+    moved[0] = 42;
+    arena_merge(&arena, &other);
+    char *next = arena_alloc(&arena, 8);
+    if (moved[0] != 42 || other.head != NULL || other.allocated != 0
+            || arena.allocated != 102 * sizeof(max_align_t)
+            || next != first + sizeof(max_align_t)) {
+        printf("! TEST FAIL ! Arenas weren't merged properly\n");
+        fails++;
+    }
+    arena_free(&arena); // Must free the merged blocks too
+
+    TEST_REPORT("arena", fails);
+
+    return fails;
+}
+
+// Test collection for the next hop table
+int test_next_hops() {
+    printf("\n=== Testing next hop table ===\n");
+    int fails = 0;
+
+    NextHopTable table;
+    if (next_hop_table_init(&table) != 0)
+        TEST_FAIL("Couldn't initialize the table\n");
+
+    printf("\n--- Test Case 1: Interface 0 ---\n");
+    if (next_hop_intern(&table, 0) != NO_NEXT_HOP
+            || next_hop_iface(&table, NO_NEXT_HOP) != 0) {
+        printf("! TEST FAIL ! Interface 0 isn't NO_NEXT_HOP\n");
+        fails++;
+    }
+
+    // Enough interfaces for the table to grow a few times, each seen twice
+    printf("\n--- Test Case 2: Deduplication ---\n");
+    const uint32_t num_ifaces = 1000;
+    for (int round = 0; round < 2; round++) {
+        for (uint32_t i = 1; i <= num_ifaces; i++) {
+            uint32_t iface = i * 65536 + 7; // Same low bits for all of them
+            int32_t index = next_hop_intern(&table, iface);
+            if (index != (int32_t)i || next_hop_iface(&table, index) != iface) {
+                printf("! TEST FAIL ! Interface %u got index %d (expected %u)\n",
+                        iface, index, i);
+                fails++;
+                break;
+            }
+        }
+    }
+    printf("Table has %u next hops\n", table.num_hops);
+    if (table.num_hops != num_ifaces + 1) {
+        printf("! TEST FAIL ! Expected %u next hops\n", num_ifaces + 1);
+        fails++;
+    }
+
+    printf("\n--- Test Case 3: Running out of indices ---\n");
+    uint32_t iface = 1;
+    while (table.num_hops <= MAX_NEXT_HOPS
+            && next_hop_intern(&table, iface) >= 0)
+        iface++;
+    if (table.num_hops != MAX_NEXT_HOPS + 1
+            || next_hop_intern(&table, iface) != -1
+            || next_hop_intern(&table, 1) != next_hop_intern(&table, 1)) {
+        printf("! TEST FAIL ! Full table doesn't behave as expected\n");
+        fails++;
+    }
+
+    next_hop_table_free(&table);
+
+    TEST_REPORT("next hop table", fails);
+
+    return fails;
+}
+
+// Reader thread for test_snapshot: checks that every object it acquires is
+// intact, until told to stop
+typedef struct SnapshotTestReader {
+    Snapshot *snapshot;
+    _Atomic bool stop;
+    long reads;
+    long bad_reads;
+} SnapshotTestReader;
+
+#define SNAPSHOT_TEST_MAGIC 0x5AFE5AFEu
+
+static void *snapshot_test_reader(void *arg) {
+    SnapshotTestReader *test = arg;
+    int reader = snapshot_register(test->snapshot);
+    while (!atomic_load(&test->stop)) {
+        for (int i = 0; i < 100; i++) {
+            uint32_t *object = snapshot_acquire(test->snapshot);
+            if (*object != SNAPSHOT_TEST_MAGIC) test->bad_reads++;
+            test->reads++;
+        }
+        snapshot_quiescent(test->snapshot, reader);
+    }
+    snapshot_unregister(test->snapshot, reader);
+    return NULL;
+}
+
+// Test collection for the snapshot (QSBR) functions
+int test_snapshot() {
+    printf("\n=== Testing snapshot ===\n");
+    int fails = 0;
+
+    Snapshot snapshot;
+    uint32_t *first = malloc(sizeof(uint32_t));
+    *first = SNAPSHOT_TEST_MAGIC;
+    snapshot_init(&snapshot, first);
+
+    printf("\n--- Test Case 1: Publishing without readers ---\n");
+    uint32_t *second = malloc(sizeof(uint32_t));
+    *second = SNAPSHOT_TEST_MAGIC;
+    if (snapshot_publish(&snapshot, second) != first
+            || snapshot_acquire(&snapshot) != second) {
+        printf("! TEST FAIL ! Publishing didn't replace the object\n");
+        fails++;
+    }
+    snapshot_synchronize(&snapshot); // Mustn't wait for anyone
+    free(first);
+
+    // Old objects are poisoned before being freed, so a reader still using
+    // one would notice
+    printf("\n--- Test Case 2: Replacing objects under readers ---\n");
+    const int num_readers = 3;
+    SnapshotTestReader tests[3];
+    pthread_t threads[3];
+    for (int i = 0; i < num_readers; i++) {
+        tests[i] = (SnapshotTestReader){ .snapshot = &snapshot };
+        atomic_init(&tests[i].stop, false);
+        pthread_create(&threads[i], NULL, snapshot_test_reader, &tests[i]);
+    }
+    for (int i = 0; i < 200; i++) {
+        uint32_t *next = malloc(sizeof(uint32_t));
+        *next = SNAPSHOT_TEST_MAGIC;
+        uint32_t *old = snapshot_publish(&snapshot, next);
+        snapshot_synchronize(&snapshot);
+        *old = 0;
+        free(old);
+    }
+    long bad_reads = 0;
+    for (int i = 0; i < num_readers; i++) {
+        atomic_store(&tests[i].stop, true);
+        pthread_join(threads[i], NULL);
+        printf("Reader %d read %ld objects\n", i, tests[i].reads);
+        bad_reads += tests[i].bad_reads;
+    }
+    if (bad_reads != 0) {
+        printf("! TEST FAIL ! %ld reads of replaced objects\n", bad_reads);
+        fails++;
+    }
+
+    printf("\n--- Test Case 3: Running out of reader slots ---\n");
+    for (int i = num_readers; i < MAX_SNAPSHOT_READERS; i++)
+        snapshot_register(&snapshot);
+    if (snapshot_register(&snapshot) != -1) {
+        printf("! TEST FAIL ! Registered more than %d readers\n",
+                MAX_SNAPSHOT_READERS);
+        fails++;
+    }
+
+    free(snapshot_acquire(&snapshot));
+
+    TEST_REPORT("snapshot", fails);
+
+    return fails;
+}
+
+// =============================================================== //
+// I/O tests                                                       //
+// =============================================================== //
+
+// Test collection for parseFIBLine
+int test_parse_fib_line() {
+    printf("\n=== Testing parseFIBLine ===\n");
+    int fails = 0;
+
+    const char fib[] = "10.0.0.0/8\t3\r\n\n192.168.1.0/24 101\n0.0.0.0/0\t1";
+    struct {
+        uint32_t prefix;
+        int prefix_len;
+        int out_iface;
+        int line;
+    } expected[] = {
+        {0x0A000000, 8, 3, 1},
+        {0xC0A80100, 24, 101, 3},
+        {0x00000000, 0, 1, 4},
+    };
+
+    const char *cursor = fib;
+    const char *end = fib + sizeof(fib) - 1;
+    uint32_t prefix;
+    int prefix_len, out_iface, line = 0;
+
+    printf("\n--- Test Case 1: Valid entries, blank lines, no final newline ---\n");
+    for (int i = 0; i < 3; i++) {
+        int status = parseFIBLine(&cursor, end, &line, &prefix, &prefix_len,
+                &out_iface);
+        printf("Entry %d: 0x%08X/%d -> %d at line %d (status %d)\n",
+                i, prefix, prefix_len, out_iface, line, status);
+        if (status != OK || prefix != expected[i].prefix
+                || prefix_len != expected[i].prefix_len
+                || out_iface != expected[i].out_iface
+                || line != expected[i].line) {
+            printf("! TEST FAIL ! Expected 0x%08X/%d -> %d at line %d\n",
+                    expected[i].prefix, expected[i].prefix_len,
+                    expected[i].out_iface, expected[i].line);
+            fails++;
+        }
+    }
+    if (parseFIBLine(&cursor, end, &line, &prefix, &prefix_len, &out_iface)
+            != REACHED_EOF) {
+        printf("! TEST FAIL ! Expected REACHED_EOF\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Malformed entries ---\n");
+    const char *bad[] = {
+        "10.0.0/8\t3\n",      // Missing octet
+        "10.0.0.256/8\t3\n",  // Octet out of range
+        "10.0.0.0/33\t3\n",   // Prefix too long
+        "10.0.0.0/8\n",       // Missing interface
+        "10.0.0.0/8\t3 4\n",  // Trailing garbage
+        "08.0.0.0/8\t3\n",    // Not an octal number
+        "0x100.0.0.0/8\t3\n", // Octet out of range, in hexadecimal
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        cursor = bad[i];
+        line = 0;
+        int status = parseFIBLine(&cursor, bad[i] + strlen(bad[i]), &line,
+                &prefix, &prefix_len, &out_iface);
+        printf("Entry %zu: status %d at line %d (expected %d at line 1)\n",
+                i, status, line, BAD_ROUTING_TABLE);
+        if (status != BAD_ROUTING_TABLE || line != 1) {
+            printf("! TEST FAIL ! Malformed entry accepted\n");
+            fails++;
+        }
+    }
+
+    printf("\n--- Test Case 3: Octal and hexadecimal, as fscanf's %%i ---\n");
+    // Like test/linearSearch reads them, so results can be compared
+    const char prefixed[] = "10.0.0.010/32\t0x10\n012.0X0a.0.0/010\t07\n";
+    cursor = prefixed;
+    end = prefixed + sizeof(prefixed) - 1;
+    uint32_t prefixed_expected[][3] = {{0x0A000008, 32, 16}, {0x0A0A0000, 8, 7}};
+    for (int i = 0; i < 2; i++) {
+        int status = parseFIBLine(&cursor, end, &line, &prefix, &prefix_len,
+                &out_iface);
+        printf("Entry %d: 0x%08X/%d -> %d (status %d)\n",
+                i, prefix, prefix_len, out_iface, status);
+        if (status != OK || prefix != prefixed_expected[i][0]
+                || prefix_len != (int)prefixed_expected[i][1]
+                || out_iface != (int)prefixed_expected[i][2]) {
+            printf("! TEST FAIL ! Expected 0x%08X/%u -> %u\n",
+                    prefixed_expected[i][0], prefixed_expected[i][1],
+                    prefixed_expected[i][2]);
+            fails++;
+        }
+    }
+
+    TEST_REPORT("parseFIBLine", fails);
+
+    return fails;
+}
+
+
+// Test collection for parseInputPacketLine
+int test_parse_input_packet_line() {
+    printf("\n=== Testing parseInputPacketLine ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Decimal, octal and hexadecimal octets ---\n");
+    const char input[] = "10.0.0.1\n\n012.0x0A.0.010 \r\n255.255.255.255";
+    const uint32_t expected[] = {0x0A000001, 0x0A0A0008, 0xFFFFFFFF};
+    const char *cursor = input;
+    const char *end = input + sizeof(input) - 1;
+    uint32_t address;
+    for (int i = 0; i < 3; i++) {
+        int status = parseInputPacketLine(&cursor, end, &address);
+        printf("Address %d: 0x%08X (status %d)\n", i, address, status);
+        if (status != OK || address != expected[i]) {
+            printf("! TEST FAIL ! Expected 0x%08X\n", expected[i]);
+            fails++;
+        }
+    }
+    if (parseInputPacketLine(&cursor, end, &address) != REACHED_EOF) {
+        printf("! TEST FAIL ! Expected REACHED_EOF\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Malformed addresses ---\n");
+    const char *bad[] = {
+        "10.0.0\n",       // Missing octet
+        "10.0.0.256\n",   // Octet out of range
+        "0x100.0.0.0\n",  // Octet out of range, in hexadecimal
+        "10.0.0.1 2\n",   // Trailing garbage
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        cursor = bad[i];
+        int status = parseInputPacketLine(&cursor, bad[i] + strlen(bad[i]),
+                &address);
+        printf("Address %zu: status %d (expected %d)\n",
+                i, status, BAD_INPUT_FILE);
+        if (status != BAD_INPUT_FILE) {
+            printf("! TEST FAIL ! Malformed address accepted\n");
+            fails++;
+        }
+    }
+
+    TEST_REPORT("parseInputPacketLine", fails);
+
+    return fails;
+}
+
+
+// Test collection for readInputPacketFileBlock
+int test_read_input_block() {
+    printf("\n=== Testing readInputPacketFileBlock ===\n");
+    int fails = 0;
+
+    // Enough addresses to need more than one buffer refill
+    char input_name[] = "/tmp/proobs_input_XXXXXX";
+    int fd = mkstemp(input_name);
+    FILE *input = fdopen(fd, "w");
+    uint32_t total = INPUT_BUFFER_SIZE / 8 + 3;
+    for (uint32_t i = 0; i < total; i++) {
+        uint32_t ip = i * 2654435761u; // Scattered, but reproducible
+        fprintf(input, "%u.%u.%u.%u%s\n", ip >> 24, (ip >> 16) & 0xFF,
+                (ip >> 8) & 0xFF, ip & 0xFF, i % 5 == 0 ? " \r" : "");
+    }
+    // Octal and hexadecimal octets, as fscanf's %i reads them
+    fprintf(input, "1.2.3.4\n010.0.0.0x1F\nnot an address\n");
+    fclose(input);
+
+    if (initializeIO("/dev/null", input_name) != OK) {
+        unlink(input_name);
+        TEST_FAIL("Couldn't initialize I/O\n");
+    }
+
+    static uint32_t addrs[1000];
+    int count, status;
+    uint32_t read = 0;
+    printf("\n--- Test Case 1: %u valid addresses ---\n", total + 2);
+    while ((status = readInputPacketFileBlock(addrs, 1000, &count)) == OK) {
+        for (int j = 0; j < count; j++, read++) {
+            uint32_t expected = read < total ? read * 2654435761u :
+                read == total ? 0x01020304 : 0x0800001F;
+            if (addrs[j] != expected && fails++ < 5) {
+                printf("! TEST FAIL ! Address %u is 0x%08X (expected 0x%08X)\n",
+                        read, addrs[j], expected);
+            }
+        }
+    }
+    printf("Read %u addresses (expected %u)\n", read, total + 2);
+    if (read != total + 2) {
+        printf("! TEST FAIL ! Wrong number of addresses\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Malformed line ---\n");
+    printf("Status %d (expected %d)\n", status, BAD_INPUT_FILE);
+    if (status != BAD_INPUT_FILE || count != 0) {
+        printf("! TEST FAIL ! Malformed line not reported\n");
+        fails++;
+    }
+
+    freeIO();
+    char output_name[sizeof(input_name) + sizeof(OUTPUT_NAME)];
+    sprintf(output_name, "%s%s", input_name, OUTPUT_NAME);
+    unlink(output_name);
+    unlink(input_name);
+
+    TEST_REPORT("readInputPacketFileBlock", fails);
+
+    return fails;
+}
+
+
+// Test collection for printOutputResult
+int test_print_output_result() {
+    printf("\n=== Testing printOutputResult ===\n");
+    int fails = 0;
+
+    char input_name[] = "/tmp/proobs_input_XXXXXX";
+    close(mkstemp(input_name));
+    if (initializeIO("/dev/null", input_name) != OK) {
+        unlink(input_name);
+        TEST_FAIL("Couldn't initialize I/O\n");
+    }
+    setOutputMirroring(0);
+
+    // Enough lines to need more than one flush, with every corner of the format
+    double times[] = {0, 0.5, 1.5, 2.4999, 1234567.5, 1e20, -3.7};
+    int ifaces[] = {0, 1, 7, 65535, -2};
+    uint32_t total = OUTPUT_BUFFER_SIZE / 16;
+    for (uint32_t i = 0; i < total; i++) {
+        printOutputResult(i * 2654435761u, ifaces[i % 5], times[i % 7], i % 40);
+    }
+    freeIO();
+
+    char output_name[sizeof(input_name) + sizeof(OUTPUT_NAME)];
+    sprintf(output_name, "%s%s", input_name, OUTPUT_NAME);
+    FILE *output = fopen(output_name, "r");
+
+    printf("\n--- Test Case 1: %u lines, same as printf ---\n", total);
+    char line[128], expected[128];
+    uint32_t i = 0;
+    while (output && fgets(line, sizeof(line), output) && i < total) {
+        uint32_t ip = i * 2654435761u;
+        int n = sprintf(expected, "%i.%i.%i.%i;", ip >> 24, (ip >> 16) & 0xFF,
+                (ip >> 8) & 0xFF, ip & 0xFF);
+        if (ifaces[i % 5]) n += sprintf(expected + n, "%i;", ifaces[i % 5]);
+        else n += sprintf(expected + n, "MISS;");
+        sprintf(expected + n, "%i;%.0lf\n", i % 40, times[i % 7]);
+        if (strcmp(line, expected) && fails++ < 5) {
+            printf("! TEST FAIL ! Line %u is '%s' (expected '%s')\n",
+                    i, line, expected);
+        }
+        i++;
+    }
+    printf("Read %u lines (expected %u)\n", i, total);
+    if (i != total) {
+        printf("! TEST FAIL ! Wrong number of lines\n");
+        fails++;
+    }
+
+    if (output) fclose(output);
+    unlink(output_name);
+    unlink(input_name);
+
+    TEST_REPORT("printOutputResult", fails);
+
+    return fails;
+}
+
+
 // =============================================================== //
 // LC-Trie tests                                                   //
 // =============================================================== //
@@ -199,6 +698,24 @@ int test_compute_branch() {
         make_rule("192.168.129.0", 24, 2)};
     fails += _test_compute_branch(rules3, 2, 16, 1);
 
+    // Every child of a 16-bit branch is used, but only half of a 17-bit one.
+    // 2^16 didn't fit in the counters, which let the branch grow past 16
+    printf("\n--- Test Case 4 (65536 rules, one per 16-bit prefix) ---\n");
+    size_t nrules4 = 1 << 16;
+    Rule *rules4 = malloc(nrules4 * sizeof(Rule));
+    for (size_t i = 0; i < nrules4; i++) {
+        rules4[i] = (Rule){
+            .prefix = (ip_addr_t)i << 16, .prefix_len = 17, .out_iface = 1,
+        };
+    }
+    uint8_t branch4 = compute_branch(rules4, nrules4, 0);
+    printf("Computed branch: %u bits (expected 16)\n", branch4);
+    if (branch4 != 16) {
+        printf("! TEST FAIL ! Wrong branch\n");
+        fails++;
+    }
+    free(rules4);
+
     TEST_REPORT("compute_skip", fails);
 
     return fails;
@@ -279,6 +796,38 @@ int test_sort_rules() {
     };
     fails += _test_sort_rules(test3, sizeof(test3) / sizeof(test3[0]), sorted3);
 
+    // Enough rules for every digit of the radix sort, and for the parallel
+    // version to split them among threads
+    printf("\n--- Test Case 4 (Large random set, checked with qsort) ---\n");
+    enum { NUM_RULES = 100000 };
+    static Rule random_rules[NUM_RULES], expected[NUM_RULES], sorted[NUM_RULES];
+    srand(11);
+    for (size_t i = 0; i < NUM_RULES; i++) {
+        // No default routes: qsort may put them in any order
+        uint8_t len = 1 + rand() % 32;
+        uint32_t prefix = (uint32_t)rand() << 16 ^ rand();
+        random_rules[i].prefix = prefix & (0xFFFFFFFF << (32 - len));
+        random_rules[i].prefix_len = len;
+        random_rules[i].out_iface = rand() % 100000; // Over a byte
+        random_rules[i].parent = NULL;
+    }
+    memcpy(expected, random_rules, sizeof(random_rules));
+    qsort(expected, NUM_RULES, sizeof(Rule), compare_rules);
+
+    static const int threads[] = {1, 2, 3, 8};
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        memcpy(sorted, random_rules, sizeof(random_rules));
+        sort_rules_parallel(sorted, NUM_RULES, threads[t]);
+        size_t i = 0;
+        while (i < NUM_RULES && eq_rules(&sorted[i], &expected[i]))
+            i++;
+        printf("Sorted in %d threads\n", threads[t]);
+        if (i < NUM_RULES) {
+            printf("! TEST FAIL ! Wrong rule ordering at %zu\n", i);
+            fails++;
+        }
+    }
+
     TEST_REPORT("sort_rules", fails);
 
     return fails;
@@ -351,6 +900,27 @@ int test_compute_default() {
     };
     fails += _test_compute_default(rules5, 2, 0, NULL);
 
+    // More defaults than fit in a byte, which used to hang
+    printf("\n--- Test Case 6 (300 nested defaults) ---\n");
+    size_t nrules6 = 302;
+    Rule *rules6 = malloc(nrules6 * sizeof(Rule));
+    for (size_t i = 0; i < nrules6 - 2; i++)
+        rules6[i] = make_rule("0.0.0.0", 0, 1 + i);
+    rules6[nrules6 - 2] = make_rule("192.168.0.0", 24, 1);
+    rules6[nrules6 - 1] = make_rule("192.168.1.0", 24, 2);
+    Rule *default6 = compute_default(rules6, nrules6, 0);
+    printf("Default: rule %td (expected %zu)\n",
+            default6 ? default6 - rules6 : -1, nrules6 - 3);
+    if (default6 != &rules6[nrules6 - 3]
+            || rules6[1].parent != &rules6[0]
+            || rules6[150].parent != &rules6[149]
+            || rules6[nrules6 - 2].parent != default6
+            || rules6[nrules6 - 1].parent != default6) {
+        printf("! TEST FAIL ! Wrong default or parents\n");
+        fails++;
+    }
+    free(rules6);
+
     TEST_REPORT("compute_default", fails);
 
     return fails;
@@ -589,6 +1159,104 @@ int test_count_nodes() {
     return fails;
 }
 
+// Check the totals of a TrieStats against each other
+int _test_trie_stats_totals(const TrieStats *stats) {
+    uint32_t nodes = 1, internal = 0, skipped = 0, depths = 0, chains = 0;
+    for (int i = 0; i < TRIE_STATS_LEVELS; i++) {
+        nodes += stats->branches[i] << i;
+        internal += stats->branches[i];
+        skipped += stats->skips[i];
+        depths += stats->depths[i];
+        chains += stats->chains[i];
+    }
+    printf("%u nodes, %u leaves (%u empty, %u filled with a default)\n",
+            stats->num_nodes, stats->num_leaves, stats->empty_leaves,
+            stats->default_leaves);
+    if (nodes != stats->num_nodes || internal != skipped
+            || internal + stats->num_leaves != stats->num_nodes
+            || depths != stats->num_leaves || chains != stats->num_leaves
+            || stats->chains[0] != stats->empty_leaves) {
+        printf("! TEST FAIL ! Totals don't add up\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Test collection for the shape counted while building tries
+int test_trie_stats() {
+    printf("\n=== Testing trie stats ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Two halves ---\n");
+    Rule halves[] = {
+        make_rule("0.0.0.0", 1, 1),
+        make_rule("128.0.0.0", 1, 2),
+    };
+    Trie *trie = build_trie(halves, 2);
+    if (trie == NULL)
+        TEST_FAIL("Building failed\n");
+    fails += _test_trie_stats_totals(&trie->stats);
+    if (trie->stats.num_nodes != 3 || trie->stats.branches[1] != 1
+            || trie->stats.skips[0] != 1 || trie->stats.depths[1] != 2
+            || trie->stats.chains[1] != 2 || trie->stats.default_leaves != 0) {
+        printf("! TEST FAIL ! Wrong shape\n");
+        fails++;
+    }
+    destroy_trie(trie);
+
+    printf("\n--- Test Case 2: Counted while building, serial and parallel ---\n");
+    enum { NUM_RULES = 20000, UPDATES = 400 };
+    static Rule rules[NUM_RULES];
+    srand(25);
+    for (size_t i = 0; i < NUM_RULES; i++) {
+        uint8_t len = 8 + rand() % 25;
+        uint32_t prefix = (uint32_t)rand() << 16 ^ rand();
+        rules[i].prefix = prefix & (0xFFFFFFFF << (32 - len));
+        rules[i].prefix_len = len;
+        rules[i].out_iface = 1 + i;
+        rules[i].parent = NULL;
+    }
+    TrieStats walked;
+    trie = build_trie(rules, NUM_RULES);
+    Trie *parallel = build_trie_parallel(rules, NUM_RULES, 4);
+    if (trie == NULL || parallel == NULL)
+        TEST_FAIL("Building failed\n");
+    count_trie_stats(trie->root, &walked);
+    fails += _test_trie_stats_totals(&trie->stats);
+    if (trie->stats.num_nodes != count_nodes_trie(trie->root)
+            || memcmp(&trie->stats, &walked, sizeof(TrieStats)) != 0
+            || memcmp(&parallel->stats, &walked, sizeof(TrieStats)) != 0) {
+        printf("! TEST FAIL ! Counted shape differs from the trie's\n");
+        fails++;
+    }
+    destroy_trie(parallel);
+
+    printf("\n--- Test Case 3: Kept up to date by updates ---\n");
+    for (int u = 0; u < UPDATES; u++) {
+        Rule *rule = &rules[rand() % NUM_RULES];
+        if (u % 2)
+            trie_delete_rule(trie, rule->prefix, rule->prefix_len);
+        else
+            trie_insert_rule(trie, &(Rule){ // Its /16, if it's longer
+                .prefix = rule->prefix_len < 16 ?
+                    rule->prefix : rule->prefix & 0xFFFF0000,
+                .prefix_len = rule->prefix_len < 16 ? rule->prefix_len : 16,
+                .out_iface = 7,
+            });
+    }
+    count_trie_stats(trie->root, &walked);
+    fails += _test_trie_stats_totals(&trie->stats);
+    if (memcmp(&trie->stats, &walked, sizeof(TrieStats)) != 0) {
+        printf("! TEST FAIL ! Counted shape differs from the trie's\n");
+        fails++;
+    }
+    destroy_trie(trie);
+
+    TEST_REPORT("trie stats", fails);
+
+    return fails;
+}
+
 
 // Test wrapper for lookup
 int _test_lookup(ip_addr_t ip, TrieNode *trie, int expected) {
@@ -737,6 +1405,1476 @@ int test_lookup() {
 }
 
 
+// Test collection for batch lookups. Results must match lookup_ip's
+int test_lookup_batch() {
+    printf("\n=== Testing lookup_ip_batch ===\n");
+    int fails = 0;
+
+    TrieNode *trie = build_test_trie2();
+
+    // More addresses than lanes, and not a multiple of them
+    size_t n = 3 * LOOKUP_BATCH_LANES + 5;
+    ip_addr_t *addrs = malloc(n * sizeof(ip_addr_t));
+    uint32_t *out = malloc(n * sizeof(uint32_t));
+    int *access_counts = malloc(n * sizeof(int));
+
+    srand(42);
+    for (size_t i = 0; i < n; i++) {
+        // Mix random addresses with some that go deep into the trie
+        addrs[i] = (i % 3 == 0) ? str_to_ip("10.0.0.0") + (i << 16)
+            : ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    }
+
+    lookup_ip_batch(addrs, out, n, trie, access_counts);
+
+    for (size_t i = 0; i < n; i++) {
+        int expected_count = 0;
+        uint32_t expected = lookup_ip(addrs[i], trie, &expected_count);
+        if (out[i] != expected || access_counts[i] != expected_count) {
+            printf("Address 0x%08X: %u in %d accesses "
+                   "(expected %u in %d)\n", addrs[i], out[i],
+                   access_counts[i], expected, expected_count);
+            fails++;
+        }
+    }
+    printf("Looked up %zu addresses in batch, %d mismatches\n", n, fails);
+
+    // A NULL access_counts must be accepted
+    lookup_ip_batch(addrs, out, 1, trie, NULL);
+
+    free(addrs);
+    free(out);
+    free(access_counts);
+    free_trie(trie);
+
+    TEST_REPORT("lookup_ip_batch", fails);
+
+    return fails;
+}
+
+
+// Test collection for compact tries. Lookups must match the original trie's
+int test_compact_trie() {
+    printf("\n=== Testing compact tries ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Empty trie ---\n");
+    if (create_compact_trie(NULL, 0) != NULL) {
+        printf("! TEST FAIL ! Expected NULL compact trie\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Freezing test_build_trie2's rules ---\n");
+    Rule rules[] = { // Same rules as in build_test_trie2
+        make_rule("0.0.0.0",     0,  1),   // Default route
+        make_rule("0.1.0.0",     16, 2),
+        make_rule("10.0.0.0",    8,  3),
+        make_rule("10.0.0.0",    16, 10),
+        make_rule("10.1.0.0",    16, 11),
+        make_rule("10.2.0.0",    16, 12),
+        make_rule("10.4.0.0",    16, 14),
+        make_rule("10.5.0.0",    16, 15),
+        make_rule("10.6.0.0",    16, 16),
+        make_rule("10.7.0.0",    16, 17),
+        make_rule("172.16.0.0",  12, 5),
+        make_rule("172.20.0.0",  16, 20),
+        make_rule("172.21.0.0",  16, 21),
+        make_rule("172.22.0.0",  16, 22),
+        make_rule("172.23.0.0",  16, 23),
+        make_rule("192.168.1.0", 24, 101),
+    };
+    size_t nrules = sizeof(rules) / sizeof(rules[0]);
+
+    TrieNode *trie = create_trie(rules, nrules);
+    CompactTrie *compact = freeze_trie(trie, rules, nrules);
+    if (compact == NULL) {
+        free_trie(trie);
+        TEST_FAIL("Freezing failed\n");
+    }
+
+    uint32_t count = count_nodes_compact_trie(compact);
+    uint32_t expected_count = count_nodes_trie(trie);
+    printf("Compact nodes: %u (expected: %u), %zu bytes each\n",
+            count, expected_count, sizeof(CompactNode));
+    if (count != expected_count) {
+        printf("! TEST FAIL ! Wrong node count\n");
+        fails++;
+    }
+
+    // The root must be the first node, with its children right after it
+    CompactNode root = compact->nodes[0];
+    if (compact_branch(root) != trie->branch
+            || compact_skip(root) != trie->skip || compact_adr(root) != 1) {
+        printf("! TEST FAIL ! Wrong root node\n");
+        fails++;
+    }
+
+    int mismatches = 0;
+    ip_addr_t addrs[256];
+    uint32_t out[256];
+    int access_counts[256];
+    for (uint32_t i = 0; i < 256; i++) {
+        // Cover every /8, with varying lower bits
+        addrs[i] = (i << 24) | (i * 0x010101 * 7);
+        if (i % 4 == 0) addrs[i] = str_to_ip("10.0.0.0") + (i << 14);
+        if (i % 4 == 1) addrs[i] = str_to_ip("172.16.0.0") + (i << 14);
+    }
+    lookup_ip_compact_batch(addrs, out, 256, compact, access_counts);
+    for (int i = 0; i < 256; i++) {
+        int count_trie = 0, count_compact = 0;
+        uint32_t expected = lookup_ip(addrs[i], trie, &count_trie);
+        uint32_t result = lookup_ip_compact(addrs[i], compact, &count_compact);
+        if (result != expected || count_compact != count_trie
+                || out[i] != expected || access_counts[i] != count_trie) {
+            printf("Address 0x%08X: %u/%u in %d/%d accesses "
+                   "(expected %u in %d)\n", addrs[i], result, out[i],
+                   count_compact, access_counts[i], expected, count_trie);
+            mismatches++;
+        }
+    }
+    printf("Looked up 256 addresses, %d mismatches\n", mismatches);
+    fails += mismatches;
+
+    free_compact_trie(compact);
+    free_trie(trie);
+
+    TEST_REPORT("compact tries", fails);
+
+    return fails;
+}
+
+int test_precompute_leaves() {
+    printf("\n=== Testing precompute_leaves ===\n");
+    int fails = 0;
+
+    // Deep nesting, with a duplicated prefix and a rule without interface,
+    // which are never candidates. Some interfaces are shared
+    Rule rules[] = {
+        make_rule("0.0.0.0",     0,  1),
+        make_rule("10.0.0.0",    8,  2),
+        make_rule("10.0.0.0",    8,  3),
+        make_rule("10.128.0.0",  9,  0),
+        make_rule("10.128.0.0",  12, 4),
+        make_rule("10.130.0.0",  16, 5),
+        make_rule("10.130.7.0",  24, 6),
+        make_rule("10.130.7.64", 26, 7),
+        make_rule("10.130.7.65", 32, 8),
+        make_rule("10.130.9.0",  24, 2),
+        make_rule("172.16.0.0",  12, 10),
+        make_rule("172.16.5.0",  24, 1),
+    };
+    size_t nrules = sizeof(rules) / sizeof(rules[0]);
+
+    Trie *trie = build_trie(rules, nrules);
+    CompactTrie *compact = trie ?
+        freeze_trie(trie->root, trie->rules, trie->num_rules) : NULL;
+    if (compact == NULL) {
+        destroy_trie(trie);
+        TEST_FAIL("Building failed\n");
+    }
+
+    printf("\n--- Test Case 1: Chain lengths ---\n");
+    uint32_t max_chain, max_candidates;
+    if (precompute_leaves(compact, &max_chain, &max_candidates) != 0) {
+        free_compact_trie(compact);
+        destroy_trie(trie);
+        TEST_FAIL("Precomputing failed\n");
+    }
+    printf("Longest chain: %u, longest list: %u, %u extra candidates\n",
+            max_chain, max_candidates, compact->num_candidates);
+    if (max_candidates >= max_chain) {
+        printf("! TEST FAIL ! Shadowed rules weren't left out\n");
+        fails++;
+    }
+    printf("Next hops: %u\n", compact->next_hops.num_hops);
+    if (compact->next_hops.num_hops != 10) { // 9 interfaces, and no route
+        printf("! TEST FAIL ! Next hops weren't deduplicated\n");
+        fails++;
+    }
+
+    // Every address around every rule's boundaries
+    printf("\n--- Test Case 2: Same results as the parent chains ---\n");
+    int mismatches = 0, checked = 0;
+    for (size_t i = 0; i < nrules; i++) {
+        uint32_t size = rules[i].prefix_len == 0 ?
+            0 : (uint32_t)1 << (32 - rules[i].prefix_len);
+        ip_addr_t addrs[] = {
+            rules[i].prefix, rules[i].prefix + size - 1,
+            rules[i].prefix - 1, rules[i].prefix + size, rules[i].prefix + 1,
+        };
+        for (size_t j = 0; j < sizeof(addrs) / sizeof(addrs[0]); j++) {
+            int accesses;
+            uint32_t expected = lookup_ip(addrs[j], trie->root, NULL);
+            uint32_t result = lookup_ip_compact(addrs[j], compact, &accesses);
+            uint32_t batch;
+            lookup_ip_compact_batch(&addrs[j], &batch, 1, compact, NULL);
+            checked++;
+            if (result != expected || batch != expected) {
+                printf("0x%08X: %u, batch %u (expected %u)\n",
+                        addrs[j], result, batch, expected);
+                mismatches++;
+            }
+        }
+    }
+    printf("%d of %d addresses mismatched\n", mismatches, checked);
+    if (mismatches > 0) {
+        printf("! TEST FAIL ! Results differ from lookup_ip's\n");
+        fails++;
+    }
+
+    free_compact_trie(compact);
+    destroy_trie(trie);
+
+    TEST_REPORT("precompute_leaves", fails);
+
+    return fails;
+}
+
+
+// Every kernel of lookup_ip_compact_batch must give lookup_ip_compact's
+// results, with the same access counts
+int test_compact_kernels() {
+    printf("\n=== Testing compact trie kernels ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Kernel selection ---\n");
+    CompactKernel best = resolve_compact_kernel(COMPACT_KERNEL_AUTO);
+    printf("Widest supported kernel: %s\n", compact_kernel_name(best));
+    if (best == COMPACT_KERNEL_AUTO
+            || resolve_compact_kernel(COMPACT_KERNEL_SCALAR)
+                != COMPACT_KERNEL_SCALAR) {
+        printf("! TEST FAIL ! Kernels weren't resolved\n");
+        fails++;
+    }
+
+    // Random prefixes of every length, so that the trie has deep paths
+    size_t nrules = 2000;
+    Rule *rules = malloc(nrules * sizeof(Rule));
+    srand(7);
+    for (size_t i = 0; i < nrules; i++) {
+        uint8_t len = i == 0 ? 0 : 1 + i % 32;
+        ip_addr_t prefix = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+        rules[i] = (Rule){
+            .prefix = len == 0 ? 0 : prefix & ~(uint32_t)0 << (32 - len),
+            .prefix_len = len,
+            .out_iface = 1 + i % 50,
+        };
+    }
+
+    // More addresses than the widest kernel's lanes, and not a multiple
+    size_t n = 3 * 16 + 5;
+    ip_addr_t *addrs = malloc(n * sizeof(ip_addr_t));
+    uint32_t *out = malloc(n * sizeof(uint32_t));
+    int *access_counts = malloc(n * sizeof(int));
+    for (size_t i = 0; i < n; i++) {
+        // Half of them under some rule's prefix, the rest anywhere
+        addrs[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+        if (i % 2 == 0)
+            addrs[i] = rules[rand() % nrules].prefix | (addrs[i] & 0xFF);
+    }
+
+    const char *cases[] = {"Default root", "Wide root", "Precomputed leaves"};
+    for (int c = 0; c < 3; c++) {
+        printf("\n--- Test Case %d: %s ---\n", c + 2, cases[c]);
+        TrieBuildOptions options = {
+            .num_threads = 1,
+            .root_branch = c == 1 ? 16 : 0,
+        };
+        Trie *trie = build_trie_with_options(rules, nrules, &options);
+        CompactTrie *compact = trie ?
+            freeze_trie(trie->root, trie->rules, trie->num_rules) : NULL;
+        destroy_trie(trie);
+        if (compact == NULL || (c == 2
+                && precompute_leaves(compact, NULL, NULL) != 0)) {
+            printf("! TEST FAIL ! Building failed\n");
+            free_compact_trie(compact);
+            fails++;
+            continue;
+        }
+
+        for (CompactKernel k = COMPACT_KERNEL_AUTO;
+                k <= COMPACT_KERNEL_AVX512; k++) {
+            lookup_ip_compact_batch_with(addrs, out, n, compact,
+                    access_counts, k);
+            int mismatches = 0;
+            for (size_t i = 0; i < n; i++) {
+                int expected_count = 0;
+                uint32_t expected = lookup_ip_compact(addrs[i], compact,
+                        &expected_count);
+                if (out[i] != expected || access_counts[i] != expected_count) {
+                    printf("Address 0x%08X: %u in %d accesses "
+                           "(expected %u in %d)\n", addrs[i], out[i],
+                           access_counts[i], expected, expected_count);
+                    mismatches++;
+                }
+            }
+            printf("Kernel %s (runs as %s): %d mismatches\n",
+                    compact_kernel_name(k),
+                    compact_kernel_name(resolve_compact_kernel(k)),
+                    mismatches);
+            fails += mismatches;
+        }
+        free_compact_trie(compact);
+    }
+
+    free(rules);
+    free(addrs);
+    free(out);
+    free(access_counts);
+
+    TEST_REPORT("compact trie kernels", fails);
+
+    return fails;
+}
+
+
+// Test collection for trie handles
+int test_build_trie() {
+    printf("\n=== Testing build_trie ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Empty trie ---\n");
+    if (build_trie(NULL, 0) != NULL) {
+        printf("! TEST FAIL ! Expected NULL trie\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Unsorted rules ---\n");
+    Rule rules[] = {
+        make_rule("192.168.1.0", 24, 1),
+        make_rule("0.0.0.0", 0, 2), // Default route
+        make_rule("10.0.0.0", 8, 3),
+        make_rule("192.168.0.0", 16, 4),
+        make_rule("192.168.0.0", 24, 5),
+        make_rule("10.0.0.0", 16, 6)
+    };
+    size_t nrules = sizeof(rules) / sizeof(rules[0]);
+    Rule original[sizeof(rules) / sizeof(rules[0])];
+    memcpy(original, rules, sizeof(rules));
+
+    Trie *trie = build_trie(rules, nrules);
+    if (trie == NULL)
+        TEST_FAIL("Building failed\n");
+    print_trie(trie->root, NULL, NULL, 0);
+
+    if (memcmp(original, rules, sizeof(rules)) != 0) {
+        printf("! TEST FAIL ! Input rules were modified\n");
+        fails++;
+    }
+
+    // Must be the same as a trie created the usual way
+    Rule *sorted = sort_rules(rules, nrules);
+    TrieNode *expected = create_trie(sorted, nrules);
+    for (size_t i = 0; i < nrules; i++) {
+        if (!eq_rules(&trie->rules[i], &sorted[i])) {
+            printf("! TEST FAIL ! Rule %zu isn't sorted\n", i);
+            fails++;
+        }
+    }
+    if (!eq_tries(trie->root, expected)) {
+        printf("! TEST FAIL ! Trie differs from create_trie's\n");
+        fails++;
+    }
+
+    free_trie(expected);
+    free(sorted);
+    destroy_trie(trie);
+
+    TEST_REPORT("build_trie", fails);
+
+    return fails;
+}
+
+
+// Test collection for trie_insert_rule and trie_delete_rule
+int test_build_trie_parallel() {
+    printf("\n=== Testing build_trie_parallel ===\n");
+    int fails = 0;
+
+    // Enough rules for the upper levels to be split into tasks. A default
+    // route makes sure no leaf is empty, as eq_tries can't compare those
+    enum { NUM_RULES = 20000 };
+    static Rule rules[NUM_RULES];
+    srand(10);
+    rules[0] = make_rule("0.0.0.0", 0, 1);
+    for (size_t i = 1; i < NUM_RULES; i++) {
+        uint8_t len = 8 + rand() % 25;
+        uint32_t prefix = (uint32_t)rand() << 16 ^ rand();
+        rules[i].prefix = prefix & (0xFFFFFFFF << (32 - len));
+        rules[i].prefix_len = len;
+        rules[i].out_iface = 1 + i;
+        rules[i].parent = NULL;
+    }
+
+    Trie *expected = build_trie(rules, NUM_RULES);
+    if (expected == NULL)
+        TEST_FAIL("Building failed\n");
+
+    static const int threads[] = {1, 2, 3, 8};
+    for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        printf("\n--- Test Case %zu: %d threads ---\n", t + 1, threads[t]);
+        Trie *trie = build_trie_parallel(rules, NUM_RULES, threads[t]);
+        if (trie == NULL) {
+            printf("! TEST FAIL ! Building failed\n");
+            fails++;
+            continue;
+        }
+        printf("%u nodes, %zu bytes in arena\n", count_nodes_trie(trie->root),
+                trie->arena.allocated);
+        if (!eq_tries(trie->root, expected->root)) {
+            printf("! TEST FAIL ! Trie differs from build_trie's\n");
+            fails++;
+        }
+        if (trie->arena.allocated != expected->arena.allocated) {
+            printf("! TEST FAIL ! Arena has %zu bytes instead of %zu\n",
+                    trie->arena.allocated, expected->arena.allocated);
+            fails++;
+        }
+        destroy_trie(trie);
+    }
+    destroy_trie(expected);
+
+    TEST_REPORT("build_trie_parallel", fails);
+
+    return fails;
+}
+
+int test_trie_update() {
+    printf("\n=== Testing trie_insert_rule and trie_delete_rule ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Nested prefix inserted under a branch ---\n");
+    Rule rules1[] = {
+        make_rule("5.0.0.0",  8,  75),
+        make_rule("5.0.0.0",  9,  18),
+        make_rule("5.64.0.0", 10, 41),
+        make_rule("5.72.0.0", 16, 1),
+        make_rule("5.76.0.0", 16, 2),
+        make_rule("5.78.0.0", 16, 3),
+        make_rule("5.79.0.0", 16, 4),
+    };
+    Trie *trie = build_trie(rules1, sizeof(rules1) / sizeof(rules1[0]));
+    if (trie == NULL)
+        TEST_FAIL("Building failed\n");
+    Rule nested = make_rule("5.64.0.0", 12, 48);
+    if (trie_insert_rule(trie, &nested) != 0) {
+        printf("! TEST FAIL ! Insert failed\n");
+        fails++;
+    }
+    print_trie(trie->root, NULL, NULL, 0);
+    fails += _test_lookup(str_to_ip("5.77.162.172"), trie->root, 48);
+    fails += _test_lookup(str_to_ip("5.78.162.172"), trie->root, 3);
+    fails += _test_lookup(str_to_ip("5.80.0.1"), trie->root, 41);
+    if (trie_delete_rule(trie, nested.prefix, nested.prefix_len) != 0) {
+        printf("! TEST FAIL ! Delete failed\n");
+        fails++;
+    }
+    fails += _test_lookup(str_to_ip("5.77.162.172"), trie->root, 41);
+
+    printf("\n--- Test Case 2: Invalid updates ---\n");
+    Rule bad = make_rule("5.64.0.1", 12, 9); // Bits set past the length
+    if (trie_insert_rule(trie, &bad) != -1 ||
+            trie_delete_rule(trie, nested.prefix, nested.prefix_len) != -1) {
+        printf("! TEST FAIL ! Invalid update accepted\n");
+        fails++;
+    }
+    destroy_trie(trie);
+
+    // Random nested rules, so that every kind of node is rebuilt at some point
+    printf("\n--- Test Case 3: Random updates, checked by linear search ---\n");
+    static const uint8_t lengths[] = {0, 4, 8, 9, 10, 12, 16, 17, 20, 24, 32};
+    enum { POOL = 600, ROUNDS = 200, UPDATES = 10, LOOKUPS = 500 };
+    static Rule pool[POOL];
+    static bool active[POOL];
+    // Few bits in use, for lots of nesting
+    random_rule_pool(pool, active, POOL, lengths, sizeof(lengths), 0x0F0FFFFF,
+            8);
+
+    // Start with the first half
+    memset(active, 0, sizeof(active));
+    Rule initial[POOL / 2];
+    size_t ninitial = 0;
+    for (size_t i = 0; i < POOL / 2; i++) {
+        if (pool[i].out_iface == 0)
+            continue;
+        initial[ninitial++] = pool[i];
+        active[i] = true;
+    }
+    trie = build_trie(initial, ninitial);
+    if (trie == NULL)
+        TEST_FAIL("Building failed\n");
+
+    int wrong = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int u = 0; u < UPDATES; u++) {
+            size_t i = rand() % POOL;
+            if (pool[i].out_iface == 0)
+                continue;
+            int status;
+            if (active[i]) {
+                status = trie_delete_rule(trie, pool[i].prefix,
+                        pool[i].prefix_len);
+            } else {
+                status = trie_insert_rule(trie, &pool[i]);
+            }
+            active[i] = !active[i];
+            if (status != 0 && fails++ < 5)
+                printf("! TEST FAIL ! Update of rule %zu failed\n", i);
+        }
+
+        for (int l = 0; l < LOOKUPS; l++) {
+            ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand());
+            if (l % 2)
+                ip &= 0x0F0FFFFF; // Where the rules are
+            uint32_t expected = linear_lookup(pool, active, POOL, ip);
+            uint32_t iface = lookup_ip(ip, trie->root, NULL);
+            if (iface != expected && wrong++ < 5) {
+                printf("! TEST FAIL ! Round %d: 0x%08X -> %u (expected %u)\n",
+                        round, ip, iface, expected);
+            }
+        }
+    }
+    printf("%d wrong lookups, %zu bytes wasted\n", wrong, trie->wasted);
+    fails += wrong;
+
+    printf("\n--- Test Case 4: Compacting ---\n");
+    size_t nactive = 0;
+    for (size_t i = 0; i < POOL; i++)
+        nactive += active[i];
+    if (trie_compact(trie) != 0 || trie->rules == NULL || trie->wasted != 0
+            || trie->num_rules != nactive) {
+        printf("! TEST FAIL ! Compacting failed\n");
+        fails++;
+    } else {
+        // Must be the same as a trie built from scratch
+        Rule *current = malloc(nactive * sizeof(Rule));
+        for (size_t i = 0, j = 0; i < POOL; i++) {
+            if (active[i])
+                current[j++] = pool[i];
+        }
+        Trie *expected = build_trie(current, nactive);
+        if (!eq_tries(trie->root, expected->root)) {
+            printf("! TEST FAIL ! Trie differs from build_trie's\n");
+            fails++;
+        }
+        destroy_trie(expected);
+        free(current);
+    }
+    destroy_trie(trie);
+
+    TEST_REPORT("trie_insert_rule and trie_delete_rule", fails);
+
+    return fails;
+}
+
+int test_wide_root() {
+    printf("\n=== Testing build_trie_with_options (wide root) ===\n");
+    int fails = 0;
+
+    // Nested rules, many of them shorter than the root's branch
+    static const uint8_t lengths[] = {0, 3, 8, 11, 12, 13, 16, 20, 24, 32};
+    enum { POOL = 2000, LOOKUPS = 20000, UPDATES = 2000 };
+    static Rule pool[POOL];
+    static bool active[POOL];
+    random_rule_pool(pool, active, POOL, lengths, sizeof(lengths), 0x3F3FFFFF,
+            12);
+    Rule *rules = malloc(POOL * sizeof(Rule));
+    size_t nrules = 0;
+    for (size_t i = 0; i < POOL; i++) {
+        if (active[i])
+            rules[nrules++] = pool[i];
+    }
+
+    printf("\n--- Test Case 1: Forced root, checked by linear search ---\n");
+    TrieBuildOptions options = { .num_threads = 1, .root_branch = 12 };
+    Trie *trie = build_trie_with_options(rules, nrules, &options);
+    options.num_threads = 3;
+    Trie *parallel = build_trie_with_options(rules, nrules, &options);
+    if (trie == NULL || parallel == NULL) {
+        free(rules);
+        destroy_trie(trie);
+        destroy_trie(parallel);
+        TEST_FAIL("Building failed\n");
+    }
+    printf("%u nodes, root branch %u\n", count_nodes_trie(trie->root),
+            trie->root->branch);
+    if (trie->root->branch != 12 || trie->root_branch != 12) {
+        printf("! TEST FAIL ! Root branch wasn't forced\n");
+        fails++;
+    }
+    if (!eq_tries(parallel->root, trie->root)) {
+        printf("! TEST FAIL ! Trie differs when built in 3 threads\n");
+        fails++;
+    }
+    int wrong = 0;
+    for (int l = 0; l < LOOKUPS; l++) {
+        ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand());
+        if (l % 2)
+            ip &= 0x3F3FFFFF; // Where the rules are
+        uint32_t expected = linear_lookup(pool, active, POOL, ip);
+        uint32_t iface = lookup_ip(ip, trie->root, NULL);
+        uint32_t iface_parallel = lookup_ip(ip, parallel->root, NULL);
+        if ((iface != expected || iface_parallel != expected) && wrong++ < 5)
+            printf("! TEST FAIL ! 0x%08X -> %u/%u (expected %u)\n",
+                    ip, iface, iface_parallel, expected);
+    }
+    printf("%d wrong lookups\n", wrong);
+    fails += wrong;
+    destroy_trie(parallel);
+
+    printf("\n--- Test Case 2: Updates keep the root ---\n");
+    wrong = 0;
+    for (int u = 0; u < UPDATES; u++) {
+        size_t i = rand() % POOL;
+        bool duplicate = false;
+        for (size_t j = 0; j < i && !duplicate; j++) {
+            duplicate = pool[j].prefix == pool[i].prefix &&
+                pool[j].prefix_len == pool[i].prefix_len;
+        }
+        if (duplicate)
+            continue;
+        int status = active[i] ?
+            trie_delete_rule(trie, pool[i].prefix, pool[i].prefix_len) :
+            trie_insert_rule(trie, &pool[i]);
+        active[i] = !active[i];
+        if (status != 0 && fails++ < 5)
+            printf("! TEST FAIL ! Update of rule %zu failed\n", i);
+
+        ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand()) & 0x3F3FFFFF;
+        uint32_t expected = linear_lookup(pool, active, POOL, ip);
+        uint32_t iface = lookup_ip(ip, trie->root, NULL);
+        if (iface != expected && wrong++ < 5)
+            printf("! TEST FAIL ! Update %d: 0x%08X -> %u (expected %u)\n",
+                    u, ip, iface, expected);
+    }
+    printf("%d wrong lookups\n", wrong);
+    fails += wrong;
+    if (trie->root->branch != 12 || trie_compact(trie) != 0
+            || trie->root->branch != 12) {
+        printf("! TEST FAIL ! Root branch wasn't kept\n");
+        fails++;
+    }
+    destroy_trie(trie);
+
+    printf("\n--- Test Case 3: Automatic and invalid root branches ---\n");
+    options = (TrieBuildOptions){ .num_threads = 1,
+        .root_branch = ROOT_BRANCH_AUTO };
+    trie = build_trie_with_options(rules, nrules, &options);
+    if (trie == NULL || trie->root->branch != MIN_AUTO_ROOT_BRANCH) {
+        printf("! TEST FAIL ! Small table didn't get the narrowest root\n");
+        fails++;
+    }
+    destroy_trie(trie);
+    options.root_branch = MAX_ROOT_BRANCH + 1;
+    if (build_trie_with_options(rules, nrules, &options) != NULL) {
+        printf("! TEST FAIL ! Invalid root branch accepted\n");
+        fails++;
+    }
+    free(rules);
+
+    TEST_REPORT("build_trie_with_options", fails);
+
+    return fails;
+}
+
+
+// =============================================================== //
+// DIR-24-8 tests                                                  //
+// =============================================================== //
+
+// Test collection for build_dir24_8 and its lookups
+int test_dir24_8() {
+    printf("\n=== Testing build_dir24_8 ===\n");
+    int fails = 0;
+
+    // Nested rules on both sides of /24, with some duplicated prefixes
+    static const uint8_t lengths[] = {8, 16, 20, 23, 24, 25, 26, 28, 30, 32};
+    enum { NRULES = 3000, LOOKUPS = 50000, BATCH = 1000 };
+    Rule *rules = malloc(NRULES * sizeof(Rule));
+    if (rules == NULL)
+        TEST_FAIL("Out of memory\n");
+    srand(15);
+    for (size_t i = 0; i < NRULES; i++) {
+        uint8_t len = lengths[rand() % sizeof(lengths)];
+        uint32_t prefix = ((uint32_t)rand() << 16 ^ rand()) & 0x0F0F0FFF;
+        if (i % 10 == 9)
+            prefix = rules[rand() % i].prefix; // Same prefix, maybe same length
+        rules[i].prefix = len == 0 ? 0 : prefix & (0xFFFFFFFF << (32 - len));
+        rules[i].prefix_len = len;
+        rules[i].out_iface = i % 50 == 0 ? 0 : 1 + rand() % 100;
+        rules[i].parent = NULL;
+    }
+    rules[NRULES / 2] = make_rule("0.0.0.0", 0, 7); // Default route
+
+    printf("\n--- Test Case 1: Same answers as an LC-Trie ---\n");
+    Trie *trie = build_trie(rules, NRULES);
+    free(rules);
+    if (trie == NULL)
+        TEST_FAIL("Building the trie failed\n");
+    // Sorted like the trie's, so that duplicates resolve the same way
+    Dir24_8 *dir = build_dir24_8(trie->rules, trie->num_rules);
+    if (dir == NULL) {
+        destroy_trie(trie);
+        TEST_FAIL("Building the table failed\n");
+    }
+    printf("%u blocks, %u next hops\n", dir->num_blocks,
+            dir->next_hops.num_hops);
+    if (count_entries_dir24_8(dir)
+            != DIR24_8_ENTRIES + dir->num_blocks * DIR24_8_BLOCK) {
+        printf("! TEST FAIL ! Wrong number of entries\n");
+        fails++;
+    }
+    int wrong = 0;
+    static ip_addr_t addrs[BATCH];
+    static uint32_t expected[BATCH];
+    for (int l = 0; l < LOOKUPS; l++) {
+        ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand());
+        if (l % 2)
+            ip &= 0x0F0F0FFF; // Where the rules are
+        int accesses = 0;
+        uint32_t iface = lookup_ip_dir24_8(ip, dir, &accesses);
+        uint32_t trie_iface = lookup_ip(ip, trie->root, NULL);
+        int long_entry = (dir->tbl24[ip >> 8] & DIR24_8_LONG) != 0;
+        if ((iface != trie_iface || accesses != 1 + long_entry)
+                && wrong++ < 5)
+            printf("! TEST FAIL ! 0x%08X -> %u in %d accesses (expected "
+                    "%u in %d)\n", ip, iface, accesses, trie_iface,
+                    1 + long_entry);
+        if (l < BATCH) {
+            addrs[l] = ip;
+            expected[l] = iface;
+        }
+    }
+    printf("%d wrong lookups\n", wrong);
+    fails += wrong;
+
+    printf("\n--- Test Case 2: Batch lookups ---\n");
+    static uint32_t out[BATCH];
+    static int batch_accesses[BATCH];
+    lookup_ip_dir24_8_batch(addrs, out, BATCH, dir, batch_accesses);
+    wrong = 0;
+    for (int i = 0; i < BATCH; i++) {
+        int accesses = 0;
+        lookup_ip_dir24_8(addrs[i], dir, &accesses);
+        if ((out[i] != expected[i] || batch_accesses[i] != accesses)
+                && wrong++ < 5)
+            printf("! TEST FAIL ! Batch: 0x%08X -> %u (expected %u)\n",
+                    addrs[i], out[i], expected[i]);
+    }
+    lookup_ip_dir24_8_batch(addrs, out, BATCH, dir, NULL);
+    if (memcmp(out, expected, sizeof(out)) != 0)
+        wrong++;
+    printf("%d wrong lookups\n", wrong);
+    fails += wrong;
+    free_dir24_8(dir);
+    destroy_trie(trie);
+
+    printf("\n--- Test Case 3: Empty table ---\n");
+    dir = build_dir24_8(NULL, 0);
+    if (dir != NULL) {
+        printf("! TEST FAIL ! Built from a NULL array\n");
+        fails++;
+        free_dir24_8(dir);
+    }
+    Rule none = make_rule("10.0.0.0", 8, 0);
+    dir = build_dir24_8(&none, 1);
+    if (dir == NULL) {
+        printf("! TEST FAIL ! Building the table failed\n");
+        fails++;
+    } else if (lookup_ip_dir24_8(str_to_ip("10.1.2.3"), dir, NULL) != 0
+            || dir->next_hops.num_hops != 1) {
+        printf("! TEST FAIL ! A rule with interface 0 was used\n");
+        fails++;
+    }
+    free_dir24_8(dir);
+
+    printf("\n--- Test Case 4: Bits set past the prefix length ---\n");
+    // As a FIB can have them. They used to be written past the tables
+    Rule hosts[] = {
+        make_rule("255.255.255.0", 8, 5),
+        make_rule("10.1.2.200", 25, 6),
+        make_rule("10.1.2.0", 24, 7),
+        make_rule("10.1.2.255", 31, 8),
+    };
+    static const struct {
+        const char *ip;
+        uint32_t iface;
+    } host_lookups[] = {
+        {"255.1.2.3", 5}, {"255.255.255.255", 5}, {"10.1.2.100", 7},
+        {"10.1.2.128", 6}, {"10.1.2.253", 6}, {"10.1.2.254", 8},
+        {"10.1.3.0", 0},
+    };
+    dir = build_dir24_8(hosts, sizeof(hosts) / sizeof(hosts[0]));
+    if (dir == NULL)
+        TEST_FAIL("Building the table failed\n");
+    printf("%u blocks\n", dir->num_blocks);
+    for (size_t i = 0; i < sizeof(host_lookups) / sizeof(host_lookups[0]);
+            i++) {
+        uint32_t iface = lookup_ip_dir24_8(str_to_ip(host_lookups[i].ip),
+                dir, NULL);
+        if (iface != host_lookups[i].iface) {
+            printf("! TEST FAIL ! %s -> %u (expected %u)\n",
+                    host_lookups[i].ip, iface, host_lookups[i].iface);
+            fails++;
+        }
+    }
+    if (dir->num_blocks != 1) {
+        printf("! TEST FAIL ! Expected a single block\n");
+        fails++;
+    }
+    free_dir24_8(dir);
+
+    printf("\n--- Test Case 5: As many next hops as there can be ---\n");
+    // One /24 per interface, so that there are no blocks
+    Rule *many = malloc((DIR24_8_MAX_NEXT_HOPS + 1) * sizeof(Rule));
+    if (many == NULL)
+        TEST_FAIL("Out of memory\n");
+    for (uint32_t i = 0; i <= DIR24_8_MAX_NEXT_HOPS; i++) {
+        many[i] = (Rule){ .prefix = i << 8, .prefix_len = 24,
+            .out_iface = 1 + i };
+    }
+    dir = build_dir24_8(many, DIR24_8_MAX_NEXT_HOPS);
+    if (dir == NULL || dir->next_hops.num_hops != DIR24_8_MAX_NEXT_HOPS + 1
+            || lookup_ip_dir24_8((DIR24_8_MAX_NEXT_HOPS - 1) << 8, dir, NULL)
+                != DIR24_8_MAX_NEXT_HOPS) {
+        printf("! TEST FAIL ! %d next hops weren't all kept\n",
+                DIR24_8_MAX_NEXT_HOPS);
+        fails++;
+    }
+    free_dir24_8(dir);
+    dir = build_dir24_8(many, DIR24_8_MAX_NEXT_HOPS + 1);
+    if (dir != NULL) {
+        printf("! TEST FAIL ! Built with %d next hops\n",
+                DIR24_8_MAX_NEXT_HOPS + 1);
+        fails++;
+    }
+    free_dir24_8(dir);
+    free(many);
+
+    TEST_REPORT("build_dir24_8", fails);
+
+    return fails;
+}
+
+
+// =============================================================== //
+// Tree Bitmap tests                                               //
+// =============================================================== //
+
+// Test collection for build_tree_bitmap, its lookups and its updates
+int test_tree_bitmap() {
+    printf("\n=== Testing build_tree_bitmap ===\n");
+    int fails = 0;
+
+    // Nested rules of every length, including stride boundaries
+    uint8_t lengths[33];
+    for (uint8_t len = 0; len <= 32; len++)
+        lengths[len] = len;
+    enum { POOL = 3000, LOOKUPS = 20000, UPDATES = 6000, BATCH = 1000 };
+    static Rule pool[POOL];
+    static bool active[POOL];
+    random_rule_pool(pool, active, POOL, lengths, sizeof(lengths), 0x3F3FFFFF,
+            17);
+    Rule *rules = malloc(POOL * sizeof(Rule));
+    if (rules == NULL)
+        TEST_FAIL("Out of memory\n");
+    size_t nrules = 0;
+    for (size_t i = 0; i < POOL; i++) {
+        if (active[i])
+            rules[nrules++] = pool[i];
+    }
+    sort_rules_in_place(rules, nrules);
+
+    printf("\n--- Test Case 1: Built tree, checked by linear search ---\n");
+    TreeBitmap *tree = build_tree_bitmap(rules, nrules);
+    if (tree == NULL) {
+        free(rules);
+        TEST_FAIL("Building failed\n");
+    }
+    uint32_t built_nodes = count_nodes_tree_bitmap(tree);
+    printf("%u nodes, %u results\n", built_nodes, tree->num_results);
+    if (tree->num_results != nrules - 1) { // All but the default route
+        printf("! TEST FAIL ! Expected %zu results\n", nrules - 1);
+        fails++;
+    }
+    static ip_addr_t addrs[BATCH];
+    static uint32_t expected[BATCH], out[BATCH];
+    static int accesses[BATCH];
+    int wrong = 0;
+    for (int l = 0; l < LOOKUPS; l++) {
+        ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand());
+        if (l % 2)
+            ip &= 0x3F3FFFFF; // Where the rules are
+        int access_count = 0;
+        uint32_t iface = lookup_ip_tree_bitmap(ip, tree, &access_count);
+        uint32_t linear = linear_lookup(pool, active, POOL, ip);
+        if ((iface != linear || access_count < 1
+                    || access_count > TREE_BITMAP_LEVELS + 1) && wrong++ < 5)
+            printf("! TEST FAIL ! 0x%08X -> %u in %d accesses (expected %u)\n",
+                    ip, iface, access_count, linear);
+        if (l < BATCH) {
+            addrs[l] = ip;
+            expected[l] = linear;
+            accesses[l] = access_count;
+        }
+    }
+    static int batch_accesses[BATCH];
+    lookup_ip_tree_bitmap_batch(addrs, out, BATCH, tree, batch_accesses);
+    if ((memcmp(out, expected, sizeof(out)) != 0
+                || memcmp(batch_accesses, accesses, sizeof(accesses)) != 0)
+            && wrong++ < 5)
+        printf("! TEST FAIL ! Batch lookups differ\n");
+    printf("%d wrong lookups\n", wrong);
+    fails += wrong;
+
+    printf("\n--- Test Case 2: Inserting and deleting rules ---\n");
+    wrong = 0;
+    int compactions = 0;
+    for (int u = 0; u < UPDATES; u++) {
+        size_t i = rand() % POOL;
+        bool duplicate = false;
+        for (size_t j = 0; j < i && !duplicate; j++) {
+            duplicate = pool[j].prefix == pool[i].prefix &&
+                pool[j].prefix_len == pool[i].prefix_len;
+        }
+        if (duplicate)
+            continue;
+        uint32_t wasted = tree->wasted_nodes + tree->wasted_results;
+        int status = active[i] ?
+            tree_bitmap_delete_rule(tree, pool[i].prefix, pool[i].prefix_len) :
+            tree_bitmap_insert_rule(tree, &pool[i]);
+        active[i] = !active[i];
+        if (status != 0 && fails++ < 5)
+            printf("! TEST FAIL ! Update of rule %zu failed\n", i);
+        if (tree->wasted_nodes + tree->wasted_results < wasted)
+            compactions++;
+
+        ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand()) & 0x3F3FFFFF;
+        if (u % 2)
+            ip = pool[i].prefix | (rand() & 0xFF); // Next to the update
+        uint32_t linear = linear_lookup(pool, active, POOL, ip);
+        uint32_t iface = lookup_ip_tree_bitmap(ip, tree, NULL);
+        if (iface != linear && wrong++ < 5)
+            printf("! TEST FAIL ! Update %d: 0x%08X -> %u (expected %u)\n",
+                    u, ip, iface, linear);
+    }
+    printf("%d wrong lookups, %d compactions\n", wrong, compactions);
+    fails += wrong;
+    if (compactions == 0) {
+        printf("! TEST FAIL ! The tree was never compacted\n");
+        fails++;
+    }
+
+    // Empty nodes are removed, so it's the same as a new tree of those rules
+    nrules = 0;
+    for (size_t i = 0; i < POOL; i++) {
+        if (active[i])
+            rules[nrules++] = pool[i];
+    }
+    sort_rules_in_place(rules, nrules);
+    TreeBitmap *rebuilt = build_tree_bitmap(rules, nrules);
+    if (rebuilt == NULL || count_nodes_tree_bitmap(rebuilt)
+            != count_nodes_tree_bitmap(tree)) {
+        printf("! TEST FAIL ! %u nodes after updates, %u if built again\n",
+                count_nodes_tree_bitmap(tree),
+                count_nodes_tree_bitmap(rebuilt));
+        fails++;
+    }
+    free_tree_bitmap(rebuilt);
+
+    printf("\n--- Test Case 3: Invalid and redundant updates ---\n");
+    Rule bad = make_rule("10.0.0.1", 24, 5);
+    Rule none = make_rule("10.1.2.0", 24, 0);
+    Rule same = make_rule("10.1.2.0", 24, 6);
+    if (tree_bitmap_insert_rule(tree, &bad) != -1
+            || tree_bitmap_delete_rule(tree, 0x0A000001, 24) != -1
+            || tree_bitmap_delete_rule(tree, 0, 33) != -1) {
+        printf("! TEST FAIL ! Invalid prefix accepted\n");
+        fails++;
+    }
+    if (tree_bitmap_insert_rule(tree, &same) != 0
+            || tree_bitmap_insert_rule(tree, &none) != 0
+            || lookup_ip_tree_bitmap(str_to_ip("10.1.2.3"), tree, NULL) == 6
+            || tree_bitmap_delete_rule(tree, same.prefix, 24) != -1) {
+        printf("! TEST FAIL ! Interface 0 didn't delete the rule\n");
+        fails++;
+    }
+    free_tree_bitmap(tree);
+    free(rules);
+
+    TEST_REPORT("build_tree_bitmap", fails);
+
+    return fails;
+}
+
+
+// =============================================================== //
+// Trie image tests                                                //
+// =============================================================== //
+
+// Test collection for compact trie images. Mapped tries must look up exactly
+// like the ones they were saved from
+int test_trie_image() {
+    printf("\n=== Testing trie images ===\n");
+    int fails = 0;
+
+    // Nested prefixes, so that leaves have several candidates
+    Rule rules[] = {
+        make_rule("0.0.0.0",     0,  1),
+        make_rule("10.0.0.0",    8,  2),
+        make_rule("10.128.0.0",  12, 4),
+        make_rule("10.130.0.0",  16, 5),
+        make_rule("10.130.7.0",  24, 6),
+        make_rule("10.130.7.64", 26, 7),
+        make_rule("10.130.7.65", 32, 8),
+        make_rule("172.16.0.0",  12, 10),
+        make_rule("172.16.5.0",  24, 1),
+        make_rule("192.168.0.0", 16, 11),
+        make_rule("192.168.1.0", 24, 12),
+    };
+    size_t nrules = sizeof(rules) / sizeof(rules[0]);
+
+    Trie *trie = build_trie(rules, nrules);
+    CompactTrie *compact = trie ?
+        freeze_trie(trie->root, trie->rules, trie->num_rules) : NULL;
+    destroy_trie(trie);
+    if (compact == NULL)
+        TEST_FAIL("Building failed\n");
+
+    char image_name[] = "/tmp/proobs_image_XXXXXX";
+    close(mkstemp(image_name));
+
+    printf("\n--- Test Case 1: Saving without precomputed leaves ---\n");
+    if (save_trie_image(compact, 0, 0, image_name) == 0) {
+        printf("! TEST FAIL ! Saved a trie without leaves\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Mapping a saved image ---\n");
+    uint32_t max_chain, max_candidates;
+    uint32_t mapped_chain = 0, mapped_candidates = 0;
+    CompactTrie *mapped = NULL;
+    if (precompute_leaves(compact, &max_chain, &max_candidates) != 0
+            || save_trie_image(compact, max_chain, max_candidates,
+                image_name) != 0
+            || (mapped = map_trie_image(image_name, &mapped_chain,
+                &mapped_candidates)) == NULL) {
+        free_compact_trie(compact);
+        unlink(image_name);
+        TEST_FAIL("Couldn't save and map the image\n");
+    }
+    printf("Image of %zu bytes: %u nodes, %u candidates, %u next hops\n",
+            mapped->image_size, mapped->num_nodes, mapped->num_candidates,
+            mapped->next_hops.num_hops);
+    if (mapped->num_nodes != compact->num_nodes
+            || mapped->num_candidates != compact->num_candidates
+            || mapped->next_hops.num_hops != compact->next_hops.num_hops
+            || mapped_chain != max_chain
+            || mapped_candidates != max_candidates) {
+        printf("! TEST FAIL ! Sizes differ from the saved trie's\n");
+        fails++;
+    }
+    if ((uintptr_t)mapped->nodes % TRIE_IMAGE_ALIGN != 0
+            || (uintptr_t)mapped->leaves % TRIE_IMAGE_ALIGN != 0) {
+        printf("! TEST FAIL ! Sections aren't aligned\n");
+        fails++;
+    }
+
+    // Every address around every rule's boundaries, one by one and in batch
+    size_t n = 5 * nrules;
+    ip_addr_t addrs[5 * sizeof(rules) / sizeof(rules[0])];
+    uint32_t out[5 * sizeof(rules) / sizeof(rules[0])];
+    int access_counts[5 * sizeof(rules) / sizeof(rules[0])];
+    for (size_t i = 0; i < nrules; i++) {
+        uint32_t size = rules[i].prefix_len == 0 ?
+            0 : (uint32_t)1 << (32 - rules[i].prefix_len);
+        addrs[5 * i] = rules[i].prefix;
+        addrs[5 * i + 1] = rules[i].prefix + size - 1;
+        addrs[5 * i + 2] = rules[i].prefix - 1;
+        addrs[5 * i + 3] = rules[i].prefix + size;
+        addrs[5 * i + 4] = rules[i].prefix + 1;
+    }
+    lookup_ip_compact_batch(addrs, out, n, mapped, access_counts);
+    int mismatches = 0;
+    for (size_t i = 0; i < n; i++) {
+        int expected_count, count;
+        uint32_t expected = lookup_ip_compact(addrs[i], compact,
+                &expected_count);
+        uint32_t result = lookup_ip_compact(addrs[i], mapped, &count);
+        if (result != expected || out[i] != expected
+                || count != expected_count
+                || access_counts[i] != expected_count) {
+            printf("0x%08X: %u, batch %u in %d/%d accesses "
+                   "(expected %u in %d)\n", addrs[i], result, out[i], count,
+                   access_counts[i], expected, expected_count);
+            mismatches++;
+        }
+    }
+    printf("Looked up %zu addresses, %d mismatches\n", n, mismatches);
+    fails += mismatches;
+
+    // Copies of the image, broken in one way each, must all be rejected
+    printf("\n--- Test Case 3: Invalid images ---\n");
+    size_t image_size = mapped->image_size;
+    size_t buffer_size = (image_size + TRIE_IMAGE_ALIGN) / TRIE_IMAGE_ALIGN
+        * TRIE_IMAGE_ALIGN;
+    char *copy = aligned_alloc(TRIE_IMAGE_ALIGN, buffer_size);
+    TrieImageHeader *header = (TrieImageHeader *)copy;
+    const char *cases[] = {
+        "not an image", "another version", "other node layout",
+        "truncated", "nodes out of bounds", "misaligned section",
+    };
+    for (int c = 0; c < 6; c++) {
+        memcpy(copy, mapped->image, image_size);
+        size_t size = image_size;
+        switch (c) {
+        case 0: copy[0] = 'X'; break;
+        case 1: header->version++; break;
+        case 2: header->node_bits = COMPACT_NODE_BITS == 32 ? 64 : 32; break;
+        case 3: size--; break;
+        case 4: header->num_nodes = image_size; break;
+        case 5: header->hops += 4; break;
+        }
+        CompactTrie *opened = open_trie_image(copy, size, NULL, NULL);
+        printf("Image %s: %s\n", cases[c], opened ? "accepted" : "rejected");
+        if (opened != NULL) {
+            printf("! TEST FAIL ! Invalid image accepted\n");
+            fails++;
+            opened->image = NULL; // Not a mapping: leave it alone
+            free(opened);
+        }
+    }
+    if (is_trie_image("10.0.0.0/8\t1\n", 13)) {
+        printf("! TEST FAIL ! A FIB was taken for an image\n");
+        fails++;
+    }
+    free(copy);
+
+    printf("\n--- Test Case 4: Engines that load images ---\n");
+    const LookupEngine *engine = find_image_engine(find_engine("compact"));
+    printf("Images given to compact are loaded by %s\n",
+            engine ? engine->name : "none");
+    if (engine == NULL || engine->load_image == NULL
+            || find_image_engine(engine) != engine) {
+        printf("! TEST FAIL ! No engine loads images\n");
+        fails++;
+    }
+
+    free_compact_trie(mapped);
+    free_compact_trie(compact);
+    unlink(image_name);
+
+    TEST_REPORT("trie images", fails);
+
+    return fails;
+}
+
+
+// =============================================================== //
+// Engine tests                                                    //
+// =============================================================== //
+
+// Test collection for the lookup engines, driven through their interface
+int test_engines() {
+    printf("\n=== Testing lookup engines ===\n");
+    int fails = 0;
+
+    // Nested rules, without duplicated prefixes
+    static const uint8_t lengths[] = {0, 8, 12, 16, 20, 24, 26, 28, 32};
+    enum { POOL = 1000, LOOKUPS = 20000, BATCH = 1000 };
+    static Rule pool[POOL];
+    static bool active[POOL];
+    random_rule_pool(pool, active, POOL, lengths, sizeof(lengths), 0x3F3FFFFF,
+            16);
+    static Rule rules[POOL];
+    static ip_addr_t addrs[BATCH];
+    static uint32_t expected[BATCH], out[BATCH];
+    static int accesses[BATCH];
+    EngineOptions options = { .num_threads = 2, .root_branch = 0 };
+
+    for (int e = 0; LOOKUP_ENGINES[e] != NULL; e++) {
+        const LookupEngine *engine = LOOKUP_ENGINES[e];
+        printf("\n--- Test Case %d: %s ---\n", e + 1, engine->name);
+        if (find_engine(engine->name) != engine) {
+            printf("! TEST FAIL ! Engine not found by name\n");
+            fails++;
+        }
+
+        // Built from a shuffled copy, which the engine may reorder
+        size_t nrules = 0;
+        for (size_t i = 0; i < POOL; i++) {
+            if (active[i])
+                rules[nrules++] = pool[i];
+        }
+        for (size_t i = nrules - 1; i > 0; i--) {
+            size_t j = rand() % (i + 1);
+            Rule tmp = rules[i];
+            rules[i] = rules[j];
+            rules[j] = tmp;
+        }
+        void *table = engine->build(rules, nrules, &options);
+        if (table == NULL) {
+            printf("! TEST FAIL ! Building failed\n");
+            fails++;
+            continue;
+        }
+        printf("%u nodes, %zu bytes\n", engine->count_nodes(table),
+                engine->memory_usage(table));
+        engine->print_stats(table, stdout);
+        if (engine->count_nodes(table) == 0 || engine->memory_usage(table) == 0) {
+            printf("! TEST FAIL ! Empty table\n");
+            fails++;
+        }
+
+        int wrong = 0;
+        for (int l = 0; l < LOOKUPS; l++) {
+            ip_addr_t ip = ((uint32_t)rand() << 16 ^ rand());
+            if (l % 2)
+                ip &= 0x3F3FFFFF; // Where the rules are
+            int access_count = 0;
+            uint32_t iface = engine->lookup(table, ip, &access_count);
+            uint32_t linear = linear_lookup(pool, active, POOL, ip);
+            if ((iface != linear || access_count < 1) && wrong++ < 5)
+                printf("! TEST FAIL ! 0x%08X -> %u in %d accesses "
+                        "(expected %u)\n", ip, iface, access_count, linear);
+            if (l < BATCH) {
+                addrs[l] = ip;
+                expected[l] = linear;
+            }
+        }
+        engine->lookup_batch(table, addrs, out, BATCH, accesses);
+        if (memcmp(out, expected, sizeof(out)) != 0 && wrong++ < 5)
+            printf("! TEST FAIL ! Batch lookups differ\n");
+        printf("%d wrong lookups\n", wrong);
+        fails += wrong;
+        engine->destroy(table);
+    }
+
+    int num_engines = 0;
+    while (LOOKUP_ENGINES[num_engines] != NULL)
+        num_engines++;
+    printf("\n--- Test Case %d: More next hops than there can be ---\n",
+            num_engines + 1);
+    // One /24 per interface. Engines that can't build this must say so with
+    // max_next_hops, which is checked before building
+    enum { MANY = MAX_NEXT_HOPS + 5 };
+    Rule *many = malloc(MANY * sizeof(Rule));
+    if (many == NULL)
+        TEST_FAIL("Out of memory\n");
+    for (int e = 0; LOOKUP_ENGINES[e] != NULL; e++) {
+        const LookupEngine *engine = LOOKUP_ENGINES[e];
+        for (uint32_t i = 0; i < MANY; i++) {
+            many[i] = (Rule){ .prefix = i << 8, .prefix_len = 24,
+                .out_iface = 1 + i };
+        }
+        void *table = engine->build(many, MANY, &options);
+        if (table == NULL && (engine->max_next_hops == 0
+                    || engine->max_next_hops >= MANY)) {
+            printf("! TEST FAIL ! %s failed with %d next hops, but takes "
+                    "up to %u\n", engine->name, MANY, engine->max_next_hops);
+            fails++;
+        }
+        printf("%s: %s\n", engine->name, table ? "built" : "rejected");
+        if (table != NULL)
+            engine->destroy(table);
+    }
+    free(many);
+
+    printf("\n--- Test Case %d: Unknown engines ---\n", num_engines + 2);
+    if (find_engine("nope") != NULL || find_engine("") != NULL) {
+        printf("! TEST FAIL ! Unknown engine found\n");
+        fails++;
+    }
+    if (find_engine(DEFAULT_ENGINE) != LOOKUP_ENGINES[0]) {
+        printf("! TEST FAIL ! The default engine isn't the first one\n");
+        fails++;
+    }
+
+    TEST_REPORT("lookup engines", fails);
+
+    return fails;
+}
+
+// =============================================================== //
+// Latency histogram tests                                         //
+// =============================================================== //
+
+// Test collection for latency histograms. Percentiles must be within a bucket
+// of the exact ones, and merging must be the same as recording in one
+int test_latency() {
+    printf("\n=== Testing latency histograms ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Buckets ---\n");
+    // Every time must fall in a bucket no wider than 1/LATENCY_SUB_BUCKETS of
+    // it, and buckets must follow each other
+    uint32_t previous = 0;
+    for (uint64_t ns = 1; ns < LATENCY_MAX_NS; ns += ns / 7 + 1) {
+        uint32_t bucket = latency_bucket(ns);
+        uint32_t next = latency_bucket(ns + ns / LATENCY_SUB_BUCKETS + 1);
+        if (bucket < previous || bucket >= LATENCY_BUCKETS || next == bucket) {
+            printf("! TEST FAIL ! %llu ns in bucket %u (next %u)\n",
+                    (unsigned long long)ns, bucket, next);
+            fails++;
+            break;
+        }
+        previous = bucket;
+    }
+    if (latency_bucket(LATENCY_MAX_NS * 4) != LATENCY_BUCKETS - 1) {
+        printf("! TEST FAIL ! Times over the maximum aren't capped\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Percentiles of 1 to 100000 ns ---\n");
+    static LatencyHistogram histogram, halves[2];
+    for (uint64_t ns = 1; ns <= 100000; ns++) {
+        latency_record(&histogram, ns);
+        latency_record(&halves[ns % 2], ns);
+    }
+    double percentiles[] = {0, 50, 90, 99, 99.9, 100};
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(double); i++) {
+        uint64_t exact = percentiles[i] == 0 ? 1 : percentiles[i] * 1000;
+        uint64_t value = latency_percentile(&histogram, percentiles[i]);
+        printf("p%g: %llu ns (exact %llu)\n", percentiles[i],
+                (unsigned long long)value, (unsigned long long)exact);
+        if (value < exact || value > exact + exact / LATENCY_SUB_BUCKETS) {
+            printf("! TEST FAIL ! Too far from the exact percentile\n");
+            fails++;
+        }
+    }
+    if (histogram.min_ns != 1 || histogram.max_ns != 100000
+            || latency_mean(&histogram) != 50000.5) {
+        printf("! TEST FAIL ! Min %llu, max %llu, mean %f\n",
+                (unsigned long long)histogram.min_ns,
+                (unsigned long long)histogram.max_ns, latency_mean(&histogram));
+        fails++;
+    }
+
+    printf("\n--- Test Case 3: Merging ---\n");
+    static LatencyHistogram merged;
+    latency_merge(&merged, &halves[0]);
+    latency_merge(&merged, &halves[1]);
+    if (memcmp(&merged, &histogram, sizeof(LatencyHistogram)) != 0) {
+        printf("! TEST FAIL ! Merged halves differ from the whole\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 4: Batches ---\n");
+    static LatencyHistogram batches;
+    latency_record_batch(&batches, 1000, 3);
+    latency_record_batch(&batches, 50, 0); // Empty, ignored
+    if (batches.count != 3 || batches.sum_ns != 1000
+            || batches.counts[latency_bucket(333)] != 3) {
+        printf("! TEST FAIL ! Batch recorded as %llu times of sum %llu\n",
+                (unsigned long long)batches.count,
+                (unsigned long long)batches.sum_ns);
+        fails++;
+    }
+    static LatencyHistogram empty;
+    if (latency_percentile(&empty, 50) != 0 || latency_mean(&empty) != 0) {
+        printf("! TEST FAIL ! Empty histogram has times\n");
+        fails++;
+    }
+
+    printf("\n--- Test Case 5: Dumping ---\n");
+    char dump_name[] = "/tmp/proobs_latency_XXXXXX";
+    close(mkstemp(dump_name));
+    FILE *dump = NULL;
+    if (latency_dump(&batches, dump_name) != 0
+            || (dump = fopen(dump_name, "r")) == NULL) {
+        printf("! TEST FAIL ! Couldn't dump the histogram\n");
+        fails++;
+    } else {
+        char line[256];
+        unsigned long long lowest, highest, count;
+        int buckets = 0;
+        while (fgets(line, sizeof(line), dump) != NULL) {
+            if (line[0] == '#')
+                continue;
+            if (sscanf(line, "%llu %llu %llu", &lowest, &highest, &count) != 3
+                    || lowest > 333 || highest < 333 || count != 3) {
+                printf("! TEST FAIL ! Unexpected line: %s", line);
+                fails++;
+            }
+            buckets++;
+        }
+        if (buckets != 1) {
+            printf("! TEST FAIL ! %d buckets dumped, expected 1\n", buckets);
+            fails++;
+        }
+        fclose(dump);
+    }
+    unlink(dump_name);
+
+    TEST_REPORT("latency histograms", fails);
+
+    return fails;
+}
+
+// =============================================================== //
+// Hardware event counter tests                                    //
+// =============================================================== //
+
+// Test collection for hardware event counters. Machines without them (e.g.
+// most virtual ones) can only check that they're reported as not counted
+int test_perf_counters() {
+    printf("\n=== Testing hardware event counters ===\n");
+    int fails = 0;
+
+    printf("\n--- Test Case 1: Merging counts ---\n");
+    PerfCounts total = {0}, thread = {0};
+    thread.values[PERF_CYCLES] = 100;
+    thread.counted[PERF_CYCLES] = true;
+    perf_counts_merge(&total, &thread);
+    perf_counts_merge(&total, &thread);
+    if (total.values[PERF_CYCLES] != 200 || !total.counted[PERF_CYCLES]
+            || total.counted[PERF_INSTRUCTIONS]) {
+        printf("! TEST FAIL ! Merged %llu cycles\n",
+                (unsigned long long)total.values[PERF_CYCLES]);
+        fails++;
+    }
+
+    printf("\n--- Test Case 2: Counting a loop ---\n");
+    PerfCounters counters;
+    if (perf_counters_open(&counters, false) != 0) {
+        printf("No hardware event counters, nothing to count\n");
+    } else {
+        volatile uint64_t sum = 0;
+        PerfCounts counts = {0}, again = {0};
+        perf_counters_start(&counters);
+        for (int i = 0; i < 1000000; i++)
+            sum += i;
+        perf_counters_stop(&counters);
+        perf_counters_read(&counters, &counts);
+        for (int i = 0; i < 1000000; i++) // Not counted
+            sum += i;
+        perf_counters_read(&counters, &again);
+        for (int i = 0; i < PERF_EVENTS; i++) {
+            printf("%s: ", perf_event_name(i));
+            if (counts.counted[i])
+                printf("%llu\n", (unsigned long long)counts.values[i]);
+            else
+                printf("n/a\n");
+            if (counts.values[i] != again.values[i]) {
+                printf("! TEST FAIL ! Counted while stopped\n");
+                fails++;
+            }
+        }
+        // At least a load, an add and a store per iteration
+        if (counts.counted[PERF_INSTRUCTIONS]
+                && counts.values[PERF_INSTRUCTIONS] < 3000000) {
+            printf("! TEST FAIL ! Too few instructions\n");
+            fails++;
+        }
+        perf_counters_close(&counters);
+    }
+
+    TEST_REPORT("hardware event counters", fails);
+
+    return fails;
+}
+
+
 // ==== Helper functions ====
 
 // Function to print a rule in human-readable format
@@ -890,6 +3028,45 @@ Rule make_rule(const char *ip, uint8_t len, int iface) {
 }
 
 // Helper function to compare two tries
+// Longest prefix match by brute force, among the rules marked as active
+uint32_t linear_lookup(const Rule *rules, const bool *active, size_t count,
+        ip_addr_t ip) {
+    const Rule *best = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (active[i] && rule_match(&rules[i], ip) &&
+                (best == NULL || rules[i].prefix_len > best->prefix_len))
+            best = &rules[i];
+    }
+    return best ? best->out_iface : 0;
+}
+
+// Random rules for checking against linear_lookup, with their lengths taken
+// from a table and their prefixes from the bits of a mask (fewer bits, more
+// nesting). Rule i goes to next hop i + 1 and is active, except for
+// duplicated prefixes, which would make the expected result ambiguous: they
+// get next hop 0 and are left inactive
+void random_rule_pool(Rule *pool, bool *active, size_t count,
+        const uint8_t *lengths, size_t num_lengths, uint32_t mask,
+        unsigned int seed) {
+    srand(seed);
+    for (size_t i = 0; i < count; i++) {
+        uint8_t len = lengths[rand() % num_lengths];
+        uint32_t prefix = ((uint32_t)rand() << 16 ^ rand()) & mask;
+        pool[i].prefix = len == 0 ? 0 : prefix & (0xFFFFFFFF << (32 - len));
+        pool[i].prefix_len = len;
+        pool[i].out_iface = 1 + i;
+        pool[i].parent = NULL;
+        active[i] = true;
+        for (size_t j = 0; j < i && active[i]; j++) {
+            if (pool[j].prefix == pool[i].prefix &&
+                    pool[j].prefix_len == len) {
+                pool[i].out_iface = 0;
+                active[i] = false;
+            }
+        }
+    }
+}
+
 int eq_tries(const TrieNode *a, const TrieNode *b) {
     if (a == NULL && b == NULL) return 1;
     if (a == NULL || b == NULL) return 0;
@@ -1119,10 +3296,24 @@ int main() {
 
     fails_utils += test_extract_lsb();
     fails_utils += test_extract_msb();
+    fails_utils += test_arena();
+    fails_utils += test_snapshot();
+    fails_utils += test_next_hops();
 
     TEST_REPORT("Utils", fails_utils);
     fails += fails_utils;
 
+    printf("\n\n==x=x== I/O Test Suite ==x=x==\n");
+    int fails_io = 0;
+
+    fails_io += test_parse_fib_line();
+    fails_io += test_parse_input_packet_line();
+    fails_io += test_read_input_block();
+    fails_io += test_print_output_result();
+
+    TEST_REPORT("I/O", fails_io);
+    fails += fails_io;
+
     printf("\n\n==x=x== LC-Trie Function Test Suite ==x=x==\n");
     int fails_lc_trie = 0;
 
@@ -1132,12 +3323,69 @@ int main() {
     fails_lc_trie += test_compute_default();
     fails_lc_trie += test_rule_match();
     fails_lc_trie += test_create_trie();
+    fails_lc_trie += test_build_trie();
+    fails_lc_trie += test_build_trie_parallel();
+    fails_lc_trie += test_trie_update();
+    fails_lc_trie += test_wide_root();
     fails_lc_trie += test_count_nodes();
+    fails_lc_trie += test_trie_stats();
     fails_lc_trie += test_lookup();
+    fails_lc_trie += test_lookup_batch();
+    fails_lc_trie += test_compact_trie();
+    fails_lc_trie += test_precompute_leaves();
+    fails_lc_trie += test_compact_kernels();
 
     TEST_REPORT("LC-Trie", fails_lc_trie);
     fails += fails_lc_trie;
 
+    printf("\n\n==x=x== DIR-24-8 Test Suite ==x=x==\n");
+    int fails_dir24_8 = 0;
+
+    fails_dir24_8 += test_dir24_8();
+
+    TEST_REPORT("DIR-24-8", fails_dir24_8);
+    fails += fails_dir24_8;
+
+    printf("\n\n==x=x== Tree Bitmap Test Suite ==x=x==\n");
+    int fails_tree_bitmap = 0;
+
+    fails_tree_bitmap += test_tree_bitmap();
+
+    TEST_REPORT("Tree Bitmap", fails_tree_bitmap);
+    fails += fails_tree_bitmap;
+
+    printf("\n\n==x=x== Trie Image Test Suite ==x=x==\n");
+    int fails_trie_image = 0;
+
+    fails_trie_image += test_trie_image();
+
+    TEST_REPORT("Trie Image", fails_trie_image);
+    fails += fails_trie_image;
+
+    printf("\n\n==x=x== Engine Test Suite ==x=x==\n");
+    int fails_engine = 0;
+
+    fails_engine += test_engines();
+
+    TEST_REPORT("Engine", fails_engine);
+    fails += fails_engine;
+
+    printf("\n\n==x=x== Latency Histogram Test Suite ==x=x==\n");
+    int fails_latency = 0;
+
+    fails_latency += test_latency();
+
+    TEST_REPORT("Latency Histogram", fails_latency);
+    fails += fails_latency;
+
+    printf("\n\n==x=x== Hardware Event Counter Test Suite ==x=x==\n");
+    int fails_perf = 0;
+
+    fails_perf += test_perf_counters();
+
+    TEST_REPORT("Hardware Event Counter", fails_perf);
+    fails += fails_perf;
+
     printf("\n\n=x=x=x= Global report =x=x=x=");
     TEST_REPORT("ALL", fails);
     printf("\n");